@@ -0,0 +1,17 @@
+let a[100];
+let b[100];
+let i;
+for (i=0;i<100;i++){
+a[i] = i * 2;
+b[i] = a[i] + 7;
+};
+let s = 0;
+for (i=0;i<100;i++){
+s = s + b[i];
+};
+print(s);
+print(a[10]);
+print(b[99]);
+let x = 5;
+a[x] = 42;
+print(a[5]);
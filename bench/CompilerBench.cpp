@@ -0,0 +1,268 @@
+// Compiler throughput and scaling on large generated programs.
+//
+// The generator below writes the same program for the same shape and size
+// every time: long expression chains, thousands of lets, deeply nested
+// if/for, many prints, or a mix of all four. On the mixed program the
+// Tokenizer, Parser and CodeGenerator are timed on their own (MB/s,
+// nodes/s and source lines/s); then each shape is compiled at 1x, 2x, 4x
+// and 8x its base size, and the run fails if compile time grows faster
+// than linearly, which is how a quadratic path would show.
+//
+//   ./bench/compiler_bench                      microbenchmarks and scaling
+//   ./bench/compiler_bench --generate SHAPE N   print a program of N units
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "../src/CodeGenerator.hpp"
+
+enum class Shape { Mixed, Chains, Lets, Nesting, Prints };
+
+struct ShapeInfo {
+    const char* name;
+    Shape shape;
+    size_t baseUnits;
+};
+
+// Base sizes are picked so each shape compiles in roughly the same time.
+constexpr ShapeInfo shapes[] = {
+    {"mixed", Shape::Mixed, 400},
+    {"chains", Shape::Chains, 200},
+    {"lets", Shape::Lets, 5000},
+    {"nesting", Shape::Nesting, 120},
+    {"prints", Shape::Prints, 10000},
+};
+
+// Every program declares this many variables up front for units to read
+// and write, and one counter per nesting level.
+constexpr int poolSize = 64;
+constexpr int nestingDepth = 10;
+constexpr int chainTerms = 200;
+
+// A fixed seed, so that a shape and size always give the same program.
+class ProgramGenerator {
+private:
+    uint64_t state = 0x9E3779B97F4A7C15u;
+    std::string out;
+    size_t lets = 0;
+
+    uint32_t next(uint32_t bound) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return static_cast<uint32_t>(state % bound);
+    }
+
+    std::string variable() { return "v" + std::to_string(next(poolSize)); }
+
+    std::string operand() {
+        return next(3) == 0 ? std::to_string(next(1000)) : variable();
+    }
+
+    // Divisors are nonzero literals, so no program divides by zero.
+    void expression(int terms) {
+        out += operand();
+        for (int term = 1; term < terms; term++) {
+            switch (next(5)) {
+                case 0: out += " + " + operand(); break;
+                case 1: out += " - " + operand(); break;
+                case 2: out += " * " + operand(); break;
+                case 3: out += " / " + std::to_string(1 + next(9)); break;
+                default:
+                    out += " + (" + operand() + " - " + operand() + ")";
+                    break;
+            }
+        }
+    }
+
+    void chain() {
+        out += variable() + " = ";
+        expression(chainTerms);
+        out += ";\n";
+    }
+
+    void let() {
+        out += "let t" + std::to_string(lets++) + " = ";
+        expression(3);
+        out += ";\n";
+    }
+
+    void print() { out += "print(" + variable() + ");\n"; }
+
+    // Alternates for and if down to nestingDepth, with a little work at
+    // every level.
+    void nest(int depth) {
+        std::string indent(depth * 2, ' ');
+        if (depth == nestingDepth) {
+            out += indent + variable() + " = ";
+            expression(4);
+            out += ";\n" + indent + "print(" + variable() + ");\n";
+            return;
+        }
+        if (depth % 2 == 0) {
+            std::string counter = "i" + std::to_string(depth);
+            out += indent + "for (" + counter + "=0;" + counter + "<" + std::to_string(2 + next(3)) + ";" +
+                   counter + "++){\n";
+            nest(depth + 1);
+            out += indent + "};\n";
+        } else {
+            out += indent + "if (" + variable() + " > " + std::to_string(next(500)) + ") {\n";
+            nest(depth + 1);
+            out += indent + "} else {\n" + indent + "  " + variable() + " = " + variable() + " + 1;\n" + indent +
+                   "};\n";
+        }
+    }
+
+public:
+    std::string generate(Shape shape, size_t units) {
+        out.clear();
+        for (int i = 0; i < poolSize; i++) {
+            out += "let v" + std::to_string(i) + " = " + std::to_string(next(100)) + ";\n";
+        }
+        for (int depth = 0; depth < nestingDepth; depth += 2) {
+            out += "let i" + std::to_string(depth) + ";\n";
+        }
+        // Otherwise constant propagation folds more of a small program than
+        // of a large one, and the work per unit would depend on the size.
+        out += "for (i0=0;i0<3;i0++){\n";
+        for (int i = 0; i < poolSize; i++) {
+            out += "  v" + std::to_string(i) + " = v" + std::to_string(i) + " * 3 + i0;\n";
+        }
+        out += "};\n";
+        for (size_t unit = 0; unit < units; unit++) {
+            Shape kind = shape == Shape::Mixed ? static_cast<Shape>(1 + unit % 4) : shape;
+            switch (kind) {
+                case Shape::Chains: chain(); break;
+                case Shape::Lets: let(); break;
+                case Shape::Nesting: nest(0); break;
+                default: print(); break;
+            }
+        }
+        return out;
+    }
+};
+
+template<typename Run>
+double bestOf(int runs, Run&& run) {
+    double best = 1e9;
+    for (int attempt = 0; attempt < runs; attempt++) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+static std::string outputPath;
+
+// Everything versec does for a file except reading it.
+static void compile(const std::string& source) {
+    StringTable strings;
+    Arena arena;
+    Tokenizer tokenizer(source, strings);
+    Parser parser(tokenizer.tokenize(), strings, arena);
+    AstNode* program = parser.parseProgram();
+    CodeGenerator(strings, outputPath).generateCode(program);
+}
+
+static void microbenchmarks() {
+    std::string source = ProgramGenerator().generate(Shape::Mixed, 8 * shapes[0].baseUnits);
+    size_t lines = std::count(source.begin(), source.end(), '\n');
+
+    StringTable strings;
+    Tokenizer tokenizer(source, strings);
+    std::vector<Token> tokens;
+    double tokenizeTime = bestOf(5, [&] { tokens = tokenizer.tokenize(); });
+
+    double parseTime = bestOf(5, [&] {
+        Arena arena;
+        Parser(tokens, strings, arena).parseProgram();
+    });
+
+    // The nodes the timed parse builds, counted on the same parse again.
+    Arena arena;
+    AstNode* program = Parser(tokens, strings, arena).parseProgram();
+    CompileStats counted;
+    counted.countNodes(program);
+    uint64_t nodes = counted.nodeCount();
+    double generateTime = bestOf(3, [&] { CodeGenerator(strings, outputPath).generateCode(program); });
+
+    std::printf("program               %zu bytes, %zu lines, %zu tokens, %llu nodes\n", source.size(), lines,
+                tokens.size(), static_cast<unsigned long long>(nodes));
+    std::printf("Tokenizer             %8.1f MB/s\n", source.size() / tokenizeTime / 1e6);
+    std::printf("Parser                %8.2f M nodes/s\n", nodes / parseTime / 1e6);
+    std::printf("CodeGenerator         %8.0f lines/s\n", lines / generateTime);
+}
+
+// Time per byte may rise by at most this much from 1x to 8x. Linear code
+// stays near 1 (cache effects and noise push it a little either way); a
+// quadratic path gives 8.
+constexpr double maxSlowdown = 2.0;
+
+static bool scaling() {
+    bool linear = true;
+    std::printf("\n%-10s %8s %10s %10s %12s\n", "shape", "size", "bytes", "ms", "ns/byte");
+    for (const ShapeInfo& info : shapes) {
+        double firstCost = 0;
+        double lastCost = 0;
+        for (size_t scale = 1; scale <= 8; scale *= 2) {
+            std::string source = ProgramGenerator().generate(info.shape, info.baseUnits * scale);
+            double time = bestOf(3, [&] { compile(source); });
+            double cost = time / source.size();
+            firstCost = scale == 1 ? cost : firstCost;
+            lastCost = cost;
+            std::printf("%-10s %7zux %10zu %10.1f %12.1f\n", info.name, scale, source.size(), time * 1e3,
+                        cost * 1e9);
+        }
+        double slowdown = lastCost / firstCost;
+        if (slowdown > maxSlowdown) {
+            std::printf("%-10s FAIL: 8x the input costs %.2fx as much per byte (limit %.1fx)\n", info.name,
+                        slowdown, maxSlowdown);
+            linear = false;
+        }
+    }
+    return linear;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc == 4 && std::string(argv[1]) == "--generate") {
+        for (const ShapeInfo& info : shapes) {
+            if (info.name == std::string(argv[2])) {
+                std::fputs(ProgramGenerator().generate(info.shape, std::strtoull(argv[3], nullptr, 10)).c_str(),
+                           stdout);
+                return 0;
+            }
+        }
+        std::fprintf(stderr, "unknown shape %s\n", argv[2]);
+        return 1;
+    }
+    if (argc != 1) {
+        std::fprintf(stderr, "usage: %s [--generate mixed|chains|lets|nesting|prints UNITS]\n", argv[0]);
+        return 1;
+    }
+
+    char path[] = "/tmp/compiler_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        std::perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    outputPath = path;
+
+    bool linear = false;
+    try {
+        microbenchmarks();
+        linear = scaling();
+    } catch (const CompileError& error) {
+        std::fprintf(stderr, "%s\n", error.what());
+    }
+    unlink(path);
+    return linear ? 0 : 1;
+}
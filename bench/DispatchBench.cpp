@@ -0,0 +1,107 @@
+// Per-node dispatch cost of the two AST traversal mechanisms: the Visitor
+// adapter (AstNode::accept, one switch plus a virtual visit call) and
+// dispatch() with an inlined generic handler.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "../src/Parser.hpp"
+
+struct CountingVisitor final : Visitor {
+    size_t nodes = 0;
+
+    void visit(ProgramNode* node) override { nodes++; for (AstNode* statement : node->statements) statement->accept(this); }
+    void visit(BinaryOpNode* node) override { nodes++; node->left->accept(this); node->right->accept(this); }
+    void visit(NumberNode*) override { nodes++; }
+    void visit(IdentifierNode*) override { nodes++; }
+    void visit(StringNode*) override { nodes++; }
+    void visit(DeclarationNode* node) override { nodes++; node->identifier->accept(this); node->value->accept(this); }
+    void visit(AssignmentNode* node) override { nodes++; node->identifier->accept(this); node->value->accept(this); }
+    void visit(ComparisonNode* node) override { nodes++; node->left->accept(this); node->right->accept(this); }
+    void visit(IfStatementNode* node) override {
+        nodes++;
+        node->condition->accept(this);
+        node->trueBody->accept(this);
+        if (node->falseBody) node->falseBody->accept(this);
+    }
+    void visit(ForLoopNode* node) override {
+        nodes++;
+        node->initialization->accept(this);
+        node->condition->accept(this);
+        node->increment->accept(this);
+        if (node->body) node->body->accept(this);
+    }
+    void visit(PrintNode* node) override { nodes++; node->identifier->accept(this); }
+    void visit(IncrementNode* node) override { nodes++; node->identifier->accept(this); }
+    void visit(ArrayDeclarationNode* node) override { nodes++; node->identifier->accept(this); }
+    void visit(ElementNode* node) override { nodes++; node->identifier->accept(this); node->index->accept(this); }
+    void visit(ElementAssignmentNode* node) override { nodes++; node->element->accept(this); node->value->accept(this); }
+};
+
+size_t countNodes(AstNode* node) {
+    return dispatch(node, [](auto* concrete) -> size_t {
+        using Node = std::remove_pointer_t<decltype(concrete)>;
+        if constexpr (std::is_same_v<Node, ProgramNode>) {
+            size_t nodes = 1;
+            for (AstNode* statement : concrete->statements) nodes += countNodes(statement);
+            return nodes;
+        } else if constexpr (std::is_same_v<Node, BinaryOpNode> || std::is_same_v<Node, ComparisonNode>) {
+            return 1 + countNodes(concrete->left) + countNodes(concrete->right);
+        } else if constexpr (std::is_same_v<Node, DeclarationNode> || std::is_same_v<Node, AssignmentNode>) {
+            return 1 + countNodes(concrete->identifier) + countNodes(concrete->value);
+        } else if constexpr (std::is_same_v<Node, IfStatementNode>) {
+            return 1 + countNodes(concrete->condition) + countNodes(concrete->trueBody) +
+                   (concrete->falseBody ? countNodes(concrete->falseBody) : 0);
+        } else if constexpr (std::is_same_v<Node, ForLoopNode>) {
+            return 1 + countNodes(concrete->initialization) + countNodes(concrete->condition) +
+                   countNodes(concrete->increment) + (concrete->body ? countNodes(concrete->body) : 0);
+        } else if constexpr (std::is_same_v<Node, PrintNode> || std::is_same_v<Node, IncrementNode> ||
+                             std::is_same_v<Node, ArrayDeclarationNode>) {
+            return 1 + countNodes(concrete->identifier);
+        } else if constexpr (std::is_same_v<Node, ElementNode>) {
+            return 1 + countNodes(concrete->identifier) + countNodes(concrete->index);
+        } else if constexpr (std::is_same_v<Node, ElementAssignmentNode>) {
+            return 1 + countNodes(concrete->element) + countNodes(concrete->value);
+        } else {
+            return 1;
+        }
+    });
+}
+
+template<typename Walk>
+double bestOf(int runs, Walk&& walk) {
+    double best = 1e9;
+    for (int run = 0; run < runs; run++) {
+        auto start = std::chrono::steady_clock::now();
+        walk();
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+// A tree of ~70k nodes stays cache resident, so the timings below measure
+// dispatch rather than memory latency.
+int main() {
+    std::string source = "let x = 1;\nlet i;\n";
+    for (int statement = 0; statement < 2000; statement++) {
+        source += "x = " + std::to_string(statement) + " * (x + 3) - (4 / 2) + x * 7;\n";
+        source += "for (i=0;i<10;i++){ if (x >= 3){ print(x); } else { print(i); }; };\n";
+    }
+
+    StringTable strings;
+    Arena arena;
+    Tokenizer tokenizer(source, strings);
+    Parser parser(tokenizer.tokenize(), strings, arena);
+    AstNode* program = parser.parseProgram();
+
+    CountingVisitor visitor;
+    size_t nodes = 0;
+    double visitorTime = bestOf(10, [&] { for (int pass = 0; pass < 200; pass++) { visitor.nodes = 0; program->accept(&visitor); } }) / 200;
+    double dispatchTime = bestOf(10, [&] { for (int pass = 0; pass < 200; pass++) nodes = countNodes(program); }) / 200;
+
+    std::printf("nodes                 %zu\n", nodes);
+    std::printf("Visitor::accept       %.2f ns/node\n", visitorTime / visitor.nodes * 1e9);
+    std::printf("dispatch() inlined    %.2f ns/node\n", dispatchTime / nodes * 1e9);
+    return 0;
+}
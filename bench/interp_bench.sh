@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# Bytecode instructions per second under versec --interp, best of the runs,
+# after checking that the interpreter prints what the native code prints.
+# Run from the repository root after make:
+#   ./bench/interp_bench.sh [runs]
+
+runs=${1:-5}
+workdir=$(mktemp -d)
+
+cleanup() {
+  rm -rf "$workdir"
+}
+trap cleanup EXIT
+
+cat > "$workdir/loops.vs" <<'VERSE'
+let a[1024];
+let i;
+let r;
+let s = 0;
+let k = 7;
+for (i=0;i<1024;i++){
+  a[i] = i * 3 - 500;
+};
+for (r=0;r<2000;r++){
+  for (i=0;i<1024;i++){
+    s = s + a[i] / k;
+    if (s > 100000) {
+      s = s - 100000;
+    };
+  };
+};
+print(s);
+VERSE
+
+for program in example.vs "$workdir/loops.vs"; do
+  if [ "$(./versec --interp "$program")" != "$(./versec --run "$program")" ]; then
+    echo "$program: versec --interp and versec --run print different output"
+    exit 1
+  fi
+done
+
+best=""
+for ((run = 0; run < runs; run++)); do
+  report=$(./versec --interp --report-interp "$workdir/loops.vs" 2>&1 > /dev/null)
+  rate=$(echo "$report" | awk '{ print $(NF - 2) }')
+  if [ -z "$best" ] || awk "BEGIN { exit !($rate > $best) }"; then
+    best=$rate
+    line=$report
+  fi
+done
+echo "$line"
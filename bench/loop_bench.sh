@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Runtime of the generated binary for nested counting loops, once per
+# loop-optimization setting. Run from the repository root after make:
+#   ./bench/loop_bench.sh [runs]
+# LINK overrides the link command (the object file is appended to it).
+
+runs=${1:-3}
+link=${LINK:-ld -m elf_i386 -o}
+workdir=$(mktemp -d)
+
+cleanup() {
+  rm -rf "$workdir"
+}
+trap cleanup EXIT
+
+cat > "$workdir/loops.vs" <<'VERSE'
+let i;
+let j;
+let k;
+let s = 0;
+let t = 0;
+let a = 3;
+let b = 7;
+for (i=0;i<200;i++){
+  for (j=0;j<1000;j++){
+    for (k=0;k<1003;k++){
+      s = s + k * 4 + a * b;
+      t = t + j * 3 - k;
+    };
+  };
+};
+print(s);
+print(t);
+VERSE
+
+settings=("--no-loop-opt" "--unroll=1" "--unroll=2" "--unroll=4" "--unroll=8")
+expected=""
+TIMEFORMAT=%R
+
+for setting in "${settings[@]}"; do
+  if ! ./versec $setting "$workdir/loops.vs" -o "$workdir/loops.o"; then
+    exit 1
+  fi
+  if ! $link "$workdir/loops" "$workdir/loops.o"; then
+    exit 1
+  fi
+
+  output=$("$workdir/loops")
+  if [ -z "$expected" ]; then
+    expected=$output
+  elif [ "$output" != "$expected" ]; then
+    echo "$setting: output differs from --no-loop-opt"
+    exit 1
+  fi
+
+  best=""
+  for ((run = 0; run < runs; run++)); do
+    seconds=$( { time "$workdir/loops" > /dev/null; } 2>&1 )
+    if [ -z "$best" ] || awk "BEGIN { exit !($seconds < $best) }"; then
+      best=$seconds
+    fi
+  done
+  printf "%-16s %8s s\n" "$setting" "$best"
+done
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Time from starting a small program to its first output, through run.sh
+# (compile to an object, link, exec) and through versec --run. The runtime
+# buffers output until the program ends, so this is the whole run. Run from
+# the repository root after make:
+#   ./bench/run_bench.sh [runs]
+
+runs=${1:-20}
+workdir=$(mktemp -d)
+
+# run.sh compiles through the compile cache. Point it at a directory of our
+# own, emptied before every run, so each run compiles from cold and the
+# user's cache is left alone.
+export VERSEC_CACHE_DIR="$workdir/cache"
+
+cleanup() {
+  rm -rf "$workdir"
+}
+trap cleanup EXIT
+
+cat > "$workdir/hello.vs" <<'VERSE'
+let greeting = "hello";
+let i;
+let s = 0;
+print(greeting);
+for (i=0;i<100;i++){
+  s = s + i;
+};
+print(s);
+VERSE
+
+expected=$(./versec --run "$workdir/hello.vs")
+if [ "$(./run.sh "$workdir/hello.vs")" != "$expected" ]; then
+  echo "run.sh and versec --run print different output"
+  exit 1
+fi
+
+# Mean and best milliseconds over the runs of the command given.
+measure() {
+  local total=0
+  local best=""
+  for ((run = 0; run < runs; run++)); do
+    rm -rf "$VERSEC_CACHE_DIR"
+    local start=$(date +%s%N)
+    "$@" > /dev/null
+    local elapsed=$(( $(date +%s%N) - start ))
+    total=$((total + elapsed))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+      best=$elapsed
+    fi
+  done
+  awk -v total="$total" -v best="$best" -v runs="$runs" \
+    'BEGIN { printf "%8.2f ms mean %8.2f ms best\n", total / runs / 1e6, best / 1e6 }'
+}
+
+printf "%-26s" "run.sh"
+measure ./run.sh "$workdir/hello.vs"
+printf "%-26s" "run.sh --target=x86_64"
+measure ./run.sh "$workdir/hello.vs" --target=x86_64
+printf "%-26s" "versec --run"
+measure ./versec --run "$workdir/hello.vs"
@@ -0,0 +1,74 @@
+#!/bin/bash
+
+# Runtime of the generated binary for loops over arrays, once per vector
+# instruction set. Run from the repository root after make:
+#   ./bench/vector_bench.sh [runs]
+# LINK overrides the link command (the object file is appended to it).
+# The avx2 setting needs a processor that has AVX2.
+
+runs=${1:-3}
+link=${LINK:-ld -m elf_i386 -o}
+workdir=$(mktemp -d)
+
+cleanup() {
+  rm -rf "$workdir"
+}
+trap cleanup EXIT
+
+cat > "$workdir/arrays.vs" <<'VERSE'
+let a[4096];
+let b[4096];
+let c[4096];
+let n = 4096;
+let i;
+let r;
+let s = 0;
+let k = 3;
+for (i=0;i<4096;i++){
+  a[i] = i * 7 - 2000;
+  b[i] = 4096 - i;
+  c[i] = 0;
+};
+for (r=0;r<50000;r++){
+  for (i=0;i<n;i++){
+    c[i] = c[i] + a[i] - b[i] + k;
+  };
+  for (i=1;i<n;i++){
+    a[i] = a[i] + c[i] - b[i];
+  };
+};
+for (i=0;i<4096;i++){
+  s = s + a[i] + c[i];
+};
+print(s);
+VERSE
+
+settings=("--vectorize=none" "--vectorize=sse2" "--vectorize=avx2")
+expected=""
+TIMEFORMAT=%R
+
+for setting in "${settings[@]}"; do
+  if ! ./versec $setting "$workdir/arrays.vs" -o "$workdir/arrays.o"; then
+    exit 1
+  fi
+  if ! $link "$workdir/arrays" "$workdir/arrays.o"; then
+    exit 1
+  fi
+
+  output=$("$workdir/arrays")
+  if [ -z "$expected" ]; then
+    expected=$output
+  elif [ "$output" != "$expected" ]; then
+    echo "$setting: output differs from --vectorize=none"
+    exit 1
+  fi
+
+  best=""
+  for ((run = 0; run < runs; run++)); do
+    seconds=$( { time "$workdir/arrays" > /dev/null; } 2>&1 )
+    if [ -z "$best" ] || awk "BEGIN { exit !($seconds < $best) }"; then
+      best=$seconds
+    fi
+  done
+  printf "%-18s %8s s\n" "$setting" "$best"
+done
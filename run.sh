@@ -1,13 +1,19 @@
 #!/bin/bash
 
 # Check number of arguments
-if [ "$#" -ne 1 ]; then
-  echo "Usage: $0 <source_file>"
+if [ "$#" -lt 1 ] || [ "$#" -gt 2 ]; then
+  echo "Usage: $0 <source_file> [--target=x86|--target=x86_64]"
   exit 1
 fi
 
-# Assign argument to a variable
+# Assign arguments to variables
 source_file=$1
+target=${2:---target=x86}
+
+case "$target" in
+  --target=x86|--target=x86_64) ;;
+  *) echo "Unknown target '$target'"; exit 1 ;;
+esac
 
 # Check if the source file exists
 if [ ! -f "$source_file" ]; then
@@ -23,18 +29,9 @@ cleanup() {
 # Trap cleanup function on exit
 trap cleanup EXIT
 
-# Compile the source code (.vs)
-if ! ./versec "$source_file"; then
-  exit 1
-fi
-
-# Assemble the output
-if ! nasm -f elf32 out.asm -o out.o; then
-  exit 1
-fi
-
-# Link the file to create the executable
-if ! gcc -m32 -o out out.o -lm -nostartfiles -no-pie; then
+# Compile the source code (.vs) and link it, or take the executable from
+# the compile cache when this source was built with these flags before
+if ! ./versec --cache --link "$target" "$source_file" -o out; then
   exit 1
 fi
 
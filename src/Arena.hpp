@@ -0,0 +1,120 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "CompileError.hpp"
+
+// Monotonic bump allocator owning every AST node of a compilation. Objects are
+// never destroyed individually, so only trivially destructible types may live
+// here; the whole arena is released at once, or rewound to an earlier mark.
+// Blocks are kept across rewinds and reused by later allocations.
+class Arena {
+private:
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+    static constexpr size_t blockSize = 64 * 1024;
+
+    std::vector<Block> blocks {};
+    size_t current = 0;
+    char* cursor = nullptr;
+    char* limit = nullptr;
+    size_t allocations = 0;
+    size_t bytes = 0;
+
+    static char* align(char* pointer, size_t alignment) {
+        uintptr_t address = reinterpret_cast<uintptr_t>(pointer);
+        return reinterpret_cast<char*>((address + alignment - 1) & ~(alignment - 1));
+    }
+
+    void* allocateSlow(size_t size, size_t alignment) {
+        size_t needed = size + alignment;
+        size_t next = cursor ? current + 1 : current;
+        if (next >= blocks.size() || blocks[next].size < needed) {
+            size_t capacity = needed > blockSize ? needed : blockSize;
+            char* data = static_cast<char*>(std::malloc(capacity));
+            if (!data) {
+                compileError("Out of memory");
+            }
+            blocks.insert(blocks.begin() + next, {data, capacity});
+        }
+        current = next;
+        cursor = blocks[current].data;
+        limit = cursor + blocks[current].size;
+        return allocate(size, alignment);
+    }
+
+public:
+    struct Mark {
+        size_t block;
+        char* cursor;
+    };
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena() {
+        for (Block& block : blocks) {
+            std::free(block.data);
+        }
+    }
+
+    void* allocate(size_t size, size_t alignment) {
+        char* pointer = align(cursor, alignment);
+        if (!cursor || pointer + size > limit) {
+            return allocateSlow(size, alignment);
+        }
+        cursor = pointer + size;
+        allocations++;
+        bytes += size;
+        return pointer;
+    }
+
+    template<typename T, typename... Args>
+    T* make(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena objects are never destroyed");
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template<typename T>
+    T* copyArray(const T* items, size_t count) {
+        static_assert(std::is_trivially_copyable_v<T>, "arena arrays are copied bytewise");
+        T* array = static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+        std::copy(items, items + count, array);
+        return array;
+    }
+
+    Mark mark() const { return {current, cursor}; }
+
+    // Releases everything allocated since the mark in O(1).
+    void rewind(Mark mark) {
+        current = mark.block;
+        cursor = mark.cursor;
+        limit = cursor ? blocks[current].data + blocks[current].size : nullptr;
+    }
+
+    size_t allocationCount() const { return allocations; }
+
+    size_t bytesAllocated() const { return bytes; }
+
+    size_t bytesReserved() const {
+        size_t total = 0;
+        for (const Block& block : blocks) {
+            total += block.size;
+        }
+        return total;
+    }
+};
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef ASM_BUFFER_HPP
+#define ASM_BUFFER_HPP
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include "CompileError.hpp"
+
+// Collects emitted assembly in memory and hands it to the kernel in as few
+// write() calls as possible: once at the end of a batch compile, or in large
+// chunks when a streaming compile spills. The path "-" means stdout.
+class AsmBuffer {
+private:
+    std::string text {};
+    std::string path {};
+    int fd = -1;
+    bool readable = false;
+
+    void open() {
+        if (fd >= 0) {
+            return;
+        }
+        if (path == "-") {
+            fd = STDOUT_FILENO;
+            return;
+        }
+        // Read access lets the object writer patch code it has written out.
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        readable = fd >= 0;
+        if (fd < 0) {
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if (fd < 0) {
+            compileError("Could not open output file ", path, ": ", std::strerror(errno));
+        }
+    }
+
+    void writeOut() {
+        open();
+        const char* data = text.data();
+        size_t remaining = text.size();
+        while (remaining > 0) {
+            ssize_t written = ::write(fd, data, remaining);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                compileError("Could not write ", path, ": ", std::strerror(errno));
+            }
+            data += written;
+            remaining -= written;
+        }
+        text.clear();
+    }
+
+public:
+    explicit AsmBuffer(std::string path) : path(std::move(path)) {
+        text.reserve(1 << 16);
+    }
+
+    AsmBuffer(const AsmBuffer&) = delete;
+    AsmBuffer& operator=(const AsmBuffer&) = delete;
+
+    ~AsmBuffer() {
+        if (fd > STDERR_FILENO) {
+            ::close(fd);
+        }
+    }
+
+    AsmBuffer& operator<<(std::string_view value) {
+        text.append(value);
+        return *this;
+    }
+
+    AsmBuffer& operator<<(char value) {
+        text.push_back(value);
+        return *this;
+    }
+
+    AsmBuffer& operator<<(int value) {
+        char digits[16];
+        auto [end, error] = std::to_chars(digits, digits + sizeof(digits), value);
+        text.append(digits, end);
+        return *this;
+    }
+
+    // Whether writeAt() and readAt() can be used: only on a regular file
+    // opened for reading as well.
+    bool seekable() {
+        if (path == "-") {
+            return false;
+        }
+        open();
+        struct stat status {};
+        return readable && fstat(fd, &status) == 0 && S_ISREG(status.st_mode);
+    }
+
+    // Writes bytes at offset in the output file, bypassing the buffer. The
+    // object writer fills in the code it has already written out this way,
+    // and the headers in front of it.
+    void writeAt(uint64_t offset, std::string_view bytes) {
+        open();
+        while (!bytes.empty()) {
+            ssize_t written = ::pwrite(fd, bytes.data(), bytes.size(), static_cast<off_t>(offset));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                compileError("Could not write ", path, ": ", std::strerror(errno));
+            }
+            bytes.remove_prefix(written);
+            offset += written;
+        }
+    }
+
+    // Reads bytes.size() bytes at offset back from the output file.
+    void readAt(uint64_t offset, std::string& bytes) {
+        size_t done = 0;
+        while (done < bytes.size()) {
+            ssize_t count = ::pread(fd, &bytes[done], bytes.size() - done, static_cast<off_t>(offset + done));
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                compileError("Could not read back ", path, ": ", count < 0 ? std::strerror(errno) : "end of file");
+            }
+            done += count;
+        }
+    }
+
+    // Writes out the buffered text once it has grown past threshold bytes.
+    void spill(size_t threshold) {
+        if (text.size() >= threshold) {
+            writeOut();
+        }
+    }
+
+    void flush() {
+        writeOut();
+        if (fd > STDERR_FILENO) {
+            ::close(fd);
+        }
+        fd = -1;
+    }
+
+    // Removes the output file after a failed compile, so that neither part
+    // of this one nor stale output from an earlier run is picked up.
+    void discard() {
+        text.clear();
+        if (path != "-") {
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+            ::unlink(path.c_str());
+        }
+    }
+
+    const std::string& pathName() const { return path; }
+};
+
+#endif
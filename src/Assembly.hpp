@@ -0,0 +1,458 @@
+#ifndef ASSEMBLY_HPP
+#define ASSEMBLY_HPP
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include "AsmBuffer.hpp"
+#include "StringTable.hpp"
+
+// Machine-level view of the generated program. CodeGenerator appends
+// instructions to an InstructionList; a backend then either prints them as
+// NASM text or encodes them straight into an ELF object.
+//
+// Both targets compute with 32-bit operands; Verse integers are 32 bits
+// wide either way. On x86-64 a 32-bit result is zero-extended to the full
+// register, so the same instructions also work on addresses as long as the
+// program is linked below 4 GiB, as ld does by default.
+enum class Target : uint8_t {
+    X86,      // ELF32, int 0x80 system calls, eight registers
+    X86_64,   // ELF64, syscall, sixteen registers, SysV calls into the runtime
+};
+
+// Numbered in hardware encoding order, so a Reg is also its ModRM field;
+// R8 to R15 only exist on x86-64 and need a REX prefix.
+enum class Reg : uint8_t {
+    Eax,
+    Ecx,
+    Edx,
+    Ebx,
+    Esp,
+    Ebp,
+    Esi,
+    Edi,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+};
+
+enum class Opcode : uint8_t {
+    Label,
+    Mov,
+    Push,
+    Pop,
+    Call,
+    Cmp,
+    Add,
+    Sub,
+    Imul,
+    Idiv,
+    Cdq,
+    Mul,
+    Neg,
+    Shr,
+    MovByte,    // mov byte [..], with the low byte of a register or an imm8
+    RepMovsb,
+    Int,
+    Syscall,
+    Ret,
+    // SSE2, on four dword lanes in an xmm register.
+    Movd,       // xmm <- r/m32, upper lanes cleared
+    Pshufd,     // always with an immediate of 0: every lane gets the low one
+    Movdqu,
+    Paddd,
+    Psubd,
+    // AVX2, on eight dword lanes in a ymm register. The arithmetic is
+    // printed and encoded destructively, dst = dst op src, like SSE.
+    Vmovd,
+    Vpbroadcastd,
+    Vmovdqu,
+    Vpaddd,
+    Vpsubd,
+    Vpmulld,
+    Vzeroupper,
+    Jmp,
+    Je,
+    Jne,
+    Jl,
+    Jle,
+    Jg,
+    Jge,
+};
+
+using LabelId = uint32_t;
+
+enum class OperandKind : uint8_t {
+    None,
+    Register,
+    Immediate,
+    Memory,     // dword [symbol + value]
+    Indirect,   // dword [reg + value]
+    Element,    // dword [symbol + reg*4 + value], an array element
+    Address,    // the address of symbol plus value, as an immediate
+    Size,       // <symbol>_len plus value, as an immediate
+    Label,
+    External,   // a function resolved by the linker
+    Virtual,    // a register to be assigned by RegisterAllocator
+    VirtualElement, // dword [symbol + vN*4], its index still a Virtual numbered value
+    Xmm,        // xmm register number value
+    Ymm,        // ymm register number value
+};
+
+struct Operand {
+    OperandKind kind = OperandKind::None;
+    Reg reg = Reg::Eax;
+    int32_t value = 0;
+    Symbol symbol = NoSymbol;
+
+    static Operand ofRegister(Reg reg) { return {OperandKind::Register, reg, 0, NoSymbol}; }
+
+    static Operand ofImmediate(int32_t value) { return {OperandKind::Immediate, Reg::Eax, value, NoSymbol}; }
+
+    static Operand ofMemory(Symbol symbol, int32_t offset = 0) {
+        return {OperandKind::Memory, Reg::Eax, offset, symbol};
+    }
+
+    static Operand ofIndirect(Reg base, int32_t offset = 0) { return {OperandKind::Indirect, base, offset, NoSymbol}; }
+
+    static Operand ofAddress(Symbol symbol, int32_t offset = 0) {
+        return {OperandKind::Address, Reg::Eax, offset, symbol};
+    }
+
+    static Operand ofSize(Symbol symbol, int32_t offset = 0) { return {OperandKind::Size, Reg::Eax, offset, symbol}; }
+
+    static Operand ofElement(Symbol array, Reg index, int32_t offset = 0) {
+        return {OperandKind::Element, index, offset, array};
+    }
+
+    static Operand ofVirtualElement(Symbol array, uint32_t index) {
+        return {OperandKind::VirtualElement, Reg::Eax, static_cast<int32_t>(index), array};
+    }
+
+    static Operand ofXmm(uint32_t number) { return {OperandKind::Xmm, Reg::Eax, static_cast<int32_t>(number), NoSymbol}; }
+
+    static Operand ofYmm(uint32_t number) { return {OperandKind::Ymm, Reg::Eax, static_cast<int32_t>(number), NoSymbol}; }
+
+    static Operand ofLabel(LabelId label) {
+        return {OperandKind::Label, Reg::Eax, static_cast<int32_t>(label), NoSymbol};
+    }
+
+    static Operand ofExternal(Symbol symbol) { return {OperandKind::External, Reg::Eax, 0, symbol}; }
+
+    static Operand ofVirtual(uint32_t index) {
+        return {OperandKind::Virtual, Reg::Eax, static_cast<int32_t>(index), NoSymbol};
+    }
+
+    bool operator==(const Operand& other) const {
+        return kind == other.kind && reg == other.reg && value == other.value && symbol == other.symbol;
+    }
+
+    bool operator!=(const Operand& other) const { return !(*this == other); }
+
+    // Whether the operand is in memory, at a fixed or an indexed address.
+    bool isMemory() const { return kind == OperandKind::Memory || kind == OperandKind::Element; }
+};
+
+struct Instruction {
+    Opcode op;
+    Operand dst {};
+    Operand src {};
+};
+
+// Labels are printed as prefix followed by number, e.g. if_label_3, or as
+// just the prefix when number is negative.
+struct LabelName {
+    const char* prefix;
+    int number;
+};
+
+// One entry of the data section: a dword, or a string followed by ",10,0"
+// and an absolute <name>_len symbol holding its size. An entry with a
+// nonzero reserve is instead that many zeroed bytes in .bss, starting at a
+// multiple of alignment.
+struct DataDefinition {
+    Symbol name;
+    bool isString;
+    int32_t number;
+    std::string_view text;
+    uint32_t reserve = 0;
+    uint32_t alignment = 4;
+};
+
+class InstructionList {
+public:
+    std::vector<Instruction> code {};
+    std::vector<LabelName> labels {};
+
+    LabelId newLabel(const char* prefix, int number) {
+        labels.push_back({prefix, number});
+        return static_cast<LabelId>(labels.size() - 1);
+    }
+
+    void emit(Opcode op, Operand dst = {}, Operand src = {}) {
+        code.push_back({op, dst, src});
+    }
+
+    void bind(LabelId label) {
+        emit(Opcode::Label, Operand::ofLabel(label));
+    }
+};
+
+inline std::string_view opcodeMnemonic(Opcode op) {
+    switch (op) {
+        case Opcode::Label: return "";
+        case Opcode::Mov: return "mov";
+        case Opcode::Push: return "push";
+        case Opcode::Pop: return "pop";
+        case Opcode::Call: return "call";
+        case Opcode::Cmp: return "cmp";
+        case Opcode::Add: return "add";
+        case Opcode::Sub: return "sub";
+        case Opcode::Imul: return "imul";
+        case Opcode::Idiv: return "idiv";
+        case Opcode::Cdq: return "cdq";
+        case Opcode::Mul: return "mul";
+        case Opcode::Neg: return "neg";
+        case Opcode::Shr: return "shr";
+        case Opcode::MovByte: return "mov";
+        case Opcode::RepMovsb: return "rep movsb";
+        case Opcode::Int: return "int";
+        case Opcode::Syscall: return "syscall";
+        case Opcode::Ret: return "ret";
+        case Opcode::Movd: return "movd";
+        case Opcode::Pshufd: return "pshufd";
+        case Opcode::Movdqu: return "movdqu";
+        case Opcode::Paddd: return "paddd";
+        case Opcode::Psubd: return "psubd";
+        case Opcode::Vmovd: return "vmovd";
+        case Opcode::Vpbroadcastd: return "vpbroadcastd";
+        case Opcode::Vmovdqu: return "vmovdqu";
+        case Opcode::Vpaddd: return "vpaddd";
+        case Opcode::Vpsubd: return "vpsubd";
+        case Opcode::Vpmulld: return "vpmulld";
+        case Opcode::Vzeroupper: return "vzeroupper";
+        case Opcode::Jmp: return "jmp";
+        case Opcode::Je: return "je";
+        case Opcode::Jne: return "jne";
+        case Opcode::Jl: return "jl";
+        case Opcode::Jle: return "jle";
+        case Opcode::Jg: return "jg";
+        case Opcode::Jge: return "jge";
+    }
+    return "";
+}
+
+inline bool isVectorOpcode(Opcode op) { return op >= Opcode::Movd && op <= Opcode::Vzeroupper; }
+
+// The AVX2 arithmetic whose destination is also its first source.
+inline bool isDestructiveVex(Opcode op) {
+    return op == Opcode::Vpaddd || op == Opcode::Vpsubd || op == Opcode::Vpmulld;
+}
+
+inline std::string_view registerName(Reg reg) {
+    static constexpr std::string_view names[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+                                                 "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+    return names[static_cast<uint8_t>(reg)];
+}
+
+// The full-width name, for addresses and the stack on x86-64.
+inline std::string_view wideRegisterName(Reg reg) {
+    static constexpr std::string_view names[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                                                 "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+    return names[static_cast<uint8_t>(reg)];
+}
+
+// Only eax through ebx have a byte register.
+inline std::string_view byteRegisterName(Reg reg) {
+    static constexpr std::string_view names[] = {"al", "cl", "dl", "bl"};
+    return names[static_cast<uint8_t>(reg)];
+}
+
+// Writes an InstructionList as NASM source, the format versec has always
+// produced (and still does under -S).
+class NasmPrinter {
+private:
+    const StringTable& strings;
+    const InstructionList& program;
+    AsmBuffer& output;
+    Target target;
+
+    std::string_view addressRegister(Reg reg) const {
+        return target == Target::X86_64 ? wideRegisterName(reg) : registerName(reg);
+    }
+
+    void printLabel(LabelId label) {
+        const LabelName& name = program.labels[label];
+        output << name.prefix;
+        if (name.number >= 0) {
+            output << name.number;
+        }
+    }
+
+    void printOffset(int32_t offset) {
+        if (offset != 0) {
+            output << (offset > 0 ? "+" : "") << offset;
+        }
+    }
+
+    // byte selects the byte forms a mov byte uses, stack the register names
+    // push and pop take. Vector instructions take memory operands without a
+    // size, which their register implies.
+    void printOperand(const Operand& operand, bool byte = false, bool stack = false, bool vector = false) {
+        switch (operand.kind) {
+            case OperandKind::None:
+                break;
+            case OperandKind::Register:
+                output << (byte ? byteRegisterName(operand.reg)
+                                : stack ? addressRegister(operand.reg) : registerName(operand.reg));
+                break;
+            case OperandKind::Immediate:
+                output << operand.value;
+                break;
+            case OperandKind::Memory:
+                output << (vector ? "[" : "dword [") << strings.str(operand.symbol);
+                printOffset(operand.value);
+                output << ']';
+                break;
+            case OperandKind::Element:
+                output << (vector ? "[" : "dword [") << strings.str(operand.symbol) << " + "
+                       << addressRegister(operand.reg) << "*4";
+                printOffset(operand.value);
+                output << ']';
+                break;
+            case OperandKind::Indirect:
+                output << (byte ? "byte [" : "dword [") << addressRegister(operand.reg);
+                printOffset(operand.value);
+                output << ']';
+                break;
+            case OperandKind::Address:
+                output << "dword " << strings.str(operand.symbol);
+                printOffset(operand.value);
+                break;
+            case OperandKind::Size:
+                output << strings.str(operand.symbol) << "_len";
+                printOffset(operand.value);
+                break;
+            case OperandKind::Label:
+                printLabel(static_cast<LabelId>(operand.value));
+                break;
+            case OperandKind::External:
+                output << strings.str(operand.symbol);
+                break;
+            case OperandKind::Virtual:
+                output << 'v' << operand.value;
+                break;
+            case OperandKind::VirtualElement:
+                output << "dword [" << strings.str(operand.symbol) << " + v" << operand.value << "*4]";
+                break;
+            case OperandKind::Xmm:
+                output << "xmm" << operand.value;
+                break;
+            case OperandKind::Ymm:
+                output << "ymm" << operand.value;
+                break;
+        }
+    }
+
+public:
+    NasmPrinter(const StringTable& strings, const InstructionList& program, AsmBuffer& output,
+                Target target = Target::X86)
+            : strings(strings), program(program), output(output), target(target) {}
+
+    void printHeader(const std::vector<Symbol>& externs) {
+        if (target == Target::X86_64) {
+            // Plain [symbol] operands are RIP-relative.
+            output << "bits 64" << '\n';
+            output << "default rel" << '\n';
+        }
+        output << "section .text" << '\n';
+        output << "global _start" << '\n';
+        for (Symbol name : externs) {
+            output << "extern " << strings.str(name) << '\n';
+        }
+        output << "_start:" << '\n';
+        output << '\n';
+    }
+
+    void print(const std::vector<Instruction>& code) {
+        for (const Instruction& instruction : code) {
+            if (instruction.op == Opcode::Label) {
+                output << '\n';
+                printLabel(static_cast<LabelId>(instruction.dst.value));
+                output << ':' << '\n';
+                continue;
+            }
+            bool byte = instruction.op == Opcode::MovByte;
+            bool stack = instruction.op == Opcode::Push || instruction.op == Opcode::Pop;
+            bool vector = isVectorOpcode(instruction.op) && instruction.op != Opcode::Movd &&
+                          instruction.op != Opcode::Vmovd;
+            output << opcodeMnemonic(instruction.op);
+            if (instruction.dst.kind != OperandKind::None) {
+                output << ' ';
+                printOperand(instruction.dst, byte, stack, vector);
+            }
+            if (isDestructiveVex(instruction.op)) {
+                output << ", ";
+                printOperand(instruction.dst);
+            }
+            if (instruction.src.kind != OperandKind::None) {
+                output << ", ";
+                printOperand(instruction.src, byte, false, vector);
+            }
+            if (instruction.op == Opcode::Pshufd) {
+                output << ", 0";
+            }
+            output << '\n';
+        }
+    }
+
+    void printData(const std::vector<DataDefinition>& data) {
+        output << '\n' << "section .data" << '\n';
+        for (const DataDefinition& item : data) {
+            std::string_view name = strings.str(item.name);
+            if (item.reserve != 0) {
+                continue;
+            }
+            if (item.isString) {
+                output << name << " db ";
+                printString(item.text);
+                output << "10,0" << '\n';
+                output << name << "_len equ $ - " << name << '\n';
+            } else {
+                output << name << " dd " << item.number << '\n';
+            }
+        }
+        output << '\n' << "section .bss" << '\n';
+        for (const DataDefinition& item : data) {
+            if (item.reserve != 0) {
+                if (item.alignment > 4) {
+                    output << "alignb " << static_cast<int>(item.alignment) << '\n';
+                }
+                output << strings.str(item.name) << " resb " << static_cast<int>(item.reserve) << '\n';
+            }
+        }
+    }
+
+    // NASM strings take no escapes, so newlines go between the quoted runs.
+    void printString(std::string_view text) {
+        while (!text.empty()) {
+            size_t newline = text.find('\n');
+            std::string_view run = text.substr(0, newline);
+            if (!run.empty()) {
+                output << '"' << run << "\",";
+            }
+            if (newline == std::string_view::npos) {
+                break;
+            }
+            output << "10,";
+            text.remove_prefix(newline + 1);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,506 @@
+#ifndef BYTECODE_HPP
+#define BYTECODE_HPP
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "CompileError.hpp"
+#include "Ir.hpp"
+#include "Parser.hpp"
+#include "StringTable.hpp"
+
+// Register bytecode for the interpreter (--interp), compiled straight from
+// the AST with no IR in between.
+//
+// Every number a program works with lives in a slot of one int32 array:
+// variables first as they are declared, then constants and temporaries as
+// expressions need them. Constants are slots filled in before the program
+// starts, so no instruction needs an immediate form. Strings are constant
+// and are printed by index; arrays are numbered and bounds-checked when
+// accessed.
+//
+// a, b and c are slot numbers unless the opcode says otherwise; jump
+// targets are instruction indices.
+enum class BytecodeOp : uint8_t {
+    Move,               // a = b
+    Add,                // a = b + c, wrapping like the 32-bit instructions
+    Subtract,
+    Multiply,
+    Divide,             // a = b / c, failing at run time when c is 0
+    AddImmediate,       // a += b, b an immediate
+    LoadElement,        // a = array b [c]
+    StoreElement,       // array a [b] = c
+    PrintInt,           // print a
+    PrintString,        // print string a
+    Jump,               // to a
+    // Compare and branch: to c when a op b, on to the next instruction
+    // otherwise.
+    JumpIfEqual,
+    JumpIfNotEqual,
+    JumpIfLess,
+    JumpIfLessEqual,
+    JumpIfGreater,
+    JumpIfGreaterEqual,
+    // The end of a for loop: a++ (or a--), then to c when a op b.
+    IncrementJumpIfLess,
+    IncrementJumpIfLessEqual,
+    IncrementJumpIfNotEqual,
+    DecrementJumpIfGreater,
+    DecrementJumpIfGreaterEqual,
+    DecrementJumpIfNotEqual,
+    Halt,
+};
+
+inline constexpr size_t bytecodeOpCount = static_cast<size_t>(BytecodeOp::Halt) + 1;
+
+struct BytecodeInstruction {
+    BytecodeOp op;
+    int32_t a = 0;
+    int32_t b = 0;
+    int32_t c = 0;
+};
+
+struct BytecodeArray {
+    uint32_t offset;    // of its first element among all arrays' elements
+    uint32_t length;
+    Symbol name;
+};
+
+struct BytecodeProgram {
+    std::vector<BytecodeInstruction> code {};
+    // Every slot's value when the program starts: 0 except for constants.
+    std::vector<int32_t> slots {};
+    // Each with its newline.
+    std::vector<std::string> strings {};
+    std::vector<BytecodeArray> arrays {};
+    uint32_t elementCount = 0;
+};
+
+// Compiles a ProgramNode to bytecode, rejecting the programs CodeGenerator
+// rejects with the same messages. Like native code, a for loop's body runs
+// once before its condition is first tested.
+class BytecodeCompiler {
+private:
+    enum class Kind : uint8_t { Number, String, Array };
+
+    struct Variable {
+        Kind kind;
+        // The slot, string or array number.
+        int32_t index;
+    };
+
+    // Where an expression's value is, and the value itself when it is
+    // known now.
+    struct Operand {
+        int32_t slot;
+        bool constant;
+        int32_t value;
+    };
+
+    // Arrays live in one block of elements; keep it well below 4 GiB.
+    static constexpr uint32_t maxArrayLength = 1 << 26;
+
+    const StringTable& strings;
+    BytecodeProgram program {};
+    std::unordered_map<Symbol, Variable> variables {};
+    std::unordered_map<int32_t, int32_t> constants {};
+    // Temporaries, handed out again once the statement using them is done.
+    std::vector<int32_t> freeTemporaries {};
+    std::vector<int32_t> usedTemporaries {};
+    int controlDepth = 0;
+
+    [[noreturn]] void fail(std::string_view message) {
+        compileError(message);
+    }
+
+    std::string name(Symbol symbol) const { return std::string(strings.str(symbol)); }
+
+    int32_t newSlot(int32_t value = 0) {
+        program.slots.push_back(value);
+        return static_cast<int32_t>(program.slots.size() - 1);
+    }
+
+    int32_t temporary() {
+        int32_t slot;
+        if (freeTemporaries.empty()) {
+            slot = newSlot();
+        } else {
+            slot = freeTemporaries.back();
+            freeTemporaries.pop_back();
+        }
+        usedTemporaries.push_back(slot);
+        return slot;
+    }
+
+    Operand constant(int32_t value) {
+        auto it = constants.find(value);
+        if (it == constants.end()) {
+            it = constants.emplace(value, newSlot(value)).first;
+        }
+        return {it->second, true, value};
+    }
+
+    size_t emit(BytecodeOp op, int32_t a = 0, int32_t b = 0, int32_t c = 0) {
+        program.code.push_back({op, a, b, c});
+        return program.code.size() - 1;
+    }
+
+    int32_t here() const { return static_cast<int32_t>(program.code.size()); }
+
+    const Variable& lookup(Symbol symbol) {
+        auto it = variables.find(symbol);
+        if (it == variables.end()) {
+            compileError("Variable ", strings.str(symbol), " not declared ");
+        }
+        return it->second;
+    }
+
+    void declare(Symbol symbol, Variable variable) {
+        if (!variables.emplace(symbol, variable).second) {
+            compileError("Variable ", strings.str(symbol), " already declared ");
+        }
+    }
+
+    const Variable& number(Symbol symbol) {
+        const Variable& variable = lookup(symbol);
+        if (variable.kind == Kind::Array) {
+            fail("Array " + name(symbol) + " needs an index");
+        }
+        if (variable.kind == Kind::String) {
+            fail("Strings cannot be used in arithmetic");
+        }
+        return variable;
+    }
+
+    // The string an expression names, or -1 for a number.
+    int32_t stringOf(AstNode* node) {
+        if (node->kind == NodeKind::String) {
+            std::string text(strings.str(static_cast<StringNode*>(node)->name));
+            for (size_t at = text.find("\\n"); at != std::string::npos; at = text.find("\\n", at + 1)) {
+                text.replace(at, 2, "\n");
+            }
+            program.strings.push_back(text + "\n");
+            return static_cast<int32_t>(program.strings.size() - 1);
+        }
+        if (node->kind == NodeKind::Identifier) {
+            auto it = variables.find(static_cast<IdentifierNode*>(node)->name);
+            if (it != variables.end() && it->second.kind == Kind::String) {
+                return it->second.index;
+            }
+        }
+        return -1;
+    }
+
+    const BytecodeArray& array(Symbol symbol, int32_t& index) {
+        const Variable& variable = lookup(symbol);
+        if (variable.kind != Kind::Array) {
+            fail("Variable " + name(symbol) + " is not an array");
+        }
+        index = variable.index;
+        return program.arrays[variable.index];
+    }
+
+    Operand elementIndex(ElementNode* node, int32_t& arrayIndex) {
+        const BytecodeArray& target = array(node->identifier->name, arrayIndex);
+        Operand index = value(node->index);
+        if (index.constant && (index.value < 0 || static_cast<uint32_t>(index.value) >= target.length)) {
+            fail("Index " + std::to_string(index.value) + " is out of bounds for array " + name(target.name) +
+                 " of " + std::to_string(target.length) + " elements");
+        }
+        return index;
+    }
+
+    // Evaluates a number expression into target, or into a temporary when
+    // target is -1. Operations on two constants are folded.
+    Operand value(AstNode* node, int32_t target = -1) {
+        switch (node->kind) {
+            case NodeKind::Number:
+                return constant(static_cast<NumberNode*>(node)->value);
+            case NodeKind::Identifier: {
+                const Variable& variable = number(static_cast<IdentifierNode*>(node)->name);
+                return {variable.index, false, 0};
+            }
+            case NodeKind::String:
+                fail("Strings cannot be used in arithmetic");
+            case NodeKind::BinaryOp: {
+                auto* binary = static_cast<BinaryOpNode*>(node);
+                Operand left = value(binary->left);
+                Operand right = value(binary->right);
+                if (binary->op == Operator::Divide && right.constant && right.value == 0) {
+                    fail("Division by zero");
+                }
+                BytecodeOp op;
+                switch (binary->op) {
+                    case Operator::Add: op = BytecodeOp::Add; break;
+                    case Operator::Subtract: op = BytecodeOp::Subtract; break;
+                    case Operator::Multiply: op = BytecodeOp::Multiply; break;
+                    case Operator::Divide: op = BytecodeOp::Divide; break;
+                    default: fail("Unsupported operator: " + std::string(operatorText(binary->op)));
+                }
+                if (left.constant && right.constant && canFoldArithmetic(binary->op, left.value, right.value)) {
+                    return constant(foldArithmetic(binary->op, left.value, right.value));
+                }
+                int32_t result = target >= 0 ? target : temporary();
+                emit(op, result, left.slot, right.slot);
+                return {result, false, 0};
+            }
+            case NodeKind::Element: {
+                auto* element = static_cast<ElementNode*>(node);
+                int32_t arrayIndex;
+                Operand index = elementIndex(element, arrayIndex);
+                int32_t result = target >= 0 ? target : temporary();
+                emit(BytecodeOp::LoadElement, result, arrayIndex, index.slot);
+                return {result, false, 0};
+            }
+            default:
+                fail("Expected a number");
+        }
+    }
+
+    void assign(int32_t slot, AstNode* node) {
+        Operand result = value(node, slot);
+        if (result.slot != slot) {
+            emit(BytecodeOp::Move, slot, result.slot);
+        }
+    }
+
+    static BytecodeOp jumpIf(Operator op) {
+        switch (op) {
+            case Operator::Equal: return BytecodeOp::JumpIfEqual;
+            case Operator::NotEqual: return BytecodeOp::JumpIfNotEqual;
+            case Operator::Less: return BytecodeOp::JumpIfLess;
+            case Operator::LessEqual: return BytecodeOp::JumpIfLessEqual;
+            case Operator::Greater: return BytecodeOp::JumpIfGreater;
+            default: return BytecodeOp::JumpIfGreaterEqual;
+        }
+    }
+
+    static Operator negate(Operator op) {
+        switch (op) {
+            case Operator::Equal: return Operator::NotEqual;
+            case Operator::NotEqual: return Operator::Equal;
+            case Operator::Less: return Operator::GreaterEqual;
+            case Operator::LessEqual: return Operator::Greater;
+            case Operator::Greater: return Operator::LessEqual;
+            default: return Operator::Less;
+        }
+    }
+
+    ComparisonNode* comparison(AstNode* node) {
+        if (node->kind != NodeKind::Comparison) {
+            return nullptr;
+        }
+        auto* compare = static_cast<ComparisonNode*>(node);
+        if (compare->op < Operator::Equal || compare->op > Operator::GreaterEqual) {
+            fail("Unsupported comparison operator: " + std::string(operatorText(compare->op)));
+        }
+        return compare;
+    }
+
+    // Emits a jump taken when condition has the value when; returns its
+    // index for the target to be filled in, or -1 when nothing was emitted
+    // because the jump is never taken.
+    int32_t jumpWhen(AstNode* node, bool when) {
+        ComparisonNode* compare = comparison(node);
+        if (compare == nullptr) {
+            // Not a comparison: like native code, never true.
+            value(node);
+            return when ? -1 : static_cast<int32_t>(emit(BytecodeOp::Jump));
+        }
+        Operand left = value(compare->left);
+        Operand right = value(compare->right);
+        Operator op = when ? compare->op : negate(compare->op);
+        if (left.constant && right.constant) {
+            return foldComparison(op, left.value, right.value) ? static_cast<int32_t>(emit(BytecodeOp::Jump)) : -1;
+        }
+        return static_cast<int32_t>(emit(jumpIf(op), left.slot, right.slot));
+    }
+
+    void setTarget(int32_t jump, int32_t target) {
+        if (jump < 0) {
+            return;
+        }
+        BytecodeInstruction& instruction = program.code[jump];
+        (instruction.op == BytecodeOp::Jump ? instruction.a : instruction.c) = target;
+    }
+
+    // The increment and condition of a for loop as one instruction, when
+    // the condition tests the counter against a variable or a constant.
+    bool fuseLoopEnd(IncrementNode* increment, AstNode* condition, int32_t top) {
+        ComparisonNode* compare = comparison(condition);
+        auto* counter = static_cast<IdentifierNode*>(increment->identifier);
+        if (compare == nullptr || compare->left->kind != NodeKind::Identifier ||
+            static_cast<IdentifierNode*>(compare->left)->name != counter->name ||
+            (compare->right->kind != NodeKind::Identifier && compare->right->kind != NodeKind::Number)) {
+            return false;
+        }
+        bool up = increment->value == Operator::Increment;
+        BytecodeOp op;
+        switch (compare->op) {
+            case Operator::Less: op = BytecodeOp::IncrementJumpIfLess; break;
+            case Operator::LessEqual: op = BytecodeOp::IncrementJumpIfLessEqual; break;
+            case Operator::Greater: op = BytecodeOp::DecrementJumpIfGreater; break;
+            case Operator::GreaterEqual: op = BytecodeOp::DecrementJumpIfGreaterEqual; break;
+            case Operator::NotEqual:
+                op = up ? BytecodeOp::IncrementJumpIfNotEqual : BytecodeOp::DecrementJumpIfNotEqual;
+                break;
+            default: return false;
+        }
+        bool increments = op <= BytecodeOp::IncrementJumpIfNotEqual;
+        if (increments != up) {
+            return false;
+        }
+        const Variable& variable = number(counter->name);
+        Operand bound = value(compare->right);
+        emit(op, variable.index, bound.slot, top);
+        return true;
+    }
+
+    void statement(AstNode* node) {
+        if (node == nullptr) {
+            return;
+        }
+        switch (node->kind) {
+            case NodeKind::Program:
+                for (AstNode* child : static_cast<ProgramNode*>(node)->statements) {
+                    statement(child);
+                    // No value outlives the statement that computed it.
+                    freeTemporaries.insert(freeTemporaries.end(), usedTemporaries.begin(), usedTemporaries.end());
+                    usedTemporaries.clear();
+                }
+                return;
+            case NodeKind::Declaration: {
+                auto* declaration = static_cast<DeclarationNode*>(node);
+                Symbol symbol = declaration->identifier->name;
+                if (variables.count(symbol)) {
+                    declare(symbol, {});
+                }
+                int32_t text = stringOf(declaration->value);
+                if (text >= 0) {
+                    declare(symbol, {Kind::String, text});
+                    return;
+                }
+                // Evaluated before the variable exists, so it cannot read
+                // itself. A constant at the top level is just the slot's
+                // starting value.
+                int32_t slot = newSlot();
+                Operand initial = value(declaration->value, slot);
+                if (initial.constant && controlDepth == 0) {
+                    program.slots[slot] = initial.value;
+                } else if (initial.slot != slot) {
+                    emit(BytecodeOp::Move, slot, initial.slot);
+                }
+                declare(symbol, {Kind::Number, slot});
+                return;
+            }
+            case NodeKind::Assignment: {
+                auto* assignment = static_cast<AssignmentNode*>(node);
+                if (stringOf(assignment->value) >= 0) {
+                    lookup(assignment->identifier->name);
+                    fail("Cant reassign String");
+                }
+                const Variable& variable = lookup(assignment->identifier->name);
+                if (variable.kind == Kind::Array) {
+                    fail("Array " + name(assignment->identifier->name) + " needs an index");
+                }
+                if (variable.kind == Kind::String) {
+                    fail("Cant reassign String");
+                }
+                assign(variable.index, assignment->value);
+                return;
+            }
+            case NodeKind::ArrayDeclaration: {
+                auto* declaration = static_cast<ArrayDeclarationNode*>(node);
+                Symbol symbol = declaration->identifier->name;
+                if (variables.count(symbol)) {
+                    fail("Variable " + name(symbol) + " already declared ");
+                }
+                if (controlDepth > 0) {
+                    fail("Array " + name(symbol) + " must be declared at the top level");
+                }
+                auto length = static_cast<uint32_t>(declaration->size);
+                if (length == 0 || length > maxArrayLength) {
+                    fail("Array " + name(symbol) + " must have between 1 and " + std::to_string(maxArrayLength) +
+                         " elements");
+                }
+                declare(symbol, {Kind::Array, static_cast<int32_t>(program.arrays.size())});
+                program.arrays.push_back({program.elementCount, length, symbol});
+                program.elementCount += length;
+                return;
+            }
+            case NodeKind::ElementAssignment: {
+                auto* assignment = static_cast<ElementAssignmentNode*>(node);
+                int32_t arrayIndex;
+                Operand index = elementIndex(assignment->element, arrayIndex);
+                Operand stored = value(assignment->value);
+                emit(BytecodeOp::StoreElement, arrayIndex, index.slot, stored.slot);
+                return;
+            }
+            case NodeKind::Print: {
+                AstNode* printed = static_cast<PrintNode*>(node)->identifier;
+                int32_t text = stringOf(printed);
+                if (text >= 0) {
+                    emit(BytecodeOp::PrintString, text);
+                } else {
+                    emit(BytecodeOp::PrintInt, value(printed).slot);
+                }
+                return;
+            }
+            case NodeKind::Increment: {
+                auto* increment = static_cast<IncrementNode*>(node);
+                const Variable& variable = number(static_cast<IdentifierNode*>(increment->identifier)->name);
+                emit(BytecodeOp::AddImmediate, variable.index, increment->value == Operator::Increment ? 1 : -1);
+                return;
+            }
+            case NodeKind::IfStatement: {
+                auto* branch = static_cast<IfStatementNode*>(node);
+                int32_t skip = jumpWhen(branch->condition, false);
+                controlDepth++;
+                statement(branch->trueBody);
+                int32_t over = -1;
+                if (branch->falseBody != nullptr) {
+                    over = static_cast<int32_t>(emit(BytecodeOp::Jump));
+                    setTarget(skip, here());
+                    statement(branch->falseBody);
+                    setTarget(over, here());
+                } else {
+                    setTarget(skip, here());
+                }
+                controlDepth--;
+                return;
+            }
+            case NodeKind::ForLoop: {
+                auto* loop = static_cast<ForLoopNode*>(node);
+                statement(loop->initialization);
+                int32_t top = here();
+                controlDepth++;
+                statement(loop->body);
+                auto* increment = static_cast<IncrementNode*>(loop->increment);
+                if (!fuseLoopEnd(increment, loop->condition, top)) {
+                    statement(increment);
+                    setTarget(jumpWhen(loop->condition, true), top);
+                }
+                controlDepth--;
+                return;
+            }
+            default:
+                // A lone expression.
+                value(node);
+                return;
+        }
+    }
+
+public:
+    explicit BytecodeCompiler(const StringTable& strings) : strings(strings) {}
+
+    BytecodeProgram compile(AstNode* root) {
+        statement(root);
+        emit(BytecodeOp::Halt);
+        return std::move(program);
+    }
+};
+
+#endif
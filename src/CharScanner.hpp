@@ -0,0 +1,183 @@
+#ifndef CHAR_SCANNER_HPP
+#define CHAR_SCANNER_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VERSE_SCAN_X86 1
+#endif
+
+// Character classes used by the tokenizer. A byte may belong to several
+// classes; scans advance while the byte shares a bit with the requested mask.
+enum CharClass : uint8_t {
+    CharSpace = 1 << 0,
+    CharDigit = 1 << 1,
+    CharAlpha = 1 << 2,
+    CharBackslash = 1 << 3,
+    CharAlnum = CharDigit | CharAlpha,
+    CharStringBody = CharAlnum | CharSpace | CharBackslash,
+};
+
+struct CharClassTable {
+    uint8_t classes[256];
+};
+
+constexpr CharClassTable buildCharClassTable() {
+    CharClassTable table {};
+    for (int c = 0; c < 256; c++) {
+        uint8_t cls = 0;
+        if (c == ' ' || (c >= '\t' && c <= '\r')) cls |= CharSpace;
+        if (c >= '0' && c <= '9') cls |= CharDigit;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) cls |= CharAlpha;
+        if (c == '\\') cls |= CharBackslash;
+        table.classes[c] = cls;
+    }
+    return table;
+}
+
+constexpr CharClassTable charClassTable = buildCharClassTable();
+
+constexpr uint8_t charClass(char c) { return charClassTable.classes[static_cast<uint8_t>(c)]; }
+
+enum class ScanKernel {
+    Scalar,
+    Sse2,
+    Avx2,
+};
+
+inline const char* scanKernelName(ScanKernel kernel) {
+    switch (kernel) {
+        case ScanKernel::Sse2: return "sse2";
+        case ScanKernel::Avx2: return "avx2";
+        default: return "scalar";
+    }
+}
+
+// Picks the widest kernel the CPU supports. VERSEC_SCAN=scalar|sse2|avx2
+// overrides the choice, which is how the scalar path is benchmarked.
+inline ScanKernel detectScanKernel() {
+    ScanKernel best = ScanKernel::Scalar;
+#if defined(VERSE_SCAN_X86) && defined(__SSE2__)
+    best = ScanKernel::Sse2;
+    if (__builtin_cpu_supports("avx2")) {
+        best = ScanKernel::Avx2;
+    }
+#endif
+    const char* forced = std::getenv("VERSEC_SCAN");
+    if (forced) {
+        if (std::strcmp(forced, "scalar") == 0) return ScanKernel::Scalar;
+        if (std::strcmp(forced, "sse2") == 0 && best != ScanKernel::Scalar) return ScanKernel::Sse2;
+    }
+    return best;
+}
+
+inline ScanKernel activeScanKernel() {
+    static const ScanKernel kernel = detectScanKernel();
+    return kernel;
+}
+
+inline size_t scanScalar(const char* begin, const char* end, uint8_t mask) {
+    const char* p = begin;
+    while (p < end && (charClass(*p) & mask)) {
+        p++;
+    }
+    return p - begin;
+}
+
+#if defined(VERSE_SCAN_X86) && defined(__SSE2__)
+
+inline __m128i inRange128(__m128i bytes, char lo, char hi) {
+    __m128i clamped = _mm_min_epu8(_mm_max_epu8(bytes, _mm_set1_epi8(lo)), _mm_set1_epi8(hi));
+    return _mm_cmpeq_epi8(clamped, bytes);
+}
+
+inline __m128i classify128(__m128i bytes, uint8_t mask) {
+    __m128i hit = _mm_setzero_si128();
+    if (mask & CharSpace) {
+        hit = _mm_or_si128(hit, _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+                                             inRange128(bytes, '\t', '\r')));
+    }
+    if (mask & CharDigit) {
+        hit = _mm_or_si128(hit, inRange128(bytes, '0', '9'));
+    }
+    if (mask & CharAlpha) {
+        hit = _mm_or_si128(hit, inRange128(_mm_or_si128(bytes, _mm_set1_epi8(0x20)), 'a', 'z'));
+    }
+    if (mask & CharBackslash) {
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')));
+    }
+    return hit;
+}
+
+inline size_t scanSse2(const char* begin, const char* end, uint8_t mask) {
+    const char* p = begin;
+    while (end - p >= 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        uint32_t miss = ~static_cast<uint32_t>(_mm_movemask_epi8(classify128(bytes, mask))) & 0xFFFF;
+        if (miss) {
+            return (p - begin) + __builtin_ctz(miss);
+        }
+        p += 16;
+    }
+    return (p - begin) + scanScalar(p, end, mask);
+}
+
+__attribute__((target("avx2"))) inline __m256i inRange256(__m256i bytes, char lo, char hi) {
+    __m256i clamped = _mm256_min_epu8(_mm256_max_epu8(bytes, _mm256_set1_epi8(lo)), _mm256_set1_epi8(hi));
+    return _mm256_cmpeq_epi8(clamped, bytes);
+}
+
+__attribute__((target("avx2"))) inline __m256i classify256(__m256i bytes, uint8_t mask) {
+    __m256i hit = _mm256_setzero_si256();
+    if (mask & CharSpace) {
+        hit = _mm256_or_si256(hit, _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')),
+                                                   inRange256(bytes, '\t', '\r')));
+    }
+    if (mask & CharDigit) {
+        hit = _mm256_or_si256(hit, inRange256(bytes, '0', '9'));
+    }
+    if (mask & CharAlpha) {
+        hit = _mm256_or_si256(hit, inRange256(_mm256_or_si256(bytes, _mm256_set1_epi8(0x20)), 'a', 'z'));
+    }
+    if (mask & CharBackslash) {
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\\')));
+    }
+    return hit;
+}
+
+__attribute__((target("avx2"))) inline size_t scanAvx2(const char* begin, const char* end, uint8_t mask) {
+    const char* p = begin;
+    while (end - p >= 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        uint32_t miss = ~static_cast<uint32_t>(_mm256_movemask_epi8(classify256(bytes, mask)));
+        if (miss) {
+            return (p - begin) + __builtin_ctz(miss);
+        }
+        p += 32;
+    }
+    return (p - begin) + scanSse2(p, end, mask);
+}
+
+#endif
+
+// Length of the run starting at begin whose bytes all belong to mask.
+inline size_t scanRun(ScanKernel kernel, const char* begin, const char* end, uint8_t mask) {
+#if defined(VERSE_SCAN_X86) && defined(__SSE2__)
+    // Most runs in real sources are a handful of bytes; settle those without
+    // paying for a vector load.
+    if (end - begin < 16 || !(charClass(begin[1]) & mask) || kernel == ScanKernel::Scalar) {
+        return scanScalar(begin, end, mask);
+    }
+    if (kernel == ScanKernel::Avx2) {
+        return scanAvx2(begin, end, mask);
+    }
+    return scanSse2(begin, end, mask);
+#else
+    return scanScalar(begin, end, mask);
+#endif
+}
+
+#endif
@@ -1,337 +1,876 @@
 #include <iostream>
 #include <string>
+#include <type_traits>
 #include <utility>
 #include <vector>
-#include <stack>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include "CompileError.hpp"
 #include "Visitor.hpp"
 #include "Parser.hpp"
+#include "FlatAst.hpp"
+#include "AsmBuffer.hpp"
+#include "CompileStats.hpp"
+#include "Assembly.hpp"
+#include "ConstantPropagator.hpp"
+#include "ElfWriter.hpp"
+#include "InstructionSelector.hpp"
+#include "Ir.hpp"
+#include "IrVerifier.hpp"
+#include "Jit.hpp"
+#include "LoopOptimizer.hpp"
+#include "LoopVectorizer.hpp"
+#include "PeepholeOptimizer.hpp"
+#include "RegisterAllocator.hpp"
+#include "Runtime.hpp"
+#include "StringTable.hpp"
+
+enum class OutputFormat {
+    Object,
+    Assembly,
+    Ir,
+    // Runs the program in this process instead of writing anything out.
+    Run,
+};
+
+struct Variable {
+    std::string value {};
+    bool isString {};
+    // A string with the same text as an earlier one shares its .data entry.
+    Symbol sharedWith = NoSymbol;
+    // Number of elements of an array, 0 for anything else.
+    uint32_t length = 0;
+};
+
+// What an expression evaluates to. Numbers are an SSA value of the region
+// being built. Strings only exist as literals or string variables and carry
+// their text instead. An identifier also records which variable it named.
+struct Value {
+    ValueId id = NoValue;
+    bool isString = false;
+    std::string_view text {};
+    Symbol variable = NoSymbol;
+
+    static Value number(ValueId id, Symbol variable = NoSymbol) { return {id, false, {}, variable}; }
+
+    static Value string(Symbol variable, std::string_view text) { return {NoValue, true, text, variable}; }
+};
 
-class CodeGenerator : public Visitor {
+class CodeGenerator final : public Visitor {
 private:
-    std::map<std::string, std::string> variables;
-    std::stack<int> stack {};
-    std::string buffer {};
-    std::string labelBuffer {};
-    std::string fileName {};
-    std::ofstream file {};
-    int labelCount {};
+    StringTable& strings;
+    std::map<Symbol, Variable> variables;
+    std::unordered_map<std::string_view, Symbol> stringData {};
+    BlockId trueTarget {};
+    BlockId falseTarget {};
+    AsmBuffer output;
+    InstructionList program {};
+    Runtime runtime;
+    OutputFormat format;
+    NasmPrinter printer;
+    ElfWriter object;
+    int controlDepth {};
+
+    IrBuilder builder {};
+    IrPrinter irPrinter;
+    bool verifyIr = false;
+    int regionCount {};
+
+    ConstantPropagator propagator {};
+    bool constantPropagation = true;
+    // The last region that reads each variable, when the whole program is
+    // known up front; a store after that is never read.
+    std::unordered_map<Symbol, int> lastRead {};
+    bool readsKnown = false;
+    // Variables some region's code still loads, stores or prints.
+    std::unordered_set<Symbol> referenced {};
+
+    LoopOptimizer loopOptimizer {};
+    bool loopOptimizations = true;
+    LoopVectorizer vectorizer {};
+
+    InstructionSelector selector;
+    RegisterAllocator allocator;
+    uint32_t virtualCount {};
+
+    PeepholeOptimizer peephole {};
+    bool peepholeEnabled = true;
+    bool peepholeReport = false;
+
+    CompileStats* stats = nullptr;
+
+    // Streaming compiles hand over one statement at a time; once this much
+    // assembly or machine code is pending it is written out so memory stays
+    // bounded.
+    static constexpr size_t spillThreshold = 1 << 20;
+
+    // Keeps every array, and so the addresses code refers to, well below
+    // 2 GiB.
+    static constexpr uint32_t maxArrayLength = 1 << 26;
 
 public:
     std::string replaceSubstring(std::string originalString, std::string searchString, std::string replacementString) {
         std::string newString = originalString;
         size_t found = newString.find(searchString);
-        if (found != std::string::npos) {
+        while (found != std::string::npos) {
             newString.replace(found, searchString.length(), replacementString);
+            found = newString.find(searchString, found + replacementString.length());
         }
         return newString;
     }
 
-    bool isAllDigits(std::string str) {
-        for (char c : str) {
-            if (!std::isdigit(c)) {
-                return false;
-            }
-        }
-        return true;
+    explicit CodeGenerator (StringTable& strings, const std::string& outputFileName = "out.o",
+                            OutputFormat format = OutputFormat::Object, Target target = Target::X86)
+            : strings(strings), output(outputFileName), runtime(strings, program, target, format == OutputFormat::Run),
+              format(format),
+              printer(strings, program, output, target), object(strings, target), irPrinter(strings, output),
+              selector(program, runtime), allocator(strings, target) {};
+
+    // Checks every region with IrVerifier before it is lowered. Always on
+    // under --emit-ir.
+    void setVerifyIr(bool enabled) {
+        verifyIr = enabled;
+    }
+
+    // Constant propagation with unreachable-branch and dead-code removal.
+    // Off, every variable also keeps its slot in .data.
+    void setConstantPropagation(bool enabled) {
+        constantPropagation = enabled;
+    }
+
+    // unrollFactor 1 keeps loop-invariant code motion and strength
+    // reduction but does not unroll.
+    void setLoopOptimizations(bool enabled, int unrollFactor) {
+        loopOptimizations = enabled;
+        loopOptimizer.setUnrollFactor(unrollFactor);
+    }
+
+    // Which instructions vectorized loops use; VectorIsa::None leaves every
+    // loop scalar.
+    void setVectorization(VectorIsa isa) {
+        vectorizer.setIsa(isa);
+    }
+
+    // report prints how many instructions the peephole pass removed once
+    // the program is finished.
+    void setPeephole(bool enabled, bool report) {
+        peepholeEnabled = enabled;
+        peepholeReport = report;
+    }
+
+    // Counts the instructions and labels emitted into stats, and times the
+    // writing of the output and a --run apart from code generation.
+    void setStats(CompileStats* compileStats) {
+        stats = compileStats;
+    }
+
+    void addVariable(Symbol name, std::string value, bool isString) {
+        variables[name] = {std::move(value), isString};
+    }
+
+    Variable& lookupVariable(Symbol name) {
+        auto it = variables.find(name);
+        if (it == variables.end()) {
+            output.discard();
+            compileError("Variable ", strings.str(name), " not declared ");
+        };
+        return it->second;
     }
 
-    explicit CodeGenerator (const std::string& outputFileName = "out.asm"){
-        this->file = std::ofstream (outputFileName, std::ios::trunc);
-        this->fileName = outputFileName;
-    };
+    [[noreturn]] void fail(std::string_view message) {
+        output.discard();
+        compileError(message);
+    }
 
-    void addVariable(const std::string& name, std::string value) {
-        variables[name] = std::move(value);
+    ValueId requireNumber(const Value& value) {
+        if (value.isString) {
+            fail("Strings cannot be used in arithmetic");
+        }
+        return value.id;
     }
 
+    // Top-level statements are emitted one at a time, each as its own IR
+    // region that is selected and register allocated on its own.
     void generateCode(AstNode* node) {
-        file << "section .text" << std::endl;
-        file << "global _start" << std::endl;
-        file << "extern printf" << std::endl;
-        file << "extern exit" << std::endl;
-        file << "_start:" << std::endl;
-        file << std::endl;
-
-        node->accept(this);
-
-        file << std::endl << "call exit" << std::endl;
-
-        genDataSection();
-        file.close();
-    }
-
-    void genDataSection() {
-        file << std::endl << "section .data" << std::endl;
-        if (!variables.empty()) {
-            for (const std::pair<const std::basic_string<char>, std::basic_string<char>>& variable : variables) {
-                if (variable.first.find("_len") != std::string::npos){
-                    file << variable.first << variable.second  << std::endl;
-                }else{
-                    if (isAllDigits(variable.second)){
-                        file << variable.first << " dd " << variable.second  << std::endl;
-                    }else{
-                        file << variable.first << " db " << "\"" << variable.second << "\"" << ",10,0" << std::endl;
-                    };
+        beginCode();
+        if (node->kind == NodeKind::Program) {
+            int region = 0;
+            for (AstNode* statement : static_cast<ProgramNode*>(node)->statements) {
+                recordReads(statement, region++);
+            }
+            readsKnown = true;
+            for (AstNode* statement : static_cast<ProgramNode*>(node)->statements) {
+                emitStatement(statement);
+            }
+        } else {
+            recordReads(node, 0);
+            readsKnown = true;
+            emitStatement(node);
+        }
+        finishCode();
+    }
+
+    void generateCode(const FlatAst& ast) {
+        beginCode();
+        recordReads(ast);
+        readsKnown = true;
+        for (const NodeIndex* it = ast.childrenBegin(ast.root); it != ast.childrenEnd(ast.root); ++it) {
+            emitRegion([&] { emitFlat(ast, *it); });
+        }
+        finishCode();
+    }
 
+    // Every identifier is a read except the target of a declaration or
+    // assignment.
+    void recordReads(AstNode* node, int region) {
+        if (node == nullptr) {
+            return;
+        }
+        dispatch(node, [&](auto* concrete) {
+            using Node = std::remove_pointer_t<decltype(concrete)>;
+            if constexpr (std::is_same_v<Node, IdentifierNode>) {
+                lastRead[concrete->name] = region;
+            } else if constexpr (std::is_same_v<Node, BinaryOpNode> || std::is_same_v<Node, ComparisonNode>) {
+                recordReads(concrete->left, region);
+                recordReads(concrete->right, region);
+            } else if constexpr (std::is_same_v<Node, DeclarationNode> || std::is_same_v<Node, AssignmentNode>) {
+                recordReads(concrete->value, region);
+            } else if constexpr (std::is_same_v<Node, PrintNode> || std::is_same_v<Node, IncrementNode>) {
+                recordReads(concrete->identifier, region);
+            } else if constexpr (std::is_same_v<Node, ElementNode>) {
+                recordReads(concrete->identifier, region);
+                recordReads(concrete->index, region);
+            } else if constexpr (std::is_same_v<Node, ElementAssignmentNode>) {
+                recordReads(concrete->element, region);
+                recordReads(concrete->value, region);
+            } else if constexpr (std::is_same_v<Node, IfStatementNode>) {
+                recordReads(concrete->condition, region);
+                recordReads(concrete->trueBody, region);
+                recordReads(concrete->falseBody, region);
+            } else if constexpr (std::is_same_v<Node, ForLoopNode>) {
+                recordReads(concrete->initialization, region);
+                recordReads(concrete->condition, region);
+                recordReads(concrete->increment, region);
+                recordReads(concrete->body, region);
+            } else if constexpr (std::is_same_v<Node, ProgramNode>) {
+                for (AstNode* statement : concrete->statements) {
+                    recordReads(statement, region);
                 }
+            }
+        });
+    }
 
+    // Nodes are stored children first, so each top-level statement's nodes
+    // sit in one run of indices ending at the statement itself.
+    void recordReads(const FlatAst& ast) {
+        std::vector<bool> target(ast.kinds.size(), false);
+        for (NodeIndex node = 0; node < ast.kinds.size(); node++) {
+            if (ast.kinds[node] == NodeKind::Declaration || ast.kinds[node] == NodeKind::Assignment ||
+                ast.kinds[node] == NodeKind::ArrayDeclaration) {
+                target[ast.first[node]] = true;
+            }
+        }
+        int region = 0;
+        const NodeIndex* statement = ast.childrenBegin(ast.root);
+        for (NodeIndex node = 0; node < ast.kinds.size(); node++) {
+            while (statement != ast.childrenEnd(ast.root) && *statement < node) {
+                statement++;
+                region++;
+            }
+            if (ast.kinds[node] == NodeKind::Identifier && !target[node]) {
+                lastRead[ast.first[node]] = region;
             }
         }
-        file << "fmt db \"%d\", 10, 0" << std::endl;
     }
 
-    void visit(ProgramNode* node) override {
-        for (AstNode* statement : node->statements) {
-            statement->accept(this);
+    bool isDeadStore(Symbol name) const {
+        if (!readsKnown) {
+            return false;
         }
+        auto it = lastRead.find(name);
+        return it == lastRead.end() || it->second <= regionCount;
     }
 
-    void visit(BinaryOpNode* node) override {
-        int l;
-        int f;
+    // beginCode/emitStatement/finishCode let a streaming driver hand over one
+    // top-level statement at a time and free it as soon as it is emitted.
+    void beginCode() {
+        if (format == OutputFormat::Assembly) {
+            printer.printHeader({});
+        } else if (format == OutputFormat::Run) {
+            // Already in machine registers, like the routines at the end.
+            runtime.enter();
+            countEmitted();
+            object.encode(program.code);
+            program.code.clear();
+        }
+    }
 
-        node->left->accept(this);
-        if (!buffer.empty()){
-            std::string varValue = replaceSubstring(variables[buffer], "\"", "");
-            l = std::stoi(varValue);
-            buffer.clear();
-        }else{
-            l = stack.top();
-            stack.pop();
-        };
+    void emitStatement(AstNode* node) {
+        emitRegion([&] { emit(node); });
+    }
 
-        node->right->accept(this);
-        if (!buffer.empty()){
-            std::string varValue = replaceSubstring(variables[buffer], "\"", "");
-            f = std::stoi(varValue);
-            buffer.clear();
-        }else{
-            f = stack.top();
-            stack.pop();
-        };
+    // Builds the IR of one statement, then dumps it or lowers it to machine
+    // code.
+    template<typename Body>
+    void emitRegion(Body&& emitBody) {
+        builder.begin();
+        emitBody();
+        IrFunction& function = builder.finish();
+        if (constantPropagation) {
+            propagator.optimize(function, [this](Symbol name) { return isDeadStore(name); });
+        }
+        vectorizer.vectorize(function);
+        if (loopOptimizations) {
+            loopOptimizer.optimize(function);
+        }
+        if (constantPropagation) {
+            recordReferences(function);
+        }
 
-        std::string op = node->op;
-        if (op == "+") {
-            stack.push(f+l);
-        } else if (op == "-") {
-            stack.push(f-l);
-        } else if (op == "*") {
-            stack.push(f*l);
-        } else if (op == "/") {
-            if (l == 0) {
-                std::cerr << "Division by zero" << std::endl;
-                std::ofstream (fileName, std::ios::trunc);
-                exit(EXIT_FAILURE);
-            } else {
-                stack.push(f/l);
+        if (verifyIr || format == OutputFormat::Ir) {
+            IrVerifier verifier(function);
+            if (!verifier.verify()) {
+                fail("IR verification failed in region " + std::to_string(regionCount) + ": " + verifier.message());
             }
+        }
+
+        if (format == OutputFormat::Ir) {
+            irPrinter.print(function, regionCount);
         } else {
-            std::cerr << "Unsupported operator: " << op << std::endl;
-            std::ofstream (fileName, std::ios::trunc);
-            exit(EXIT_FAILURE);
+            virtualCount = selector.select(function);
+            drainInstructions();
+        }
+        regionCount++;
+        CompileStats::Scope emitting(stats, CompileStats::Phase::Emit);
+        if (format == OutputFormat::Object) {
+            object.spill(output, spillThreshold);
+        } else {
+            output.spill(spillThreshold);
         }
     }
 
-    void visit(NumberNode* node) override {
-        stack.push(node->value);
+    void recordReferences(const IrFunction& function) {
+        for (BlockId b : function.layout) {
+            for (const IrInstruction& instruction : function.blocks[b].instructions) {
+                if (instruction.op == IrOp::Load || instruction.op == IrOp::Store ||
+                    instruction.op == IrOp::PrintString || instruction.op == IrOp::LoadElement ||
+                    instruction.op == IrOp::StoreElement || instruction.op == IrOp::VectorLoad ||
+                    instruction.op == IrOp::VectorStore) {
+                    referenced.insert(instruction.symbol);
+                }
+            }
+        }
     }
 
-    void visit(StringNode* node) override {
-        std::string string = replaceSubstring(node->name, "\\n", "%c");
-        buffer.append(string);
+    // Switches on the node kind and calls the matching lowering directly;
+    // CodeGenerator is final, so none of these calls go through the vtable.
+    Value emit(AstNode* node) {
+        return dispatch(node, [this](auto* concrete) { return lower(concrete); });
     }
 
-    void visit(IdentifierNode* node) override {
-        auto it = variables.find(node->name);
-        if (it == variables.end()) {
-            std::cerr << "Variable " << node->name << " not declared " << std::endl;
-            std::ofstream (fileName, std::ios::trunc);
-            exit(EXIT_FAILURE);
-        };
-        buffer.append(it->first);
+    // Assigns registers to the instructions generated so far and hands them
+    // to the backend: printed as text, or encoded into the object's .text section.
+    void drainInstructions() {
+        if (peepholeEnabled) {
+            peephole.foldCompares(program.code, virtualCount);
+        }
+        allocator.allocate(program.code, virtualCount);
+        virtualCount = 0;
+        if (peepholeEnabled) {
+            peephole.optimize(program.code);
+        }
+        countEmitted();
+        if (format == OutputFormat::Assembly) {
+            printer.print(program.code);
+        } else {
+            object.encode(program.code);
+        }
+        program.code.clear();
+    }
+
+    void countEmitted() {
+        if (stats != nullptr) {
+            stats->countInstructions(program.code);
+        }
     }
 
-    void visit(PrintNode* node) override {
-        node->identifier->accept(this);
+    void finishCode() {
+        if (format == OutputFormat::Ir) {
+            CompileStats::Scope emitting(stats, CompileStats::Phase::Emit);
+            output.flush();
+            return;
+        }
 
-        if (isAllDigits(variables.at(buffer))){
-            file << "push dword [" << buffer << "]" << std::endl;
-            file << "push dword fmt" << std::endl;
-            file << "call printf" << std::endl;
-        }else{
-            file << "push dword " << buffer << "" << std::endl;
-            file << "call printf" << std::endl;
-        };
+        runtime.exit();
+        drainInstructions();
+        if (peepholeReport) {
+            std::cerr << "peephole: removed " << peephole.removed() << " of " << peephole.examined()
+                      << " instructions" << std::endl;
+        }
 
-        buffer.clear();
+        // Already in machine registers, and not to be rearranged.
+        runtime.emitRoutines();
+        countEmitted();
+        if (format == OutputFormat::Assembly) {
+            printer.print(program.code);
+        } else {
+            object.encode(program.code);
+        }
+        program.code.clear();
+
+        std::vector<DataDefinition> data = genDataSection();
+        if (format == OutputFormat::Assembly) {
+            CompileStats::Scope emitting(stats, CompileStats::Phase::Emit);
+            printer.printData(data);
+            output.flush();
+        } else if (format == OutputFormat::Run) {
+            CompileStats::Scope running(stats, CompileStats::Phase::Run);
+            Jit::run(object, data, runtime);
+        } else {
+            CompileStats::Scope emitting(stats, CompileStats::Phase::Emit);
+            object.finish(data, {}, output);
+        }
     }
 
-    void visit(DeclarationNode* node) override {
-        auto it = variables.find(node->identifier->name);
+    std::vector<DataDefinition> genDataSection() {
+        std::vector<DataDefinition> data;
+        data.reserve(variables.size() + 1);
+        for (const std::pair<const Symbol, Variable>& variable : variables) {
+            if ((constantPropagation && !referenced.count(variable.first)) ||
+                variable.second.sharedWith != NoSymbol) {
+                continue;
+            }
+            if (variable.second.length != 0) {
+                // Aligned for the widest vector loads, 32 bytes.
+                data.push_back({variable.first, false, 0, {}, variable.second.length * 4, 32});
+            }else if (variable.second.isString){
+                data.push_back({variable.first, true, 0, variable.second.value});
+            }else{
+                data.push_back({variable.first, false, std::stoi(variable.second.value), {}});
+            };
+        }
+        for (Symbol slot : allocator.spillSymbols()) {
+            data.push_back({slot, false, 0, {}});
+        }
+        runtime.addData(data);
+        return data;
+    }
 
-        if (it != variables.end()) {
-            std::cerr << "Variable " << node->identifier->name << " already declared " << std::endl;
-            std::ofstream (fileName, std::ios::trunc);
-            exit(EXIT_FAILURE);
-        };
+    Value emitFlat(const FlatAst& ast, NodeIndex node) {
+        if (node == NoNode) {
+            return {};
+        }
+        auto child = [this, &ast](NodeIndex index) { return [this, &ast, index] { return emitFlat(ast, index); }; };
 
-        node->value->accept(this);
+        switch (ast.kinds[node]) {
+            case NodeKind::Program:
+                for (const NodeIndex* it = ast.childrenBegin(node); it != ast.childrenEnd(node); ++it) {
+                    emitFlat(ast, *it);
+                }
+                return {};
+            case NodeKind::BinaryOp:
+                return genBinaryOp(ast.ops[node], child(ast.first[node]), child(ast.second[node]));
+            case NodeKind::Number:
+                return genNumber(ast.number(node));
+            case NodeKind::Identifier:
+                return genIdentifier(ast.first[node]);
+            case NodeKind::String:
+                return genString(ast.first[node]);
+            case NodeKind::Declaration:
+                return genDeclaration(ast.first[ast.first[node]], child(ast.second[node]));
+            case NodeKind::Assignment:
+                return genAssignment(ast.first[ast.first[node]], child(ast.second[node]));
+            case NodeKind::Comparison:
+                return genComparison(ast.ops[node], child(ast.first[node]), child(ast.second[node]));
+            case NodeKind::IfStatement:
+                return genIfStatement(child(ast.first[node]), child(ast.extraChild(node, 0)),
+                                      child(ast.extraChild(node, 1)), ast.extraChild(node, 1) != NoNode);
+            case NodeKind::ForLoop:
+                return genForLoop(child(ast.first[node]), child(ast.extraChild(node, 0)),
+                                  child(ast.extraChild(node, 1)), child(ast.extraChild(node, 2)));
+            case NodeKind::Print:
+                return genPrint(child(ast.first[node]));
+            case NodeKind::Increment:
+                return genIncrement(ast.ops[node], child(ast.first[node]));
+            case NodeKind::ArrayDeclaration:
+                return genArrayDeclaration(ast.first[ast.first[node]], ast.second[node]);
+            case NodeKind::Element:
+                return genElement(ast.first[ast.first[node]], child(ast.second[node]));
+            case NodeKind::ElementAssignment: {
+                NodeIndex element = ast.first[node];
+                return genElementAssignment(ast.first[ast.first[element]], child(ast.second[element]),
+                                            child(ast.second[node]));
+            }
+        }
+        return {};
+    }
 
-        if (!stack.empty()){
-            addVariable(node->identifier->name, std::to_string(stack.top()));
-            stack.pop();
-        }else{
-            addVariable(node->identifier->name + "_len", " equ $ - " + node->identifier->name);
-            addVariable(node->identifier->name, buffer);
-        };
+    void visit(ProgramNode* node) override { lower(node); }
+
+    void visit(BinaryOpNode* node) override { lower(node); }
+
+    void visit(NumberNode* node) override { lower(node); }
+
+    void visit(StringNode* node) override { lower(node); }
+
+    void visit(IdentifierNode* node) override { lower(node); }
+
+    void visit(PrintNode* node) override { lower(node); }
 
-        buffer.clear();
+    void visit(DeclarationNode* node) override { lower(node); }
+
+    void visit(AssignmentNode* node) override { lower(node); }
+
+    void visit(ComparisonNode* node) override { lower(node); }
+
+    void visit(IfStatementNode* node) override { lower(node); }
+
+    void visit(IncrementNode* node) override { lower(node); }
+
+    void visit(ForLoopNode* node) override { lower(node); }
+
+    void visit(ArrayDeclarationNode* node) override { lower(node); }
+
+    void visit(ElementNode* node) override { lower(node); }
+
+    void visit(ElementAssignmentNode* node) override { lower(node); }
+
+    Value lower(ProgramNode* node) {
+        for (AstNode* statement : node->statements) {
+            emit(statement);
+        }
+        return {};
+    }
+
+    Value lower(BinaryOpNode* node) {
+        return genBinaryOp(node->op, [&] { return emit(node->left); }, [&] { return emit(node->right); });
     }
 
-    void visit(AssignmentNode* node) override {
-        node->value->accept(this);
+    Value lower(NumberNode* node) {
+        return genNumber(node->value);
+    }
 
-        bool varExists = false;
-        for (auto& it : variables){
-            if (it.first == node->identifier->name) {
-                varExists = true;
-            };
-        };
+    Value lower(StringNode* node) {
+        return genString(node->name);
+    }
 
-        if (!varExists){
-            std::cerr << "Variable " << node->identifier->name << " not declared " << std::endl;
-            std::ofstream (fileName, std::ios::trunc);
-            exit(EXIT_FAILURE);
-        };
+    Value lower(IdentifierNode* node) {
+        return genIdentifier(node->name);
+    }
 
-        if (!stack.empty()){
-            file << "mov dword [" << node->identifier->name << "]," << stack.top() << std::endl;
-            stack.pop();
-        }else{
-            std::cerr << "Cant reassign String" << std::endl;
-            std::ofstream (fileName, std::ios::trunc);
-            exit(EXIT_FAILURE);
-        };
+    Value lower(PrintNode* node) {
+        return genPrint([&] { return emit(node->identifier); });
     }
 
-    void visit(ComparisonNode* node) override {
-        std::string label = labelBuffer;
+    Value lower(DeclarationNode* node) {
+        return genDeclaration(node->identifier->name, [&] { return emit(node->value); });
+    }
 
-        node->left->accept(this);
-        std::string leftOp;
-        if (!stack.empty()){
-            leftOp = std::to_string(stack.top());
-            stack.pop();
-        }else{
-            leftOp = buffer;
-            buffer.clear();
-        };
+    Value lower(AssignmentNode* node) {
+        return genAssignment(node->identifier->name, [&] { return emit(node->value); });
+    }
+
+    Value lower(ComparisonNode* node) {
+        return genComparison(node->op, [&] { return emit(node->left); }, [&] { return emit(node->right); });
+    }
+
+    Value lower(IfStatementNode* node) {
+        return genIfStatement([&] { return emit(node->condition); }, [&] { return emit(node->trueBody); },
+                              [&] { return emit(node->falseBody); }, node->falseBody != nullptr);
+    }
+
+    Value lower(IncrementNode* node) {
+        return genIncrement(node->value, [&] { return emit(node->identifier); });
+    }
+
+    Value lower(ForLoopNode* node) {
+        return genForLoop([&] { return emit(node->initialization); }, [&] { return emit(node->condition); },
+                          [&] { return emit(node->increment); },
+                          [&] { return node->body ? emit(node->body) : Value {}; });
+    }
+
+    Value lower(ArrayDeclarationNode* node) {
+        return genArrayDeclaration(node->identifier->name, static_cast<uint32_t>(node->size));
+    }
+
+    Value lower(ElementNode* node) {
+        return genElement(node->identifier->name, [&] { return emit(node->index); });
+    }
+
+    Value lower(ElementAssignmentNode* node) {
+        return genElementAssignment(node->element->identifier->name, [&] { return emit(node->element->index); },
+                                    [&] { return emit(node->value); });
+    }
+
+    int32_t fold(Operator op, int32_t left, int32_t right) {
+        if (op != Operator::Add && op != Operator::Subtract && op != Operator::Multiply && op != Operator::Divide) {
+            fail("Unsupported operator: " + std::string(operatorText(op)));
+        }
+        return foldArithmetic(op, left, right);
+    }
+
+    void checkDivisor(Operator op, ValueId divisor) {
+        int32_t value;
+        if (op == Operator::Divide && builder.isConstant(divisor, value) && value == 0) {
+            fail("Division by zero");
+        }
+    }
+
+    // Decides a comparison between two constants.
+    bool compare(Operator op, int32_t a, int32_t b) {
+        if (op < Operator::Equal || op > Operator::GreaterEqual) {
+            fail("Unsupported comparison operator: " + std::string(operatorText(op)));
+        }
+        return foldComparison(op, a, b);
+    }
 
-        node->right->accept(this);
-        std::string rightOp;
-        if (!stack.empty()){
-            rightOp = std::to_string(stack.top());
-            stack.pop();
+    // Per-node IR generation, shared by the pointer AST visitor and the flat
+    // AST walker. Children are passed as callables that emit the child and
+    // return its Value.
+    template<typename Left, typename Right>
+    Value genBinaryOp(Operator op, Left&& emitLeft, Right&& emitRight) {
+        ValueId left = requireNumber(emitLeft());
+        ValueId right = requireNumber(emitRight());
+        checkDivisor(op, right);
+
+        int32_t a, b;
+        if (builder.isConstant(left, a) && builder.isConstant(right, b) && canFoldArithmetic(op, a, b)) {
+            return Value::number(builder.makeConstant(fold(op, a, b)));
+        }
+        if (op != Operator::Add && op != Operator::Subtract && op != Operator::Multiply && op != Operator::Divide) {
+            fail("Unsupported operator: " + std::string(operatorText(op)));
+        }
+        return Value::number(builder.binary(op, left, right));
+    }
+
+    Value genNumber(int value) {
+        return Value::number(builder.makeConstant(value));
+    }
+
+    Value genString(Symbol name) {
+        std::string string = replaceSubstring(std::string(strings.str(name)), "\\n", "\n");
+        return Value::string(NoSymbol, strings.str(strings.internCopy(string)));
+    }
+
+    Value genIdentifier(Symbol name) {
+        Variable& variable = lookupVariable(name);
+        if (variable.length != 0) {
+            fail("Array " + std::string(strings.str(name)) + " needs an index");
+        }
+        if (variable.isString) {
+            return Value::string(variable.sharedWith != NoSymbol ? variable.sharedWith : name, variable.value);
+        }
+        return Value::number(builder.readVariable(name), name);
+    }
+
+    template<typename Identifier>
+    Value genPrint(Identifier&& emitIdentifier) {
+        Value value = emitIdentifier();
+
+        if (!value.isString){
+            builder.print(value.id);
         }else{
-            rightOp = buffer;
-            buffer.clear();
+            builder.printString(value.variable);
         };
 
-        std::string compOp = node->op;
+        return {};
+    }
 
-        if (isAllDigits(leftOp)){
-            file << "mov eax, " << leftOp << "" << std::endl;
-        }else{
-            file << "mov eax, [" << leftOp << "]" << std::endl;
+    // A constant declared at the top level becomes the variable's initial
+    // value in .data. Anything else, a runtime value or a declaration inside
+    // an if or a loop that must take effect every time it runs, is stored by code.
+    template<typename Initializer>
+    Value genDeclaration(Symbol name, Initializer&& emitValue) {
+        auto it = variables.find(name);
+
+        if (it != variables.end()) {
+            output.discard();
+            compileError("Variable ", strings.str(name), " already declared ");
         };
 
-        if (isAllDigits(rightOp)){
-            file << "mov ebx, " << rightOp << "" << std::endl;
+        Value value = emitValue();
+
+        int32_t constant;
+        if (value.isString){
+            addVariable(name, std::string(value.text), true);
+            auto shared = stringData.emplace(value.text, name);
+            if (!shared.second) {
+                variables[name].sharedWith = shared.first->second;
+            }
+        }else if (builder.isConstant(value.id, constant) && controlDepth == 0){
+            addVariable(name, std::to_string(constant), false);
+            propagator.setKnown(name, constant);
         }else{
-            file << "mov ebx, [" << rightOp << "]" << std::endl;
+            addVariable(name, "0", false);
+            propagator.setKnown(name, 0);
+            builder.writeVariable(name, value.id);
         };
 
-        file << "cmp eax, ebx" << std::endl;
-
-        if (compOp == "<") {
-            file << "jl " << label << std::endl;
-            file << std::endl;
-        } else if (compOp == ">") {
-            file << "jg " << label << std::endl;
-            file << std::endl;
-        } else if (compOp == "==") {
-            file << "je " << label << std::endl;
-            file << std::endl;
-        } else if (compOp == ">=") {
-            file << "jge " << label << std::endl;
-            file << std::endl;
-        } else if (compOp == "<=") {
-            file << "jle " << label << std::endl;
-            file << std::endl;
-        } else {
-            std::cerr << "Unsupported comparison operator: " << compOp << std::endl;
-            exit(EXIT_FAILURE);
-        }
-
+        return {};
     }
 
-    void visit(IfStatementNode* node) override {
-        int label = ++labelCount;
-        labelBuffer.append("if_label_"+std::to_string(label));
-        node->condition->accept(this);
+    template<typename Initializer>
+    Value genAssignment(Symbol name, Initializer&& emitValue) {
+        Value value = emitValue();
 
-        if (!node->falseBody) {
-            file << "jmp " << "end_if_label_" << label << std::endl;
-        }else{
-            file << "jmp " << "else_label_" << label << std::endl;
+        Variable& variable = lookupVariable(name);
+        if (variable.length != 0) {
+            fail("Array " + std::string(strings.str(name)) + " needs an index");
+        }
+        if (variable.isString || value.isString){
+            fail("Cant reassign String");
         };
 
-        file << std::endl << "if_label_" << label << ":" << std::endl;
-        node->trueBody->accept(this);
-        file << "jmp " << "end_if_label_" << label << std::endl;
-        file << std::endl;
+        builder.writeVariable(name, value.id);
+        return {};
+    }
 
-        if (node->falseBody) {
-            file << "else_label_" << label << ":" << std::endl;
-            node->falseBody->accept(this);
-            file << "jmp " << "end_if_label_" << label << std::endl;
-            file << std::endl;
+    // Arrays are static storage in .bss, zeroed when the program starts, so
+    // they are only declared at the top level.
+    Value genArrayDeclaration(Symbol name, uint32_t length) {
+        if (variables.count(name)) {
+            fail("Variable " + std::string(strings.str(name)) + " already declared ");
+        }
+        if (controlDepth > 0) {
+            fail("Array " + std::string(strings.str(name)) + " must be declared at the top level");
+        }
+        if (length == 0 || length > maxArrayLength) {
+            fail("Array " + std::string(strings.str(name)) + " must have between 1 and " +
+                 std::to_string(maxArrayLength) + " elements");
         }
+        addVariable(name, "0", false);
+        variables[name].length = length;
+        return {};
+    }
 
-        file << std::endl << "end_if_label_" << label << ":" << std::endl;
-        labelBuffer.clear();
+    // The array a constant index is checked against at compile time; any
+    // other index is not checked.
+    ValueId requireIndex(Symbol name, const Value& index) {
+        Variable& variable = lookupVariable(name);
+        if (variable.length == 0) {
+            fail("Variable " + std::string(strings.str(name)) + " is not an array");
+        }
+        ValueId id = requireNumber(index);
+        int32_t constant;
+        if (builder.isConstant(id, constant) && (constant < 0 || static_cast<uint32_t>(constant) >= variable.length)) {
+            fail("Index " + std::to_string(constant) + " is out of bounds for array " +
+                 std::string(strings.str(name)) + " of " + std::to_string(variable.length) + " elements");
+        }
+        return id;
     }
 
-    void visit(IncrementNode* node) override {
-        node->identifier->accept(this);
-        std::string id = buffer;
-        buffer.clear();
-        if (node->value == "++"){
-            file << "add dword ["<< id << "], 1" << std::endl;
-        }else{
-            file << "sub dword ["<< id << "], 1" << std::endl;
-        };
+    template<typename Index>
+    Value genElement(Symbol name, Index&& emitIndex) {
+        ValueId index = requireIndex(name, emitIndex());
+        return Value::number(builder.loadElement(name, index));
     }
 
-    void visit(ForLoopNode* node) override {
-        int label = ++labelCount;
-        labelBuffer.append("for_loop_label_"+std::to_string(label));
+    template<typename Index, typename Initializer>
+    Value genElementAssignment(Symbol name, Index&& emitIndex, Initializer&& emitValue) {
+        ValueId index = requireIndex(name, emitIndex());
+        ValueId value = requireNumber(emitValue());
+        builder.storeElement(name, index, value);
+        return {};
+    }
 
-        node->initialization->accept(this);
-        file << std::endl;
-        file << "for_loop_label_" << label << ":" << std::endl;
+    // Ends the current block with a branch to trueTarget when the comparison
+    // holds and to falseTarget otherwise. Two constants are decided here.
+    template<typename Left, typename Right>
+    Value genComparison(Operator compOp, Left&& emitLeft, Right&& emitRight) {
+        BlockId taken = trueTarget;
+        BlockId notTaken = falseTarget;
+
+        ValueId left = requireNumber(emitLeft());
+        ValueId right = requireNumber(emitRight());
+
+        int32_t a, b;
+        bool constant = builder.isConstant(left, a) && builder.isConstant(right, b);
+        if (!constant) {
+            compare(compOp, 0, 0); // rejects operators that are not comparisons
+            builder.branch(compOp, left, right, taken, notTaken);
+        } else {
+            builder.jump(compare(compOp, a, b) ? taken : notTaken);
+        }
+        return {};
+    }
 
-        node->body->accept(this);
-        node->increment->accept(this);
-        node->condition->accept(this);
+    template<typename Condition, typename TrueBody, typename FalseBody>
+    Value genIfStatement(Condition&& emitCondition, TrueBody&& emitTrueBody, FalseBody&& emitFalseBody,
+                         bool hasFalseBody) {
+        BlockId thenBlock = builder.newBlock("if_label_");
+        BlockId elseBlock = hasFalseBody ? builder.newBlock("else_label_") : NoBlock;
+        BlockId endBlock = builder.newBlock("end_if_label_");
+        if (!hasFalseBody) {
+            elseBlock = endBlock;
+        }
 
-        file << "jmp end_for_loop_" << label << std::endl;
-        file << std::endl;
-        file << "end_for_loop_" << label << ":" << std::endl;
+        trueTarget = thenBlock;
+        falseTarget = elseBlock;
+        emitCondition();
+        if (!builder.terminated()) {
+            builder.jump(elseBlock);
+        }
+        builder.seal(thenBlock);
+
+        controlDepth++;
+        builder.setBlock(thenBlock);
+        emitTrueBody();
+        builder.jump(endBlock);
+
+        if (hasFalseBody) {
+            builder.seal(elseBlock);
+            builder.setBlock(elseBlock);
+            emitFalseBody();
+            builder.jump(endBlock);
+        }
+        controlDepth--;
 
-        labelBuffer.clear();
+        builder.seal(endBlock);
+        builder.setBlock(endBlock);
+        return {};
     }
 
-};
+    template<typename Identifier>
+    Value genIncrement(Operator op, Identifier&& emitIdentifier) {
+        Value value = emitIdentifier();
+        ValueId target = requireNumber(value);
+        ValueId one = builder.makeConstant(1);
+        if (op == Operator::Increment){
+            builder.writeVariable(value.variable, builder.binary(Operator::Add, target, one));
+        }else{
+            builder.writeVariable(value.variable, builder.binary(Operator::Subtract, target, one));
+        };
+        return {};
+    }
+
+    // The body runs once before the condition is first tested. The loop
+    // block stays unsealed until the condition has added the back edge.
+    template<typename Initialization, typename Condition, typename Increment, typename Body>
+    Value genForLoop(Initialization&& emitInitialization, Condition&& emitCondition, Increment&& emitIncrement,
+                     Body&& emitBody) {
+        BlockId loopBlock = builder.newBlock("for_loop_label_");
+        BlockId endBlock = builder.newBlock("end_for_loop_");
+
+        emitInitialization();
+        builder.jump(loopBlock);
+        builder.setBlock(loopBlock);
+
+        controlDepth++;
+        emitBody();
+        emitIncrement();
+        controlDepth--;
+        trueTarget = loopBlock;
+        falseTarget = endBlock;
+        emitCondition();
+        if (!builder.terminated()) {
+            builder.jump(endBlock);
+        }
+
+        builder.seal(loopBlock);
+        builder.seal(endBlock);
+        builder.setBlock(endBlock);
+        return {};
+    }
 
+};
\ No newline at end of file
@@ -0,0 +1,427 @@
+#ifndef COMPILE_CACHE_HPP
+#define COMPILE_CACHE_HPP
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "CompileError.hpp"
+
+// versec has no release numbers, so the time it was built stands in for
+// its version: no build serves another build's output.
+inline constexpr const char* compilerVersion = "versec " __DATE__ " " __TIME__;
+
+// What a compile produced, stored under its key with one of these
+// extensions.
+enum class CacheArtifact { Assembly, Object, Ir, Executable };
+
+// An on-disk cache of compiler output (--cache). An entry's name is a hash
+// of the source bytes, the compiler version and every flag that changes
+// the output, plus the kind of output; a hit copies the entry to the
+// output path without tokenizing, parsing or generating anything.
+//
+// Many versec processes may share the directory. Entries are written to a
+// temporary file and renamed into place, so a reader sees a whole entry or
+// none. A reader that loses an entry to eviction treats it as a miss. Each
+// hit sets the entry's modification time to now, and once the entries add
+// up to more than the limit the least recently used go first. Hit and miss
+// counts and a running total of the entries' size live in a file updated
+// under flock; only a store that takes the total past the limit lists the
+// directory.
+class CompileCache {
+private:
+    // A temporary file left behind this long is from a process that died.
+    static constexpr time_t staleTemporarySeconds = 3600;
+
+    std::string directory;
+    uint64_t limit;
+    bool usable = true;
+    unsigned temporaries = 0;
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        // What the entries add up to, as far as stores and evictions have
+        // kept track. Unknown in a stats file written before it was kept.
+        uint64_t bytes = 0;
+        bool bytesKnown = false;
+    };
+
+    struct Entry {
+        std::string path;
+        uint64_t size;
+        struct timespec used;
+    };
+
+    static const char* extension(CacheArtifact artifact) {
+        switch (artifact) {
+            case CacheArtifact::Assembly: return ".asm";
+            case CacheArtifact::Object: return ".o";
+            case CacheArtifact::Ir: return ".ir";
+            default: return ".exe";
+        }
+    }
+
+    // Two 64-bit lanes over the input eight bytes at a time, each field
+    // closed off by its length so that moving bytes from one field to the
+    // next changes the key.
+    class Hash {
+    private:
+        uint64_t low = 0x9e3779b97f4a7c15ULL;
+        uint64_t high = 0xc2b2ae3d27d4eb4fULL;
+
+        static uint64_t rotate(uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); }
+
+        static uint64_t finish(uint64_t value) {
+            value ^= value >> 33;
+            value *= 0xff51afd7ed558ccdULL;
+            value ^= value >> 33;
+            value *= 0xc4ceb9fe1a85ec53ULL;
+            return value ^ (value >> 33);
+        }
+
+        void mix(uint64_t word) {
+            low = rotate((low ^ word) * 0x9e3779b97f4a7c15ULL, 31);
+            high = rotate((high + word) * 0xc2b2ae3d27d4eb4fULL, 29) ^ low;
+        }
+
+    public:
+        void add(std::string_view bytes) {
+            size_t at = 0;
+            for (; at + 8 <= bytes.size(); at += 8) {
+                uint64_t word;
+                std::memcpy(&word, bytes.data() + at, 8);
+                mix(word);
+            }
+            uint64_t tail = 0;
+            std::memcpy(&tail, bytes.data() + at, bytes.size() - at);
+            mix(tail);
+            mix(bytes.size());
+        }
+
+        std::string hex() const {
+            char digits[33];
+            std::snprintf(digits, sizeof(digits), "%016llx%016llx", static_cast<unsigned long long>(finish(high)),
+                          static_cast<unsigned long long>(finish(low)));
+            return digits;
+        }
+    };
+
+    void warn(const std::string& message) {
+        std::cerr << "cache: " << message << ": " << std::strerror(errno) << std::endl;
+    }
+
+    // mkdir -p.
+    static bool makeDirectories(const std::string& path) {
+        for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+            std::string prefix = path.substr(0, slash);
+            if (::mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+                return false;
+            }
+            if (slash == std::string::npos) {
+                return true;
+            }
+        }
+    }
+
+    static bool readFile(const std::string& path, std::string& contents) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        contents.clear();
+        char chunk[1 << 16];
+        ssize_t count;
+        while ((count = ::read(fd, chunk, sizeof(chunk))) != 0) {
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ::close(fd);
+                return false;
+            }
+            contents.append(chunk, static_cast<size_t>(count));
+        }
+        ::close(fd);
+        return true;
+    }
+
+    // Writes contents to a fresh file beside path and renames it over
+    // path, so path never holds part of a file. The temporary's name is
+    // unique to the process and thread.
+    bool writeAtomically(const std::string& path, std::string_view contents, mode_t mode) {
+        size_t slash = path.rfind('/');
+        std::string temporary = (slash == std::string::npos ? std::string() : path.substr(0, slash + 1)) + ".tmp-" +
+                                std::to_string(::getpid()) + "-" +
+                                std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id())) + "-" +
+                                std::to_string(temporaries++);
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL, mode);
+        if (fd < 0) {
+            return false;
+        }
+        const char* data = contents.data();
+        size_t remaining = contents.size();
+        while (remaining > 0) {
+            ssize_t written = ::write(fd, data, remaining);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ::close(fd);
+                ::unlink(temporary.c_str());
+                return false;
+            }
+            data += written;
+            remaining -= static_cast<size_t>(written);
+        }
+        if (::close(fd) != 0 || ::rename(temporary.c_str(), path.c_str()) != 0) {
+            ::unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    std::string entryPath(const std::string& key, CacheArtifact artifact) const {
+        return directory + "/" + key + extension(artifact);
+    }
+
+    // Holds an exclusive lock on the stats file for as long as it lives.
+    class StatsFile {
+    private:
+        int fd;
+
+    public:
+        explicit StatsFile(const std::string& path) : fd(::open(path.c_str(), O_RDWR | O_CREAT, 0644)) {
+            if (fd >= 0 && ::flock(fd, LOCK_EX) != 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+
+        StatsFile(const StatsFile&) = delete;
+        StatsFile& operator=(const StatsFile&) = delete;
+
+        ~StatsFile() {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+
+        bool locked() const { return fd >= 0; }
+
+        Stats read() const {
+            Stats stats;
+            char text[128] = {};
+            if (::pread(fd, text, sizeof(text) - 1, 0) > 0) {
+                unsigned long long hits = 0, misses = 0, evictions = 0, bytes = 0;
+                int fields = std::sscanf(text, "%llu %llu %llu %llu", &hits, &misses, &evictions, &bytes);
+                stats = {hits, misses, evictions, bytes, fields == 4};
+            }
+            return stats;
+        }
+
+        void write(const Stats& stats) {
+            char text[128];
+            int length = std::snprintf(text, sizeof(text), "%llu %llu %llu %llu\n",
+                                       static_cast<unsigned long long>(stats.hits),
+                                       static_cast<unsigned long long>(stats.misses),
+                                       static_cast<unsigned long long>(stats.evictions),
+                                       static_cast<unsigned long long>(stats.bytes));
+            if (::pwrite(fd, text, static_cast<size_t>(length), 0) == length) {
+                (void) ::ftruncate(fd, length);
+            }
+        }
+    };
+
+    // Every entry, and removes temporary files abandoned by dead processes
+    // on the way.
+    std::vector<Entry> entries() const {
+        std::vector<Entry> found;
+        DIR* listing = ::opendir(directory.c_str());
+        if (listing == nullptr) {
+            return found;
+        }
+        time_t now = std::time(nullptr);
+        while (struct dirent* item = ::readdir(listing)) {
+            std::string name = item->d_name;
+            std::string path = directory + "/" + name;
+            struct stat info {};
+            if (name == "." || name == ".." || name == "stats" || ::stat(path.c_str(), &info) != 0 ||
+                !S_ISREG(info.st_mode)) {
+                continue;
+            }
+            if (name.rfind(".tmp-", 0) == 0) {
+                if (now - info.st_mtime > staleTemporarySeconds) {
+                    ::unlink(path.c_str());
+                }
+                continue;
+            }
+            found.push_back({path, static_cast<uint64_t>(info.st_size), info.st_mtim});
+        }
+        ::closedir(listing);
+        return found;
+    }
+
+    void record(bool hit) {
+        StatsFile file(directory + "/stats");
+        if (!file.locked()) {
+            return;
+        }
+        Stats stats = file.read();
+        (hit ? stats.hits : stats.misses)++;
+        file.write(stats);
+    }
+
+    // Adds a store of added bytes, in place of replaced bytes, to the
+    // running total. Once that goes past the limit, lists the directory to
+    // learn the true total and removes the least recently used entries
+    // until the rest fit. Runs under the stats lock so that concurrent
+    // stores do not both evict for the same excess.
+    void account(uint64_t added, uint64_t replaced) {
+        StatsFile file(directory + "/stats");
+        if (!file.locked()) {
+            return;
+        }
+        Stats stats = file.read();
+        stats.bytes = stats.bytes + added - std::min(replaced, stats.bytes + added);
+        if (stats.bytesKnown && stats.bytes <= limit) {
+            file.write(stats);
+            return;
+        }
+        std::vector<Entry> found = entries();
+        uint64_t total = 0;
+        for (const Entry& entry : found) {
+            total += entry.size;
+        }
+        if (total > limit) {
+            std::sort(found.begin(), found.end(), [](const Entry& a, const Entry& b) {
+                return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec
+                                                      : a.used.tv_nsec < b.used.tv_nsec;
+            });
+            for (const Entry& entry : found) {
+                if (total <= limit) {
+                    break;
+                }
+                if (::unlink(entry.path.c_str()) == 0) {
+                    stats.evictions++;
+                }
+                total -= entry.size;
+            }
+        }
+        stats.bytes = total;
+        file.write(stats);
+    }
+
+public:
+    // $VERSEC_CACHE_DIR, else versec under $XDG_CACHE_HOME or ~/.cache.
+    static std::string defaultDirectory() {
+        if (const char* path = std::getenv("VERSEC_CACHE_DIR"); path != nullptr && *path != '\0') {
+            return path;
+        }
+        if (const char* path = std::getenv("XDG_CACHE_HOME"); path != nullptr && *path != '\0') {
+            return std::string(path) + "/versec";
+        }
+        const char* home = std::getenv("HOME");
+        return std::string(home != nullptr ? home : ".") + "/.cache/versec";
+    }
+
+    // The key for source compiled with settings, which must spell out every
+    // flag that changes the output.
+    static std::string key(std::string_view source, std::string_view settings) {
+        Hash hash;
+        hash.add(compilerVersion);
+        hash.add(settings);
+        hash.add(source);
+        return hash.hex();
+    }
+
+    // A directory that cannot be created leaves the cache unusable: every
+    // lookup misses and nothing is stored, and the compile goes on.
+    CompileCache(std::string directory, uint64_t limit) : directory(std::move(directory)), limit(limit) {
+        if (!makeDirectories(this->directory)) {
+            warn("could not create " + this->directory);
+            usable = false;
+        }
+    }
+
+    // Copies the entry to outputPath and counts a hit, or counts a miss
+    // when there is none. A lookup with another to fall back on passes
+    // countMiss false, so that one compile counts once.
+    bool fetch(const std::string& key, CacheArtifact artifact, const std::string& outputPath, bool countMiss = true) {
+        if (!usable) {
+            return false;
+        }
+        std::string path = entryPath(key, artifact);
+        std::string contents;
+        if (!readFile(path, contents)) {
+            if (countMiss) {
+                record(false);
+            }
+            return false;
+        }
+        ::utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+        mode_t mode = artifact == CacheArtifact::Executable ? 0755 : 0644;
+        if (!writeAtomically(outputPath, contents, mode)) {
+            compileError("Could not write ", outputPath, ": ", std::strerror(errno));
+        }
+        record(true);
+        return true;
+    }
+
+    // Copies a freshly compiled outputPath into the cache.
+    void store(const std::string& key, CacheArtifact artifact, const std::string& outputPath) {
+        if (!usable) {
+            return;
+        }
+        std::string contents;
+        if (!readFile(outputPath, contents)) {
+            warn("could not read " + outputPath);
+            return;
+        }
+        std::string path = entryPath(key, artifact);
+        struct stat previous {};
+        uint64_t replaced = ::stat(path.c_str(), &previous) == 0 ? static_cast<uint64_t>(previous.st_size) : 0;
+        if (!writeAtomically(path, contents, 0644)) {
+            warn("could not store " + outputPath);
+            return;
+        }
+        account(contents.size(), replaced);
+    }
+
+    void printStats() const {
+        Stats stats;
+        {
+            StatsFile file(directory + "/stats");
+            if (file.locked()) {
+                stats = file.read();
+            }
+        }
+        uint64_t total = 0;
+        std::vector<Entry> found = entries();
+        for (const Entry& entry : found) {
+            total += entry.size;
+        }
+        uint64_t lookups = stats.hits + stats.misses;
+        std::cerr << "cache: " << stats.hits << " hits, " << stats.misses << " misses ("
+                  << (lookups > 0 ? stats.hits * 100 / lookups : 0) << "% hits), " << stats.evictions
+                  << " evicted; " << found.size() << " entries, " << total << " of " << limit << " bytes in "
+                  << directory << std::endl;
+    }
+};
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef COMPILE_ERROR_HPP
+#define COMPILE_ERROR_HPP
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// Why a compile stopped. Everything from opening the source to writing the
+// output throws this instead of exiting, so that a batch compile can report
+// one file's failure and carry on with the rest; for a single file main
+// prints the message and exits with a failure status, as it always has.
+class CompileError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Throws a CompileError with the parts streamed one after another.
+template<typename... Parts>
+[[noreturn]] void compileError(const Parts&... parts) {
+    std::ostringstream message;
+    (message << ... << parts);
+    throw CompileError(message.str());
+}
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef COMPILE_STATS_HPP
+#define COMPILE_STATS_HPP
+
+#include <sys/resource.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "Assembly.hpp"
+#include "FlatAst.hpp"
+#include "Parser.hpp"
+
+// What one compile spent and produced, for --stats and --stats-json: wall
+// time and heap allocations per phase, token and AST node counts, the
+// machine instructions and labels emitted, and the process's peak RSS.
+//
+// Nothing is measured unless a CompileStats is handed to the driver and
+// the code generator: a Scope given no stats does nothing, and operator
+// new (replaced in Main.cpp) only counts while countingAllocations is set,
+// which main does once before any compile starts.
+class CompileStats {
+public:
+    enum class Phase : uint8_t { Read, Tokenize, Parse, Generate, Emit, Run };
+
+    static constexpr size_t phaseCount = static_cast<size_t>(Phase::Run) + 1;
+    static constexpr size_t nodeKindCount = static_cast<size_t>(NodeKind::ElementAssignment) + 1;
+
+    // Zeroed by value initialization ({}) where declared: default member
+    // initializers would not be usable by the thread_local below.
+    struct Allocations {
+        uint64_t count;
+        uint64_t bytes;
+    };
+
+    static inline bool countingAllocations = false;
+    // Per thread, so that each file of a batch counts only its own.
+    static inline thread_local Allocations threadAllocations {};
+
+    static void recordAllocation(size_t size) {
+        threadAllocations.count++;
+        threadAllocations.bytes += size;
+    }
+
+    // Adds the time and allocations from its construction to its
+    // destruction to phase, less whatever nested scopes recorded for other
+    // phases in between, so that each phase is counted once.
+    class Scope {
+    private:
+        CompileStats* stats;
+        Phase phase;
+        std::chrono::steady_clock::time_point start {};
+        double nestedSeconds = 0;
+        Allocations nestedAllocations {};
+        Allocations allocationsBefore {};
+
+    public:
+        Scope(CompileStats* stats, Phase phase) : stats(stats), phase(phase) {
+            if (stats != nullptr) {
+                nestedSeconds = stats->totalSeconds();
+                nestedAllocations = stats->totalAllocations();
+                allocationsBefore = threadAllocations;
+                start = std::chrono::steady_clock::now();
+            }
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        ~Scope() { end(); }
+
+        // Stops measuring before the scope closes.
+        void end() {
+            if (stats == nullptr) {
+                return;
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            Allocations nested = stats->totalAllocations();
+            PhaseRecord& record = stats->phases[static_cast<size_t>(phase)];
+            record.seconds += seconds - (stats->totalSeconds() - nestedSeconds);
+            record.allocations.count += threadAllocations.count - allocationsBefore.count -
+                                        (nested.count - nestedAllocations.count);
+            record.allocations.bytes += threadAllocations.bytes - allocationsBefore.bytes -
+                                        (nested.bytes - nestedAllocations.bytes);
+            stats = nullptr;
+        }
+    };
+
+private:
+    struct PhaseRecord {
+        double seconds = 0;
+        Allocations allocations {};
+    };
+
+    static constexpr const char* phaseNames[phaseCount] = {"read", "tokenize", "parse", "generate", "emit", "run"};
+    static constexpr const char* nodeKindNames[nodeKindCount] = {
+        "Program", "BinaryOp", "Number", "Identifier", "String", "Declaration", "Assignment", "Comparison",
+        "IfStatement", "ForLoop", "Print", "Increment", "ArrayDeclaration", "Element", "ElementAssignment",
+    };
+
+    std::array<PhaseRecord, phaseCount> phases {};
+    std::array<uint64_t, nodeKindCount> nodes {};
+    uint64_t tokens = 0;
+    uint64_t instructions = 0;
+    uint64_t labels = 0;
+    Allocations arena {};
+
+    double totalSeconds() const {
+        double total = 0;
+        for (const PhaseRecord& record : phases) {
+            total += record.seconds;
+        }
+        return total;
+    }
+
+    Allocations totalAllocations() const {
+        Allocations total {};
+        for (const PhaseRecord& record : phases) {
+            total.count += record.allocations.count;
+            total.bytes += record.allocations.bytes;
+        }
+        return total;
+    }
+
+    // ru_maxrss is in KiB on Linux.
+    static uint64_t peakResidentBytes() {
+        struct rusage usage {};
+        getrusage(RUSAGE_SELF, &usage);
+        return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+    }
+
+    static void writeJsonString(std::ostream& out, const std::string& text) {
+        out << '"';
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                out << '\\' << c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out << escaped;
+            } else {
+                out << c;
+            }
+        }
+        out << '"';
+    }
+
+public:
+    void addTokens(uint64_t count) { tokens += count; }
+
+    uint64_t nodeCount() const {
+        uint64_t total = 0;
+        for (uint64_t count : nodes) {
+            total += count;
+        }
+        return total;
+    }
+
+    void countNodes(AstNode* node) {
+        if (node == nullptr) {
+            return;
+        }
+        nodes[static_cast<size_t>(node->kind)]++;
+        dispatch(node, [&](auto* concrete) {
+            using Node = std::remove_pointer_t<decltype(concrete)>;
+            if constexpr (std::is_same_v<Node, BinaryOpNode> || std::is_same_v<Node, ComparisonNode>) {
+                countNodes(concrete->left);
+                countNodes(concrete->right);
+            } else if constexpr (std::is_same_v<Node, DeclarationNode> || std::is_same_v<Node, AssignmentNode>) {
+                countNodes(concrete->identifier);
+                countNodes(concrete->value);
+            } else if constexpr (std::is_same_v<Node, PrintNode> || std::is_same_v<Node, IncrementNode>) {
+                countNodes(concrete->identifier);
+            } else if constexpr (std::is_same_v<Node, ArrayDeclarationNode>) {
+                countNodes(concrete->identifier);
+            } else if constexpr (std::is_same_v<Node, ElementNode>) {
+                countNodes(concrete->identifier);
+                countNodes(concrete->index);
+            } else if constexpr (std::is_same_v<Node, ElementAssignmentNode>) {
+                countNodes(concrete->element);
+                countNodes(concrete->value);
+            } else if constexpr (std::is_same_v<Node, IfStatementNode>) {
+                countNodes(concrete->condition);
+                countNodes(concrete->trueBody);
+                countNodes(concrete->falseBody);
+            } else if constexpr (std::is_same_v<Node, ForLoopNode>) {
+                countNodes(concrete->initialization);
+                countNodes(concrete->condition);
+                countNodes(concrete->increment);
+                countNodes(concrete->body);
+            } else if constexpr (std::is_same_v<Node, ProgramNode>) {
+                for (AstNode* statement : concrete->statements) {
+                    countNodes(statement);
+                }
+            }
+        });
+    }
+
+    void countNodes(const FlatAst& ast) {
+        for (NodeKind kind : ast.kinds) {
+            nodes[static_cast<size_t>(kind)]++;
+        }
+    }
+
+    // A streaming compile never holds the whole program, so its root is
+    // counted on its own.
+    void countProgramNode() { nodes[static_cast<size_t>(NodeKind::Program)]++; }
+
+    void countInstructions(const std::vector<Instruction>& code) {
+        for (const Instruction& instruction : code) {
+            (instruction.op == Opcode::Label ? labels : instructions)++;
+        }
+    }
+
+    void countInstructions(uint64_t count) { instructions += count; }
+
+    // AST nodes come from the arena, which allocates from malloc in large
+    // blocks and is not seen by operator new.
+    void setArenaAllocations(uint64_t count, uint64_t bytes) { arena = {count, bytes}; }
+
+    void print(std::ostream& out, const std::string& file) const {
+        char line[128];
+        out << "stats for " << file << ":\n";
+        std::snprintf(line, sizeof(line), "  %-10s %12s %12s %14s\n", "phase", "ms", "allocations", "bytes");
+        out << line;
+        for (size_t i = 0; i < phaseCount; i++) {
+            std::snprintf(line, sizeof(line), "  %-10s %12.3f %12llu %14llu\n", phaseNames[i], phases[i].seconds * 1e3,
+                          static_cast<unsigned long long>(phases[i].allocations.count),
+                          static_cast<unsigned long long>(phases[i].allocations.bytes));
+            out << line;
+        }
+        Allocations total = totalAllocations();
+        std::snprintf(line, sizeof(line), "  %-10s %12.3f %12llu %14llu\n", "total", totalSeconds() * 1e3,
+                      static_cast<unsigned long long>(total.count), static_cast<unsigned long long>(total.bytes));
+        out << line;
+        out << "  arena: " << arena.count << " nodes and arrays, " << arena.bytes << " bytes\n";
+        out << "  tokens: " << tokens << "\n";
+        out << "  AST nodes: " << nodeCount();
+        const char* separator = " (";
+        for (size_t i = 0; i < nodeKindCount; i++) {
+            if (nodes[i] != 0) {
+                out << separator << nodeKindNames[i] << " " << nodes[i];
+                separator = ", ";
+            }
+        }
+        out << (nodeCount() != 0 ? ")\n" : "\n");
+        out << "  emitted: " << instructions << " instructions, " << labels << " labels\n";
+        out << "  peak RSS: " << peakResidentBytes() / 1024 << " KiB" << std::endl;
+    }
+
+    void printJson(std::ostream& out, const std::string& file) const {
+        char seconds[32];
+        out << "{\"file\": ";
+        writeJsonString(out, file);
+        out << ", \"phases\": {";
+        for (size_t i = 0; i < phaseCount; i++) {
+            std::snprintf(seconds, sizeof(seconds), "%.9f", phases[i].seconds);
+            out << (i == 0 ? "" : ", ") << "\"" << phaseNames[i] << "\": {\"seconds\": " << seconds
+                << ", \"allocations\": " << phases[i].allocations.count
+                << ", \"allocated_bytes\": " << phases[i].allocations.bytes << "}";
+        }
+        std::snprintf(seconds, sizeof(seconds), "%.9f", totalSeconds());
+        out << "}, \"total_seconds\": " << seconds << ", \"arena_allocations\": " << arena.count
+            << ", \"arena_bytes\": " << arena.bytes << ", \"tokens\": " << tokens << ", \"ast_nodes\": " << nodeCount()
+            << ", \"ast_nodes_by_kind\": {";
+        for (size_t i = 0; i < nodeKindCount; i++) {
+            out << (i == 0 ? "" : ", ") << "\"" << nodeKindNames[i] << "\": " << nodes[i];
+        }
+        out << "}, \"instructions\": " << instructions << ", \"labels\": " << labels
+            << ", \"peak_rss_bytes\": " << peakResidentBytes() << "}";
+    }
+};
+
+#endif
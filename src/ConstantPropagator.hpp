@@ -0,0 +1,454 @@
+#ifndef CONSTANT_PROPAGATOR_HPP
+#define CONSTANT_PROPAGATOR_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "Ir.hpp"
+
+// Sparse conditional constant propagation (Wegman and Zadeck) over an SSA
+// region, followed by dead-code elimination.
+//
+// Values start out unknown and are lowered to a constant or to
+// "varies" as blocks are found executable: a branch on constants only
+// makes one of its edges executable, and a phi only merges the inputs of
+// executable edges. Afterwards constant values are rewritten to Const,
+// decided branches to jumps, and blocks that never became executable are
+// removed.
+//
+// Regions run one after another at the top level, so the value every
+// variable holds when a region starts is known from the regions before
+// it. The propagator carries those values over: a load of a variable
+// known to hold a constant is that constant.
+//
+// Dead-code elimination then drops arithmetic, loads and phis whose
+// results are never used (a division is kept, it may fault), and stores
+// the caller reports no later region reads. Stores to array elements are
+// always kept.
+class ConstantPropagator {
+private:
+    enum class State : uint8_t {
+        Unknown,
+        Constant,
+        Varies,
+    };
+
+    struct Lattice {
+        State state = State::Unknown;
+        int32_t value = 0;
+    };
+
+    IrFunction* function = nullptr;
+    std::unordered_map<Symbol, int32_t> known {};
+
+    std::vector<Lattice> lattice {};
+    std::vector<bool> executable {};
+    // edges[b][t]: the edge to the t-th target of b's terminator is executable.
+    std::vector<std::array<bool, 2>> edges {};
+    std::vector<ValueId> replacement {};
+    std::vector<bool> live {};
+
+    size_t foldedBranchCount = 0;
+    size_t removedBlockCount = 0;
+    size_t removedStoreCount = 0;
+
+    bool lower(ValueId value, Lattice to) {
+        Lattice& current = lattice[value];
+        if (current.state == to.state && (to.state != State::Constant || current.value == to.value)) {
+            return false;
+        }
+        if (current.state == State::Varies || (current.state == State::Constant && to.state == State::Unknown)) {
+            return false;
+        }
+        if (current.state == State::Constant && to.state == State::Constant) {
+            to.state = State::Varies;
+        }
+        current = to;
+        return true;
+    }
+
+    static Lattice meet(Lattice a, Lattice b) {
+        if (a.state == State::Unknown) return b;
+        if (b.state == State::Unknown) return a;
+        if (a.state == State::Constant && b.state == State::Constant && a.value == b.value) return a;
+        return {State::Varies, 0};
+    }
+
+    Lattice evaluate(const IrInstruction& instruction) {
+        switch (instruction.op) {
+            case IrOp::Const:
+                return {State::Constant, instruction.constant};
+            case IrOp::Load: {
+                auto it = known.find(instruction.symbol);
+                return it == known.end() ? Lattice {State::Varies, 0} : Lattice {State::Constant, it->second};
+            }
+            case IrOp::LoadElement:
+                // Array elements are not tracked.
+                return {State::Varies, 0};
+            case IrOp::Binary: {
+                Lattice left = lattice[instruction.operands[0]];
+                Lattice right = lattice[instruction.operands[1]];
+                if (left.state == State::Varies || right.state == State::Varies) return {State::Varies, 0};
+                if (left.state == State::Unknown || right.state == State::Unknown) return {};
+                if (!canFoldArithmetic(instruction.operation, left.value, right.value)) {
+                    // Left to fault at run time, as written.
+                    return {State::Varies, 0};
+                }
+                return {State::Constant, foldArithmetic(instruction.operation, left.value, right.value)};
+            }
+            default:
+                return {};
+        }
+    }
+
+    // Which targets of a branch can be taken, given its operands so far.
+    std::array<bool, 2> feasible(const IrInstruction& branch) {
+        Lattice left = lattice[branch.operands[0]];
+        Lattice right = lattice[branch.operands[1]];
+        if (left.state == State::Varies || right.state == State::Varies) return {true, true};
+        if (left.state == State::Unknown || right.state == State::Unknown) return {false, false};
+        bool holds = foldComparison(branch.operation, left.value, right.value);
+        return {holds, !holds};
+    }
+
+    // Iterates to a fixed point over the executable blocks. Regions are
+    // small, so re-evaluating whole blocks stands in for SSA worklists.
+    void propagate() {
+        executable[0] = true;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (BlockId b : function->layout) {
+                if (!executable[b]) {
+                    continue;
+                }
+                IrBlock& block = function->blocks[b];
+                for (const IrPhi& phi : block.phis) {
+                    Lattice merged;
+                    for (const IrPhiInput& input : phi.inputs) {
+                        if (edgeExecutable(input.block, b)) merged = meet(merged, lattice[input.value]);
+                    }
+                    changed |= lower(phi.result, merged);
+                }
+                for (const IrInstruction& instruction : block.instructions) {
+                    if (instruction.result != NoValue) {
+                        changed |= lower(instruction.result, evaluate(instruction));
+                    }
+                }
+                const IrInstruction& last = block.instructions.back();
+                std::array<bool, 2> taken = {false, false};
+                if (last.op == IrOp::Jump) {
+                    taken = {true, false};
+                } else if (last.op == IrOp::Branch) {
+                    taken = feasible(last);
+                }
+                for (int t = 0; t < 2; t++) {
+                    if (taken[t] && !edges[b][t]) {
+                        edges[b][t] = true;
+                        executable[last.targets[t]] = true;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    bool edgeExecutable(BlockId from, BlockId to) const {
+        if (!executable[from]) return false;
+        const IrInstruction& last = function->blocks[from].instructions.back();
+        return (last.targets[0] == to && edges[from][0]) || (last.targets[1] == to && edges[from][1]);
+    }
+
+    void removeEdge(BlockId from, BlockId to) {
+        IrBlock& target = function->blocks[to];
+        auto it = std::find(target.predecessors.begin(), target.predecessors.end(), from);
+        if (it != target.predecessors.end()) {
+            target.predecessors.erase(it);
+        }
+        // Only one input goes: a branch can have both edges to one block.
+        for (IrPhi& phi : target.phis) {
+            auto input = std::find_if(phi.inputs.begin(), phi.inputs.end(),
+                                      [from](const IrPhiInput& input) { return input.block == from; });
+            if (input != phi.inputs.end()) {
+                phi.inputs.erase(input);
+            }
+        }
+    }
+
+    static IrInstruction constantInstruction(ValueId result, int32_t value) {
+        IrInstruction instruction {IrOp::Const};
+        instruction.result = result;
+        instruction.constant = value;
+        return instruction;
+    }
+
+    void rewrite() {
+        std::vector<BlockId> layout;
+        for (BlockId b : function->layout) {
+            if (executable[b]) {
+                layout.push_back(b);
+                continue;
+            }
+            removedBlockCount++;
+        }
+
+        for (BlockId b = 0; b < function->blocks.size(); b++) {
+            IrBlock& block = function->blocks[b];
+            if (!executable[b]) {
+                continue;
+            }
+            IrInstruction& last = block.instructions.back();
+            if (last.op == IrOp::Branch && edges[b][0] != edges[b][1]) {
+                BlockId kept = last.targets[edges[b][0] ? 0 : 1];
+                BlockId dropped = last.targets[edges[b][0] ? 1 : 0];
+                removeEdge(b, dropped);
+                last = IrInstruction {IrOp::Jump};
+                last.targets[0] = kept;
+                foldedBranchCount++;
+            }
+
+            std::vector<IrInstruction> front;
+            std::vector<IrPhi> phis;
+            for (IrPhi& phi : block.phis) {
+                if (lattice[phi.result].state == State::Constant) {
+                    front.push_back(constantInstruction(phi.result, lattice[phi.result].value));
+                } else {
+                    phis.push_back(std::move(phi));
+                }
+            }
+            block.phis = std::move(phis);
+            for (IrInstruction& instruction : block.instructions) {
+                if (instruction.result != NoValue && instruction.op != IrOp::Const &&
+                    lattice[instruction.result].state == State::Constant) {
+                    instruction = constantInstruction(instruction.result, lattice[instruction.result].value);
+                }
+            }
+            block.instructions.insert(block.instructions.begin(), front.begin(), front.end());
+        }
+
+        // Unreachable blocks give up their edges and become empty.
+        for (BlockId b = 0; b < function->blocks.size(); b++) {
+            if (executable[b]) {
+                continue;
+            }
+            IrBlock& block = function->blocks[b];
+            const IrInstruction& last = block.instructions.back();
+            if (last.op == IrOp::Jump || last.op == IrOp::Branch) {
+                removeEdge(b, last.targets[0]);
+                if (last.op == IrOp::Branch) removeEdge(b, last.targets[1]);
+            }
+            block.phis.clear();
+            block.instructions.assign(1, IrInstruction {IrOp::Return});
+            block.predecessors.clear();
+        }
+        function->layout = std::move(layout);
+    }
+
+    ValueId resolve(ValueId value) const {
+        while (replacement[value] != NoValue) {
+            value = replacement[value];
+        }
+        return value;
+    }
+
+    // A phi left with one distinct input once edges are gone is that input.
+    void removeTrivialPhis() {
+        replacement.assign(function->valueCount, NoValue);
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (IrBlock& block : function->blocks) {
+                for (IrPhi& phi : block.phis) {
+                    if (replacement[phi.result] != NoValue) continue;
+                    ValueId same = NoValue;
+                    bool trivial = true;
+                    for (const IrPhiInput& input : phi.inputs) {
+                        ValueId value = resolve(input.value);
+                        if (value == phi.result || value == same) continue;
+                        if (same != NoValue) {
+                            trivial = false;
+                            break;
+                        }
+                        same = value;
+                    }
+                    if (trivial && same != NoValue) {
+                        replacement[phi.result] = same;
+                        changed = true;
+                    }
+                }
+            }
+        }
+        for (IrBlock& block : function->blocks) {
+            block.phis.erase(std::remove_if(block.phis.begin(), block.phis.end(),
+                                            [this](const IrPhi& phi) { return replacement[phi.result] != NoValue; }),
+                             block.phis.end());
+            for (IrPhi& phi : block.phis) {
+                for (IrPhiInput& input : phi.inputs) input.value = resolve(input.value);
+            }
+            for (IrInstruction& instruction : block.instructions) {
+                for (ValueId& operand : instruction.operands) {
+                    if (operand != NoValue) operand = resolve(operand);
+                }
+            }
+        }
+    }
+
+    static bool hasEffect(const IrInstruction& instruction) {
+        switch (instruction.op) {
+            case IrOp::Binary:
+                return instruction.operation == Operator::Divide;
+            case IrOp::Const:
+            case IrOp::Load:
+            case IrOp::LoadElement:
+                return false;
+            default:
+                return true;
+        }
+    }
+
+    template<typename IsDeadStore>
+    void eliminateDeadCode(IsDeadStore&& isDeadStore) {
+        for (IrBlock& block : function->blocks) {
+            auto end = std::remove_if(block.instructions.begin(), block.instructions.end(),
+                                      [&](const IrInstruction& instruction) {
+                                          return instruction.op == IrOp::Store && isDeadStore(instruction.symbol);
+                                      });
+            removedStoreCount += block.instructions.end() - end;
+            block.instructions.erase(end, block.instructions.end());
+        }
+
+        live.assign(function->valueCount, false);
+        std::vector<ValueId> work;
+        auto mark = [&](ValueId value) {
+            if (value != NoValue && !live[value]) {
+                live[value] = true;
+                work.push_back(value);
+            }
+        };
+        // Where each phi and instruction result is defined, to follow
+        // operands back from the roots.
+        std::vector<const IrPhi*> phiOf(function->valueCount, nullptr);
+        std::vector<const IrInstruction*> instructionOf(function->valueCount, nullptr);
+        for (const IrBlock& block : function->blocks) {
+            for (const IrPhi& phi : block.phis) phiOf[phi.result] = &phi;
+            for (const IrInstruction& instruction : block.instructions) {
+                if (instruction.result != NoValue) instructionOf[instruction.result] = &instruction;
+                if (hasEffect(instruction)) {
+                    if (instruction.result != NoValue) mark(instruction.result);
+                    for (ValueId operand : instruction.operands) mark(operand);
+                }
+            }
+        }
+        while (!work.empty()) {
+            ValueId value = work.back();
+            work.pop_back();
+            if (phiOf[value]) {
+                for (const IrPhiInput& input : phiOf[value]->inputs) mark(input.value);
+            } else if (instructionOf[value]) {
+                for (ValueId operand : instructionOf[value]->operands) mark(operand);
+            }
+        }
+
+        for (IrBlock& block : function->blocks) {
+            block.phis.erase(std::remove_if(block.phis.begin(), block.phis.end(),
+                                            [this](const IrPhi& phi) { return !live[phi.result]; }),
+                             block.phis.end());
+            block.instructions.erase(
+                    std::remove_if(block.instructions.begin(), block.instructions.end(),
+                                   [this](const IrInstruction& instruction) {
+                                       return instruction.result != NoValue && !live[instruction.result];
+                                   }),
+                    block.instructions.end());
+        }
+    }
+
+    // Folding branches leaves chains of blocks that only jump to the next
+    // one. A block whose single predecessor jumps to it, and comes right
+    // before it in the layout, is appended to that predecessor; this puts
+    // a loop body back into one block. Any phis it had are trivial by now.
+    void mergeBlocks() {
+        std::vector<BlockId> layout;
+        for (BlockId b : function->layout) {
+            IrBlock& block = function->blocks[b];
+            if (!layout.empty() && b != 0 && block.predecessors.size() == 1 &&
+                block.predecessors[0] == layout.back() && block.phis.empty()) {
+                BlockId into = layout.back();
+                IrBlock& previous = function->blocks[into];
+                if (previous.instructions.back().op == IrOp::Jump) {
+                    previous.instructions.pop_back();
+                    previous.instructions.insert(previous.instructions.end(), block.instructions.begin(),
+                                                 block.instructions.end());
+                    const IrInstruction& last = previous.instructions.back();
+                    int targets = last.op == IrOp::Branch ? 2 : last.op == IrOp::Jump ? 1 : 0;
+                    for (int t = 0; t < targets; t++) {
+                        retarget(last.targets[t], b, into);
+                    }
+                    block.instructions.assign(1, IrInstruction {IrOp::Return});
+                    block.predecessors.clear();
+                    continue;
+                }
+            }
+            layout.push_back(b);
+        }
+        function->layout = std::move(layout);
+    }
+
+    // Renames one edge from `from` into block to come from `to` instead.
+    void retarget(BlockId block, BlockId from, BlockId to) {
+        IrBlock& target = function->blocks[block];
+        auto it = std::find(target.predecessors.begin(), target.predecessors.end(), from);
+        *it = to;
+        for (IrPhi& phi : target.phis) {
+            auto input = std::find_if(phi.inputs.begin(), phi.inputs.end(),
+                                      [from](const IrPhiInput& input) { return input.block == from; });
+            input->block = to;
+        }
+    }
+
+    // What each variable holds once the region has run.
+    void recordStores() {
+        for (BlockId b : function->layout) {
+            if (!executable[b]) continue;
+            for (const IrInstruction& instruction : function->blocks[b].instructions) {
+                if (instruction.op != IrOp::Store) continue;
+                const Lattice& value = lattice[instruction.operands[0]];
+                if (value.state == State::Constant) {
+                    known[instruction.symbol] = value.value;
+                } else {
+                    known.erase(instruction.symbol);
+                }
+            }
+        }
+    }
+
+public:
+    // name holds value when the next region starts.
+    void setKnown(Symbol name, int32_t value) { known[name] = value; }
+
+    // isDeadStore(symbol) tells whether a store to symbol can be dropped
+    // because nothing reads the variable afterwards.
+    template<typename IsDeadStore>
+    void optimize(IrFunction& region, IsDeadStore&& isDeadStore) {
+        function = &region;
+        lattice.assign(region.valueCount, Lattice {});
+        executable.assign(region.blocks.size(), false);
+        edges.assign(region.blocks.size(), {false, false});
+
+        propagate();
+        recordStores();
+        rewrite();
+        removeTrivialPhis();
+        mergeBlocks();
+        eliminateDeadCode(isDeadStore);
+    }
+
+    size_t foldedBranches() const { return foldedBranchCount; }
+
+    size_t removedBlocks() const { return removedBlockCount; }
+
+    size_t removedStores() const { return removedStoreCount; }
+};
+
+#endif
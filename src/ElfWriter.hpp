@@ -0,0 +1,1057 @@
+#ifndef ELF_WRITER_HPP
+#define ELF_WRITER_HPP
+
+#include <elf.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "CompileError.hpp"
+#include "Assembly.hpp"
+#include "AsmBuffer.hpp"
+#include "StringTable.hpp"
+
+// Encodes an InstructionList as IA-32 machine code and writes it out as a
+// relocatable ELF32 object with the same shape nasm -f elf32 gives the text
+// form: .text, .data, .bss, a symbol per variable, an absolute <name>_len
+// for each string, and relocations against .data, .bss and any external
+// functions.
+//
+// For x86-64 the same instructions get a REX prefix where they name r8 to
+// r15, [symbol] operands become RIP-relative, and the object is ELF64 with
+// RELA relocations, as nasm -f elf64 would write it.
+//
+// Instructions can be handed over in several batches; label references are
+// patched once every label is known, and data references and string sizes
+// once the data section is laid out in finish(). spill() writes the code
+// encoded so far to its place in the output file and its data references
+// to a temporary file, so memory stays bounded however large the program;
+// finish() patches the code in place and writes the relocations in one pass
+// over both. load() and relocate() lay the same code and data out to run in
+// the compiler's own process instead.
+class ElfWriter {
+private:
+    struct LabelFixup {
+        uint32_t offset;
+        LabelId label;
+    };
+
+    struct SymbolReference {
+        uint32_t offset;
+        Symbol symbol;
+        bool external;
+        // Relative to the end of the instruction rather than absolute.
+        bool relative = false;
+        // An absolute address used as a displacement, which x86-64
+        // sign-extends.
+        bool displacement = false;
+        // What the code holds before the reference is resolved, kept here
+        // since the code itself may already be written out.
+        int32_t addend = 0;
+    };
+
+    static_assert(std::is_trivially_copyable_v<SymbolReference>);
+
+    // Section numbers in the object; the symbol table starts with one
+    // section symbol for each of the first three.
+    enum : uint16_t { TextSection = 1, DataSection = 2, BssSection = 3, RelTextSection = 4, SymtabSection = 5,
+                      StrtabSection = 6, ShstrtabSection = 7, NoteSection = 8, SectionCount = 9 };
+
+    // Where a data symbol ended up: its section and offset in it.
+    struct Placement {
+        uint16_t section;
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    static constexpr int64_t unbound = -1;
+
+    // Where .text starts in the object file: right after the ELF header,
+    // aligned to 16 bytes, for either class.
+    static constexpr uint64_t textFileOffset = 64;
+    static_assert(sizeof(Elf32_Ehdr) <= textFileOffset && sizeof(Elf64_Ehdr) <= textFileOffset);
+
+    const StringTable& strings;
+    Target target;
+    // How many references finish() reads back, or code bytes it patches, at
+    // a time.
+    static constexpr size_t referenceBatch = 1 << 14;
+    static constexpr size_t codeWindow = 1 << 20;
+
+    // The code not yet spilled, which starts spilled bytes into .text, and
+    // the references in it; those in spilled code are in referenceSpill.
+    std::string text {};
+    uint64_t spilled = 0;
+    AsmBuffer* spillOutput = nullptr;
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> referenceSpill {nullptr, std::fclose};
+    uint64_t spilledReferences = 0;
+    std::vector<int64_t> labelOffsets {};
+    std::vector<LabelFixup> labelFixups {};
+    std::vector<SymbolReference> references {};
+    std::vector<SymbolReference> sizeReferences {};
+    // A RIP-relative reference in the instruction being encoded; its
+    // addend is settled once the instruction's length is known.
+    size_t pendingRelative = SIZE_MAX;
+
+    uint32_t position() const { return static_cast<uint32_t>(spilled + text.size()); }
+
+    void byte(uint8_t value) { text.push_back(static_cast<char>(value)); }
+
+    void dword(int32_t value) {
+        char bytes[4];
+        std::memcpy(bytes, &value, sizeof(bytes));
+        text.append(bytes, sizeof(bytes));
+    }
+
+    static bool fitsInByte(int32_t value) { return value >= -128 && value <= 127; }
+
+    static uint8_t regField(Reg reg) { return static_cast<uint8_t>(reg); }
+
+    static bool isExtended(const Operand& operand) {
+        return (operand.kind == OperandKind::Register || operand.kind == OperandKind::Indirect) &&
+               regField(operand.reg) >= 8;
+    }
+
+    static bool isExtendedIndex(const Operand& operand) {
+        return operand.kind == OperandKind::Element && regField(operand.reg) >= 8;
+    }
+
+    // The REX prefix an instruction needs when its reg field, its r/m
+    // operand or an array index is one of r8 to r15. Nothing is emitted
+    // otherwise, so code for x86 never gets one.
+    void rex(uint8_t reg, const Operand& rm) {
+        uint8_t bits = (reg >= 8 ? 0x04 : 0) | (isExtendedIndex(rm) ? 0x02 : 0) | (isExtended(rm) ? 0x01 : 0);
+        if (bits != 0) {
+            byte(0x40 | bits);
+        }
+    }
+
+    // An opcode followed by ModRM: prefix, opcode bytes, then the operand.
+    void encodeModrm(std::initializer_list<uint8_t> opcode, uint8_t reg, const Operand& rm,
+                     const Instruction& instruction) {
+        rex(reg, rm);
+        for (uint8_t value : opcode) {
+            byte(value);
+        }
+        modrm(reg, rm, instruction);
+    }
+
+    // An SSE instruction: its mandatory prefix goes before any REX prefix.
+    void encodeSse(uint8_t prefix, uint8_t opcode, uint8_t reg, const Operand& rm, const Instruction& instruction) {
+        byte(prefix);
+        encodeModrm({0x0F, opcode}, reg, rm, instruction);
+    }
+
+    // A VEX-encoded instruction on ymm registers (or xmm when wide is
+    // false). map is 1 for the 0F opcode map and 2 for 0F38, prefix the
+    // implied 66/F3 as the pp field, and vvvv the extra source register or
+    // 0 when there is none. The two-byte form is used where it suffices.
+    void encodeVex(uint8_t map, uint8_t prefix, bool wide, uint8_t vvvv, uint8_t opcode, uint8_t reg,
+                   const Operand& rm, const Instruction& instruction) {
+        uint8_t inverted = static_cast<uint8_t>((~vvvv & 0x0F) << 3 | (wide ? 0x04 : 0) | prefix);
+        uint8_t r = reg >= 8 ? 0 : 0x80;
+        uint8_t x = isExtendedIndex(rm) ? 0 : 0x40;
+        uint8_t b = isExtended(rm) ? 0 : 0x20;
+        if (map == 1 && x && b) {
+            byte(0xC5);
+            byte(r | inverted);
+        } else {
+            byte(0xC4);
+            byte(r | x | b | map);
+            byte(inverted);
+        }
+        byte(opcode);
+        modrm(reg, rm, instruction);
+    }
+
+    static uint8_t vectorField(const Operand& operand) { return static_cast<uint8_t>(operand.value); }
+
+    static bool isVectorRegister(const Operand& operand) {
+        return operand.kind == OperandKind::Xmm || operand.kind == OperandKind::Ymm;
+    }
+
+    // movdqu and vmovdqu load into a register with 6F and store with 7F.
+    void encodeVectorMove(const Instruction& instruction, bool vex) {
+        const Operand& dst = instruction.dst;
+        const Operand& src = instruction.src;
+        bool load = isVectorRegister(dst);
+        const Operand& reg = load ? dst : src;
+        const Operand& rm = load ? src : dst;
+        if (!isVectorRegister(reg)) {
+            unencodable(instruction);
+        }
+        uint8_t opcode = load ? 0x6F : 0x7F;
+        if (vex) {
+            encodeVex(1, 2, true, 0, opcode, vectorField(reg), rm, instruction);
+        } else {
+            encodeSse(0xF3, opcode, vectorField(reg), rm, instruction);
+        }
+    }
+
+    // movd and vmovd: an xmm register from a general register or memory.
+    void encodeVectorInsert(const Instruction& instruction, bool vex) {
+        if (instruction.dst.kind != OperandKind::Xmm) {
+            unencodable(instruction);
+        }
+        if (vex) {
+            encodeVex(1, 1, false, 0, 0x6E, vectorField(instruction.dst), instruction.src, instruction);
+        } else {
+            encodeSse(0x66, 0x6E, vectorField(instruction.dst), instruction.src, instruction);
+        }
+    }
+
+    // Packed arithmetic, dst = dst op src. AVX2 names dst again as vvvv.
+    void encodeVectorArithmetic(const Instruction& instruction, uint8_t map, uint8_t opcode, bool vex) {
+        if (!isVectorRegister(instruction.dst)) {
+            unencodable(instruction);
+        }
+        uint8_t dst = vectorField(instruction.dst);
+        if (vex) {
+            encodeVex(map, 1, true, dst, opcode, dst, instruction.src, instruction);
+        } else {
+            encodeSse(0x66, opcode, dst, instruction.src, instruction);
+        }
+    }
+
+    // An opcode with the register in its low three bits, like push r.
+    void encodeShort(uint8_t opcode, Reg reg) {
+        rex(0, Operand::ofRegister(reg));
+        byte(opcode + (regField(reg) & 7));
+    }
+
+    [[noreturn]] void unencodable(const Instruction& instruction) {
+        compileError("Cannot encode ", opcodeMnemonic(instruction.op), " with these operands");
+    }
+
+    // Absolute address of a data symbol; the addend stays in place and the
+    // symbol's offset within .data is added in finish().
+    void dataReference(Symbol symbol, int32_t offset, bool displacement = false) {
+        references.push_back({position(), symbol, false, false, displacement, offset});
+        dword(offset);
+    }
+
+    // The size of a string, <symbol>_len plus offset, filled in by finish().
+    void sizeReference(Symbol symbol, int32_t offset) {
+        sizeReferences.push_back({position(), symbol, false, false, false, offset});
+        dword(offset);
+    }
+
+    // A 32-bit immediate: a number, an address in .data or .bss, or a size.
+    void immediate(const Operand& value, const Instruction& instruction) {
+        if (value.kind == OperandKind::Immediate) {
+            dword(value.value);
+        } else if (value.kind == OperandKind::Address) {
+            dataReference(value.symbol, value.value);
+        } else if (value.kind == OperandKind::Size) {
+            sizeReference(value.symbol, value.value);
+        } else {
+            unencodable(instruction);
+        }
+    }
+
+    static bool isImmediate(const Operand& operand) {
+        return operand.kind == OperandKind::Immediate || operand.kind == OperandKind::Address ||
+               operand.kind == OperandKind::Size;
+    }
+
+    // ModRM (plus SIB and displacement) for a register, a [symbol + offset],
+    // [reg + offset] or [symbol + reg*4 + offset] operand. Only the low three
+    // bits of reg and of a register operand are encoded here; rex() carries
+    // the fourth.
+    void modrm(uint8_t reg, const Operand& rm, const Instruction& instruction) {
+        reg &= 7;
+        if (rm.kind == OperandKind::Register) {
+            byte(0xC0 | reg << 3 | (regField(rm.reg) & 7));
+        } else if (isVectorRegister(rm)) {
+            byte(0xC0 | reg << 3 | (vectorField(rm) & 7));
+        } else if (rm.kind == OperandKind::Element) {
+            // A SIB byte with no base: index*4 plus an absolute disp32.
+            byte(0x04 | reg << 3);
+            byte(0x80 | (regField(rm.reg) & 7) << 3 | 0x05);
+            dataReference(rm.symbol, rm.value, true);
+        } else if (rm.kind == OperandKind::Memory) {
+            // An absolute disp32 on x86, RIP-relative on x86-64.
+            byte(0x05 | reg << 3);
+            if (target == Target::X86_64) {
+                pendingRelative = references.size();
+            }
+            dataReference(rm.symbol, rm.value);
+        } else if (rm.kind == OperandKind::Indirect) {
+            // [ebp] and [r13] have no displacement-free form, and esp and r12
+            // need a SIB byte.
+            uint8_t base = regField(rm.reg) & 7;
+            uint8_t mode = rm.value == 0 && base != regField(Reg::Ebp) ? 0x00 : fitsInByte(rm.value) ? 0x40 : 0x80;
+            byte(mode | reg << 3 | base);
+            if (base == regField(Reg::Esp)) {
+                byte(0x24);
+            }
+            if (mode == 0x40) {
+                byte(static_cast<uint8_t>(rm.value));
+            } else if (mode == 0x80) {
+                dword(rm.value);
+            }
+        } else {
+            unencodable(instruction);
+        }
+    }
+
+    void labelReference(const Operand& target) {
+        LabelId label = static_cast<LabelId>(target.value);
+        labelFixups.push_back({position(), label});
+        dword(0);
+    }
+
+    void encodeMov(const Instruction& instruction) {
+        const Operand& dst = instruction.dst;
+        const Operand& src = instruction.src;
+        if (dst.kind == OperandKind::Register && isImmediate(src)) {
+            encodeShort(0xB8, dst.reg);
+            immediate(src, instruction);
+        } else if (dst.kind == OperandKind::Register) {
+            encodeModrm({0x8B}, regField(dst.reg), src, instruction);
+        } else if (src.kind == OperandKind::Register) {
+            encodeModrm({0x89}, regField(src.reg), dst, instruction);
+        } else if (isImmediate(src)) {
+            encodeModrm({0xC7}, 0, dst, instruction);
+            immediate(src, instruction);
+        } else {
+            unencodable(instruction);
+        }
+    }
+
+    void encodeMovByte(const Instruction& instruction) {
+        const Operand& src = instruction.src;
+        if (src.kind == OperandKind::Register && regField(src.reg) < 4) {
+            encodeModrm({0x88}, regField(src.reg), instruction.dst, instruction);
+        } else if (src.kind == OperandKind::Immediate) {
+            encodeModrm({0xC6}, 0, instruction.dst, instruction);
+            byte(static_cast<uint8_t>(src.value));
+        } else {
+            unencodable(instruction);
+        }
+    }
+
+    // add, sub and cmp share one encoding scheme: 81 /ext imm32 (83 when the
+    // immediate fits a byte), op r/m, reg and op reg, r/m.
+    void encodeArithmetic(const Instruction& instruction, uint8_t extension, uint8_t storeOpcode, uint8_t loadOpcode) {
+        const Operand& dst = instruction.dst;
+        const Operand& src = instruction.src;
+        if (src.kind == OperandKind::Immediate && fitsInByte(src.value)) {
+            encodeModrm({0x83}, extension, dst, instruction);
+            byte(static_cast<uint8_t>(src.value));
+        } else if (isImmediate(src)) {
+            encodeModrm({0x81}, extension, dst, instruction);
+            immediate(src, instruction);
+        } else if (src.kind == OperandKind::Register) {
+            encodeModrm({storeOpcode}, regField(src.reg), dst, instruction);
+        } else if (dst.kind == OperandKind::Register) {
+            encodeModrm({loadOpcode}, regField(dst.reg), src, instruction);
+        } else {
+            unencodable(instruction);
+        }
+    }
+
+    void encodePush(const Instruction& instruction) {
+        const Operand& value = instruction.dst;
+        switch (value.kind) {
+            case OperandKind::Register:
+                encodeShort(0x50, value.reg);
+                break;
+            case OperandKind::Immediate:
+            case OperandKind::Address:
+            case OperandKind::Size:
+                byte(0x68);
+                immediate(value, instruction);
+                break;
+            case OperandKind::Memory:
+                encodeModrm({0xFF}, 6, value, instruction);
+                break;
+            default:
+                unencodable(instruction);
+        }
+    }
+
+    void encodePop(const Instruction& instruction) {
+        if (instruction.dst.kind != OperandKind::Register) {
+            unencodable(instruction);
+        }
+        encodeShort(0x58, instruction.dst.reg);
+    }
+
+    // Two-operand imul: 0F AF /r, or 6B/69 /r with the destination repeated
+    // as the source when multiplying by an immediate.
+    void encodeImul(const Instruction& instruction) {
+        const Operand& dst = instruction.dst;
+        const Operand& src = instruction.src;
+        if (dst.kind != OperandKind::Register) {
+            unencodable(instruction);
+        }
+        if (src.kind == OperandKind::Immediate) {
+            bool shortForm = fitsInByte(src.value);
+            encodeModrm({static_cast<uint8_t>(shortForm ? 0x6B : 0x69)}, regField(dst.reg), dst, instruction);
+            if (shortForm) {
+                byte(static_cast<uint8_t>(src.value));
+            } else {
+                dword(src.value);
+            }
+        } else {
+            encodeModrm({0x0F, 0xAF}, regField(dst.reg), src, instruction);
+        }
+    }
+
+    // A call to a label in .text or to an external function.
+    void encodeCall(const Instruction& instruction) {
+        byte(0xE8);
+        if (instruction.dst.kind == OperandKind::Label) {
+            labelReference(instruction.dst);
+        } else if (instruction.dst.kind == OperandKind::External) {
+            references.push_back({position(), instruction.dst.symbol, true, false, false, -4});
+            dword(-4);
+        } else {
+            unencodable(instruction);
+        }
+    }
+
+    // Group-3 and shift instructions on a single r/m operand.
+    void encodeUnary(const Instruction& instruction, uint8_t opcode, uint8_t extension) {
+        encodeModrm({opcode}, extension, instruction.dst, instruction);
+    }
+
+    void encodeJump(const Instruction& instruction, uint8_t condition) {
+        if (instruction.op == Opcode::Jmp) {
+            byte(0xE9);
+        } else {
+            byte(0x0F);
+            byte(0x80 | condition);
+        }
+        labelReference(instruction.dst);
+    }
+
+    void bindLabel(LabelId label) {
+        if (label >= labelOffsets.size()) {
+            labelOffsets.resize(label + 1, unbound);
+        }
+        labelOffsets[label] = static_cast<int64_t>(position());
+    }
+
+    // Code that has been spilled is patched in the output file.
+    void patch(uint32_t offset, int32_t value) {
+        if (offset >= spilled) {
+            std::memcpy(&text[offset - spilled], &value, sizeof(value));
+            return;
+        }
+        char bytes[sizeof(value)];
+        std::memcpy(bytes, &value, sizeof(value));
+        spillOutput->writeAt(textFileOffset + offset, std::string_view(bytes, sizeof(bytes)));
+    }
+
+    // What differs between the two object formats. ELF32 keeps relocation
+    // addends in the code they patch; ELF64 (RELA) keeps them in the entry.
+    struct Elf32Format {
+        using Ehdr = Elf32_Ehdr;
+        using Shdr = Elf32_Shdr;
+        using Sym = Elf32_Sym;
+        using Rel = Elf32_Rel;
+        static constexpr uint8_t elfClass = ELFCLASS32;
+        static constexpr uint16_t machine = EM_386;
+        static constexpr bool explicitAddend = false;
+        static constexpr uint32_t wordSize = 4;
+        static constexpr uint32_t absoluteRelocation = R_386_32;
+        static constexpr uint32_t displacementRelocation = R_386_32;
+        static constexpr uint32_t relativeRelocation = R_386_PC32;
+        static constexpr uint32_t callRelocation = R_386_PC32;
+
+        static Elf32_Word info(uint32_t symbol, uint32_t type) { return ELF32_R_INFO(symbol, type); }
+    };
+
+    struct Elf64Format {
+        using Ehdr = Elf64_Ehdr;
+        using Shdr = Elf64_Shdr;
+        using Sym = Elf64_Sym;
+        using Rel = Elf64_Rela;
+        static constexpr uint8_t elfClass = ELFCLASS64;
+        static constexpr uint16_t machine = EM_X86_64;
+        static constexpr bool explicitAddend = true;
+        static constexpr uint32_t wordSize = 8;
+        // Addresses as 32-bit immediates, which requires a program linked
+        // below 4 GiB.
+        static constexpr uint32_t absoluteRelocation = R_X86_64_32;
+        static constexpr uint32_t displacementRelocation = R_X86_64_32S;
+        static constexpr uint32_t relativeRelocation = R_X86_64_PC32;
+        static constexpr uint32_t callRelocation = R_X86_64_PLT32;
+
+        static Elf64_Xword info(uint32_t symbol, uint32_t type) { return ELF64_R_INFO(symbol, type); }
+    };
+
+    template<typename T>
+    static void append(std::string& out, const T& value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static uint32_t addString(std::string& table, std::string_view name) {
+        uint32_t offset = static_cast<uint32_t>(table.size());
+        table.append(name);
+        table.push_back('\0');
+        return offset;
+    }
+
+    // Every data and external reference in code order, spilled ones first.
+    template<typename Visit>
+    void forEachReference(Visit&& visit) {
+        if (referenceSpill) {
+            std::rewind(referenceSpill.get());
+            std::vector<SymbolReference> batch(referenceBatch);
+            for (uint64_t remaining = spilledReferences; remaining > 0;) {
+                size_t count = static_cast<size_t>(std::min<uint64_t>(remaining, referenceBatch));
+                if (std::fread(batch.data(), sizeof(SymbolReference), count, referenceSpill.get()) != count) {
+                    compileError("Could not read back relocations: ", std::strerror(errno));
+                }
+                for (size_t i = 0; i < count; i++) {
+                    visit(batch[i]);
+                }
+                remaining -= count;
+            }
+        }
+        for (const SymbolReference& reference : references) {
+            visit(reference);
+        }
+    }
+
+    // Patches code already written out, reading it back a window at a time;
+    // patches must come in increasing offset order.
+    class SpilledCode {
+    private:
+        ElfWriter& writer;
+        std::string window {};
+        uint64_t start = 0;
+
+    public:
+        explicit SpilledCode(ElfWriter& writer) : writer(writer) {}
+
+        void patch(uint32_t offset, int32_t value) {
+            if (offset + sizeof(value) > start + window.size()) {
+                finish();
+                start = offset;
+                window.resize(static_cast<size_t>(std::min<uint64_t>(codeWindow, writer.spilled - offset)));
+                writer.spillOutput->readAt(textFileOffset + start, window);
+            }
+            std::memcpy(&window[offset - start], &value, sizeof(value));
+        }
+
+        void finish() {
+            if (!window.empty()) {
+                writer.spillOutput->writeAt(textFileOffset + start, window);
+                window.clear();
+            }
+        }
+    };
+
+    static bool isBound(const std::vector<int64_t>& offsets, LabelId label) {
+        return label < offsets.size() && offsets[label] != unbound;
+    }
+
+    // Patches the references to labels already bound and keeps the rest.
+    void resolveBoundLabels() {
+        size_t kept = 0;
+        for (const LabelFixup& fixup : labelFixups) {
+            if (isBound(labelOffsets, fixup.label)) {
+                patch(fixup.offset, static_cast<int32_t>(labelOffsets[fixup.label] - (fixup.offset + 4)));
+            } else {
+                labelFixups[kept++] = fixup;
+            }
+        }
+        labelFixups.resize(kept);
+    }
+
+    void resolveLabels() {
+        resolveBoundLabels();
+        if (!labelFixups.empty()) {
+            compileError("Jump to an undefined label");
+        }
+    }
+
+    // Places each data item in .data or .bss and fills in string sizes.
+    std::unordered_map<Symbol, Placement> layOutData(const std::vector<DataDefinition>& data, std::string& dataBytes,
+                                                     uint32_t& bssSize, uint32_t& bssAlignment) {
+        std::unordered_map<Symbol, Placement> placements;
+        for (const DataDefinition& item : data) {
+            if (item.reserve != 0) {
+                bssSize = (bssSize + item.alignment - 1) / item.alignment * item.alignment;
+                bssAlignment = std::max(bssAlignment, item.alignment);
+                placements[item.name] = {BssSection, bssSize, item.reserve};
+                bssSize += (item.reserve + 3) & ~3u;
+                continue;
+            }
+            uint32_t offset = static_cast<uint32_t>(dataBytes.size());
+            if (item.isString) {
+                dataBytes.append(item.text);
+                dataBytes.push_back('\n');
+                dataBytes.push_back('\0');
+            } else {
+                append(dataBytes, item.number);
+            }
+            placements[item.name] = {DataSection, offset, static_cast<uint32_t>(dataBytes.size()) - offset};
+        }
+
+        for (const SymbolReference& reference : sizeReferences) {
+            auto it = placements.find(reference.symbol);
+            if (it == placements.end()) {
+                compileError("Reference to undefined symbol ", strings.str(reference.symbol), "_len");
+            }
+            patch(reference.offset, reference.addend + static_cast<int32_t>(it->second.size));
+        }
+        sizeReferences.clear();
+        return placements;
+    }
+
+    // Resolves labels, lays out .data and writes the object in format Elf.
+    template<typename Elf>
+    void writeObject(const std::vector<DataDefinition>& data, const std::vector<Symbol>& externs,
+                     AsmBuffer& output) {
+        resolveLabels();
+
+        std::string dataBytes;
+        uint32_t bssSize = 0;
+        uint32_t bssAlignment = 4;
+        std::unordered_map<Symbol, Placement> placements = layOutData(data, dataBytes, bssSize, bssAlignment);
+
+        // Symbol table: null, the three section symbols, one local per data
+        // item (plus its _len), then _start and the externals as globals.
+        std::string stringTable(1, '\0');
+        std::vector<typename Elf::Sym> symbols(4, typename Elf::Sym {});
+        for (uint16_t section : {TextSection, DataSection, BssSection}) {
+            symbols[section].st_info = ELF32_ST_INFO(STB_LOCAL, STT_SECTION);
+            symbols[section].st_shndx = section;
+        }
+
+        for (const DataDefinition& item : data) {
+            std::string_view name = strings.str(item.name);
+            const Placement& placement = placements[item.name];
+            typename Elf::Sym symbol {};
+            symbol.st_name = addString(stringTable, name);
+            symbol.st_value = placement.offset;
+            symbol.st_size = placement.size;
+            symbol.st_info = ELF32_ST_INFO(STB_LOCAL, STT_OBJECT);
+            symbol.st_shndx = placement.section;
+            symbols.push_back(symbol);
+
+            if (item.isString) {
+                typename Elf::Sym length {};
+                length.st_name = addString(stringTable, std::string(name) + "_len");
+                length.st_value = symbol.st_size;
+                length.st_info = ELF32_ST_INFO(STB_LOCAL, STT_NOTYPE);
+                length.st_shndx = SHN_ABS;
+                symbols.push_back(length);
+            }
+        }
+
+        uint32_t firstGlobal = static_cast<uint32_t>(symbols.size());
+        typename Elf::Sym start {};
+        start.st_name = addString(stringTable, "_start");
+        start.st_info = ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+        start.st_shndx = TextSection;
+        symbols.push_back(start);
+
+        std::unordered_map<Symbol, uint32_t> externIndex;
+        for (Symbol name : externs) {
+            typename Elf::Sym symbol {};
+            symbol.st_name = addString(stringTable, strings.str(name));
+            symbol.st_info = ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+            symbol.st_shndx = SHN_UNDEF;
+            externIndex[name] = static_cast<uint32_t>(symbols.size());
+            symbols.push_back(symbol);
+        }
+
+        // The relocation for reference, and the value its code ends up with.
+        auto relocationFor = [&](const SymbolReference& reference, int32_t& code) {
+            typename Elf::Rel relocation {};
+            relocation.r_offset = reference.offset;
+            int32_t addend = reference.addend;
+            if (reference.external) {
+                auto it = externIndex.find(reference.symbol);
+                if (it == externIndex.end()) {
+                    compileError("Call to undeclared function ", strings.str(reference.symbol));
+                }
+                relocation.r_info = Elf::info(it->second, Elf::callRelocation);
+            } else {
+                auto it = placements.find(reference.symbol);
+                if (it == placements.end()) {
+                    compileError("Reference to undefined symbol ", strings.str(reference.symbol));
+                }
+                // Section symbols come first, numbered like their sections.
+                addend += static_cast<int32_t>(it->second.offset);
+                uint32_t type = reference.relative       ? Elf::relativeRelocation
+                                : reference.displacement ? Elf::displacementRelocation
+                                                         : Elf::absoluteRelocation;
+                relocation.r_info = Elf::info(it->second.section, type);
+            }
+            if constexpr (Elf::explicitAddend) {
+                relocation.r_addend = addend;
+                addend = 0;
+            }
+            code = addend;
+            return relocation;
+        };
+
+        std::string sectionNames(1, '\0');
+        uint32_t textName = addString(sectionNames, ".text");
+        uint32_t dataName = addString(sectionNames, ".data");
+        uint32_t bssName = addString(sectionNames, ".bss");
+        uint32_t relTextName = addString(sectionNames, Elf::explicitAddend ? ".rela.text" : ".rel.text");
+        uint32_t symtabName = addString(sectionNames, ".symtab");
+        uint32_t strtabName = addString(sectionNames, ".strtab");
+        uint32_t shstrtabName = addString(sectionNames, ".shstrtab");
+        uint32_t noteName = addString(sectionNames, ".note.GNU-stack");
+
+        // Lays the sections out one after another from the end of .text.
+        typename Elf::Shdr sections[SectionCount] {};
+        uint64_t fileSize = textFileOffset + textSize();
+        auto place = [&sections, &fileSize](uint16_t index, uint32_t name, uint32_t type, uint32_t flags,
+                                            uint64_t size, uint32_t alignment) {
+            fileSize = (fileSize + alignment - 1) / alignment * alignment;
+            typename Elf::Shdr& section = sections[index];
+            section.sh_name = name;
+            section.sh_type = type;
+            section.sh_flags = flags;
+            section.sh_offset = fileSize;
+            section.sh_size = size;
+            section.sh_addralign = alignment;
+            fileSize += size;
+        };
+
+        sections[TextSection].sh_name = textName;
+        sections[TextSection].sh_type = SHT_PROGBITS;
+        sections[TextSection].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+        sections[TextSection].sh_offset = textFileOffset;
+        sections[TextSection].sh_size = textSize();
+        sections[TextSection].sh_addralign = 16;
+        place(DataSection, dataName, SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, dataBytes.size(), 4);
+        place(BssSection, bssName, SHT_NOBITS, SHF_ALLOC | SHF_WRITE, 0, bssAlignment);
+        sections[BssSection].sh_size = bssSize;
+        place(RelTextSection, relTextName, Elf::explicitAddend ? SHT_RELA : SHT_REL, 0,
+              (spilledReferences + references.size()) * sizeof(typename Elf::Rel), Elf::wordSize);
+        sections[RelTextSection].sh_link = SymtabSection;
+        sections[RelTextSection].sh_info = TextSection;
+        sections[RelTextSection].sh_entsize = sizeof(typename Elf::Rel);
+        place(SymtabSection, symtabName, SHT_SYMTAB, 0, symbols.size() * sizeof(typename Elf::Sym), Elf::wordSize);
+        sections[SymtabSection].sh_link = StrtabSection;
+        sections[SymtabSection].sh_info = firstGlobal;
+        sections[SymtabSection].sh_entsize = sizeof(typename Elf::Sym);
+        place(StrtabSection, strtabName, SHT_STRTAB, 0, stringTable.size(), 1);
+        place(ShstrtabSection, shstrtabName, SHT_STRTAB, 0, sectionNames.size(), 1);
+        place(NoteSection, noteName, SHT_PROGBITS, 0, 0, 1);
+        fileSize = (fileSize + Elf::wordSize - 1) / Elf::wordSize * Elf::wordSize;
+
+        typename Elf::Ehdr header {};
+        std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+        header.e_ident[EI_CLASS] = Elf::elfClass;
+        header.e_ident[EI_DATA] = ELFDATA2LSB;
+        header.e_ident[EI_VERSION] = EV_CURRENT;
+        header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+        header.e_type = ET_REL;
+        header.e_machine = Elf::machine;
+        header.e_version = EV_CURRENT;
+        header.e_shoff = fileSize;
+        header.e_ehsize = sizeof(typename Elf::Ehdr);
+        header.e_shentsize = sizeof(typename Elf::Shdr);
+        header.e_shnum = SectionCount;
+        header.e_shstrndx = ShstrtabSection;
+
+        // Once code has been spilled, the rest goes straight to its place in
+        // the file too; otherwise the file is put together in memory. Gaps
+        // between sections are zero either way.
+        std::string file;
+        auto write = [&](uint64_t offset, const void* bytes, size_t size) {
+            if (spilled != 0) {
+                output.writeAt(offset, std::string_view(static_cast<const char*>(bytes), size));
+                return;
+            }
+            if (file.size() < offset + size) {
+                file.resize(offset + size, '\0');
+            }
+            std::memcpy(&file[offset], bytes, size);
+        };
+
+        // Relocations are written in batches as the references are read
+        // back, and each reference's code is patched on the way.
+        std::vector<typename Elf::Rel> relocations;
+        relocations.reserve(std::min<size_t>(referenceBatch, spilledReferences + references.size()));
+        uint64_t relocationOffset = sections[RelTextSection].sh_offset;
+        SpilledCode code(*this);
+        forEachReference([&](const SymbolReference& reference) {
+            int32_t value;
+            relocations.push_back(relocationFor(reference, value));
+            if (reference.offset >= spilled) {
+                patch(reference.offset, value);
+            } else {
+                code.patch(reference.offset, value);
+            }
+            if (relocations.size() == referenceBatch) {
+                write(relocationOffset, relocations.data(), relocations.size() * sizeof(typename Elf::Rel));
+                relocationOffset += relocations.size() * sizeof(typename Elf::Rel);
+                relocations.clear();
+            }
+        });
+        code.finish();
+        write(relocationOffset, relocations.data(), relocations.size() * sizeof(typename Elf::Rel));
+
+        write(0, &header, sizeof(header));
+        write(textFileOffset + spilled, text.data(), text.size());
+        write(sections[DataSection].sh_offset, dataBytes.data(), dataBytes.size());
+        write(sections[SymtabSection].sh_offset, symbols.data(), symbols.size() * sizeof(typename Elf::Sym));
+        write(sections[StrtabSection].sh_offset, stringTable.data(), stringTable.size());
+        write(sections[ShstrtabSection].sh_offset, sectionNames.data(), sectionNames.size());
+        write(fileSize, sections, sizeof(sections));
+        if (spilled == 0) {
+            output << std::string_view(file);
+        }
+        output.flush();
+    }
+
+public:
+    explicit ElfWriter(const StringTable& strings, Target target = Target::X86) : strings(strings), target(target) {
+        text.reserve(1 << 16);
+    }
+
+    void encode(const std::vector<Instruction>& code) {
+        for (const Instruction& instruction : code) {
+            switch (instruction.op) {
+                case Opcode::Label:
+                    bindLabel(static_cast<LabelId>(instruction.dst.value));
+                    break;
+                case Opcode::Mov:
+                    encodeMov(instruction);
+                    break;
+                case Opcode::Push:
+                    encodePush(instruction);
+                    break;
+                case Opcode::Pop:
+                    encodePop(instruction);
+                    break;
+                case Opcode::Call:
+                    encodeCall(instruction);
+                    break;
+                case Opcode::Imul:
+                    encodeImul(instruction);
+                    break;
+                case Opcode::Idiv:
+                    encodeUnary(instruction, 0xF7, 7);
+                    break;
+                case Opcode::Cdq:
+                    byte(0x99);
+                    break;
+                case Opcode::Mul:
+                    encodeUnary(instruction, 0xF7, 4);
+                    break;
+                case Opcode::Neg:
+                    encodeUnary(instruction, 0xF7, 3);
+                    break;
+                case Opcode::Shr:
+                    if (instruction.src.kind != OperandKind::Immediate) {
+                        unencodable(instruction);
+                    }
+                    encodeUnary(instruction, 0xC1, 5);
+                    byte(static_cast<uint8_t>(instruction.src.value));
+                    break;
+                case Opcode::MovByte:
+                    encodeMovByte(instruction);
+                    break;
+                case Opcode::RepMovsb:
+                    byte(0xF3);
+                    byte(0xA4);
+                    break;
+                case Opcode::Int:
+                    byte(0xCD);
+                    byte(static_cast<uint8_t>(instruction.dst.value));
+                    break;
+                case Opcode::Syscall:
+                    byte(0x0F);
+                    byte(0x05);
+                    break;
+                case Opcode::Ret:
+                    byte(0xC3);
+                    break;
+                case Opcode::Movd:
+                    encodeVectorInsert(instruction, false);
+                    break;
+                case Opcode::Pshufd:
+                    encodeSse(0x66, 0x70, vectorField(instruction.dst), instruction.src, instruction);
+                    byte(0);
+                    break;
+                case Opcode::Movdqu:
+                    encodeVectorMove(instruction, false);
+                    break;
+                case Opcode::Paddd:
+                    encodeVectorArithmetic(instruction, 1, 0xFE, false);
+                    break;
+                case Opcode::Psubd:
+                    encodeVectorArithmetic(instruction, 1, 0xFA, false);
+                    break;
+                case Opcode::Vmovd:
+                    encodeVectorInsert(instruction, true);
+                    break;
+                case Opcode::Vpbroadcastd:
+                    encodeVex(2, 1, true, 0, 0x58, vectorField(instruction.dst), instruction.src, instruction);
+                    break;
+                case Opcode::Vmovdqu:
+                    encodeVectorMove(instruction, true);
+                    break;
+                case Opcode::Vpaddd:
+                    encodeVectorArithmetic(instruction, 1, 0xFE, true);
+                    break;
+                case Opcode::Vpsubd:
+                    encodeVectorArithmetic(instruction, 1, 0xFA, true);
+                    break;
+                case Opcode::Vpmulld:
+                    encodeVectorArithmetic(instruction, 2, 0x40, true);
+                    break;
+                case Opcode::Vzeroupper:
+                    byte(0xC5);
+                    byte(0xF8);
+                    byte(0x77);
+                    break;
+                case Opcode::Add:
+                    encodeArithmetic(instruction, 0, 0x01, 0x03);
+                    break;
+                case Opcode::Sub:
+                    encodeArithmetic(instruction, 5, 0x29, 0x2B);
+                    break;
+                case Opcode::Cmp:
+                    encodeArithmetic(instruction, 7, 0x39, 0x3B);
+                    break;
+                case Opcode::Jmp:
+                    encodeJump(instruction, 0);
+                    break;
+                case Opcode::Je:
+                    encodeJump(instruction, 0x4);
+                    break;
+                case Opcode::Jne:
+                    encodeJump(instruction, 0x5);
+                    break;
+                case Opcode::Jl:
+                    encodeJump(instruction, 0xC);
+                    break;
+                case Opcode::Jge:
+                    encodeJump(instruction, 0xD);
+                    break;
+                case Opcode::Jle:
+                    encodeJump(instruction, 0xE);
+                    break;
+                case Opcode::Jg:
+                    encodeJump(instruction, 0xF);
+                    break;
+            }
+            if (pendingRelative != SIZE_MAX) {
+                // The CPU adds the displacement to the address of the next
+                // instruction, which may lie past an immediate.
+                SymbolReference& reference = references[pendingRelative];
+                reference.relative = true;
+                reference.addend -= static_cast<int32_t>(position() - reference.offset);
+                patch(reference.offset, reference.addend);
+                pendingRelative = SIZE_MAX;
+            }
+        }
+    }
+
+    size_t textSize() const { return spilled + text.size(); }
+
+    // Writes the code encoded so far to the object file being written to
+    // output once more than threshold bytes of it are pending. Code for a
+    // pipe or to be run in this process stays in memory.
+    void spill(AsmBuffer& output, size_t threshold) {
+        if (text.size() < threshold || !output.seekable()) {
+            return;
+        }
+        resolveBoundLabels();
+        if (!references.empty()) {
+            if (!referenceSpill) {
+                referenceSpill.reset(std::tmpfile());
+                if (!referenceSpill) {
+                    compileError("Could not create a temporary file: ", std::strerror(errno));
+                }
+            }
+            if (std::fwrite(references.data(), sizeof(SymbolReference), references.size(), referenceSpill.get()) !=
+                references.size()) {
+                compileError("Could not write a temporary file: ", std::strerror(errno));
+            }
+            spilledReferences += references.size();
+            references.clear();
+        }
+        output.writeAt(textFileOffset + spilled, text);
+        spilled += text.size();
+        text.clear();
+        spillOutput = &output;
+    }
+
+    // Code and data laid out to run in this process instead of being
+    // written out: .data, then .bss from bssOffset on, size bytes in all,
+    // with the offset of every data symbol in that block.
+    struct LoadedImage {
+        std::string data {};
+        uint32_t bssOffset = 0;
+        uint32_t size = 0;
+        std::unordered_map<Symbol, uint32_t> offsets {};
+    };
+
+    // Resolves labels and lays out the data block as finish() would.
+    LoadedImage load(const std::vector<DataDefinition>& data) {
+        resolveLabels();
+        LoadedImage image;
+        uint32_t bssSize = 0;
+        uint32_t bssAlignment = 4;
+        std::unordered_map<Symbol, Placement> placements = layOutData(data, image.data, bssSize, bssAlignment);
+        image.bssOffset = static_cast<uint32_t>(image.data.size() + bssAlignment - 1) / bssAlignment * bssAlignment;
+        image.size = image.bssOffset + bssSize;
+        for (const auto& [name, placement] : placements) {
+            image.offsets[name] = (placement.section == BssSection ? image.bssOffset : 0) + placement.offset;
+        }
+        return image;
+    }
+
+    // Patches every data reference for code at textAddress and the data
+    // block at dataAddress, and returns the finished code. Each reference
+    // has 32 bits, so both must lie within reach of each other and, for
+    // absolute addresses, below 2 GiB.
+    const std::string& relocate(const LoadedImage& image, uint64_t textAddress, uint64_t dataAddress) {
+        for (const SymbolReference& reference : references) {
+            if (reference.external) {
+                compileError("Call to undeclared function ", strings.str(reference.symbol));
+            }
+            auto it = image.offsets.find(reference.symbol);
+            if (it == image.offsets.end()) {
+                compileError("Reference to undefined symbol ", strings.str(reference.symbol));
+            }
+            int64_t value = static_cast<int64_t>(dataAddress + it->second) + reference.addend;
+            if (reference.relative) {
+                value -= static_cast<int64_t>(textAddress + reference.offset);
+            }
+            bool fits = reference.relative || reference.displacement ? value == static_cast<int32_t>(value)
+                                                                     : value == static_cast<uint32_t>(value);
+            if (!fits) {
+                compileError("Data at ", dataAddress, " is out of reach of code at ", textAddress);
+            }
+            patch(reference.offset, static_cast<int32_t>(value));
+        }
+        references.clear();
+        return text;
+    }
+
+    // Resolves labels, lays out .data and writes the complete object file.
+    void finish(const std::vector<DataDefinition>& data, const std::vector<Symbol>& externs, AsmBuffer& output) {
+        if (target == Target::X86_64) {
+            writeObject<Elf64Format>(data, externs, output);
+        } else {
+            writeObject<Elf32Format>(data, externs, output);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef FLAT_AST_HPP
+#define FLAT_AST_HPP
+
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+#include "Parser.hpp"
+#include "Visitor.hpp"
+
+using NodeIndex = uint32_t;
+
+constexpr NodeIndex NoNode = UINT32_MAX;
+
+// Struct-of-arrays form of the AST. Node i is described by kinds[i], ops[i],
+// first[i] and second[i]; children are referenced by 32-bit index and always
+// precede their parent. What the two operand slots hold depends on the kind:
+//
+//   Program                  first = offset into extra, second = child count
+//   BinaryOp, Comparison     first = left, second = right
+//   Number                   first = value
+//   Identifier, String       first = symbol
+//   Declaration, Assignment  first = identifier, second = value
+//   Print, Increment         first = identifier
+//   IfStatement              first = condition, extra[second..] = true body, false body
+//   ForLoop                  first = initialization, extra[second..] = condition, increment, body
+//   ArrayDeclaration         first = identifier, second = size
+//   Element                  first = identifier, second = index
+//   ElementAssignment        first = element, second = value
+//
+// Absent children (an if without else, an empty loop body) are NoNode.
+struct FlatAst {
+    std::vector<NodeKind> kinds {};
+    std::vector<Operator> ops {};
+    std::vector<uint32_t> first {};
+    std::vector<uint32_t> second {};
+    std::vector<NodeIndex> extra {};
+    NodeIndex root = NoNode;
+
+    NodeIndex add(NodeKind kind, Operator op, uint32_t a, uint32_t b) {
+        kinds.push_back(kind);
+        ops.push_back(op);
+        first.push_back(a);
+        second.push_back(b);
+        return static_cast<NodeIndex>(kinds.size() - 1);
+    }
+
+    NodeIndex addWithExtra(NodeKind kind, uint32_t a, std::initializer_list<NodeIndex> children) {
+        uint32_t offset = static_cast<uint32_t>(extra.size());
+        extra.insert(extra.end(), children);
+        return add(kind, Operator::None, a, offset);
+    }
+
+    NodeIndex addProgram(const std::vector<NodeIndex>& statements) {
+        uint32_t offset = static_cast<uint32_t>(extra.size());
+        extra.insert(extra.end(), statements.begin(), statements.end());
+        return add(NodeKind::Program, Operator::None, offset, static_cast<uint32_t>(statements.size()));
+    }
+
+    const NodeIndex* childrenBegin(NodeIndex node) const { return extra.data() + first[node]; }
+
+    const NodeIndex* childrenEnd(NodeIndex node) const { return extra.data() + first[node] + second[node]; }
+
+    int32_t number(NodeIndex node) const { return static_cast<int32_t>(first[node]); }
+
+    NodeIndex extraChild(NodeIndex node, uint32_t slot) const { return extra[second[node] + slot]; }
+
+    size_t size() const { return kinds.size(); }
+
+    size_t bytes() const {
+        return kinds.size() * (sizeof(NodeKind) + sizeof(Operator) + 2 * sizeof(uint32_t)) +
+               extra.size() * sizeof(NodeIndex);
+    }
+};
+
+// Lowers a pointer AST into a FlatAst, children first.
+class FlatAstBuilder final : public Visitor {
+private:
+    FlatAst& ast;
+    NodeIndex last = NoNode;
+
+public:
+    explicit FlatAstBuilder(FlatAst& ast) : ast(ast) {}
+
+    NodeIndex build(AstNode* node) {
+        if (!node) {
+            return NoNode;
+        }
+        dispatch(node, [this](auto* concrete) { visit(concrete); });
+        return last;
+    }
+
+    void visit(ProgramNode* node) override {
+        std::vector<NodeIndex> statements;
+        statements.reserve(node->statements.size());
+        for (AstNode* statement : node->statements) {
+            statements.push_back(build(statement));
+        }
+        last = ast.addProgram(statements);
+    }
+
+    void visit(BinaryOpNode* node) override {
+        NodeIndex left = build(node->left);
+        NodeIndex right = build(node->right);
+        last = ast.add(NodeKind::BinaryOp, node->op, left, right);
+    }
+
+    void visit(NumberNode* node) override {
+        last = ast.add(NodeKind::Number, Operator::None, static_cast<uint32_t>(node->value), 0);
+    }
+
+    void visit(IdentifierNode* node) override {
+        last = ast.add(NodeKind::Identifier, Operator::None, node->name, 0);
+    }
+
+    void visit(StringNode* node) override {
+        last = ast.add(NodeKind::String, Operator::None, node->name, 0);
+    }
+
+    void visit(DeclarationNode* node) override {
+        NodeIndex identifier = build(node->identifier);
+        NodeIndex value = build(node->value);
+        last = ast.add(NodeKind::Declaration, Operator::None, identifier, value);
+    }
+
+    void visit(AssignmentNode* node) override {
+        NodeIndex identifier = build(node->identifier);
+        NodeIndex value = build(node->value);
+        last = ast.add(NodeKind::Assignment, Operator::None, identifier, value);
+    }
+
+    void visit(ComparisonNode* node) override {
+        NodeIndex left = build(node->left);
+        NodeIndex right = build(node->right);
+        last = ast.add(NodeKind::Comparison, node->op, left, right);
+    }
+
+    void visit(IfStatementNode* node) override {
+        NodeIndex condition = build(node->condition);
+        NodeIndex trueBody = build(node->trueBody);
+        NodeIndex falseBody = build(node->falseBody);
+        last = ast.addWithExtra(NodeKind::IfStatement, condition, {trueBody, falseBody});
+    }
+
+    void visit(ForLoopNode* node) override {
+        NodeIndex initialization = build(node->initialization);
+        NodeIndex condition = build(node->condition);
+        NodeIndex increment = build(node->increment);
+        NodeIndex body = build(node->body);
+        last = ast.addWithExtra(NodeKind::ForLoop, initialization, {condition, increment, body});
+    }
+
+    void visit(PrintNode* node) override {
+        NodeIndex identifier = build(node->identifier);
+        last = ast.add(NodeKind::Print, Operator::None, identifier, 0);
+    }
+
+    void visit(IncrementNode* node) override {
+        NodeIndex identifier = build(node->identifier);
+        last = ast.add(NodeKind::Increment, node->value, identifier, 0);
+    }
+
+    void visit(ArrayDeclarationNode* node) override {
+        NodeIndex identifier = build(node->identifier);
+        last = ast.add(NodeKind::ArrayDeclaration, Operator::None, identifier, static_cast<uint32_t>(node->size));
+    }
+
+    void visit(ElementNode* node) override {
+        NodeIndex identifier = build(node->identifier);
+        NodeIndex index = build(node->index);
+        last = ast.add(NodeKind::Element, Operator::None, identifier, index);
+    }
+
+    void visit(ElementAssignmentNode* node) override {
+        NodeIndex element = build(node->element);
+        NodeIndex value = build(node->value);
+        last = ast.add(NodeKind::ElementAssignment, Operator::None, element, value);
+    }
+};
+
+inline void Parser::parseProgramFlat(FlatAst& ast) {
+    FlatAstBuilder builder(ast);
+    std::vector<NodeIndex> statements;
+    Arena::Mark statementStart = arena.mark();
+
+    while (AstNode* statement = parseNextStatement()) {
+        statements.push_back(builder.build(statement));
+        arena.rewind(statementStart);
+    }
+
+    ast.root = ast.addProgram(statements);
+}
+
+#endif
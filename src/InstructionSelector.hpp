@@ -0,0 +1,565 @@
+#ifndef INSTRUCTION_SELECTOR_HPP
+#define INSTRUCTION_SELECTOR_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "Assembly.hpp"
+#include "Ir.hpp"
+#include "Runtime.hpp"
+#include "StringTable.hpp"
+
+// Lowers an SSA region to x86 instructions over virtual registers, which
+// RegisterAllocator then assigns.
+//
+// Constants become immediates. A variable loaded in a region that neither
+// loops nor stores it is read straight from memory where it is used; other
+// loads, phis and computed values get a virtual register each. An
+// arithmetic result takes over the register of an operand that dies at that
+// instruction, so x = x + 1 inside a loop stays a single add.
+//
+// Phis are resolved by copies on the incoming edges. The copies of one edge
+// happen in parallel, so they are ordered to never overwrite a source still
+// to be read, and a cycle is broken through a fresh register.
+//
+// An array element is addressed as [array + index*4], the index in a
+// virtual register, or at a fixed offset when the index is a constant.
+// Vector values never reach the allocator: they are few (LoopVectorizer
+// sees to that), so each takes one of xmm0 to xmm7 when it is defined and
+// gives it back where it dies. Four lanes select SSE2, eight AVX2, and a
+// region that used AVX2 ends with vzeroupper.
+class InstructionSelector {
+private:
+    static constexpr LabelId NoLabel = UINT32_MAX;
+    static constexpr uint32_t vectorRegisterCount = 8;
+
+    using Bits = std::vector<uint64_t>;
+
+    struct Copy {
+        Operand dst;
+        Operand src;
+    };
+
+    InstructionList& program;
+    Runtime& runtime;
+    int labelCount = 0;
+
+    // Per-region state, reused from region to region.
+    const IrFunction* function = nullptr;
+    uint32_t virtualCount = 0;
+    std::vector<Operand> operands {};
+    std::vector<BlockId> order {};
+    std::vector<uint32_t> position {};
+    std::vector<LabelId> labels {};
+    LabelId endLabel = 0;
+    std::vector<Bits> liveOut {};
+    std::vector<uint8_t> dies {};
+    std::vector<Copy> copies {};
+    std::vector<bool> vectorBusy {};
+    bool usedAvx = false;
+
+    static bool test(const Bits& bits, uint32_t index) { return bits[index / 64] >> (index % 64) & 1; }
+
+    static void set(Bits& bits, uint32_t index) { bits[index / 64] |= uint64_t(1) << (index % 64); }
+
+    static void reset(Bits& bits, uint32_t index) { bits[index / 64] &= ~(uint64_t(1) << (index % 64)); }
+
+    static std::vector<BlockId> successors(const IrBlock& block) {
+        const IrInstruction& last = block.instructions.back();
+        if (last.op == IrOp::Jump) return {last.targets[0]};
+        if (last.op == IrOp::Branch) return {last.targets[0], last.targets[1]};
+        return {};
+    }
+
+    static Opcode jumpFor(Operator comparison) {
+        switch (comparison) {
+            case Operator::Equal: return Opcode::Je;
+            case Operator::NotEqual: return Opcode::Jne;
+            case Operator::Less: return Opcode::Jl;
+            case Operator::LessEqual: return Opcode::Jle;
+            case Operator::Greater: return Opcode::Jg;
+            default: return Opcode::Jge;
+        }
+    }
+
+    static Opcode inverse(Opcode jump) {
+        switch (jump) {
+            case Opcode::Je: return Opcode::Jne;
+            case Opcode::Jne: return Opcode::Je;
+            case Opcode::Jl: return Opcode::Jge;
+            case Opcode::Jge: return Opcode::Jl;
+            case Opcode::Jg: return Opcode::Jle;
+            default: return Opcode::Jg;
+        }
+    }
+
+    Operand newTemporary() { return Operand::ofVirtual(virtualCount++); }
+
+    LabelId labelOf(BlockId block) {
+        if (labels[block] == NoLabel) {
+            labels[block] = program.newLabel(function->blocks[block].name, ++labelCount);
+        }
+        return labels[block];
+    }
+
+    bool isNext(BlockId block, size_t index) const {
+        return index + 1 < order.size() && order[index + 1] == block;
+    }
+
+    // Blocks reachable from the entry, in the order they were generated.
+    void computeOrder() {
+        const std::vector<IrBlock>& blocks = function->blocks;
+        std::vector<bool> reachable(blocks.size());
+        std::vector<BlockId> stack {0};
+        reachable[0] = true;
+        while (!stack.empty()) {
+            BlockId block = stack.back();
+            stack.pop_back();
+            for (BlockId target : successors(blocks[block])) {
+                if (!reachable[target]) {
+                    reachable[target] = true;
+                    stack.push_back(target);
+                }
+            }
+        }
+        order.clear();
+        position.assign(blocks.size(), UINT32_MAX);
+        for (BlockId block : function->layout) {
+            if (reachable[block]) {
+                position[block] = static_cast<uint32_t>(order.size());
+                order.push_back(block);
+            }
+        }
+    }
+
+    // Backward liveness of SSA values. A phi input is live out of the
+    // predecessor it comes from, not into the phi's block.
+    void computeLiveness() {
+        const std::vector<IrBlock>& blocks = function->blocks;
+        size_t words = (function->valueCount + 63) / 64;
+        std::vector<Bits> liveIn(blocks.size(), Bits(words));
+        liveOut.assign(blocks.size(), Bits(words));
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = order.size(); i-- > 0;) {
+                BlockId b = order[i];
+                Bits live(words);
+                for (BlockId target : successors(blocks[b])) {
+                    for (size_t w = 0; w < words; w++) live[w] |= liveIn[target][w];
+                    for (const IrPhi& phi : blocks[target].phis) {
+                        for (const IrPhiInput& input : phi.inputs) {
+                            if (input.block == b) set(live, input.value);
+                        }
+                    }
+                }
+                if (live != liveOut[b]) {
+                    liveOut[b] = live;
+                    changed = true;
+                }
+                for (size_t k = blocks[b].instructions.size(); k-- > 0;) {
+                    const IrInstruction& instruction = blocks[b].instructions[k];
+                    if (instruction.result != NoValue) reset(live, instruction.result);
+                    for (ValueId operand : instruction.operands) {
+                        if (operand != NoValue) set(live, operand);
+                    }
+                }
+                for (const IrPhi& phi : blocks[b].phis) {
+                    reset(live, phi.result);
+                }
+                if (live != liveIn[b]) {
+                    liveIn[b] = std::move(live);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Marks, for each instruction of block, which operands are read for the
+    // last time there: bit 0 for operands[0], bit 1 for operands[1].
+    void computeDeaths(BlockId b) {
+        const std::vector<IrInstruction>& instructions = function->blocks[b].instructions;
+        Bits live = liveOut[b];
+        dies.assign(instructions.size(), 0);
+        for (size_t k = instructions.size(); k-- > 0;) {
+            const IrInstruction& instruction = instructions[k];
+            if (instruction.result != NoValue) reset(live, instruction.result);
+            for (int o = 0; o < 2; o++) {
+                ValueId operand = instruction.operands[o];
+                if (operand != NoValue && !test(live, operand)) dies[k] |= 1 << o;
+            }
+            for (ValueId operand : instruction.operands) {
+                if (operand != NoValue) set(live, operand);
+            }
+        }
+    }
+
+    // Decides up front how each value is held, so phis can be referred to
+    // before their block is reached.
+    void assignOperands() {
+        const std::vector<IrBlock>& blocks = function->blocks;
+        bool loops = false;
+        std::vector<Symbol> stored;
+        for (BlockId b : order) {
+            for (BlockId target : successors(blocks[b])) {
+                loops |= position[target] <= position[b];
+            }
+            for (const IrInstruction& instruction : blocks[b].instructions) {
+                if (instruction.op == IrOp::Store) stored.push_back(instruction.symbol);
+            }
+        }
+
+        operands.assign(function->valueCount, Operand {});
+        for (BlockId b : order) {
+            for (const IrPhi& phi : blocks[b].phis) {
+                operands[phi.result] = newTemporary();
+            }
+            for (const IrInstruction& instruction : blocks[b].instructions) {
+                if (instruction.op == IrOp::Const) {
+                    operands[instruction.result] = Operand::ofImmediate(instruction.constant);
+                } else if (instruction.op == IrOp::Load) {
+                    bool inMemory = !loops && std::find(stored.begin(), stored.end(), instruction.symbol) == stored.end();
+                    operands[instruction.result] = inMemory ? Operand::ofMemory(instruction.symbol) : newTemporary();
+                } else if (instruction.op == IrOp::LoadElement) {
+                    operands[instruction.result] = newTemporary();
+                }
+            }
+        }
+    }
+
+    // Emits the pending parallel copies as a sequence of moves.
+    void emitCopies() {
+        while (!copies.empty()) {
+            bool progress = false;
+            for (size_t c = 0; c < copies.size(); c++) {
+                bool blocked = false;
+                for (size_t other = 0; other < copies.size(); other++) {
+                    if (other != c && copies[other].src == copies[c].dst) {
+                        blocked = true;
+                        break;
+                    }
+                }
+                if (!blocked) {
+                    program.emit(Opcode::Mov, copies[c].dst, copies[c].src);
+                    copies.erase(copies.begin() + c);
+                    progress = true;
+                    break;
+                }
+            }
+            if (!progress) {
+                // Every destination is still needed: a cycle. Save one
+                // destination aside and read it from there instead.
+                Operand saved = newTemporary();
+                Operand dst = copies[0].dst;
+                program.emit(Opcode::Mov, saved, dst);
+                for (Copy& copy : copies) {
+                    if (copy.src == dst) copy.src = saved;
+                }
+            }
+        }
+    }
+
+    void collectCopies(BlockId from, BlockId to) {
+        copies.clear();
+        for (const IrPhi& phi : function->blocks[to].phis) {
+            for (const IrPhiInput& input : phi.inputs) {
+                if (input.block == from && operands[phi.result] != operands[input.value]) {
+                    copies.push_back({operands[phi.result], operands[input.value]});
+                }
+            }
+        }
+    }
+
+    void jumpTo(BlockId target, size_t index) {
+        if (!isNext(target, index)) {
+            program.emit(Opcode::Jmp, Operand::ofLabel(labelOf(target)));
+        }
+    }
+
+    void selectBranch(BlockId from, const IrInstruction& branch, size_t index) {
+        Operand left = operands[branch.operands[0]];
+        Operand right = operands[branch.operands[1]];
+        if (left.kind == OperandKind::Immediate ||
+            (left.kind == OperandKind::Memory && right.kind == OperandKind::Memory)) {
+            Operand temporary = newTemporary();
+            program.emit(Opcode::Mov, temporary, left);
+            left = temporary;
+        }
+        program.emit(Opcode::Cmp, left, right);
+
+        Opcode jump = jumpFor(branch.operation);
+        BlockId taken = branch.targets[0];
+        BlockId notTaken = branch.targets[1];
+
+        collectCopies(from, taken);
+        std::vector<Copy> takenCopies = copies;
+        collectCopies(from, notTaken);
+        bool notTakenCopies = !copies.empty();
+
+        if (takenCopies.empty()) {
+            if (isNext(taken, index) && !notTakenCopies) {
+                program.emit(inverse(jump), Operand::ofLabel(labelOf(notTaken)));
+                return;
+            }
+            program.emit(jump, Operand::ofLabel(labelOf(taken)));
+            emitCopies();
+            jumpTo(notTaken, index);
+        } else if (!notTakenCopies) {
+            program.emit(inverse(jump), Operand::ofLabel(labelOf(notTaken)));
+            copies = std::move(takenCopies);
+            emitCopies();
+            jumpTo(taken, index);
+        } else {
+            LabelId edge = program.newLabel("edge_", ++labelCount);
+            program.emit(jump, Operand::ofLabel(edge));
+            emitCopies();
+            program.emit(Opcode::Jmp, Operand::ofLabel(labelOf(notTaken)));
+            program.bind(edge);
+            copies = std::move(takenCopies);
+            emitCopies();
+            jumpTo(taken, index);
+        }
+    }
+
+    void selectBinary(const IrInstruction& instruction, uint8_t dying) {
+        Operand left = operands[instruction.operands[0]];
+        Operand right = operands[instruction.operands[1]];
+        bool leftDies = left.kind == OperandKind::Virtual && (dying & 1);
+        bool rightDies = right.kind == OperandKind::Virtual && (dying & 2);
+        Operand& result = operands[instruction.result];
+
+        if (instruction.operation == Operator::Divide) {
+            Operand eax = Operand::ofRegister(Reg::Eax);
+            Operand divisor = right;
+            if (right.kind == OperandKind::Immediate) {
+                divisor = newTemporary();
+                program.emit(Opcode::Mov, divisor, right);
+            }
+            result = leftDies ? left : newTemporary();
+            program.emit(Opcode::Mov, eax, left);
+            program.emit(Opcode::Cdq);
+            program.emit(Opcode::Idiv, divisor);
+            program.emit(Opcode::Mov, result, eax);
+            return;
+        }
+
+        Opcode opcode = instruction.operation == Operator::Add ? Opcode::Add
+                        : instruction.operation == Operator::Subtract ? Opcode::Sub
+                        : Opcode::Imul;
+        bool commutative = opcode != Opcode::Sub;
+        if (leftDies) {
+            result = left;
+        } else if (commutative && rightDies) {
+            result = right;
+            right = left;
+        } else {
+            result = newTemporary();
+            program.emit(Opcode::Mov, result, left);
+        }
+        program.emit(opcode, result, right);
+    }
+
+    // A value as something an instruction can read besides a memory
+    // operand: immediates and memory go through a register when asked.
+    Operand inRegister(ValueId value, bool immediateAllowed) {
+        Operand operand = operands[value];
+        if (operand.isMemory() || (!immediateAllowed && operand.kind == OperandKind::Immediate)) {
+            Operand temporary = newTemporary();
+            program.emit(Opcode::Mov, temporary, operand);
+            return temporary;
+        }
+        return operand;
+    }
+
+    Operand elementOperand(Symbol array, ValueId index) {
+        Operand operand = operands[index];
+        if (operand.kind == OperandKind::Immediate) {
+            return Operand::ofMemory(array, operand.value * 4);
+        }
+        operand = inRegister(index, false);
+        return Operand::ofVirtualElement(array, static_cast<uint32_t>(operand.value));
+    }
+
+    Operand newVectorRegister(int32_t lanes) {
+        auto free = std::find(vectorBusy.begin(), vectorBusy.end(), false);
+        uint32_t number = static_cast<uint32_t>(free - vectorBusy.begin());
+        *free = true;
+        return lanes == 8 ? Operand::ofYmm(number) : Operand::ofXmm(number);
+    }
+
+    // Frees the registers of the vector operands that die at instruction,
+    // except one the result took over.
+    void releaseDying(const IrInstruction& instruction, uint8_t dying, const Operand& kept) {
+        for (int o = 0; o < 2; o++) {
+            ValueId value = instruction.operands[o];
+            if (value == NoValue || !(dying >> o & 1)) continue;
+            const Operand& operand = operands[value];
+            if ((operand.kind == OperandKind::Xmm || operand.kind == OperandKind::Ymm) && operand != kept) {
+                vectorBusy[operand.value] = false;
+            }
+        }
+    }
+
+    static Opcode vectorMove(int32_t lanes) { return lanes == 8 ? Opcode::Vmovdqu : Opcode::Movdqu; }
+
+    void selectSplat(const IrInstruction& instruction) {
+        Operand value = inRegister(instruction.operands[0], false);
+        Operand result = newVectorRegister(instruction.constant);
+        Operand low = Operand::ofXmm(static_cast<uint32_t>(result.value));
+        if (instruction.constant == 8) {
+            program.emit(Opcode::Vmovd, low, value);
+            program.emit(Opcode::Vpbroadcastd, result, low);
+        } else {
+            program.emit(Opcode::Movd, low, value);
+            program.emit(Opcode::Pshufd, result, low);
+        }
+        operands[instruction.result] = result;
+    }
+
+    void selectVectorBinary(const IrInstruction& instruction, uint8_t dying) {
+        Operand left = operands[instruction.operands[0]];
+        Operand right = operands[instruction.operands[1]];
+        bool avx = instruction.constant == 8;
+        Opcode opcode = instruction.operation == Operator::Add ? (avx ? Opcode::Vpaddd : Opcode::Paddd)
+                        : instruction.operation == Operator::Subtract ? (avx ? Opcode::Vpsubd : Opcode::Psubd)
+                        : Opcode::Vpmulld;
+        bool commutative = instruction.operation != Operator::Subtract;
+        Operand result;
+        if (dying & 1) {
+            result = left;
+        } else if (commutative && (dying & 2)) {
+            result = right;
+            right = left;
+        } else {
+            result = newVectorRegister(instruction.constant);
+            program.emit(vectorMove(instruction.constant), result, left);
+        }
+        program.emit(opcode, result, right);
+        releaseDying(instruction, dying, result);
+        operands[instruction.result] = result;
+    }
+
+    void selectBlock(BlockId b, size_t index) {
+        const IrBlock& block = function->blocks[b];
+        // Forward jumps have already asked for the label; back edges will.
+        bool backEdge = false;
+        for (BlockId predecessor : block.predecessors) {
+            backEdge |= position[predecessor] >= index && position[predecessor] != UINT32_MAX;
+        }
+        if (labels[b] != NoLabel || backEdge) {
+            program.bind(labelOf(b));
+        }
+        computeDeaths(b);
+
+        for (size_t k = 0; k < block.instructions.size(); k++) {
+            const IrInstruction& instruction = block.instructions[k];
+            switch (instruction.op) {
+                case IrOp::Const:
+                    break;
+                case IrOp::Load:
+                    if (operands[instruction.result].kind == OperandKind::Virtual) {
+                        program.emit(Opcode::Mov, operands[instruction.result], Operand::ofMemory(instruction.symbol));
+                    }
+                    break;
+                case IrOp::Binary:
+                    selectBinary(instruction, dies[k]);
+                    break;
+                case IrOp::Store: {
+                    Operand value = operands[instruction.operands[0]];
+                    if (value.kind == OperandKind::Memory) {
+                        Operand temporary = newTemporary();
+                        program.emit(Opcode::Mov, temporary, value);
+                        value = temporary;
+                    }
+                    program.emit(Opcode::Mov, Operand::ofMemory(instruction.symbol), value);
+                    break;
+                }
+                case IrOp::LoadElement:
+                    program.emit(Opcode::Mov, operands[instruction.result],
+                                 elementOperand(instruction.symbol, instruction.operands[0]));
+                    break;
+                case IrOp::StoreElement: {
+                    Operand value = inRegister(instruction.operands[1], true);
+                    program.emit(Opcode::Mov, elementOperand(instruction.symbol, instruction.operands[0]), value);
+                    break;
+                }
+                case IrOp::VectorLoad: {
+                    Operand result = newVectorRegister(instruction.constant);
+                    program.emit(vectorMove(instruction.constant), result,
+                                 elementOperand(instruction.symbol, instruction.operands[0]));
+                    operands[instruction.result] = result;
+                    usedAvx |= instruction.constant == 8;
+                    break;
+                }
+                case IrOp::VectorStore:
+                    program.emit(vectorMove(instruction.constant),
+                                 elementOperand(instruction.symbol, instruction.operands[0]),
+                                 operands[instruction.operands[1]]);
+                    releaseDying(instruction, dies[k], {});
+                    break;
+                case IrOp::VectorBinary:
+                    selectVectorBinary(instruction, dies[k]);
+                    break;
+                case IrOp::Splat:
+                    selectSplat(instruction);
+                    usedAvx |= instruction.constant == 8;
+                    break;
+                case IrOp::Print:
+                    runtime.printInt(operands[instruction.operands[0]]);
+                    break;
+                case IrOp::PrintString:
+                    runtime.printString(instruction.symbol);
+                    break;
+                case IrOp::Jump:
+                    collectCopies(b, instruction.targets[0]);
+                    emitCopies();
+                    jumpTo(instruction.targets[0], index);
+                    break;
+                case IrOp::Branch:
+                    selectBranch(b, instruction, index);
+                    break;
+                case IrOp::Return:
+                    if (index + 1 < order.size()) {
+                        if (endLabel == NoLabel) {
+                            endLabel = program.newLabel("end_region_", ++labelCount);
+                        }
+                        program.emit(Opcode::Jmp, Operand::ofLabel(endLabel));
+                    }
+                    break;
+            }
+        }
+    }
+
+public:
+    InstructionSelector(InstructionList& program, Runtime& runtime) : program(program), runtime(runtime) {}
+
+    // Appends the code of function to the program and returns the number of
+    // virtual registers it uses.
+    uint32_t select(const IrFunction& region) {
+        function = &region;
+        virtualCount = 0;
+        computeOrder();
+        computeLiveness();
+        assignOperands();
+        labels.assign(region.blocks.size(), NoLabel);
+        endLabel = NoLabel;
+        vectorBusy.assign(vectorRegisterCount, false);
+        usedAvx = false;
+
+        for (size_t i = 0; i < order.size(); i++) {
+            selectBlock(order[i], i);
+        }
+        if (endLabel != NoLabel) {
+            program.bind(endLabel);
+        }
+        if (usedAvx) {
+            // Leaves the upper halves clean, so no later SSE code pays for
+            // mixing the two.
+            program.emit(Opcode::Vzeroupper);
+        }
+        return virtualCount;
+    }
+};
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef INTERPRETER_HPP
+#define INTERPRETER_HPP
+
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "Bytecode.hpp"
+#include "Ir.hpp"
+#include "StringTable.hpp"
+
+#if !defined(__GNUC__)
+#error "The interpreter dispatches through computed goto, which needs GCC or Clang"
+#endif
+
+// Runs bytecode for --interp with direct-threaded dispatch. Before the
+// program starts every instruction's opcode is swapped for the address of
+// its handler (GCC's labels as values), and each handler ends by jumping
+// straight to the next instruction's handler: there is no central loop or
+// switch, and every handler's indirect jump is predicted on its own.
+//
+// Output is buffered like the native runtime's. A division by zero or of
+// INT32_MIN by -1, or an index outside its array, stops the program with an
+// error once the output so far is written; native code would crash or read
+// past the array.
+class Interpreter {
+private:
+    struct ThreadedInstruction {
+        const void* handler;
+        int32_t a;
+        int32_t b;
+        int32_t c;
+    };
+
+    static constexpr size_t outputBufferSize = 1 << 16;
+
+    const BytecodeProgram& program;
+    const StringTable& strings;
+    std::vector<int32_t> slots;
+    std::vector<int32_t> elements;
+    std::string output {};
+    uint64_t executed = 0;
+
+    void flush() {
+        std::fwrite(output.data(), 1, output.size(), stdout);
+        std::fflush(stdout);
+        output.clear();
+    }
+
+    void printInt(int32_t value) {
+        char digits[12];
+        char* end = std::to_chars(digits, digits + sizeof(digits) - 1, value).ptr;
+        *end++ = '\n';
+        output.append(digits, end);
+        if (output.size() >= outputBufferSize) {
+            flush();
+        }
+    }
+
+    void printString(const std::string& text) {
+        output += text;
+        if (output.size() >= outputBufferSize) {
+            flush();
+        }
+    }
+
+    [[noreturn]] void fail(const std::string& message) {
+        flush();
+        std::cerr << message << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    [[noreturn]] void outOfBounds(const BytecodeArray& array, int32_t index) {
+        fail("Index " + std::to_string(index) + " is out of bounds for array " + std::string(strings.str(array.name)) +
+             " of " + std::to_string(array.length) + " elements");
+    }
+
+    // Counting keeps a tally of executed instructions for the report; the
+    // copy that runs without it has nothing extra in its handlers.
+    template<bool Counting>
+    std::chrono::steady_clock::time_point execute() {
+        static const void* const handlers[bytecodeOpCount] = {
+            &&Move, &&Add, &&Subtract, &&Multiply, &&Divide, &&AddImmediate, &&LoadElement, &&StoreElement,
+            &&PrintInt, &&PrintString, &&Jump, &&JumpIfEqual, &&JumpIfNotEqual, &&JumpIfLess, &&JumpIfLessEqual,
+            &&JumpIfGreater, &&JumpIfGreaterEqual, &&IncrementJumpIfLess, &&IncrementJumpIfLessEqual,
+            &&IncrementJumpIfNotEqual, &&DecrementJumpIfGreater, &&DecrementJumpIfGreaterEqual,
+            &&DecrementJumpIfNotEqual, &&Halt,
+        };
+
+        std::vector<ThreadedInstruction> code;
+        code.reserve(program.code.size());
+        for (const BytecodeInstruction& instruction : program.code) {
+            code.push_back({handlers[static_cast<size_t>(instruction.op)], instruction.a, instruction.b, instruction.c});
+        }
+
+        int32_t* r = slots.data();
+        int32_t* heap = elements.data();
+        const BytecodeArray* arrays = program.arrays.data();
+        const ThreadedInstruction* const base = code.data();
+        const ThreadedInstruction* ip = base;
+        uint64_t count = 0;
+        auto started = std::chrono::steady_clock::now();
+
+#define DISPATCH()               \
+    do {                         \
+        if constexpr (Counting) { \
+            count++;             \
+        }                        \
+        goto *ip->handler;       \
+    } while (0)
+#define NEXT()   \
+    do {         \
+        ip++;    \
+        DISPATCH(); \
+    } while (0)
+#define BRANCH(condition)                         \
+    do {                                          \
+        ip = (condition) ? base + ip->c : ip + 1; \
+        DISPATCH();                               \
+    } while (0)
+
+        DISPATCH();
+
+    Move:
+        r[ip->a] = r[ip->b];
+        NEXT();
+    Add:
+        r[ip->a] = foldArithmetic(Operator::Add, r[ip->b], r[ip->c]);
+        NEXT();
+    Subtract:
+        r[ip->a] = foldArithmetic(Operator::Subtract, r[ip->b], r[ip->c]);
+        NEXT();
+    Multiply:
+        r[ip->a] = foldArithmetic(Operator::Multiply, r[ip->b], r[ip->c]);
+        NEXT();
+    Divide:
+        if (r[ip->c] == 0) {
+            fail("Division by zero");
+        }
+        if (r[ip->b] == INT32_MIN && r[ip->c] == -1) {
+            fail("Division overflow");
+        }
+        r[ip->a] = foldArithmetic(Operator::Divide, r[ip->b], r[ip->c]);
+        NEXT();
+    AddImmediate:
+        r[ip->a] = foldArithmetic(Operator::Add, r[ip->a], ip->b);
+        NEXT();
+    LoadElement: {
+        const BytecodeArray& array = arrays[ip->b];
+        int32_t index = r[ip->c];
+        if (static_cast<uint32_t>(index) >= array.length) {
+            outOfBounds(array, index);
+        }
+        r[ip->a] = heap[array.offset + static_cast<uint32_t>(index)];
+        NEXT();
+    }
+    StoreElement: {
+        const BytecodeArray& array = arrays[ip->a];
+        int32_t index = r[ip->b];
+        if (static_cast<uint32_t>(index) >= array.length) {
+            outOfBounds(array, index);
+        }
+        heap[array.offset + static_cast<uint32_t>(index)] = r[ip->c];
+        NEXT();
+    }
+    PrintInt:
+        printInt(r[ip->a]);
+        NEXT();
+    PrintString:
+        printString(program.strings[ip->a]);
+        NEXT();
+    Jump:
+        ip = base + ip->a;
+        DISPATCH();
+    JumpIfEqual:
+        BRANCH(r[ip->a] == r[ip->b]);
+    JumpIfNotEqual:
+        BRANCH(r[ip->a] != r[ip->b]);
+    JumpIfLess:
+        BRANCH(r[ip->a] < r[ip->b]);
+    JumpIfLessEqual:
+        BRANCH(r[ip->a] <= r[ip->b]);
+    JumpIfGreater:
+        BRANCH(r[ip->a] > r[ip->b]);
+    JumpIfGreaterEqual:
+        BRANCH(r[ip->a] >= r[ip->b]);
+    IncrementJumpIfLess:
+        r[ip->a] = foldArithmetic(Operator::Add, r[ip->a], 1);
+        BRANCH(r[ip->a] < r[ip->b]);
+    IncrementJumpIfLessEqual:
+        r[ip->a] = foldArithmetic(Operator::Add, r[ip->a], 1);
+        BRANCH(r[ip->a] <= r[ip->b]);
+    IncrementJumpIfNotEqual:
+        r[ip->a] = foldArithmetic(Operator::Add, r[ip->a], 1);
+        BRANCH(r[ip->a] != r[ip->b]);
+    DecrementJumpIfGreater:
+        r[ip->a] = foldArithmetic(Operator::Subtract, r[ip->a], 1);
+        BRANCH(r[ip->a] > r[ip->b]);
+    DecrementJumpIfGreaterEqual:
+        r[ip->a] = foldArithmetic(Operator::Subtract, r[ip->a], 1);
+        BRANCH(r[ip->a] >= r[ip->b]);
+    DecrementJumpIfNotEqual:
+        r[ip->a] = foldArithmetic(Operator::Subtract, r[ip->a], 1);
+        BRANCH(r[ip->a] != r[ip->b]);
+    Halt:
+        executed = count;
+        return started;
+
+#undef BRANCH
+#undef NEXT
+#undef DISPATCH
+    }
+
+public:
+    Interpreter(const BytecodeProgram& program, const StringTable& strings)
+        : program(program), strings(strings), slots(program.slots), elements(program.elementCount, 0) {}
+
+    // Runs the program to its end and writes its output. With report, the
+    // number of instructions executed and the rate they ran at go to
+    // stderr afterwards.
+    void run(bool report) {
+        if (!report) {
+            execute<false>();
+            flush();
+            return;
+        }
+        auto started = execute<true>();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        flush();
+        std::cerr << "interp: " << executed << " instructions in " << seconds * 1e3 << " ms, "
+                  << (seconds > 0 ? executed / seconds / 1e6 : 0) << " M instructions/s" << std::endl;
+    }
+};
+
+#endif
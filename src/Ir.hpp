@@ -0,0 +1,605 @@
+#ifndef IR_HPP
+#define IR_HPP
+
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "AsmBuffer.hpp"
+#include "Parser.hpp"
+#include "StringTable.hpp"
+
+// SSA intermediate representation of one region: the code of a single
+// top-level statement. A region is a control-flow graph of basic blocks.
+// Block 0 is the entry and falls through to the next region when it
+// returns. Every value is defined exactly once, either by an instruction or
+// by a phi at the head of a block.
+//
+// Verse variables live in .data between regions. Inside a region they are
+// SSA values: a variable is loaded once in the entry block if the region
+// reads it before writing it, and stored once before the final return if
+// the region writes it. Array elements stay in memory and are loaded and
+// stored where the program reads and writes them.
+//
+// The vector operations only come from LoopVectorizer. Their values hold
+// constant lanes of 32-bit integers at once; the selector keeps them in xmm
+// (four lanes) or ymm (eight lanes) registers.
+
+using ValueId = uint32_t;
+using BlockId = uint32_t;
+
+constexpr ValueId NoValue = UINT32_MAX;
+constexpr BlockId NoBlock = UINT32_MAX;
+
+enum class IrOp : uint8_t {
+    Const,        // result = constant
+    Load,         // result = [symbol]
+    Binary,       // result = operands[0] op operands[1]
+    Store,        // [symbol] = operands[0]
+    Print,        // operands[0] in decimal, then a newline
+    PrintString,  // the string variable symbol
+    LoadElement,  // result = symbol[operands[0]]
+    StoreElement, // symbol[operands[0]] = operands[1]
+    VectorLoad,   // result = symbol[operands[0]] up to symbol[operands[0] + constant - 1]
+    VectorStore,  // the same elements = the lanes of operands[1]
+    VectorBinary, // result = operands[0] op operands[1], lane by lane
+    Splat,        // result = operands[0] in each of constant lanes
+    Jump,         // goto targets[0]
+    Branch,       // if (operands[0] op operands[1]) goto targets[0] else goto targets[1]
+    Return,       // end of the region
+};
+
+struct IrInstruction {
+    IrOp op;
+    Operator operation = Operator::None;
+    ValueId result = NoValue;
+    ValueId operands[2] = {NoValue, NoValue};
+    int32_t constant = 0;
+    Symbol symbol = NoSymbol;
+    BlockId targets[2] = {NoBlock, NoBlock};
+
+    bool isTerminator() const { return op == IrOp::Jump || op == IrOp::Branch || op == IrOp::Return; }
+};
+
+struct IrPhiInput {
+    BlockId block;
+    ValueId value;
+};
+
+struct IrPhi {
+    ValueId result;
+    Symbol variable;
+    std::vector<IrPhiInput> inputs {};
+};
+
+struct IrBlock {
+    // Prefix of the assembly label the block gets if something jumps to it.
+    const char* name = "block_";
+    std::vector<IrPhi> phis {};
+    std::vector<IrInstruction> instructions {};
+    std::vector<BlockId> predecessors {};
+
+    bool terminated() const { return !instructions.empty() && instructions.back().isTerminator(); }
+};
+
+struct IrFunction {
+    std::vector<IrBlock> blocks {};
+    // Blocks in the order their code was generated, which is the order the
+    // instruction selector lays them out in.
+    std::vector<BlockId> layout {};
+    uint32_t valueCount = 0;
+};
+
+inline std::string_view irOpName(IrOp op) {
+    switch (op) {
+        case IrOp::Const: return "const";
+        case IrOp::Load: return "load";
+        case IrOp::Binary: return "binary";
+        case IrOp::Store: return "store";
+        case IrOp::Print: return "print";
+        case IrOp::PrintString: return "print_string";
+        case IrOp::LoadElement: return "load_element";
+        case IrOp::StoreElement: return "store_element";
+        case IrOp::VectorLoad: return "vector_load";
+        case IrOp::VectorStore: return "vector_store";
+        case IrOp::VectorBinary: return "vector_binary";
+        case IrOp::Splat: return "splat";
+        case IrOp::Jump: return "jump";
+        case IrOp::Branch: return "branch";
+        case IrOp::Return: return "return";
+    }
+    return "";
+}
+
+// Evaluates arithmetic on two constants with the wrap-around semantics of
+// the 32-bit instructions it stands for. right is not 0 for Divide.
+// Whether left op right can be computed at compile time. A division by
+// zero, or of INT32_MIN by -1, faults in idiv, so it is left in the code to
+// fault at run time the same way whatever is optimized.
+inline bool canFoldArithmetic(Operator op, int32_t left, int32_t right) {
+    return op != Operator::Divide || (right != 0 && (left != INT32_MIN || right != -1));
+}
+
+inline int32_t foldArithmetic(Operator op, int32_t left, int32_t right) {
+    uint32_t a = static_cast<uint32_t>(left);
+    uint32_t b = static_cast<uint32_t>(right);
+    switch (op) {
+        case Operator::Add: return static_cast<int32_t>(a + b);
+        case Operator::Subtract: return static_cast<int32_t>(a - b);
+        case Operator::Multiply: return static_cast<int32_t>(a * b);
+        case Operator::Divide:
+            if (right == -1) {
+                return static_cast<int32_t>(0u - a);
+            }
+            return left / right;
+        default:
+            return 0;
+    }
+}
+
+inline bool foldComparison(Operator op, int32_t a, int32_t b) {
+    switch (op) {
+        case Operator::Less: return a < b;
+        case Operator::Greater: return a > b;
+        case Operator::Equal: return a == b;
+        case Operator::NotEqual: return a != b;
+        case Operator::GreaterEqual: return a >= b;
+        case Operator::LessEqual: return a <= b;
+        default: return false;
+    }
+}
+
+// Builds a region directly in SSA form while the AST is walked, following
+// Braun et al., "Simple and Efficient Construction of Static Single
+// Assignment Form": each block records the latest value of every variable
+// it assigns; reading a variable a block does not define looks through its
+// predecessors, placing a phi where they meet. Blocks whose predecessors are
+// not all known yet (loop headers) are unsealed and get incomplete phis that
+// are filled in when the block is sealed. Phis that turn out to merge a
+// single value are forwarded to that value when the region is finished.
+class IrBuilder {
+private:
+    struct IncompletePhi {
+        Symbol variable;
+        size_t phi;
+    };
+
+    IrFunction function {};
+    BlockId current = 0;
+    std::vector<bool> sealed {};
+    std::vector<std::unordered_map<Symbol, ValueId>> definitions {};
+    std::vector<std::vector<IncompletePhi>> incomplete {};
+    std::vector<ValueId> forward {};
+    std::vector<bool> constant {};
+    std::vector<int32_t> constantValue {};
+    std::vector<Symbol> written {};
+    std::unordered_set<Symbol> writtenSet {};
+    std::unordered_map<Symbol, ValueId> loaded {};
+    size_t entryLoads = 0;
+
+    ValueId newValue() {
+        forward.push_back(NoValue);
+        constant.push_back(false);
+        constantValue.push_back(0);
+        return function.valueCount++;
+    }
+
+    void append(IrInstruction instruction) {
+        function.blocks[current].instructions.push_back(instruction);
+    }
+
+    void addEdge(BlockId from, BlockId to) {
+        function.blocks[to].predecessors.push_back(from);
+    }
+
+    ValueId loadEntryValue(Symbol variable) {
+        auto [it, inserted] = loaded.emplace(variable, NoValue);
+        if (inserted) {
+            it->second = newValue();
+            IrInstruction load {IrOp::Load};
+            load.result = it->second;
+            load.symbol = variable;
+            std::vector<IrInstruction>& entry = function.blocks[0].instructions;
+            entry.insert(entry.begin() + entryLoads++, load);
+        }
+        return it->second;
+    }
+
+    ValueId addPhi(BlockId block, Symbol variable) {
+        ValueId result = newValue();
+        function.blocks[block].phis.push_back({result, variable, {}});
+        return result;
+    }
+
+    void addPhiOperands(BlockId block, size_t phi) {
+        Symbol variable = function.blocks[block].phis[phi].variable;
+        std::vector<BlockId> predecessors = function.blocks[block].predecessors;
+        for (BlockId predecessor : predecessors) {
+            ValueId value = readVariable(variable, predecessor);
+            function.blocks[block].phis[phi].inputs.push_back({predecessor, value});
+        }
+    }
+
+    ValueId readVariableRecursive(Symbol variable, BlockId block) {
+        ValueId value;
+        const std::vector<BlockId>& predecessors = function.blocks[block].predecessors;
+        if (!sealed[block]) {
+            value = addPhi(block, variable);
+            incomplete[block].push_back({variable, function.blocks[block].phis.size() - 1});
+        } else if (block == 0 || predecessors.empty()) {
+            value = loadEntryValue(variable);
+        } else if (predecessors.size() == 1) {
+            value = readVariable(variable, predecessors[0]);
+        } else {
+            value = addPhi(block, variable);
+            size_t phi = function.blocks[block].phis.size() - 1;
+            definitions[block][variable] = value;
+            addPhiOperands(block, phi);
+        }
+        definitions[block][variable] = value;
+        return value;
+    }
+
+    // The phi merges one value (besides itself) when that is the only
+    // distinct input.
+    ValueId trivialValue(const IrPhi& phi) {
+        ValueId same = NoValue;
+        for (const IrPhiInput& input : phi.inputs) {
+            ValueId value = resolve(input.value);
+            if (value == same || value == phi.result) {
+                continue;
+            }
+            if (same != NoValue) {
+                return NoValue;
+            }
+            same = value;
+        }
+        return same;
+    }
+
+    void removeTrivialPhis() {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (IrBlock& block : function.blocks) {
+                for (IrPhi& phi : block.phis) {
+                    if (forward[phi.result] != NoValue) {
+                        continue;
+                    }
+                    ValueId same = trivialValue(phi);
+                    if (same != NoValue) {
+                        forward[phi.result] = same;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        for (IrBlock& block : function.blocks) {
+            std::vector<IrPhi> live;
+            for (IrPhi& phi : block.phis) {
+                if (forward[phi.result] == NoValue) {
+                    for (IrPhiInput& input : phi.inputs) {
+                        input.value = resolve(input.value);
+                    }
+                    live.push_back(std::move(phi));
+                }
+            }
+            block.phis = std::move(live);
+            for (IrInstruction& instruction : block.instructions) {
+                for (ValueId& operand : instruction.operands) {
+                    if (operand != NoValue) {
+                        operand = resolve(operand);
+                    }
+                }
+            }
+        }
+    }
+
+public:
+    void begin() {
+        function = IrFunction {};
+        sealed.clear();
+        definitions.clear();
+        incomplete.clear();
+        forward.clear();
+        constant.clear();
+        constantValue.clear();
+        written.clear();
+        writtenSet.clear();
+        loaded.clear();
+        entryLoads = 0;
+        current = newBlock();
+        seal(current);
+        function.layout.push_back(current);
+    }
+
+    BlockId newBlock(const char* name = "block_") {
+        function.blocks.emplace_back();
+        function.blocks.back().name = name;
+        sealed.push_back(false);
+        definitions.emplace_back();
+        incomplete.emplace_back();
+        return static_cast<BlockId>(function.blocks.size() - 1);
+    }
+
+    // Declares that every predecessor of block is known.
+    void seal(BlockId block) {
+        std::vector<IncompletePhi> pending = std::move(incomplete[block]);
+        incomplete[block].clear();
+        sealed[block] = true;
+        for (const IncompletePhi& phi : pending) {
+            addPhiOperands(block, phi.phi);
+        }
+    }
+
+    void setBlock(BlockId block) {
+        current = block;
+        function.layout.push_back(block);
+    }
+
+    BlockId currentBlock() const { return current; }
+
+    bool terminated() const { return function.blocks[current].terminated(); }
+
+    ValueId resolve(ValueId value) const {
+        while (forward[value] != NoValue) {
+            value = forward[value];
+        }
+        return value;
+    }
+
+    bool isConstant(ValueId value, int32_t& out) const {
+        value = resolve(value);
+        if (!constant[value]) {
+            return false;
+        }
+        out = constantValue[value];
+        return true;
+    }
+
+    ValueId makeConstant(int32_t value) {
+        ValueId result = newValue();
+        constant[result] = true;
+        constantValue[result] = value;
+        IrInstruction instruction {IrOp::Const};
+        instruction.result = result;
+        instruction.constant = value;
+        append(instruction);
+        return result;
+    }
+
+    ValueId binary(Operator op, ValueId left, ValueId right) {
+        IrInstruction instruction {IrOp::Binary, op};
+        instruction.result = newValue();
+        instruction.operands[0] = left;
+        instruction.operands[1] = right;
+        append(instruction);
+        return instruction.result;
+    }
+
+    ValueId loadElement(Symbol array, ValueId index) {
+        IrInstruction instruction {IrOp::LoadElement};
+        instruction.result = newValue();
+        instruction.operands[0] = index;
+        instruction.symbol = array;
+        append(instruction);
+        return instruction.result;
+    }
+
+    void storeElement(Symbol array, ValueId index, ValueId value) {
+        IrInstruction instruction {IrOp::StoreElement};
+        instruction.operands[0] = index;
+        instruction.operands[1] = value;
+        instruction.symbol = array;
+        append(instruction);
+    }
+
+    void print(ValueId value) {
+        IrInstruction instruction {IrOp::Print};
+        instruction.operands[0] = value;
+        append(instruction);
+    }
+
+    void printString(Symbol variable) {
+        IrInstruction instruction {IrOp::PrintString};
+        instruction.symbol = variable;
+        append(instruction);
+    }
+
+    void jump(BlockId target) {
+        IrInstruction instruction {IrOp::Jump};
+        instruction.targets[0] = target;
+        append(instruction);
+        addEdge(current, target);
+    }
+
+    void branch(Operator comparison, ValueId left, ValueId right, BlockId taken, BlockId notTaken) {
+        IrInstruction instruction {IrOp::Branch, comparison};
+        instruction.operands[0] = left;
+        instruction.operands[1] = right;
+        instruction.targets[0] = taken;
+        instruction.targets[1] = notTaken;
+        append(instruction);
+        addEdge(current, taken);
+        addEdge(current, notTaken);
+    }
+
+    void writeVariable(Symbol variable, ValueId value) {
+        if (writtenSet.insert(variable).second) {
+            written.push_back(variable);
+        }
+        definitions[current][variable] = value;
+    }
+
+    ValueId readVariable(Symbol variable) { return readVariable(variable, current); }
+
+    ValueId readVariable(Symbol variable, BlockId block) {
+        auto it = definitions[block].find(variable);
+        if (it != definitions[block].end()) {
+            return it->second;
+        }
+        return readVariableRecursive(variable, block);
+    }
+
+    // Stores every variable the region changed, returns, and hands over the
+    // finished region.
+    IrFunction& finish() {
+        for (Symbol variable : written) {
+            ValueId value = resolve(readVariable(variable));
+            auto it = loaded.find(variable);
+            if (it != loaded.end() && resolve(it->second) == value) {
+                continue;
+            }
+            IrInstruction store {IrOp::Store};
+            store.operands[0] = value;
+            store.symbol = variable;
+            append(store);
+        }
+        append({IrOp::Return});
+        removeTrivialPhis();
+        return function;
+    }
+};
+
+// Textual form of a region, written by versec --emit-ir.
+class IrPrinter {
+private:
+    const StringTable& strings;
+    AsmBuffer& output;
+
+    void value(ValueId id) { output << '%' << static_cast<int>(id); }
+
+    void block(BlockId id) { output << "block" << static_cast<int>(id); }
+
+    void element(const IrInstruction& instruction) {
+        output << strings.str(instruction.symbol) << '[';
+        value(instruction.operands[0]);
+        output << ']';
+    }
+
+    void lanes(const IrInstruction& instruction) { output << 'x' << instruction.constant << ' '; }
+
+public:
+    IrPrinter(const StringTable& strings, AsmBuffer& output) : strings(strings), output(output) {}
+
+    void print(const IrFunction& function, int region) {
+        output << "region " << region << ":" << '\n';
+        for (BlockId id : function.layout) {
+            const IrBlock& current = function.blocks[id];
+            block(id);
+            output << ':';
+            if (!current.predecessors.empty()) {
+                output << " ; preds";
+                for (BlockId predecessor : current.predecessors) {
+                    output << ' ';
+                    block(predecessor);
+                }
+            }
+            output << '\n';
+            for (const IrPhi& phi : current.phis) {
+                output << "  ";
+                value(phi.result);
+                output << " = phi";
+                if (phi.variable != NoSymbol) {
+                    // Phis a pass adds for its own values have no variable.
+                    output << ' ' << strings.str(phi.variable);
+                }
+                for (const IrPhiInput& input : phi.inputs) {
+                    output << " [";
+                    value(input.value);
+                    output << ", ";
+                    block(input.block);
+                    output << ']';
+                }
+                output << '\n';
+            }
+            for (const IrInstruction& instruction : current.instructions) {
+                output << "  ";
+                if (instruction.result != NoValue) {
+                    value(instruction.result);
+                    output << " = ";
+                }
+                switch (instruction.op) {
+                    case IrOp::Const:
+                        output << "const " << instruction.constant;
+                        break;
+                    case IrOp::Load:
+                        output << "load " << strings.str(instruction.symbol);
+                        break;
+                    case IrOp::Binary:
+                        value(instruction.operands[0]);
+                        output << ' ' << operatorText(instruction.operation) << ' ';
+                        value(instruction.operands[1]);
+                        break;
+                    case IrOp::Store:
+                        output << "store " << strings.str(instruction.symbol) << ", ";
+                        value(instruction.operands[0]);
+                        break;
+                    case IrOp::Print:
+                        output << "print ";
+                        value(instruction.operands[0]);
+                        break;
+                    case IrOp::PrintString:
+                        output << "print " << strings.str(instruction.symbol);
+                        break;
+                    case IrOp::LoadElement:
+                        output << "load ";
+                        element(instruction);
+                        break;
+                    case IrOp::StoreElement:
+                        output << "store ";
+                        element(instruction);
+                        output << ", ";
+                        value(instruction.operands[1]);
+                        break;
+                    case IrOp::VectorLoad:
+                        lanes(instruction);
+                        output << "load ";
+                        element(instruction);
+                        break;
+                    case IrOp::VectorStore:
+                        lanes(instruction);
+                        output << "store ";
+                        element(instruction);
+                        output << ", ";
+                        value(instruction.operands[1]);
+                        break;
+                    case IrOp::VectorBinary:
+                        lanes(instruction);
+                        value(instruction.operands[0]);
+                        output << ' ' << operatorText(instruction.operation) << ' ';
+                        value(instruction.operands[1]);
+                        break;
+                    case IrOp::Splat:
+                        lanes(instruction);
+                        output << "splat ";
+                        value(instruction.operands[0]);
+                        break;
+                    case IrOp::Jump:
+                        output << "jump ";
+                        block(instruction.targets[0]);
+                        break;
+                    case IrOp::Branch:
+                        output << "branch ";
+                        value(instruction.operands[0]);
+                        output << ' ' << operatorText(instruction.operation) << ' ';
+                        value(instruction.operands[1]);
+                        output << ", ";
+                        block(instruction.targets[0]);
+                        output << ", ";
+                        block(instruction.targets[1]);
+                        break;
+                    case IrOp::Return:
+                        output << "return";
+                        break;
+                }
+                output << '\n';
+            }
+        }
+        output << '\n';
+    }
+};
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef IR_VERIFIER_HPP
+#define IR_VERIFIER_HPP
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "Ir.hpp"
+
+// Checks the structural invariants every pass over the IR relies on:
+//
+// - each reachable block ends in exactly one terminator, whose targets exist;
+// - predecessor lists match the edges the terminators actually create;
+// - a phi has one input per predecessor;
+// - every value is defined once and its definition dominates each use.
+//   A phi input counts as a use at the end of the predecessor it comes from.
+//
+// Unreachable blocks (the untaken side of a constant condition) are only
+// checked for well-formed terminators, as no code is selected for them.
+class IrVerifier {
+private:
+    const IrFunction& function;
+    std::string error {};
+
+    std::vector<bool> reachable {};
+    std::vector<BlockId> postorder {};
+    std::vector<uint32_t> postorderIndex {};
+    std::vector<BlockId> idom {};
+    std::vector<BlockId> definingBlock {};
+    std::vector<uint32_t> definingIndex {};
+
+    bool report(const std::string& message) {
+        if (error.empty()) {
+            error = message;
+        }
+        return false;
+    }
+
+    static std::vector<BlockId> successors(const IrBlock& block) {
+        std::vector<BlockId> result;
+        if (!block.terminated()) {
+            return result;
+        }
+        const IrInstruction& last = block.instructions.back();
+        if (last.op == IrOp::Jump) {
+            result.push_back(last.targets[0]);
+        } else if (last.op == IrOp::Branch) {
+            result.push_back(last.targets[0]);
+            result.push_back(last.targets[1]);
+        }
+        return result;
+    }
+
+    bool checkTerminators() {
+        size_t blockCount = function.blocks.size();
+        for (BlockId b = 0; b < blockCount; b++) {
+            const IrBlock& block = function.blocks[b];
+            if (!block.terminated()) {
+                return report("block" + std::to_string(b) + " does not end in a terminator");
+            }
+            for (size_t i = 0; i + 1 < block.instructions.size(); i++) {
+                if (block.instructions[i].isTerminator()) {
+                    return report("block" + std::to_string(b) + " has a terminator before its end");
+                }
+            }
+            for (BlockId target : successors(block)) {
+                if (target >= blockCount) {
+                    return report("block" + std::to_string(b) + " jumps to a missing block");
+                }
+            }
+        }
+        return true;
+    }
+
+    bool checkPredecessors() {
+        std::vector<std::vector<BlockId>> expected(function.blocks.size());
+        for (BlockId b = 0; b < function.blocks.size(); b++) {
+            for (BlockId target : successors(function.blocks[b])) {
+                expected[target].push_back(b);
+            }
+        }
+        for (BlockId b = 0; b < function.blocks.size(); b++) {
+            std::vector<BlockId> actual = function.blocks[b].predecessors;
+            std::sort(actual.begin(), actual.end());
+            std::sort(expected[b].begin(), expected[b].end());
+            if (actual != expected[b]) {
+                return report("block" + std::to_string(b) + " has inconsistent predecessors");
+            }
+            for (const IrPhi& phi : function.blocks[b].phis) {
+                if (phi.inputs.size() != actual.size()) {
+                    return report("phi %" + std::to_string(phi.result) + " does not have one input per predecessor");
+                }
+                for (const IrPhiInput& input : phi.inputs) {
+                    if (std::find(actual.begin(), actual.end(), input.block) == actual.end()) {
+                        return report("phi %" + std::to_string(phi.result) + " has an input from a non-predecessor");
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    void computeReachability() {
+        size_t blockCount = function.blocks.size();
+        reachable.assign(blockCount, false);
+        postorder.clear();
+        postorderIndex.assign(blockCount, UINT32_MAX);
+
+        // Iterative depth-first search; a block is appended to postorder once
+        // all its successors have been visited.
+        std::vector<std::pair<BlockId, size_t>> stack {{0, 0}};
+        reachable[0] = true;
+        while (!stack.empty()) {
+            auto& [block, next] = stack.back();
+            std::vector<BlockId> targets = successors(function.blocks[block]);
+            if (next < targets.size()) {
+                BlockId target = targets[next++];
+                if (!reachable[target]) {
+                    reachable[target] = true;
+                    stack.push_back({target, 0});
+                }
+                continue;
+            }
+            postorderIndex[block] = static_cast<uint32_t>(postorder.size());
+            postorder.push_back(block);
+            stack.pop_back();
+        }
+    }
+
+    // Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm".
+    void computeDominators() {
+        idom.assign(function.blocks.size(), NoBlock);
+        idom[0] = 0;
+        auto intersect = [this](BlockId a, BlockId b) {
+            while (a != b) {
+                while (postorderIndex[a] < postorderIndex[b]) a = idom[a];
+                while (postorderIndex[b] < postorderIndex[a]) b = idom[b];
+            }
+            return a;
+        };
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = postorder.size(); i-- > 0;) {
+                BlockId block = postorder[i];
+                if (block == 0) {
+                    continue;
+                }
+                BlockId dominator = NoBlock;
+                for (BlockId predecessor : function.blocks[block].predecessors) {
+                    if (!reachable[predecessor] || idom[predecessor] == NoBlock) {
+                        continue;
+                    }
+                    dominator = dominator == NoBlock ? predecessor : intersect(predecessor, dominator);
+                }
+                if (idom[block] != dominator) {
+                    idom[block] = dominator;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    bool dominates(BlockId a, BlockId b) const {
+        while (b != a) {
+            if (b == 0) {
+                return false;
+            }
+            b = idom[b];
+        }
+        return true;
+    }
+
+    bool define(ValueId value, BlockId block, uint32_t index) {
+        if (value >= function.valueCount) {
+            return report("%" + std::to_string(value) + " is out of range");
+        }
+        if (definingBlock[value] != NoBlock) {
+            return report("%" + std::to_string(value) + " is defined more than once");
+        }
+        definingBlock[value] = block;
+        definingIndex[value] = index;
+        return true;
+    }
+
+    // index is the position of the use in block; phis sit at position 0 and
+    // instructions follow from 1, so a phi input is used at block's end.
+    bool use(ValueId value, BlockId block, uint32_t index) {
+        if (value >= function.valueCount || definingBlock[value] == NoBlock) {
+            return report("%" + std::to_string(value) + " is used but never defined");
+        }
+        BlockId definition = definingBlock[value];
+        if (!reachable[definition] || !dominates(definition, block) ||
+            (definition == block && definingIndex[value] >= index)) {
+            return report("%" + std::to_string(value) + " does not dominate its use in block" +
+                          std::to_string(block));
+        }
+        return true;
+    }
+
+    bool checkValues() {
+        definingBlock.assign(function.valueCount, NoBlock);
+        definingIndex.assign(function.valueCount, 0);
+        for (BlockId b = 0; b < function.blocks.size(); b++) {
+            const IrBlock& block = function.blocks[b];
+            for (const IrPhi& phi : block.phis) {
+                if (!define(phi.result, b, 0)) return false;
+            }
+            for (uint32_t i = 0; i < block.instructions.size(); i++) {
+                const IrInstruction& instruction = block.instructions[i];
+                if (instruction.result != NoValue && !define(instruction.result, b, i + 1)) return false;
+            }
+        }
+
+        for (BlockId b = 0; b < function.blocks.size(); b++) {
+            if (!reachable[b]) {
+                continue;
+            }
+            const IrBlock& block = function.blocks[b];
+            for (const IrPhi& phi : block.phis) {
+                for (const IrPhiInput& input : phi.inputs) {
+                    if (reachable[input.block] &&
+                        !use(input.value, input.block, static_cast<uint32_t>(function.blocks[input.block].instructions.size() + 1))) {
+                        return false;
+                    }
+                }
+            }
+            for (uint32_t i = 0; i < block.instructions.size(); i++) {
+                for (ValueId operand : block.instructions[i].operands) {
+                    if (operand != NoValue && !use(operand, b, i + 1)) return false;
+                }
+            }
+        }
+        return true;
+    }
+
+public:
+    explicit IrVerifier(const IrFunction& function) : function(function) {}
+
+    bool verify() {
+        if (function.blocks.empty()) {
+            return report("region has no blocks");
+        }
+        if (!checkTerminators() || !checkPredecessors()) {
+            return false;
+        }
+        computeReachability();
+        computeDominators();
+        return checkValues();
+    }
+
+    const std::string& message() const { return error; }
+};
+
+#endif
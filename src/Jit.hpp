@@ -0,0 +1,116 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "CompileError.hpp"
+#include "ElfWriter.hpp"
+#include "Runtime.hpp"
+
+// Runs a program compiled for x86-64 with a hosted Runtime inside the
+// compiler's own process, for --run: no object file, no linker, no exec.
+//
+// The code is copied into memory mapped writable and then switched to
+// executable, never both at once. Variables get a block of their own. Code
+// reaches variables through 32-bit absolute addresses and RIP-relative
+// displacements, so both mappings are made below 2 GiB (MAP_32BIT).
+//
+// print and the final flush land in the functions below, which write
+// through stdout's stdio buffer.
+class Jit {
+private:
+    static void printInt(int32_t value) {
+        char digits[12];
+        char* end = std::to_chars(digits, digits + sizeof(digits) - 1, value).ptr;
+        *end++ = '\n';
+        std::fwrite(digits, 1, static_cast<size_t>(end - digits), stdout);
+    }
+
+    // The text already ends in its newline.
+    static void printString(const char* text, int32_t length) {
+        std::fwrite(text, 1, static_cast<size_t>(length), stdout);
+    }
+
+    static void flush() {
+        std::fflush(stdout);
+    }
+
+#if defined(__linux__) && defined(__x86_64__)
+    // Writable memory below 2 GiB, unmapped when it goes out of scope, so
+    // an error after the first mapping leaks neither.
+    class Mapping {
+    private:
+        char* memory;
+        size_t size;
+
+    public:
+        explicit Mapping(size_t size) : size(size) {
+            void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+            if (mapped == MAP_FAILED) {
+                compileError("Could not map memory to run the program: ", std::strerror(errno));
+            }
+            memory = static_cast<char*>(mapped);
+        }
+
+        Mapping(const Mapping&) = delete;
+        Mapping& operator=(const Mapping&) = delete;
+
+        ~Mapping() {
+            munmap(memory, size);
+        }
+
+        char* data() const { return memory; }
+
+        void makeExecutable() {
+            if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+                compileError("Could not make the program executable: ", std::strerror(errno));
+            }
+        }
+    };
+#endif
+
+public:
+    // Links the code object holds against freshly mapped memory and calls
+    // it; returns once the program has finished and its output is flushed.
+    static void run(ElfWriter& object, const std::vector<DataDefinition>& data, const Runtime& runtime) {
+#if defined(__linux__) && defined(__x86_64__)
+        ElfWriter::LoadedImage image = object.load(data);
+        Mapping variableMapping(std::max<uint32_t>(image.size, 1));
+        char* variables = variableMapping.data();
+        std::memcpy(variables, image.data.data(), image.data.size());
+
+        const std::array<Symbol, 3>& slots = runtime.hostFunctionSlots();
+        const uint64_t functions[] = {reinterpret_cast<uint64_t>(&printInt), reinterpret_cast<uint64_t>(&printString),
+                                      reinterpret_cast<uint64_t>(&flush)};
+        for (size_t i = 0; i < slots.size(); i++) {
+            std::memcpy(variables + image.offsets.at(slots[i]), &functions[i], sizeof(functions[i]));
+        }
+
+        Mapping codeMapping(std::max<size_t>(object.textSize(), 1));
+        char* code = codeMapping.data();
+        const std::string& text = object.relocate(image, reinterpret_cast<uint64_t>(code),
+                                                  reinterpret_cast<uint64_t>(variables));
+        std::memcpy(code, text.data(), text.size());
+        codeMapping.makeExecutable();
+
+        reinterpret_cast<void (*)()>(code)();
+#else
+        (void) object;
+        (void) data;
+        (void) runtime;
+        compileError("--run needs an x86-64 Linux host");
+#endif
+    }
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef LINKER_HPP
+#define LINKER_HPP
+
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include "CompileError.hpp"
+#include "Assembly.hpp"
+
+extern char** environ;
+
+// Links an object file into an executable with GNU ld, for --link. The
+// runtime is generated into every object, so nothing else goes on the
+// command line.
+class Linker {
+public:
+    static void link(Target target, const std::string& objectPath, const std::string& outputPath) {
+        const char* emulation = target == Target::X86_64 ? "elf_x86_64" : "elf_i386";
+        const char* arguments[] = {"ld", "-m", emulation, "-o", outputPath.c_str(), objectPath.c_str(), nullptr};
+        pid_t pid;
+        int error = ::posix_spawnp(&pid, "ld", nullptr, nullptr, const_cast<char* const*>(arguments), environ);
+        if (error != 0) {
+            compileError("Could not run ld: ", std::strerror(error));
+        }
+        int status;
+        while (::waitpid(pid, &status, 0) < 0) {
+            if (errno != EINTR) {
+                compileError("Could not wait for ld: ", std::strerror(errno));
+            }
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            compileError("Could not link ", outputPath);
+        }
+    }
+};
+
+#endif
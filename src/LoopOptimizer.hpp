@@ -0,0 +1,573 @@
+#ifndef LOOP_OPTIMIZER_HPP
+#define LOOP_OPTIMIZER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+#include "Ir.hpp"
+
+// Optimizes the loops of an SSA region. A ForLoop lowers to a header block
+// that the body starts in and a latch, the last block of the body, whose
+// branch either goes back to the header or leaves to the exit block. The
+// body always runs at least once.
+//
+// - Loop-invariant code motion: constants and arithmetic whose operands
+//   are all defined outside the loop move to the preheader, the block
+//   that enters the loop. A division only moves if it sits in the header,
+//   which runs whenever the preheader does, so it cannot fault where the
+//   original would not have.
+// - Induction variables: a header phi that the latch advances by a
+//   constant step is a basic induction variable. Multiplying it by a
+//   constant becomes a second induction variable that is advanced by an
+//   add instead.
+// - Unrolling: an innermost loop whose body is a single block and whose
+//   trip count is known at compile time is copied factor times per
+//   iteration. Iterations that do not fill a whole unrolled round run in a
+//   remainder loop after it.
+class LoopOptimizer {
+private:
+    struct Loop {
+        BlockId header;
+        BlockId latch;
+        BlockId preheader;
+        std::vector<bool> contains;
+        size_t size;
+    };
+
+    struct Induction {
+        ValueId phi;
+        ValueId init;
+        ValueId next;
+        int32_t step;
+    };
+
+    // Unrolled bodies stay below this many instructions.
+    static constexpr size_t unrollBudget = 256;
+
+    IrFunction* function = nullptr;
+    int unrollFactor = 4;
+
+    std::vector<BlockId> definingBlock {};
+    std::vector<bool> constant {};
+    std::vector<int32_t> constantValue {};
+    std::vector<ValueId> replacement {};
+
+    size_t hoistedCount = 0;
+    size_t reducedCount = 0;
+    size_t unrolledCount = 0;
+
+    static std::vector<BlockId> successors(const IrBlock& block) {
+        const IrInstruction& last = block.instructions.back();
+        if (last.op == IrOp::Jump) return {last.targets[0]};
+        if (last.op == IrOp::Branch) return {last.targets[0], last.targets[1]};
+        return {};
+    }
+
+    ValueId newValue(BlockId block) {
+        definingBlock.push_back(block);
+        constant.push_back(false);
+        constantValue.push_back(0);
+        replacement.push_back(NoValue);
+        return function->valueCount++;
+    }
+
+    IrInstruction makeConstant(BlockId block, int32_t value) {
+        IrInstruction instruction {IrOp::Const};
+        instruction.result = newValue(block);
+        instruction.constant = value;
+        constant[instruction.result] = true;
+        constantValue[instruction.result] = value;
+        return instruction;
+    }
+
+    static IrInstruction makeBinary(Operator op, ValueId result, ValueId left, ValueId right) {
+        IrInstruction instruction {IrOp::Binary, op};
+        instruction.result = result;
+        instruction.operands[0] = left;
+        instruction.operands[1] = right;
+        return instruction;
+    }
+
+    // Inserts instructions into block just before its terminator.
+    void insertBeforeEnd(BlockId block, const std::vector<IrInstruction>& instructions) {
+        std::vector<IrInstruction>& code = function->blocks[block].instructions;
+        code.insert(code.end() - 1, instructions.begin(), instructions.end());
+        for (const IrInstruction& instruction : instructions) {
+            if (instruction.result != NoValue) definingBlock[instruction.result] = block;
+        }
+    }
+
+    void analyzeValues() {
+        uint32_t count = function->valueCount;
+        definingBlock.assign(count, NoBlock);
+        constant.assign(count, false);
+        constantValue.assign(count, 0);
+        replacement.assign(count, NoValue);
+        for (BlockId b = 0; b < function->blocks.size(); b++) {
+            for (const IrPhi& phi : function->blocks[b].phis) {
+                definingBlock[phi.result] = b;
+            }
+            for (const IrInstruction& instruction : function->blocks[b].instructions) {
+                if (instruction.result == NoValue) continue;
+                definingBlock[instruction.result] = b;
+                if (instruction.op == IrOp::Const) {
+                    constant[instruction.result] = true;
+                    constantValue[instruction.result] = instruction.constant;
+                }
+            }
+        }
+    }
+
+    // Natural loops, one per back edge: a jump to a block laid out at or
+    // before the jump. Inner loops come first.
+    std::vector<Loop> findLoops() {
+        const std::vector<IrBlock>& blocks = function->blocks;
+        std::vector<uint32_t> position(blocks.size(), UINT32_MAX);
+        for (uint32_t i = 0; i < function->layout.size(); i++) {
+            position[function->layout[i]] = i;
+        }
+
+        std::vector<Loop> loops;
+        for (BlockId latch : function->layout) {
+            for (BlockId header : successors(blocks[latch])) {
+                if (position[header] > position[latch]) {
+                    continue;
+                }
+                Loop loop {header, latch, NoBlock, std::vector<bool>(blocks.size()), 1};
+                loop.contains[header] = true;
+                std::vector<BlockId> work;
+                if (!loop.contains[latch]) {
+                    loop.contains[latch] = true;
+                    loop.size++;
+                    work.push_back(latch);
+                }
+                while (!work.empty()) {
+                    BlockId block = work.back();
+                    work.pop_back();
+                    for (BlockId predecessor : blocks[block].predecessors) {
+                        if (!loop.contains[predecessor]) {
+                            loop.contains[predecessor] = true;
+                            loop.size++;
+                            work.push_back(predecessor);
+                        }
+                    }
+                }
+                for (BlockId predecessor : blocks[header].predecessors) {
+                    if (!loop.contains[predecessor]) {
+                        loop.preheader = loop.preheader == NoBlock ? predecessor : NoBlock - 1;
+                    }
+                }
+                if (loop.preheader < blocks.size() && blocks[loop.preheader].instructions.back().op == IrOp::Jump) {
+                    loops.push_back(std::move(loop));
+                }
+            }
+        }
+        std::stable_sort(loops.begin(), loops.end(), [](const Loop& a, const Loop& b) { return a.size < b.size; });
+        return loops;
+    }
+
+    bool invariant(const Loop& loop, ValueId value) const {
+        return !loop.contains[definingBlock[value]];
+    }
+
+    void hoistInvariants(const Loop& loop) {
+        std::vector<IrInstruction> hoisted;
+        for (BlockId block : function->layout) {
+            if (!loop.contains[block]) {
+                continue;
+            }
+            std::vector<IrInstruction>& code = function->blocks[block].instructions;
+            size_t kept = 0;
+            for (size_t i = 0; i < code.size(); i++) {
+                const IrInstruction& instruction = code[i];
+                bool move = instruction.op == IrOp::Const ||
+                            (instruction.op == IrOp::Binary && invariant(loop, instruction.operands[0]) &&
+                             invariant(loop, instruction.operands[1]) &&
+                             (instruction.operation != Operator::Divide || block == loop.header));
+                if (move) {
+                    // Later instructions of the loop see it as defined outside.
+                    definingBlock[instruction.result] = loop.preheader;
+                    hoisted.push_back(instruction);
+                    hoistedCount += instruction.op != IrOp::Const;
+                } else {
+                    code[kept++] = instruction;
+                }
+            }
+            code.resize(kept);
+        }
+        insertBeforeEnd(loop.preheader, hoisted);
+    }
+
+    // The basic induction variables of loop: header phis advanced by a
+    // constant step in the latch.
+    std::vector<Induction> findInductions(const Loop& loop) {
+        std::vector<Induction> inductions;
+        const IrBlock& header = function->blocks[loop.header];
+        const IrBlock& latch = function->blocks[loop.latch];
+        for (const IrPhi& phi : header.phis) {
+            if (phi.inputs.size() != 2) {
+                continue;
+            }
+            ValueId init = NoValue, next = NoValue;
+            for (const IrPhiInput& input : phi.inputs) {
+                (input.block == loop.latch ? next : init) = input.value;
+            }
+            if (init == NoValue || next == NoValue || definingBlock[next] != loop.latch) {
+                continue;
+            }
+            for (const IrInstruction& instruction : latch.instructions) {
+                if (instruction.result != next || instruction.op != IrOp::Binary ||
+                    instruction.operands[0] != phi.result || !constant[instruction.operands[1]]) {
+                    continue;
+                }
+                int32_t step = constantValue[instruction.operands[1]];
+                if (instruction.operation == Operator::Add) {
+                    inductions.push_back({phi.result, init, next, step});
+                } else if (instruction.operation == Operator::Subtract && step != INT32_MIN) {
+                    inductions.push_back({phi.result, init, next, -step});
+                }
+            }
+        }
+        return inductions;
+    }
+
+    void strengthReduce(const Loop& loop) {
+        std::vector<Induction> inductions = findInductions(loop);
+        if (inductions.empty()) {
+            return;
+        }
+        // (induction phi, factor) -> the reduced induction variable.
+        std::map<std::pair<ValueId, int32_t>, ValueId> reduced;
+
+        for (BlockId block : function->layout) {
+            if (!loop.contains[block]) {
+                continue;
+            }
+            std::vector<IrInstruction>& code = function->blocks[block].instructions;
+            for (size_t i = 0; i < code.size(); i++) {
+                IrInstruction instruction = code[i];
+                if (instruction.op != IrOp::Binary || instruction.operation != Operator::Multiply) {
+                    continue;
+                }
+                ValueId base = instruction.operands[0];
+                ValueId factor = instruction.operands[1];
+                if (constant[base]) std::swap(base, factor);
+                auto induction = std::find_if(inductions.begin(), inductions.end(),
+                                              [base](const Induction& candidate) { return candidate.phi == base; });
+                if (!constant[factor] || induction == inductions.end()) {
+                    continue;
+                }
+                int32_t k = constantValue[factor];
+                auto [it, inserted] = reduced.emplace(std::make_pair(base, k), NoValue);
+                if (inserted) {
+                    it->second = addReducedInduction(loop, *induction, k);
+                }
+                replacement[instruction.result] = it->second;
+                code.erase(code.begin() + i--);
+                reducedCount++;
+            }
+        }
+        applyReplacements();
+    }
+
+    // Builds q = phi * k as its own induction variable: q starts at init * k
+    // and the latch advances it by step * k right where phi is advanced.
+    ValueId addReducedInduction(const Loop& loop, const Induction& induction, int32_t k) {
+        uint32_t wrappedStep = static_cast<uint32_t>(induction.step) * static_cast<uint32_t>(k);
+
+        std::vector<IrInstruction> preheader;
+        ValueId start;
+        if (constant[induction.init]) {
+            uint32_t product = static_cast<uint32_t>(constantValue[induction.init]) * static_cast<uint32_t>(k);
+            preheader.push_back(makeConstant(loop.preheader, static_cast<int32_t>(product)));
+            start = preheader.back().result;
+        } else {
+            IrInstruction factor = makeConstant(loop.preheader, k);
+            preheader.push_back(factor);
+            start = newValue(loop.preheader);
+            preheader.push_back(makeBinary(Operator::Multiply, start, induction.init, factor.result));
+        }
+        insertBeforeEnd(loop.preheader, preheader);
+
+        ValueId phi = newValue(loop.header);
+        ValueId next = newValue(loop.latch);
+        std::vector<IrInstruction>& latch = function->blocks[loop.latch].instructions;
+        auto advance = std::find_if(latch.begin(), latch.end(),
+                                    [&](const IrInstruction& instruction) { return instruction.result == induction.next; });
+        IrInstruction step = makeConstant(loop.latch, static_cast<int32_t>(wrappedStep));
+        IrInstruction add = makeBinary(Operator::Add, next, phi, step.result);
+        latch.insert(latch.insert(advance + 1, step) + 1, add);
+
+        IrPhi reducedPhi {phi, NoSymbol, {}};
+        for (const IrPhiInput& input : findPhi(loop.header, induction.phi).inputs) {
+            reducedPhi.inputs.push_back({input.block, input.block == loop.latch ? next : start});
+        }
+        function->blocks[loop.header].phis.push_back(reducedPhi);
+        return phi;
+    }
+
+    IrPhi& findPhi(BlockId block, ValueId result) {
+        for (IrPhi& phi : function->blocks[block].phis) {
+            if (phi.result == result) return phi;
+        }
+        return function->blocks[block].phis.front();
+    }
+
+    ValueId resolve(ValueId value) const {
+        while (replacement[value] != NoValue) {
+            value = replacement[value];
+        }
+        return value;
+    }
+
+    void applyReplacements() {
+        for (IrBlock& block : function->blocks) {
+            for (IrPhi& phi : block.phis) {
+                for (IrPhiInput& input : phi.inputs) input.value = resolve(input.value);
+            }
+            for (IrInstruction& instruction : block.instructions) {
+                for (ValueId& operand : instruction.operands) {
+                    if (operand != NoValue) operand = resolve(operand);
+                }
+            }
+        }
+    }
+
+    // Number of times a do-while body runs when its induction variable
+    // starts at start, advances by step and the loop continues while
+    // (value after the step) op bound holds. Zero when that cannot be
+    // told without wrapping around.
+    static int64_t tripCount(Operator op, int64_t start, int64_t step, int64_t bound) {
+        int64_t distance = bound - start;
+        switch (op) {
+            case Operator::Less:
+                if (step <= 0) return 0;
+                return distance <= step ? 1 : (distance + step - 1) / step;
+            case Operator::LessEqual:
+                if (step <= 0) return 0;
+                return distance < step ? 1 : distance / step + 1;
+            case Operator::Greater:
+                if (step >= 0) return 0;
+                return -distance <= -step ? 1 : (-distance - step - 1) / -step;
+            case Operator::GreaterEqual:
+                if (step >= 0) return 0;
+                return -distance < -step ? 1 : -distance / -step + 1;
+            case Operator::NotEqual:
+                if (step == 0 || distance % step != 0 || distance / step <= 0) return 0;
+                return distance / step;
+            default:
+                return 0;
+        }
+    }
+
+    // Copies the first count instructions of a single-block loop's body to
+    // the end of block to (before its terminator, if it has one), renaming
+    // every value they define. values maps the loop's values to the copy's;
+    // on entry it holds what the header phis stand for in this copy.
+    void copyBody(BlockId from, BlockId to, size_t count, std::vector<ValueId>& values) {
+        const std::vector<IrInstruction>& body = function->blocks[from].instructions;
+        std::vector<IrInstruction> copies;
+        copies.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            IrInstruction copy = body[i];
+            for (ValueId& operand : copy.operands) {
+                if (operand != NoValue && values[operand] != NoValue) operand = values[operand];
+            }
+            if (copy.result != NoValue) {
+                ValueId result = newValue(to);
+                constant[result] = constant[copy.result];
+                constantValue[result] = constantValue[copy.result];
+                values.resize(function->valueCount, NoValue);
+                values[copy.result] = result;
+                copy.result = result;
+            }
+            copies.push_back(copy);
+        }
+        std::vector<IrInstruction>& code = function->blocks[to].instructions;
+        code.insert(function->blocks[to].terminated() ? code.end() - 1 : code.end(), copies.begin(), copies.end());
+    }
+
+    // Maps each header phi to the value its latch input has in the copy
+    // described by values, all at once as phis are evaluated in parallel.
+    static void enterCopy(const std::vector<IrPhi>& phis, BlockId latch, std::vector<ValueId>& values) {
+        std::vector<ValueId> entering;
+        for (const IrPhi& phi : phis) {
+            entering.push_back(current(values, findInput(phi, latch)));
+        }
+        for (size_t p = 0; p < phis.size(); p++) {
+            values[phis[p].result] = entering[p];
+        }
+    }
+
+    static ValueId current(const std::vector<ValueId>& values, ValueId value) {
+        return value < values.size() && values[value] != NoValue ? values[value] : value;
+    }
+
+    static ValueId findInput(const IrPhi& phi, BlockId block) {
+        for (const IrPhiInput& input : phi.inputs) {
+            if (input.block == block) return input.value;
+        }
+        return NoValue;
+    }
+
+    // Redirects every use after the loop of a value defined in block to the
+    // copy in values.
+    void replaceUsesAfter(BlockId block, BlockId except, const std::vector<ValueId>& values) {
+        std::vector<ValueId> final(function->valueCount, NoValue);
+        for (size_t value = 0; value < values.size(); value++) {
+            if (values[value] != NoValue && definingBlock[value] == block) final[value] = values[value];
+        }
+        for (BlockId b = 0; b < function->blocks.size(); b++) {
+            if (b == block || b == except) {
+                continue;
+            }
+            for (IrInstruction& instruction : function->blocks[b].instructions) {
+                for (ValueId& operand : instruction.operands) {
+                    if (operand != NoValue) operand = current(final, operand);
+                }
+            }
+            for (IrPhi& phi : function->blocks[b].phis) {
+                for (IrPhiInput& input : phi.inputs) input.value = current(final, input.value);
+            }
+        }
+    }
+
+    bool unroll(const Loop& loop) {
+        if (unrollFactor < 2 || loop.header != loop.latch || loop.size != 1) {
+            return false;
+        }
+        BlockId header = loop.header;
+        const IrInstruction branch = function->blocks[header].instructions.back();
+        if (branch.op != IrOp::Branch || branch.targets[0] != header || !constant[branch.operands[1]]) {
+            return false;
+        }
+        std::vector<Induction> inductions = findInductions(loop);
+        auto induction = std::find_if(inductions.begin(), inductions.end(),
+                                      [&](const Induction& candidate) { return candidate.next == branch.operands[0]; });
+        if (induction == inductions.end() || !constant[induction->init]) {
+            return false;
+        }
+
+        int64_t start = constantValue[induction->init];
+        int64_t step = induction->step;
+        int64_t trips = tripCount(branch.operation, start, step, constantValue[branch.operands[1]]);
+        int64_t end = start + trips * step;
+        int64_t rounds = trips / unrollFactor;
+        size_t bodySize = function->blocks[header].instructions.size() - 1;
+        if (rounds == 0 || bodySize * unrollFactor > unrollBudget || end < INT32_MIN || end > INT32_MAX) {
+            return false;
+        }
+
+        // Main loop: factor copies of the body per round. The first copy is
+        // the original body.
+        std::vector<IrPhi> phis = function->blocks[header].phis;
+        std::vector<ValueId> values(function->valueCount, NoValue);
+        for (int copy = 1; copy < unrollFactor; copy++) {
+            enterCopy(phis, header, values);
+            copyBody(header, header, bodySize, values);
+        }
+        for (IrPhi& phi : function->blocks[header].phis) {
+            for (IrPhiInput& input : phi.inputs) {
+                if (input.block == header) input.value = current(values, input.value);
+            }
+        }
+        IrInstruction bound = makeConstant(header, static_cast<int32_t>(start + rounds * unrollFactor * step));
+        std::vector<IrInstruction>& code = function->blocks[header].instructions;
+        code.insert(code.end() - 1, bound);
+        code.back().operation = Operator::NotEqual;
+        code.back().operands[0] = current(values, branch.operands[0]);
+        code.back().operands[1] = bound.result;
+
+        BlockId rest = NoBlock;
+        if (trips % unrollFactor != 0) {
+            rest = addRemainderLoop(header, branch, phis, bodySize, end, values);
+        }
+        replaceUsesAfter(header, rest, values);
+        unrolledCount++;
+        return true;
+    }
+
+    // A copy of the original body in a loop of its own that the main loop
+    // leaves to. It runs the iterations left over, until the induction
+    // variable reaches end, then goes on to the original exit. values is
+    // updated to map the loop's values to the remainder's.
+    BlockId addRemainderLoop(BlockId header, const IrInstruction& branch, const std::vector<IrPhi>& phis,
+                             size_t bodySize, int64_t end, std::vector<ValueId>& values) {
+        BlockId exit = branch.targets[1];
+        BlockId rest = static_cast<BlockId>(function->blocks.size());
+        function->blocks.emplace_back();
+        function->blocks[rest].name = "unroll_remainder_";
+        function->blocks[rest].predecessors = {header, rest};
+        function->layout.insert(std::find(function->layout.begin(), function->layout.end(), header) + 1, rest);
+        function->blocks[header].instructions.back().targets[1] = rest;
+
+        // The remainder's phis take the main loop's final values on entry;
+        // phis holds the header phis as they were before unrolling.
+        std::vector<ValueId> renamed(function->valueCount, NoValue);
+        std::vector<IrPhi> restPhis;
+        for (const IrPhi& phi : phis) {
+            ValueId result = newValue(rest);
+            renamed.resize(function->valueCount, NoValue);
+            renamed[phi.result] = result;
+            restPhis.push_back({result, phi.variable, {{header, current(values, findInput(phi, header))}}});
+        }
+        copyBody(header, rest, bodySize, renamed);
+        for (size_t p = 0; p < phis.size(); p++) {
+            restPhis[p].inputs.push_back({rest, current(renamed, findInput(phis[p], header))});
+        }
+        function->blocks[rest].phis = std::move(restPhis);
+
+        IrInstruction bound = makeConstant(rest, static_cast<int32_t>(end));
+        IrInstruction restBranch {IrOp::Branch, Operator::NotEqual};
+        restBranch.operands[0] = current(renamed, branch.operands[0]);
+        restBranch.operands[1] = bound.result;
+        restBranch.targets[0] = rest;
+        restBranch.targets[1] = exit;
+        function->blocks[rest].instructions.push_back(bound);
+        function->blocks[rest].instructions.push_back(restBranch);
+
+        for (BlockId& predecessor : function->blocks[exit].predecessors) {
+            if (predecessor == header) predecessor = rest;
+        }
+        for (IrPhi& phi : function->blocks[exit].phis) {
+            for (IrPhiInput& input : phi.inputs) {
+                if (input.block == header) input.block = rest;
+            }
+        }
+        values = std::move(renamed);
+        return rest;
+    }
+
+public:
+    // 1 turns unrolling off.
+    void setUnrollFactor(int factor) { unrollFactor = factor; }
+
+    void optimize(IrFunction& region) {
+        function = &region;
+        if (region.blocks.size() < 2) {
+            return;
+        }
+        analyzeValues();
+        std::vector<Loop> loops = findLoops();
+        if (loops.empty()) {
+            return;
+        }
+        for (const Loop& loop : loops) {
+            hoistInvariants(loop);
+            strengthReduce(loop);
+        }
+        for (const Loop& loop : loops) {
+            unroll(loop);
+        }
+    }
+
+    size_t hoisted() const { return hoistedCount; }
+
+    size_t reduced() const { return reducedCount; }
+
+    size_t unrolled() const { return unrolledCount; }
+};
+
+#endif
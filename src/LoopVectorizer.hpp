@@ -0,0 +1,561 @@
+#ifndef LOOP_VECTORIZER_HPP
+#define LOOP_VECTORIZER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "Ir.hpp"
+
+enum class VectorIsa : uint8_t {
+    None,
+    Sse2,   // four lanes, no 32-bit multiply
+    Avx2,   // eight lanes
+};
+
+// Rewrites loops that walk arrays one element at a time to handle several
+// elements per iteration.
+//
+// A candidate is a single-block loop whose only phi is a counter i going up
+// by one while i < bound (or i <= bound), with bound a constant or fixed
+// before the loop.
+// Its body may only load and store elements at index i, add, subtract or
+// multiply those (and values fixed for the whole loop), and nothing but i
+// may be used after it. Every iteration then touches element i of each
+// array and nothing else, so the iterations are independent and W of them
+// can run at once, W being the number of lanes.
+//
+// The loop becomes:
+//
+//   check:     fewer than 4 * W iterations: the original loop, unchanged
+//   align:     a = init rounded up to a multiple of W
+//   prologue:  the scalar body from init up to a
+//   setup:     L = the last multiple of W from a that fits; splat every
+//              loop-invariant operand of the vector code into all lanes
+//   loop:      the vector body, from a to L in steps of W
+//   epilogue:  the scalar body from L up to the end
+//
+// Arrays start at a 32-byte boundary, so the vector loop only ever accesses
+// whole aligned runs. Checks the compiler can decide, when init and bound
+// are constants, are left out.
+class LoopVectorizer {
+private:
+    enum class Kind : uint8_t {
+        Uniform,   // the same in every iteration
+        Index,     // the counter
+        Vector,    // one value per lane
+        Other,     // rules the loop out where it is used
+    };
+
+    // Vector values and splats share the eight registers xmm0 to xmm7.
+    static constexpr size_t vectorRegisterBudget = 8;
+
+    IrFunction* function = nullptr;
+    VectorIsa isa = VectorIsa::Sse2;
+    int32_t lanes = 4;
+
+    std::vector<BlockId> definingBlock {};
+    std::vector<bool> constant {};
+    std::vector<int32_t> constantValue {};
+    std::vector<Kind> kinds {};
+    std::vector<uint32_t> uses {};
+
+    size_t vectorizedCount = 0;
+
+    struct Candidate {
+        BlockId preheader;
+        BlockId header;
+        BlockId exit;
+        ValueId phi;
+        ValueId init;
+        ValueId next;
+        ValueId bound;
+        Operator comparison;
+    };
+
+    ValueId newValue(BlockId block) {
+        definingBlock.push_back(block);
+        constant.push_back(false);
+        constantValue.push_back(0);
+        kinds.push_back(Kind::Other);
+        uses.push_back(0);
+        return function->valueCount++;
+    }
+
+    BlockId newBlock(const char* name) {
+        function->blocks.emplace_back();
+        function->blocks.back().name = name;
+        return static_cast<BlockId>(function->blocks.size() - 1);
+    }
+
+    void append(BlockId block, const IrInstruction& instruction) {
+        function->blocks[block].instructions.push_back(instruction);
+    }
+
+    ValueId constantIn(BlockId block, int32_t value) {
+        IrInstruction instruction {IrOp::Const};
+        instruction.result = newValue(block);
+        instruction.constant = value;
+        constant[instruction.result] = true;
+        constantValue[instruction.result] = value;
+        append(block, instruction);
+        return instruction.result;
+    }
+
+    // left op right, folded when both are constants.
+    ValueId arithmetic(BlockId block, Operator op, ValueId left, ValueId right) {
+        if (constant[left] && constant[right]) {
+            return constantIn(block, foldArithmetic(op, constantValue[left], constantValue[right]));
+        }
+        IrInstruction instruction {IrOp::Binary, op};
+        instruction.result = newValue(block);
+        instruction.operands[0] = left;
+        instruction.operands[1] = right;
+        append(block, instruction);
+        return instruction.result;
+    }
+
+    void jump(BlockId from, BlockId to) {
+        IrInstruction instruction {IrOp::Jump};
+        instruction.targets[0] = to;
+        append(from, instruction);
+        function->blocks[to].predecessors.push_back(from);
+    }
+
+    // Branches to taken when left op right holds, or jumps straight to the
+    // one target constants decide on.
+    void branch(BlockId from, Operator op, ValueId left, ValueId right, BlockId taken, BlockId notTaken) {
+        if (constant[left] && constant[right]) {
+            jump(from, foldComparison(op, constantValue[left], constantValue[right]) ? taken : notTaken);
+            return;
+        }
+        IrInstruction instruction {IrOp::Branch, op};
+        instruction.operands[0] = left;
+        instruction.operands[1] = right;
+        instruction.targets[0] = taken;
+        instruction.targets[1] = notTaken;
+        append(from, instruction);
+        function->blocks[taken].predecessors.push_back(from);
+        function->blocks[notTaken].predecessors.push_back(from);
+    }
+
+    void analyzeValues() {
+        uint32_t count = function->valueCount;
+        definingBlock.assign(count, NoBlock);
+        constant.assign(count, false);
+        constantValue.assign(count, 0);
+        kinds.assign(count, Kind::Uniform);
+        uses.assign(count, 0);
+        for (BlockId b = 0; b < function->blocks.size(); b++) {
+            for (const IrPhi& phi : function->blocks[b].phis) {
+                definingBlock[phi.result] = b;
+                for (const IrPhiInput& input : phi.inputs) uses[input.value]++;
+            }
+            for (const IrInstruction& instruction : function->blocks[b].instructions) {
+                for (ValueId operand : instruction.operands) {
+                    if (operand != NoValue) uses[operand]++;
+                }
+                if (instruction.result == NoValue) continue;
+                definingBlock[instruction.result] = b;
+                if (instruction.op == IrOp::Const) {
+                    constant[instruction.result] = true;
+                    constantValue[instruction.result] = instruction.constant;
+                }
+            }
+        }
+    }
+
+    // Matches the loop shape described above with header as its only block.
+    bool findCandidate(BlockId header, Candidate& candidate) {
+        const IrBlock& block = function->blocks[header];
+        const IrInstruction& last = block.instructions.back();
+        if (last.op != IrOp::Branch || last.targets[0] != header || last.targets[1] == header ||
+            block.predecessors.size() != 2 || block.phis.size() != 1 || block.phis[0].inputs.size() != 2) {
+            return false;
+        }
+        BlockId preheader = block.predecessors[0] == header ? block.predecessors[1] : block.predecessors[0];
+        BlockId exit = last.targets[1];
+        const IrBlock& exitBlock = function->blocks[exit];
+        if (preheader == header || function->blocks[preheader].instructions.back().op != IrOp::Jump ||
+            exitBlock.predecessors.size() != 1 || !exitBlock.phis.empty()) {
+            return false;
+        }
+
+        const IrPhi& phi = block.phis[0];
+        ValueId init = NoValue, next = NoValue;
+        for (const IrPhiInput& input : phi.inputs) {
+            (input.block == header ? next : init) = input.value;
+        }
+        if (init == NoValue || next == NoValue || definingBlock[next] != header || last.operands[0] != next ||
+            (last.operation != Operator::Less && last.operation != Operator::LessEqual) ||
+            (definingBlock[last.operands[1]] == header && !constant[last.operands[1]])) {
+            return false;
+        }
+        auto advance = std::find_if(block.instructions.begin(), block.instructions.end(),
+                                    [next](const IrInstruction& instruction) { return instruction.result == next; });
+        bool byOne = advance->op == IrOp::Binary && advance->operation == Operator::Add &&
+                     ((advance->operands[0] == phi.result && constant[advance->operands[1]] &&
+                       constantValue[advance->operands[1]] == 1) ||
+                      (advance->operands[1] == phi.result && constant[advance->operands[0]] &&
+                       constantValue[advance->operands[0]] == 1));
+        if (!byOne) {
+            return false;
+        }
+        candidate = {preheader, header, exit, phi.result, init, next, last.operands[1], last.operation};
+        return true;
+    }
+
+    // Classifies the body's values; false when something in it cannot be
+    // vectorized. splats receives the invariant values vector code reads.
+    bool classify(const Candidate& loop, std::vector<ValueId>& splats) {
+        const std::vector<IrInstruction>& body = function->blocks[loop.header].instructions;
+        kinds[loop.phi] = Kind::Index;
+        kinds[loop.next] = Kind::Other;
+        size_t vectorValues = 0;
+        bool stores = false;
+        auto operand = [&](ValueId value) {
+            if (kinds[value] == Kind::Uniform && std::find(splats.begin(), splats.end(), value) == splats.end()) {
+                splats.push_back(value);
+            }
+        };
+
+        for (size_t i = 0; i + 1 < body.size(); i++) {
+            const IrInstruction& instruction = body[i];
+            if (instruction.result == loop.next) {
+                continue;
+            }
+            switch (instruction.op) {
+                case IrOp::Const:
+                    kinds[instruction.result] = Kind::Uniform;
+                    break;
+                case IrOp::Binary: {
+                    Kind left = kinds[instruction.operands[0]];
+                    Kind right = kinds[instruction.operands[1]];
+                    if (left == Kind::Index || left == Kind::Other || right == Kind::Index || right == Kind::Other) {
+                        return false;
+                    }
+                    if (left == Kind::Uniform && right == Kind::Uniform) {
+                        kinds[instruction.result] = Kind::Uniform;
+                        break;
+                    }
+                    bool supported = instruction.operation == Operator::Add ||
+                                     instruction.operation == Operator::Subtract ||
+                                     (instruction.operation == Operator::Multiply && isa == VectorIsa::Avx2);
+                    if (!supported) {
+                        return false;
+                    }
+                    operand(instruction.operands[0]);
+                    operand(instruction.operands[1]);
+                    kinds[instruction.result] = Kind::Vector;
+                    vectorValues++;
+                    break;
+                }
+                case IrOp::LoadElement:
+                    if (instruction.operands[0] != loop.phi) {
+                        return false;
+                    }
+                    kinds[instruction.result] = Kind::Vector;
+                    vectorValues += uses[instruction.result] != 0;
+                    break;
+                case IrOp::StoreElement: {
+                    Kind value = kinds[instruction.operands[1]];
+                    if (instruction.operands[0] != loop.phi || (value != Kind::Vector && value != Kind::Uniform)) {
+                        return false;
+                    }
+                    operand(instruction.operands[1]);
+                    stores = true;
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        return stores && vectorValues + splats.size() <= vectorRegisterBudget;
+    }
+
+    // Whether anything outside the loop uses a value it defines, besides
+    // the counter's final value.
+    bool escapes(const Candidate& loop) const {
+        auto inside = [&](ValueId value) {
+            return value != NoValue && value != loop.next && definingBlock[value] == loop.header;
+        };
+        for (BlockId b = 0; b < function->blocks.size(); b++) {
+            if (b == loop.header) continue;
+            for (const IrPhi& phi : function->blocks[b].phis) {
+                for (const IrPhiInput& input : phi.inputs) {
+                    if (inside(input.value)) return true;
+                }
+            }
+            for (const IrInstruction& instruction : function->blocks[b].instructions) {
+                if (inside(instruction.operands[0]) || inside(instruction.operands[1])) return true;
+            }
+        }
+        return false;
+    }
+
+    // Appends a renamed copy of the loop's body to block, with the counter
+    // replaced by counter; returns the renaming.
+    std::vector<ValueId> copyBody(const Candidate& loop, BlockId block, ValueId counter) {
+        std::vector<ValueId> renamed(function->valueCount, NoValue);
+        renamed[loop.phi] = counter;
+        const std::vector<IrInstruction> body = function->blocks[loop.header].instructions;
+        for (size_t i = 0; i + 1 < body.size(); i++) {
+            IrInstruction copy = body[i];
+            for (ValueId& operand : copy.operands) {
+                if (operand != NoValue && renamed[operand] != NoValue) operand = renamed[operand];
+            }
+            if (copy.result != NoValue) {
+                ValueId result = newValue(block);
+                constant[result] = constant[copy.result];
+                constantValue[result] = constantValue[copy.result];
+                renamed[copy.result] = result;
+                copy.result = result;
+            }
+            append(block, copy);
+        }
+        return renamed;
+    }
+
+    // A scalar loop in block running the body for counter values from
+    // start while they stay below end; start < end on entry.
+    void scalarLoop(const Candidate& loop, BlockId block, BlockId entry, ValueId start, ValueId end,
+                    BlockId exit) {
+        ValueId counter = newValue(block);
+        std::vector<ValueId> renamed = copyBody(loop, block, counter);
+        ValueId next = renamed[loop.next];
+        function->blocks[block].phis.push_back(
+                {counter, function->blocks[loop.header].phis[0].variable, {{entry, start}, {block, next}}});
+        branch(block, Operator::Less, next, end, block, exit);
+    }
+
+    void vectorBody(const Candidate& loop, BlockId block, ValueId counter, const std::vector<ValueId>& splatOf) {
+        std::vector<ValueId> vector(kinds.size(), NoValue);
+        auto lanesOf = [&](ValueId value) { return kinds[value] == Kind::Vector ? vector[value] : splatOf[value]; };
+        const std::vector<IrInstruction> body = function->blocks[loop.header].instructions;
+        for (size_t i = 0; i + 1 < body.size(); i++) {
+            const IrInstruction& instruction = body[i];
+            IrInstruction lane {IrOp::VectorLoad};
+            lane.constant = lanes;
+            if (instruction.op == IrOp::LoadElement && uses[instruction.result] != 0) {
+                lane.result = newValue(block);
+                lane.operands[0] = counter;
+                lane.symbol = instruction.symbol;
+                vector[instruction.result] = lane.result;
+            } else if (instruction.op == IrOp::Binary && kinds[instruction.result] == Kind::Vector) {
+                lane.op = IrOp::VectorBinary;
+                lane.operation = instruction.operation;
+                lane.result = newValue(block);
+                lane.operands[0] = lanesOf(instruction.operands[0]);
+                lane.operands[1] = lanesOf(instruction.operands[1]);
+                vector[instruction.result] = lane.result;
+            } else if (instruction.op == IrOp::StoreElement) {
+                lane.op = IrOp::VectorStore;
+                lane.operands[0] = counter;
+                lane.operands[1] = lanesOf(instruction.operands[1]);
+                lane.symbol = instruction.symbol;
+            } else {
+                continue;
+            }
+            append(block, lane);
+        }
+    }
+
+    // Redirects every use of from outside the loop to to.
+    void replaceUses(const Candidate& loop, ValueId from, ValueId to) {
+        for (BlockId b = 0; b < function->blocks.size(); b++) {
+            if (b == loop.header) continue;
+            for (IrPhi& phi : function->blocks[b].phis) {
+                for (IrPhiInput& input : phi.inputs) {
+                    if (input.value == from) input.value = to;
+                }
+            }
+            for (IrInstruction& instruction : function->blocks[b].instructions) {
+                for (ValueId& operand : instruction.operands) {
+                    if (operand == from) operand = to;
+                }
+            }
+        }
+    }
+
+    void transform(const Candidate& loop, const std::vector<ValueId>& splats, bool checked) {
+        const int32_t threshold = 4 * lanes;
+        BlockId header = loop.header;
+        BlockId exit = loop.exit;
+
+        BlockId check = checked ? newBlock("vector_check_") : NoBlock;
+        BlockId checkLength = checked ? newBlock("vector_check_") : NoBlock;
+        BlockId align = newBlock("vector_align_");
+        BlockId prologue = newBlock("vector_prologue_");
+        BlockId setup = newBlock("vector_setup_");
+        BlockId vectorLoop = newBlock("vector_loop_");
+        BlockId restCheck = newBlock("vector_rest_check_");
+        BlockId epilogue = newBlock("vector_epilogue_");
+        BlockId done = newBlock("vector_done_");
+        BlockId scalar = checked ? newBlock("scalar_loop_") : NoBlock;
+
+        // The preheader enters the new code instead of the loop.
+        BlockId first = checked ? check : align;
+        function->blocks[loop.preheader].instructions.back().targets[0] = first;
+        function->blocks[first].predecessors.push_back(loop.preheader);
+
+        // A constant bound may sit in the loop itself.
+        ValueId end = constant[loop.bound] ? constantIn(first, constantValue[loop.bound]) : loop.bound;
+        if (loop.comparison == Operator::LessEqual) {
+            end = arithmetic(first, Operator::Add, end, constantIn(first, 1));
+        }
+        if (checked) {
+            // end - init only counts the iterations when it cannot wrap.
+            branch(check, Operator::Less, loop.init, end, checkLength, scalar);
+            ValueId length = arithmetic(checkLength, Operator::Subtract, end, loop.init);
+            branch(checkLength, Operator::GreaterEqual, length, constantIn(checkLength, threshold), align, scalar);
+            jump(scalar, header);
+        }
+
+        ValueId width = constantIn(align, lanes);
+        ValueId rounded = arithmetic(align, Operator::Add, loop.init, constantIn(align, lanes - 1));
+        ValueId start = arithmetic(align, Operator::Multiply, arithmetic(align, Operator::Divide, rounded, width),
+                                   width);
+        branch(align, Operator::Less, loop.init, start, prologue, setup);
+        if (!function->blocks[prologue].predecessors.empty()) {
+            scalarLoop(loop, prologue, align, loop.init, start, setup);
+        }
+
+        // The vector loop runs at least once: end - start >= threshold - 2 * lanes + 1.
+        ValueId count = arithmetic(setup, Operator::Subtract, end, start);
+        ValueId rounds = arithmetic(setup, Operator::Divide, count, constantIn(setup, lanes));
+        ValueId limit = arithmetic(setup, Operator::Add, start,
+                                   arithmetic(setup, Operator::Multiply, rounds, constantIn(setup, lanes)));
+        std::vector<ValueId> uniform = copyUniforms(loop, setup);
+        std::vector<ValueId> splatOf(kinds.size(), NoValue);
+        for (ValueId value : splats) {
+            IrInstruction splat {IrOp::Splat};
+            splat.result = newValue(setup);
+            splat.operands[0] = uniform[value] != NoValue ? uniform[value] : value;
+            splat.constant = lanes;
+            append(setup, splat);
+            splatOf[value] = splat.result;
+        }
+        jump(setup, vectorLoop);
+
+        ValueId counter = newValue(vectorLoop);
+        vectorBody(loop, vectorLoop, counter, splatOf);
+        ValueId advanced = arithmetic(vectorLoop, Operator::Add, counter, constantIn(vectorLoop, lanes));
+        function->blocks[vectorLoop].phis.push_back({counter, NoSymbol, {{setup, start}, {vectorLoop, advanced}}});
+        branch(vectorLoop, Operator::Less, advanced, limit, vectorLoop, restCheck);
+
+        branch(restCheck, Operator::Less, limit, end, epilogue, done);
+        if (!function->blocks[epilogue].predecessors.empty()) {
+            scalarLoop(loop, epilogue, restCheck, limit, end, done);
+        }
+        jump(done, exit);
+
+        // After the loop the counter is end on the new path.
+        std::vector<BlockId>& exitPredecessors = function->blocks[exit].predecessors;
+        if (checked) {
+            ValueId final = newValue(exit);
+            replaceUses(loop, loop.next, final);
+            exitPredecessors.push_back(done);
+            function->blocks[exit].phis.push_back(
+                    {final, function->blocks[header].phis[0].variable, {{header, loop.next}, {done, end}}});
+            for (BlockId& predecessor : function->blocks[header].predecessors) {
+                if (predecessor == loop.preheader) predecessor = scalar;
+            }
+            for (IrPhiInput& input : function->blocks[header].phis[0].inputs) {
+                if (input.block == loop.preheader) input.block = scalar;
+            }
+        } else {
+            replaceUses(loop, loop.next, end);
+            exitPredecessors.assign(1, done);
+        }
+
+        // The new blocks go where the loop was, the original loop, if it
+        // stays, last, right before the exit.
+        std::vector<BlockId>& layout = function->layout;
+        auto position = std::find(layout.begin(), layout.end(), header);
+        if (!checked) {
+            IrBlock& original = function->blocks[header];
+            original.phis.clear();
+            original.instructions.assign(1, IrInstruction {IrOp::Return});
+            original.predecessors.clear();
+            position = layout.erase(position);
+        }
+        for (BlockId block : {check, checkLength, align, prologue, setup, vectorLoop, restCheck, epilogue, done,
+                              scalar}) {
+            if (block == NoBlock) continue;
+            if (function->blocks[block].predecessors.empty()) {
+                // Decided never to run.
+                function->blocks[block].instructions.assign(1, IrInstruction {IrOp::Return});
+                continue;
+            }
+            position = layout.insert(position, block) + 1;
+        }
+        vectorizedCount++;
+    }
+
+    // Copies the body's loop-invariant instructions to block, so splats of
+    // them can be made before the vector loop; returns the renaming.
+    std::vector<ValueId> copyUniforms(const Candidate& loop, BlockId block) {
+        std::vector<ValueId> renamed(function->valueCount, NoValue);
+        const std::vector<IrInstruction> body = function->blocks[loop.header].instructions;
+        for (size_t i = 0; i + 1 < body.size(); i++) {
+            IrInstruction copy = body[i];
+            if (copy.result == NoValue || copy.result == loop.next || kinds[copy.result] != Kind::Uniform) {
+                continue;
+            }
+            for (ValueId& operand : copy.operands) {
+                if (operand != NoValue && renamed[operand] != NoValue) operand = renamed[operand];
+            }
+            ValueId result = newValue(block);
+            constant[result] = constant[copy.result];
+            constantValue[result] = constantValue[copy.result];
+            renamed[copy.result] = result;
+            copy.result = result;
+            append(block, copy);
+        }
+        renamed.resize(function->valueCount, NoValue);
+        return renamed;
+    }
+
+    bool vectorizeLoop(BlockId header) {
+        Candidate loop {};
+        std::vector<ValueId> splats;
+        if (!findCandidate(header, loop) || !classify(loop, splats) || escapes(loop)) {
+            return false;
+        }
+        // With both ends known the checks are decided here: too short a
+        // loop stays as it is.
+        bool checked = !constant[loop.init] || !constant[loop.bound];
+        if (!checked) {
+            int64_t end = int64_t(constantValue[loop.bound]) + (loop.comparison == Operator::LessEqual ? 1 : 0);
+            if (end - constantValue[loop.init] < 4 * lanes) {
+                return false;
+            }
+        }
+        transform(loop, splats, checked);
+        return true;
+    }
+
+public:
+    void setIsa(VectorIsa target) {
+        isa = target;
+        lanes = isa == VectorIsa::Avx2 ? 8 : 4;
+    }
+
+    void vectorize(IrFunction& region) {
+        function = &region;
+        if (isa == VectorIsa::None || region.blocks.size() < 2) {
+            return;
+        }
+        analyzeValues();
+        // Blocks added along the way are never candidates themselves.
+        std::vector<BlockId> layout = region.layout;
+        for (BlockId block : layout) {
+            if (vectorizeLoop(block)) {
+                analyzeValues();
+            }
+        }
+    }
+
+    size_t vectorized() const { return vectorizedCount; }
+};
+
+#endif
@@ -1,33 +1,619 @@
+#include <sys/stat.h>
+
+#include <cstdlib>
 #include <fstream>
+#include <new>
 #include <sstream>
-
+#include <thread>
+#include <unordered_map>
+#include "SourceFile.hpp"
 #include "Parser.hpp"
 #include "CodeGenerator.hpp"
+#include "Bytecode.hpp"
+#include "Interpreter.hpp"
+#include "CompileCache.hpp"
+#include "CompileError.hpp"
+#include "CompileStats.hpp"
+#include "Linker.hpp"
+#include "ThreadPool.hpp"
+
+// Replaced only to count allocations for --stats; with it off they are
+// malloc and free behind one predictable branch. Every form of new and
+// delete other than the aligned ones, which keep the library's pair, is
+// replaced so that each allocation is released by a matching function. The
+// deletes stay out of line: inlined, GCC sees free() meet a pointer from
+// operator new and warns (-Wmismatched-new-delete).
+void* operator new(size_t size) {
+    if (CompileStats::countingAllocations) {
+        CompileStats::recordAllocation(size);
+    }
+    if (void* memory = std::malloc(size != 0 ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return operator new(size);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return operator new(size, std::nothrow);
+}
+
+[[gnu::noinline]] void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+[[gnu::noinline]] void operator delete[](void* memory) noexcept {
+    operator delete(memory);
+}
+
+[[gnu::noinline]] void operator delete(void* memory, size_t) noexcept {
+    operator delete(memory);
+}
+
+[[gnu::noinline]] void operator delete[](void* memory, size_t) noexcept {
+    operator delete(memory);
+}
+
+[[gnu::noinline]] void operator delete(void* memory, const std::nothrow_t&) noexcept {
+    operator delete(memory);
+}
+
+[[gnu::noinline]] void operator delete[](void* memory, const std::nothrow_t&) noexcept {
+    operator delete(memory);
+}
+
+// The flags that shape a compile, read by every file of a batch and
+// written by none.
+struct CompileOptions {
+    bool streaming = false;
+    bool flat = false;
+    bool verifyIr = false;
+    bool peephole = true;
+    bool peepholeReport = false;
+    bool constantPropagation = true;
+    bool loopOptimizations = true;
+    int unrollFactor = 4;
+    VectorIsa vectorIsa = VectorIsa::Sse2;
+    OutputFormat format = OutputFormat::Object;
+    Target target = Target::X86;
+    bool link = false;
+    bool cache = false;
+    std::string cacheDirectory = CompileCache::defaultDirectory();
+    uint64_t cacheLimit = uint64_t(256) << 20;
+};
+
+// Compiles filename to outputPath. The source, string table, arena,
+// tokenizer, parser and code generator all belong to this call, so calls
+// for different files can run at the same time. Measures the compile into
+// stats unless it is null. Throws CompileError.
+static void compileFile(const CompileOptions& options, const std::string& filename, const std::string& outputPath,
+                        CompileStats* stats) {
+    CompileStats::Scope reading(stats, CompileStats::Phase::Read);
+    SourceFile source(filename);
+    reading.end();
+
+    StringTable strings;
+    Arena arena;
+    Tokenizer tokenizer(source.view(), strings);
+
+    auto configure = [&](CodeGenerator& codeGenerator) {
+        codeGenerator.setStats(stats);
+        codeGenerator.setVerifyIr(options.verifyIr);
+        codeGenerator.setPeephole(options.peephole, options.peepholeReport);
+        codeGenerator.setConstantPropagation(options.constantPropagation);
+        codeGenerator.setLoopOptimizations(options.loopOptimizations, options.unrollFactor);
+        codeGenerator.setVectorization(options.vectorIsa);
+    };
+
+    auto compile = [&](const std::string& path) {
+        if (options.streaming) {
+            // Tokens are read as the parser asks for them, so tokenizing
+            // counts as parsing.
+            Parser parser(tokenizer, strings, arena);
+            CompileStats::Scope generating(stats, CompileStats::Phase::Generate);
+            CodeGenerator codeGenerator(strings, path, options.format, options.target);
+            configure(codeGenerator);
+            Arena::Mark statementStart = arena.mark();
+
+            codeGenerator.beginCode();
+            for (;;) {
+                CompileStats::Scope parsing(stats, CompileStats::Phase::Parse);
+                AstNode* statement = parser.parseNextStatement();
+                parsing.end();
+                if (statement == nullptr) {
+                    break;
+                }
+                if (stats != nullptr) {
+                    stats->countNodes(statement);
+                }
+                codeGenerator.emitStatement(statement);
+                arena.rewind(statementStart);
+                source.release(tokenizer.position());
+            }
+            codeGenerator.finishCode();
+            if (stats != nullptr) {
+                stats->countProgramNode();
+                stats->addTokens(tokenizer.tokenCount());
+            }
+            return;
+        }
+
+        CompileStats::Scope tokenizing(stats, CompileStats::Phase::Tokenize);
+        std::vector<Token> tokens = tokenizer.tokenize();
+        tokenizing.end();
+        if (stats != nullptr) {
+            stats->addTokens(tokens.size());
+        }
+
+        CompileStats::Scope parsing(stats, CompileStats::Phase::Parse);
+        Parser parser(std::move(tokens), strings, arena);
+
+        if (options.flat) {
+            FlatAst ast;
+            parser.parseProgramFlat(ast);
+            parsing.end();
+            if (stats != nullptr) {
+                stats->countNodes(ast);
+            }
+
+            CompileStats::Scope generating(stats, CompileStats::Phase::Generate);
+            CodeGenerator codeGenerator(strings, path, options.format, options.target);
+            configure(codeGenerator);
+            codeGenerator.generateCode(ast);
+            return;
+        }
+
+        AstNode* AST = parser.parseProgram();
+        parsing.end();
+        if (stats != nullptr) {
+            stats->countNodes(AST);
+        }
+
+        CompileStats::Scope generating(stats, CompileStats::Phase::Generate);
+        CodeGenerator codeGenerator(strings, path, options.format, options.target);
+        configure(codeGenerator);
+        codeGenerator.generateCode(AST);
+    };
+
+    // Output that only lives in this process or goes to stdout is not
+    // cached. An executable shares its key with the object it is linked
+    // from.
+    std::optional<CompileCache> compileCache;
+    std::string cacheKey;
+    if (options.cache && options.format != OutputFormat::Run && outputPath != "-") {
+        compileCache.emplace(options.cacheDirectory, options.cacheLimit);
+        // Everything that changes what the compile writes, and nothing else:
+        // --flat only changes how the AST is held, and --verify-ir and
+        // --report-peephole only check or report on the same output.
+        std::string settings = std::string(options.target == Target::X86_64 ? "x86_64" : "x86") +
+                               (options.format == OutputFormat::Assembly ? " asm"
+                                : options.format == OutputFormat::Ir   ? " ir"
+                                                                       : " object") +
+                               (options.streaming ? " stream" : "") + (options.peephole ? "" : " no-peephole") +
+                               (options.constantPropagation ? "" : " no-sccp") +
+                               (options.loopOptimizations ? "" : " no-loop-opt") +
+                               " unroll=" + std::to_string(options.unrollFactor) +
+                               " vectorize=" + std::to_string(static_cast<int>(options.vectorIsa));
+        cacheKey = CompileCache::key(source.view(), settings);
+    }
+    CacheArtifact artifact = options.link                              ? CacheArtifact::Executable
+                             : options.format == OutputFormat::Assembly ? CacheArtifact::Assembly
+                             : options.format == OutputFormat::Ir       ? CacheArtifact::Ir
+                                                                        : CacheArtifact::Object;
+
+    // A compile asked to verify its IR or report on its peephole pass runs
+    // in full, so the check or report is never skipped, and stores what it
+    // writes as usual.
+    bool lookup = compileCache && !options.verifyIr && !options.peepholeReport;
+
+    // A missing executable falls back on the object, and only the second
+    // lookup counts a miss.
+    if (lookup && compileCache->fetch(cacheKey, artifact, outputPath, !options.link)) {
+        return;
+    }
+    // --run writes no file, so it has no output for a failure to remove.
+    std::string compiledPath = options.format == OutputFormat::Run ? "-"
+                               : options.link                      ? outputPath + ".o"
+                                                                   : outputPath;
+    // A failed compile or link leaves nothing at either path, rather than
+    // an empty or half-written file that a later link would accept.
+    try {
+        if (!lookup || !options.link || !compileCache->fetch(cacheKey, CacheArtifact::Object, compiledPath)) {
+            compile(compiledPath);
+            if (stats != nullptr) {
+                stats->setArenaAllocations(arena.allocationCount(), arena.bytesAllocated());
+            }
+            if (compileCache) {
+                compileCache->store(cacheKey, options.link ? CacheArtifact::Object : artifact, compiledPath);
+            }
+        }
+        if (options.link) {
+            CompileStats::Scope linking(stats, CompileStats::Phase::Emit);
+            Linker::link(options.target, compiledPath, outputPath);
+        }
+    } catch (const std::exception&) {
+        if (compiledPath != "-") {
+            ::unlink(compiledPath.c_str());
+        }
+        if (options.link) {
+            ::unlink(outputPath.c_str());
+        }
+        throw;
+    }
+    if (options.link) {
+        ::unlink(compiledPath.c_str());
+        if (compileCache) {
+            compileCache->store(cacheKey, CacheArtifact::Executable, outputPath);
+        }
+    }
+}
+
+// Generating is compiling to bytecode here; the instructions counted are
+// bytecode instructions.
+static void interpretFile(const std::string& filename, bool report, CompileStats* stats) {
+    CompileStats::Scope reading(stats, CompileStats::Phase::Read);
+    SourceFile source(filename);
+    reading.end();
+
+    StringTable strings;
+    Arena arena;
+    Tokenizer tokenizer(source.view(), strings);
+    CompileStats::Scope tokenizing(stats, CompileStats::Phase::Tokenize);
+    std::vector<Token> tokens = tokenizer.tokenize();
+    tokenizing.end();
+    if (stats != nullptr) {
+        stats->addTokens(tokens.size());
+    }
+
+    CompileStats::Scope parsing(stats, CompileStats::Phase::Parse);
+    Parser parser(std::move(tokens), strings, arena);
+    AstNode* AST = parser.parseProgram();
+    parsing.end();
+
+    CompileStats::Scope generating(stats, CompileStats::Phase::Generate);
+    BytecodeProgram program = BytecodeCompiler(strings).compile(AST);
+    generating.end();
+    if (stats != nullptr) {
+        stats->countNodes(AST);
+        stats->countInstructions(program.code.size());
+        stats->setArenaAllocations(arena.allocationCount(), arena.bytesAllocated());
+    }
+
+    CompileStats::Scope running(stats, CompileStats::Phase::Run);
+    Interpreter(program, strings).run(report);
+}
+
+struct BatchFile {
+    std::string input;
+    std::string output;
+};
+
+// Where a batch writes input's output when it is not given: beside the
+// input, or in directory when -o names one, with the .vs extension
+// replaced by the output format's.
+static std::string batchOutputPath(const CompileOptions& options, const std::string& input,
+                                   const std::string& directory) {
+    std::string stem = input;
+    bool source = stem.size() > 3 && stem.compare(stem.size() - 3, 3, ".vs") == 0;
+    if (source) {
+        stem.resize(stem.size() - 3);
+    }
+    if (!directory.empty()) {
+        size_t slash = stem.rfind('/');
+        stem = directory + "/" + (slash == std::string::npos ? stem : stem.substr(slash + 1));
+    }
+    if (options.link) {
+        return source ? stem : stem + ".out";
+    }
+    return stem + (options.format == OutputFormat::Assembly ? ".asm" : options.format == OutputFormat::Ir ? ".ir" : ".o");
+}
+
+// A manifest names one input per line, optionally followed by its output
+// path. Blank lines and lines starting with # are skipped.
+static bool readManifest(const std::string& path, const CompileOptions& options, const std::string& directory,
+                         std::vector<BatchFile>& files) {
+    std::ifstream manifest(path);
+    if (!manifest) {
+        std::cerr << "Could not open manifest " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    for (int number = 1; std::getline(manifest, line); number++) {
+        std::istringstream fields(line);
+        std::string input;
+        std::string output;
+        std::string extra;
+        if (!(fields >> input) || input[0] == '#') {
+            continue;
+        }
+        if (fields >> output >> extra) {
+            std::cerr << path << ":" << number << ": expected an input and at most one output" << std::endl;
+            return false;
+        }
+        files.push_back({input, output.empty() ? batchOutputPath(options, input, directory) : output});
+    }
+    return true;
+}
+
+// Compiles every file on up to jobs threads. A file that fails does not
+// stop the others; failures are reported in input order once all are done.
+// Each file's stats go to its own entry of stats when it is not empty.
+static int compileBatch(const CompileOptions& options, const std::vector<BatchFile>& files, unsigned jobs,
+                        std::vector<CompileStats>& stats) {
+    std::vector<std::string> errors(files.size());
+    std::vector<char> failed(files.size(), 0);
+
+    WorkStealingPool(jobs).run(files.size(), [&](size_t index) {
+        try {
+            compileFile(options, files[index].input, files[index].output, stats.empty() ? nullptr : &stats[index]);
+        } catch (const std::exception& error) {
+            errors[index] = error.what();
+            failed[index] = 1;
+        }
+    });
+
+    size_t failures = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (failed[i]) {
+            std::cerr << files[i].input << ": " << errors[i] << std::endl;
+            failures++;
+        }
+    }
+    if (failures > 0) {
+        std::cerr << failures << " of " << files.size() << " files failed to compile" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+// --stats goes to stderr; --stats-json to stderr or the file named, as one
+// object for a single file and an array of them for a batch.
+static bool printStats(const std::vector<CompileStats>& stats, const std::vector<std::string>& files, bool text,
+                       bool json, const std::string& jsonPath, bool batch) {
+    if (text) {
+        for (size_t i = 0; i < stats.size(); i++) {
+            stats[i].print(std::cerr, files[i]);
+        }
+    }
+    if (!json) {
+        return true;
+    }
+    std::ofstream file;
+    if (!jsonPath.empty()) {
+        file.open(jsonPath);
+        if (!file) {
+            std::cerr << "Could not open output file " << jsonPath << std::endl;
+            return false;
+        }
+    }
+    std::ostream& out = jsonPath.empty() ? std::cerr : file;
+    out << (batch ? "[" : "");
+    for (size_t i = 0; i < stats.size(); i++) {
+        out << (i == 0 ? "" : ",\n ");
+        stats[i].printJson(out, files[i]);
+    }
+    out << (batch ? "]" : "") << std::endl;
+    return true;
+}
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
+    CompileOptions options;
+    bool targetGiven = false;
+    bool run = false;
+    bool interpret = false;
+    bool interpreterReport = false;
+    bool cacheStats = false;
+    unsigned jobs = std::thread::hardware_concurrency();
+    bool statsText = false;
+    bool statsJson = false;
+    std::string statsJsonPath;
+    std::vector<std::string> inputs;
+    std::string manifest;
+    std::string outputPath;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--stream") {
+            options.streaming = true;
+        } else if (arg == "--flat") {
+            options.flat = true;
+        } else if (arg == "-S") {
+            options.format = OutputFormat::Assembly;
+        } else if (arg == "--emit-ir") {
+            options.format = OutputFormat::Ir;
+        } else if (arg == "--run") {
+            run = true;
+        } else if (arg == "--interp") {
+            interpret = true;
+        } else if (arg == "--report-interp") {
+            interpreterReport = true;
+        } else if (arg == "--link") {
+            options.link = true;
+        } else if (arg == "--cache") {
+            options.cache = true;
+        } else if (arg == "--cache-stats") {
+            cacheStats = true;
+        } else if (arg.rfind("--cache-dir=", 0) == 0) {
+            options.cacheDirectory = arg.substr(12);
+        } else if (arg.rfind("--cache-size=", 0) == 0) {
+            long megabytes = std::atol(arg.c_str() + 13);
+            if (megabytes < 1) {
+                std::cerr << "Invalid cache size" << std::endl;
+                return EXIT_FAILURE;
+            }
+            options.cacheLimit = static_cast<uint64_t>(megabytes) << 20;
+        } else if (arg == "--verify-ir") {
+            options.verifyIr = true;
+        } else if (arg == "--no-peephole") {
+            options.peephole = false;
+        } else if (arg == "--report-peephole") {
+            options.peepholeReport = true;
+        } else if (arg == "--no-sccp") {
+            options.constantPropagation = false;
+        } else if (arg == "--no-loop-opt") {
+            options.loopOptimizations = false;
+        } else if (arg.rfind("--unroll=", 0) == 0) {
+            options.unrollFactor = std::atoi(arg.c_str() + 9);
+            if (options.unrollFactor < 1) {
+                std::cerr << "Invalid unroll factor" << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "--vectorize=sse2") {
+            options.vectorIsa = VectorIsa::Sse2;
+        } else if (arg == "--vectorize=avx2") {
+            options.vectorIsa = VectorIsa::Avx2;
+        } else if (arg == "--vectorize=none") {
+            options.vectorIsa = VectorIsa::None;
+        } else if (arg.rfind("--vectorize=", 0) == 0) {
+            std::cerr << "Unknown instruction set " << arg.substr(12) << std::endl;
+            return EXIT_FAILURE;
+        } else if (arg == "--target=x86") {
+            options.target = Target::X86;
+            targetGiven = true;
+        } else if (arg == "--target=x86_64") {
+            options.target = Target::X86_64;
+            targetGiven = true;
+        } else if (arg.rfind("--target=", 0) == 0) {
+            std::cerr << "Unknown target " << arg.substr(9) << std::endl;
+            return EXIT_FAILURE;
+        } else if (arg == "--stats") {
+            statsText = true;
+        } else if (arg == "--stats-json") {
+            statsJson = true;
+        } else if (arg.rfind("--stats-json=", 0) == 0) {
+            statsJson = true;
+            statsJsonPath = arg.substr(13);
+        } else if (arg.rfind("--manifest=", 0) == 0) {
+            manifest = arg.substr(11);
+        } else if ((arg == "-j" && i + 1 < argc) || arg.rfind("--jobs=", 0) == 0) {
+            int count = std::atoi(arg == "-j" ? argv[++i] : arg.c_str() + 7);
+            if (count < 1) {
+                std::cerr << "Invalid job count" << std::endl;
+                return EXIT_FAILURE;
+            }
+            jobs = static_cast<unsigned>(count);
+        } else if (arg == "-o" && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+
+    if (inputs.empty() && manifest.empty()) {
+        if (cacheStats) {
+            CompileCache(options.cacheDirectory, options.cacheLimit).printStats();
+            return 0;
+        }
         std::cerr << "Input error" << std::endl;
         return 0;
     }
 
-    std::string filename = argv[1];
-    std::ifstream inputFile(filename);
-    std::string line;
-    std::string source;
+    if (run) {
+        // The program runs in this process, so it is compiled for it.
+        if (targetGiven && options.target != Target::X86_64) {
+            std::cerr << "--run needs --target=x86_64" << std::endl;
+            return EXIT_FAILURE;
+        }
+        options.target = Target::X86_64;
+        options.format = OutputFormat::Run;
+    }
 
-    while (getline(inputFile, line)) {
-        source += line;
+    if (options.link && options.format != OutputFormat::Object) {
+        std::cerr << "--link cannot be combined with -S, --emit-ir or --run" << std::endl;
+        return EXIT_FAILURE;
     }
-    inputFile.close();
 
-    Tokenizer tokenizer(source);
-    std::vector<Token> tokens = tokenizer.tokenize();
-    
-    Parser parser(tokens);
-    AstNode* AST = parser.parseProgram();
+    // Set before any compile, and so before any other thread, starts.
+    CompileStats::countingAllocations = statsText || statsJson;
+    std::vector<std::string> statsFiles;
+    std::vector<CompileStats> stats;
+
+    // Several inputs or a manifest: each file gets its own output, and -o
+    // names the directory they go to.
+    if (inputs.size() > 1 || !manifest.empty()) {
+        if (run || interpret) {
+            std::cerr << "--run and --interp take a single input file" << std::endl;
+            return EXIT_FAILURE;
+        }
+        struct stat info {};
+        if (!outputPath.empty() && (::stat(outputPath.c_str(), &info) != 0 || !S_ISDIR(info.st_mode))) {
+            std::cerr << "-o must name a directory when compiling several files" << std::endl;
+            return EXIT_FAILURE;
+        }
 
-    CodeGenerator codeGenerator;
-    codeGenerator.generateCode(AST);
+        std::vector<BatchFile> files;
+        for (const std::string& input : inputs) {
+            files.push_back({input, batchOutputPath(options, input, outputPath)});
+        }
+        if (!manifest.empty() && !readManifest(manifest, options, outputPath, files)) {
+            return EXIT_FAILURE;
+        }
+        std::unordered_map<std::string, const std::string*> writers;
+        for (const BatchFile& file : files) {
+            auto [it, added] = writers.emplace(file.output, &file.input);
+            if (!added) {
+                std::cerr << *it->second << " and " << file.input << " would both be written to " << file.output
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (statsText || statsJson) {
+            stats.resize(files.size());
+            for (const BatchFile& file : files) {
+                statsFiles.push_back(file.input);
+            }
+        }
+        int status = compileBatch(options, files, jobs, stats);
+        if (!printStats(stats, statsFiles, statsText, statsJson, statsJsonPath, true)) {
+            return EXIT_FAILURE;
+        }
+        if (cacheStats) {
+            CompileCache(options.cacheDirectory, options.cacheLimit).printStats();
+        }
+        return status;
+    }
+
+    if (outputPath.empty()) {
+        outputPath = options.link                              ? "out"
+                     : options.format == OutputFormat::Assembly ? "out.asm"
+                     : options.format == OutputFormat::Ir       ? "out.ir"
+                                                                : "out.o";
+    }
+
+    if (statsText || statsJson) {
+        stats.resize(1);
+        statsFiles.push_back(inputs[0]);
+    }
+    CompileStats* fileStats = stats.empty() ? nullptr : &stats[0];
+    try {
+        if (interpret) {
+            interpretFile(inputs[0], interpreterReport, fileStats);
+        } else {
+            compileFile(options, inputs[0], outputPath, fileStats);
+        }
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!printStats(stats, statsFiles, statsText, statsJson, statsJsonPath, false)) {
+        return EXIT_FAILURE;
+    }
+
+    if (cacheStats) {
+        CompileCache(options.cacheDirectory, options.cacheLimit).printStats();
+    }
 
     return 0;
-}
\ No newline at end of file
+}
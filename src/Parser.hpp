@@ -2,83 +2,148 @@
 #define PARSER_HPP
 
 #include <iostream>
+#include <optional>
 #include <utility>
 #include <vector>
-#include "Tokenizer.hpp"
+#include "CompileError.hpp"
+#include "Arena.hpp"
+#include "TokenStream.hpp"
 #include "Visitor.hpp"
 
+enum class NodeKind : uint8_t {
+    Program,
+    BinaryOp,
+    Number,
+    Identifier,
+    String,
+    Declaration,
+    Assignment,
+    Comparison,
+    IfStatement,
+    ForLoop,
+    Print,
+    Increment,
+    ArrayDeclaration,
+    Element,
+    ElementAssignment,
+};
+
+enum class Operator : uint8_t {
+    None,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Equal,
+    NotEqual,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+    Increment,
+    Decrement,
+};
+
+constexpr Operator operatorFor(TokenType type) {
+    switch (type) {
+        case TokenType::PLUS: return Operator::Add;
+        case TokenType::MINUS: return Operator::Subtract;
+        case TokenType::STAR: return Operator::Multiply;
+        case TokenType::DIVIDE: return Operator::Divide;
+        case TokenType::EQEQ: return Operator::Equal;
+        case TokenType::NOTEQ: return Operator::NotEqual;
+        case TokenType::LT: return Operator::Less;
+        case TokenType::LTEQ: return Operator::LessEqual;
+        case TokenType::GT: return Operator::Greater;
+        case TokenType::GTEQ: return Operator::GreaterEqual;
+        case TokenType::INCVALUE: return Operator::Increment;
+        case TokenType::DECVALUE: return Operator::Decrement;
+        default: return Operator::None;
+    }
+}
+
+constexpr std::string_view operatorText(Operator op) {
+    switch (op) {
+        case Operator::Add: return "+";
+        case Operator::Subtract: return "-";
+        case Operator::Multiply: return "*";
+        case Operator::Divide: return "/";
+        case Operator::Equal: return "==";
+        case Operator::NotEqual: return "!=";
+        case Operator::Less: return "<";
+        case Operator::LessEqual: return "<=";
+        case Operator::Greater: return ">";
+        case Operator::GreaterEqual: return ">=";
+        case Operator::Increment: return "++";
+        case Operator::Decrement: return "--";
+        default: return "";
+    }
+}
+
+struct FlatAst;
+
+// AST nodes are allocated in the compilation's Arena and never destroyed one by
+// one, so they must stay trivially destructible. They carry no vtable: the kind
+// tag says which concrete node this is, and dispatch() below switches on it.
 struct AstNode {
-    virtual void accept(Visitor* visitor) = 0;
+    NodeKind kind;
+
+    explicit AstNode(NodeKind kind) : kind(kind) {}
+
+    // Adapter for Visitor implementations: one switch plus one virtual call.
+    void accept(Visitor* visitor);
 };
 
-struct ProgramNode : AstNode {
-    std::vector<AstNode *> statements;
+// Arena-backed, immutable list of child statements.
+struct NodeList {
+    AstNode **items{};
+    uint32_t count{};
 
-    explicit ProgramNode(const std::vector<AstNode *> &statements)
-            : statements(statements) {}
+    AstNode **begin() const { return items; }
+    AstNode **end() const { return items + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+};
 
-    ~ProgramNode() {
-        for (AstNode *statement : statements) {
-            delete statement;
-        }
-    }
+struct ProgramNode : AstNode {
+    NodeList statements;
 
-    void accept(Visitor* visitor) override {
-        visitor->visit(this);
-    }
+    explicit ProgramNode(NodeList statements)
+            : AstNode(NodeKind::Program), statements(statements) {}
 };
 
 struct BinaryOpNode : AstNode {
-    std::string op;
+    Operator op;
     AstNode *left;
     AstNode *right;
 
-    explicit BinaryOpNode(std::string op, AstNode *left, AstNode *right)
-            : op(std::move(op)), left(left), right(right){};
-
-    void accept(Visitor* visitor) override {
-        visitor->visit(this);
-    }
+    explicit BinaryOpNode(Operator op, AstNode *left, AstNode *right)
+            : AstNode(NodeKind::BinaryOp), op(op), left(left), right(right){};
 };
 
 struct NumberNode : AstNode {
     int value{};
 
-    explicit NumberNode(int value) : value(value) {}
-
-    void accept(Visitor* visitor) override {
-        visitor->visit(this);
-    }
+    explicit NumberNode(int value) : AstNode(NodeKind::Number), value(value) {}
 };
 
 struct IncrementNode : AstNode{
     AstNode* identifier{};
-    std::string value{};
-
-    explicit IncrementNode(AstNode* identifier, std::string value) : value(value),identifier(identifier) {}
+    Operator value{};
 
-    void accept(Visitor* visitor) override {
-        visitor->visit(this);
-    }
+    explicit IncrementNode(AstNode* identifier, Operator value)
+            : AstNode(NodeKind::Increment), identifier(identifier), value(value) {}
 };
 
 struct IdentifierNode : AstNode {
-    std::string name;
-
-    explicit IdentifierNode(std::string name) : name(std::move(name)) {}
+    Symbol name;
 
-    void accept(Visitor* visitor) override {
-        visitor->visit(this);
-    }
+    explicit IdentifierNode(Symbol name) : AstNode(NodeKind::Identifier), name(name) {}
 };
 
 struct StringNode : AstNode {
-    std::string name;
-    explicit StringNode(std::string name) : name(std::move(name)) {}
-
-    void accept(Visitor* visitor) override {
-        visitor->visit(this);
-    }
+    Symbol name;
+    explicit StringNode(Symbol name) : AstNode(NodeKind::String), name(name) {}
 };
 
 struct DeclarationNode : AstNode {
@@ -86,11 +151,7 @@ struct DeclarationNode : AstNode {
     AstNode *value{};
 
     explicit DeclarationNode(IdentifierNode *identifier, AstNode *value)
-            : identifier(identifier), value(value) {};
-
-    void accept(Visitor* visitor) override {
-        visitor->visit(this);
-    }
+            : AstNode(NodeKind::Declaration), identifier(identifier), value(value) {};
 };
 
 struct AssignmentNode : AstNode {
@@ -98,24 +159,16 @@ struct AssignmentNode : AstNode {
     AstNode *value{};
 
     explicit AssignmentNode(IdentifierNode *identifier, AstNode *value)
-            : identifier(identifier), value(value) {};
-
-    void accept(Visitor* visitor) override {
-        visitor->visit(this);
-    }
+            : AstNode(NodeKind::Assignment), identifier(identifier), value(value) {};
 };
 
 struct ComparisonNode : AstNode {
-    std::string op;
+    Operator op;
     AstNode *left;
     AstNode *right;
 
-    ComparisonNode(std::string op, AstNode *left, AstNode *right)
-            : op(op), left(left), right(right) {};
-
-    void accept(Visitor* visitor) override {
-        visitor->visit(this);
-    }
+    ComparisonNode(Operator op, AstNode *left, AstNode *right)
+            : AstNode(NodeKind::Comparison), op(op), left(left), right(right) {};
 };
 
 struct IfStatementNode : AstNode {
@@ -125,11 +178,7 @@ struct IfStatementNode : AstNode {
 
     explicit IfStatementNode(AstNode *condition, AstNode *trueBody,
                              AstNode *falseBody)
-            : condition(condition), trueBody(trueBody), falseBody(falseBody) {};
-
-    void accept(Visitor* visitor) override {
-        visitor->visit(this);
-    }
+            : AstNode(NodeKind::IfStatement), condition(condition), trueBody(trueBody), falseBody(falseBody) {};
 };
 
 struct ForLoopNode : AstNode {
@@ -139,39 +188,111 @@ struct ForLoopNode : AstNode {
     AstNode* body;
 
     ForLoopNode(AstNode* initialization, AstNode* condition, AstNode* increment, AstNode* body)
-            : initialization(initialization), condition(condition), increment(increment), body(body) {};
-
-    void accept(Visitor* visitor) override {
-        visitor->visit(this);
-    }
+            : AstNode(NodeKind::ForLoop), initialization(initialization), condition(condition), increment(increment),
+              body(body) {};
 };
 
 struct PrintNode : AstNode {
     AstNode* identifier;
 
-    explicit  PrintNode(AstNode *identifier) : identifier(identifier){}
+    explicit  PrintNode(AstNode *identifier) : AstNode(NodeKind::Print), identifier(identifier){}
+};
 
-    void accept(Visitor* visitor) override {
-        visitor->visit(this);
-    }
+// let name[size]; size is a literal, the elements start out zero.
+struct ArrayDeclarationNode : AstNode {
+    IdentifierNode *identifier;
+    int size;
+
+    ArrayDeclarationNode(IdentifierNode *identifier, int size)
+            : AstNode(NodeKind::ArrayDeclaration), identifier(identifier), size(size) {}
+};
+
+// name[index], read as a value.
+struct ElementNode : AstNode {
+    IdentifierNode *identifier;
+    AstNode *index;
+
+    ElementNode(IdentifierNode *identifier, AstNode *index)
+            : AstNode(NodeKind::Element), identifier(identifier), index(index) {}
+};
+
+struct ElementAssignmentNode : AstNode {
+    ElementNode *element;
+    AstNode *value;
+
+    ElementAssignmentNode(ElementNode *element, AstNode *value)
+            : AstNode(NodeKind::ElementAssignment), element(element), value(value) {}
 };
 
+// Calls handler with node cast to its concrete type. Handlers are usually
+// generic lambdas, so every per-kind call is direct and can be inlined.
+template<typename Handler>
+decltype(auto) dispatch(AstNode* node, Handler&& handler) {
+    switch (node->kind) {
+        case NodeKind::Program: return handler(static_cast<ProgramNode*>(node));
+        case NodeKind::BinaryOp: return handler(static_cast<BinaryOpNode*>(node));
+        case NodeKind::Number: return handler(static_cast<NumberNode*>(node));
+        case NodeKind::Identifier: return handler(static_cast<IdentifierNode*>(node));
+        case NodeKind::String: return handler(static_cast<StringNode*>(node));
+        case NodeKind::Declaration: return handler(static_cast<DeclarationNode*>(node));
+        case NodeKind::Assignment: return handler(static_cast<AssignmentNode*>(node));
+        case NodeKind::Comparison: return handler(static_cast<ComparisonNode*>(node));
+        case NodeKind::IfStatement: return handler(static_cast<IfStatementNode*>(node));
+        case NodeKind::ForLoop: return handler(static_cast<ForLoopNode*>(node));
+        case NodeKind::Print: return handler(static_cast<PrintNode*>(node));
+        case NodeKind::Increment: return handler(static_cast<IncrementNode*>(node));
+        case NodeKind::ArrayDeclaration: return handler(static_cast<ArrayDeclarationNode*>(node));
+        case NodeKind::Element: return handler(static_cast<ElementNode*>(node));
+        case NodeKind::ElementAssignment: return handler(static_cast<ElementAssignmentNode*>(node));
+    }
+    __builtin_unreachable();
+}
+
+inline void AstNode::accept(Visitor* visitor) {
+    dispatch(this, [visitor](auto* node) { visitor->visit(node); });
+}
+
 class Parser {
 private:
-    std::vector<Token> tokens;
-    int idx = 0;
+    TokenStream tokens;
+    StringTable& strings;
+    Arena& arena;
+    // Statements of every block still being parsed, innermost last; finished
+    // blocks are copied into the arena and popped off.
+    std::vector<AstNode *> pending {};
 
 public:
-    explicit Parser(std::vector<Token> tokens) : tokens(std::move(tokens)) {}
+    explicit Parser(std::vector<Token> tokens, StringTable& strings, Arena& arena)
+            : tokens(std::move(tokens)), strings(strings), arena(arena) {}
+
+    // Streaming mode: tokens are pulled from the tokenizer as the parser needs them.
+    explicit Parser(Tokenizer& tokenizer, StringTable& strings, Arena& arena)
+            : tokens(tokenizer), strings(strings), arena(arena) {}
+
+    template<typename T, typename... Args>
+    T *make(Args&&... args) {
+        return arena.make<T>(std::forward<Args>(args)...);
+    };
 
-    std::optional<Token> peek(int offset = 0) {
-        if (idx + offset >= tokens.size()) {
-            return std::nullopt;
+    NodeList takePending(size_t base) {
+        NodeList list{arena.copyArray(pending.data() + base, pending.size() - base),
+                      static_cast<uint32_t>(pending.size() - base)};
+        pending.resize(base);
+        return list;
+    };
+
+    std::optional<Token> peek(int offset = 0) { return tokens.peek(offset); };
+
+    // The next token, which the grammar requires to be there.
+    Token current() {
+        std::optional<Token> token = tokens.peek();
+        if (!token) {
+            compileError("Unexpected end of input");
         }
-        return tokens.at(idx + offset);
+        return *token;
     };
 
-    Token consume() { return tokens.at(idx++); };
+    Token consume() { return tokens.consume(); };
 
     bool isComparisonOp(Token token) {
         return token.type == TokenType::EQEQ || token.type == TokenType::GT ||
@@ -179,385 +300,382 @@ public:
                token.type == TokenType::LTEQ || token.type == TokenType::NOTEQ;
     };
 
-    std::vector<std::string> separateIdAndIncrementSymbols(std::string input) {
-        std::vector<std::string> separatedTokens;
-        std::string currentToken = "";
-
-        for (size_t i = 0; i < input.length(); i++) {
-
-            if (input[i] == '+' && i < input.length() - 1 && input[i + 1] == '+') {
-                if (!currentToken.empty()) {
-                    separatedTokens.push_back(currentToken);
-                    currentToken = "";
-                }
-                separatedTokens.push_back("++");
-                i++;
-            } else if (input[i] == '-' && i < input.length() - 1 && input[i + 1] == '-') {
-                if (!currentToken.empty()) {
-                    separatedTokens.push_back(currentToken);
-                    currentToken = "";
-                }
-                separatedTokens.push_back("--");
-                i++;
-            } else {
-                currentToken += input[i];
-            }
-        }
-
-        if (!currentToken.empty()) {
-            separatedTokens.push_back(currentToken);
+    AstNode *parseProgram() {
+        size_t base = pending.size();
+        while (AstNode *statement = parseNextStatement()) {
+            pending.push_back(statement);
         }
+        return make<ProgramNode>(takePending(base));
+    };
 
-        return separatedTokens;
-    }
+    // Parses the whole input into a flat AST, one statement at a time, so the
+    // pointer nodes only ever exist for the statement being flattened.
+    // Defined in FlatAst.hpp.
+    void parseProgramFlat(FlatAst& ast);
 
-    AstNode *parseProgram() {
-        std::vector<AstNode *> statements;
-        while (peek().has_value()) {
-            AstNode *statement = parseStatement();
-            if (statement) {
-                statements.push_back(statement);
-            } else {
-                std::cerr << "Invalid statement in parse program" << std::endl;
-                exit(EXIT_FAILURE);
-            }
+    // Parses one top-level statement, returning nullptr at the end of input.
+    AstNode *parseNextStatement() {
+        if (!peek().has_value()) {
+            return nullptr;
         }
-        idx = 0;
-        return new ProgramNode(statements);
+        AstNode *statement = parseStatement();
+        if (!statement) {
+            compileError("Invalid statement in parse program");
+        }
+        return statement;
     };
 
     AstNode *parseStatement() {
-        if (peek().value().type == TokenType::LET) {
+        if (current().type == TokenType::LET) {
             consume();
             return parseDeclaration();
-        } else if (peek().value().type == TokenType::IDENT) {
+        } else if (current().type == TokenType::IDENT) {
             Token identifier = consume();
             return parseAssignment(identifier);
-        } else if (peek().value().type == TokenType::IF) {
+        } else if (current().type == TokenType::IF) {
             consume();
             return parseIfStatement();
-        } else if (peek().value().type == TokenType::FOR) {
+        } else if (current().type == TokenType::FOR) {
             consume();
             return parseForLoopStatement();
-        } else if (peek().value().type == TokenType::PRINT) {
+        } else if (current().type == TokenType::PRINT) {
             consume();
             return parsePrintStatement();
         }else {
-            std::cerr << static_cast<int>(peek().value().type) << std::endl;
-            std::cerr << "Invalid statement in parse statement" << std::endl;
-            exit(EXIT_FAILURE);
+            compileError(static_cast<int>(current().type), "\nInvalid statement in parse statement");
         }
     };
 
     AstNode *parseDeclaration() {
-        if (peek().value().type != TokenType::IDENT) {
-            std::cerr << "Expected an identifier after 'let'" << std::endl;
-            exit(EXIT_FAILURE);
+        if (current().type != TokenType::IDENT) {
+            compileError("Expected an identifier after 'let'");
         }
 
-        std::string identifierName = consume().value;
+        Symbol identifierName = consume().symbol;
+        if (peek().has_value() && current().type == TokenType::OPENSQUAR) {
+            return parseArrayDeclaration(identifierName);
+        }
         AstNode *expression = nullptr;
 
-        if (peek().value().type == TokenType::EQ) {
+        if (current().type == TokenType::EQ) {
             consume();
             expression = parseExpression();
         }
 
-        if (!peek().has_value() || peek().value().type != TokenType::SEMI_COL) {
-            std::cerr << "Expected ';' after the declaration" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::SEMI_COL) {
+            compileError("Expected ';' after the declaration");
         }
         consume();
 
         if (expression) {
-            return new DeclarationNode(new IdentifierNode(identifierName), expression);
+            return make<DeclarationNode>(make<IdentifierNode>(identifierName), expression);
         } else {
-            return new DeclarationNode(new IdentifierNode(identifierName) , new NumberNode(0));
+            return make<DeclarationNode>(make<IdentifierNode>(identifierName) , make<NumberNode>(0));
         }
     };
 
+    AstNode *parseArrayDeclaration(Symbol identifierName) {
+        consume();
+        if (!peek().has_value() || current().type != TokenType::NUMBER) {
+            compileError("Expected the array size");
+        }
+        int size = consume().number;
+
+        if (!peek().has_value() || current().type != TokenType::CLOSSQUAR) {
+            compileError("Expected ']'");
+        }
+        consume();
+
+        if (!peek().has_value() || current().type != TokenType::SEMI_COL) {
+            compileError("Expected ';' after the declaration");
+        }
+        consume();
+
+        return make<ArrayDeclarationNode>(make<IdentifierNode>(identifierName), size);
+    };
+
+    // The '[' has been consumed.
+    ElementNode *parseElement(Symbol identifierName) {
+        AstNode *index = parseExpression();
+        if (!peek().has_value() || current().type != TokenType::CLOSSQUAR) {
+            compileError("Expected ']'");
+        }
+        consume();
+        return make<ElementNode>(make<IdentifierNode>(identifierName), index);
+    };
+
     AstNode *parseAssignment(Token identifier) {
-        if (!peek().has_value() || peek().value().type != TokenType::EQ) {
-            std::cerr << "Expected '='" << std::endl;
-            exit(EXIT_FAILURE);
+        ElementNode *element = nullptr;
+        if (peek().has_value() && current().type == TokenType::OPENSQUAR) {
+            consume();
+            element = parseElement(identifier.symbol);
+        }
+
+        if (!peek().has_value() || current().type != TokenType::EQ) {
+            compileError("Expected '='");
         }
         consume();
 
         AstNode *expression = parseExpression();
 
-        if (!peek().has_value() || peek().value().type != TokenType::SEMI_COL) {
-                std::cerr << "Expected ';' after the assignment" << std::endl;
-                exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::SEMI_COL) {
+                compileError("Expected ';' after the assignment");
         }
         consume();
 
-        return new AssignmentNode(new IdentifierNode(identifier.value), expression);
+        if (element) {
+            return make<ElementAssignmentNode>(element, expression);
+        }
+        return make<AssignmentNode>(make<IdentifierNode>(identifier.symbol), expression);
     };
 
     AstNode *parseExpression() {
         AstNode *left = parseTerm();
-        while (peek().has_value() && peek().value().type == TokenType::PLUS ||
-               peek().has_value() && peek().value().type == TokenType::MINUS) {
+        while (peek().has_value() && current().type == TokenType::PLUS ||
+               peek().has_value() && current().type == TokenType::MINUS) {
             Token operatorToken = consume();
             AstNode *right = parseTerm();
-            left = new BinaryOpNode(operatorToken.value, right, left);
+            left = make<BinaryOpNode>(operatorFor(operatorToken.type), left, right);
         }
         return left;
     };
 
     AstNode *parseTerm() {
         AstNode *left = parseFactor();
-        while (peek().has_value() && peek().value().type == TokenType::STAR ||
-               peek().has_value() && peek().value().type == TokenType::DIVIDE) {
+        while (peek().has_value() && current().type == TokenType::STAR ||
+               peek().has_value() && current().type == TokenType::DIVIDE) {
             Token operatorToken = consume();
             AstNode *right = parseFactor();
-            left = new BinaryOpNode(operatorToken.value, left, right);
+            left = make<BinaryOpNode>(operatorFor(operatorToken.type), left, right);
         }
         return left;
     };
 
     AstNode *parseFactor() {
-        if (peek().value().type == TokenType::NUMBER) {
-            int value = std::stoi(consume().value);
-            return new NumberNode(value);
-        } else if (peek().value().type == TokenType::STRING) {
-            std::string name = consume().value;
-            return new StringNode(name);
-        } else if (peek().value().type == TokenType::PRINT) {
+        if (current().type == TokenType::NUMBER) {
+            int value = consume().number;
+            return make<NumberNode>(value);
+        } else if (current().type == TokenType::STRING) {
+            Symbol name = consume().symbol;
+            return make<StringNode>(name);
+        } else if (current().type == TokenType::PRINT) {
             consume();
-            if (peek().value().type == TokenType::OPENPAR) {
+            if (current().type == TokenType::OPENPAR) {
                 consume();
-                AstNode* id = new IdentifierNode(consume().value);
+                AstNode* id = make<IdentifierNode>(consume().symbol);
                 consume();
-                return new PrintNode(id);
+                return make<PrintNode>(id);
             } else {
-                std::cerr << "Expected '('" << std::endl;
-                exit(EXIT_FAILURE);
+                compileError("Expected '('");
             }
-        } else if (peek().value().type == TokenType::IDENT) {
+        } else if (current().type == TokenType::IDENT) {
             Token name = consume();
-            return new IdentifierNode(name.value);
-        } else if (peek().value().type == TokenType::OPENPAR) {
+            if (peek().has_value() && current().type == TokenType::OPENSQUAR) {
+                consume();
+                return parseElement(name.symbol);
+            }
+            return make<IdentifierNode>(name.symbol);
+        } else if (current().type == TokenType::OPENPAR) {
             consume();
             AstNode *expression = parseExpression();
-            if (peek().value().type == TokenType::CLOSPAR) {
+            if (current().type == TokenType::CLOSPAR) {
                 consume();
                 return expression;
             } else {
-                std::cerr << "Expected ')'" << std::endl;
-                exit(EXIT_FAILURE);
+                compileError("Expected ')'");
             }
         } else {
-            std::cerr << "Unexpected token in factor: type -> "
-                      << static_cast<int>(peek().value().type) << std::endl;
-            exit(EXIT_FAILURE);
+            compileError("Unexpected token in factor: type -> ", static_cast<int>(current().type));
         }
     };
 
     AstNode *parseComparison() {
         AstNode *left = parseExpression();
-        while (peek().has_value() && isComparisonOp(peek().value())) {
+        while (peek().has_value() && isComparisonOp(current())) {
             Token operatorToken = consume();
             AstNode *right = parseExpression();
-            left = new ComparisonNode(operatorToken.value, left, right);
+            left = make<ComparisonNode>(operatorFor(operatorToken.type), left, right);
         }
         return left;
     };
 
     AstNode *parseIfStatement() {
-        if (!peek().has_value() || peek().value().type != TokenType::OPENPAR) {
-            std::cerr << "Expected '('" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::OPENPAR) {
+            compileError("Expected '('");
         }
         consume();
 
         AstNode* left;
-        if (peek().value().type == TokenType::IDENT) {
-            left = new IdentifierNode(consume().value);
-        } else if (peek().value().type == TokenType::NUMBER) {
-            left = new NumberNode(std::stoi(consume().value));
+        if (current().type == TokenType::IDENT) {
+            left = make<IdentifierNode>(consume().symbol);
+        } else if (current().type == TokenType::NUMBER) {
+            left = make<NumberNode>(consume().number);
         } else {
-            std::cerr << "Invalid condition in 'if'" << std::endl;
-            exit(EXIT_FAILURE);
+            compileError("Invalid condition in 'if'");
         }
 
-        if (!peek().has_value() || !isComparisonOp(peek().value())) {
-            std::cerr << "Expected a comparison operator in 'if'" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || !isComparisonOp(current())) {
+            compileError("Expected a comparison operator in 'if'");
         }
 
         Token compOp = consume();
 
         AstNode* right;
-        if (peek().value().type == TokenType::IDENT) {
-            right = new IdentifierNode(consume().value);
-        } else if (peek().value().type == TokenType::NUMBER) {
-            right = new NumberNode(std::stoi(consume().value));
+        if (current().type == TokenType::IDENT) {
+            right = make<IdentifierNode>(consume().symbol);
+        } else if (current().type == TokenType::NUMBER) {
+            right = make<NumberNode>(consume().number);
         } else {
-            std::cerr << "Invalid condition in 'if'" << std::endl;
-            exit(EXIT_FAILURE);
+            compileError("Invalid condition in 'if'");
         }
 
-        AstNode *condition = new ComparisonNode(compOp.value, left, right);
+        AstNode *condition = make<ComparisonNode>(operatorFor(compOp.type), left, right);
         AstNode *trueBody = nullptr;
         AstNode *falseBody = nullptr;
 
-        if (!peek().has_value() || peek().value().type != TokenType::CLOSPAR) {
-            std::cerr << "Expected ')'" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::CLOSPAR) {
+            compileError("Expected ')'");
         }
         consume();
 
-        if (!peek().has_value() || peek().value().type != TokenType::OPENCURL) {
-            std::cerr << "Expected '{' " << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::OPENCURL) {
+            compileError("Expected '{' ");
         }
         consume();
 
-        if (peek().has_value() && peek().value().type != TokenType::CLOSCURL) {
+        if (peek().has_value() && current().type != TokenType::CLOSCURL) {
             trueBody = parseIfElseProgram();
         }else{
-            std::cerr << "Expected expression" << std::endl;
-            exit(EXIT_FAILURE);
+            compileError("Expected expression");
         };
 
-        if (peek().has_value() && peek().value().type == TokenType::ELSE) {
+        if (peek().has_value() && current().type == TokenType::ELSE) {
             consume();
-            if (!peek().has_value() || peek().value().type != TokenType::OPENCURL) {
-                std::cerr << "Expected '{'" << std::endl;
-                exit(EXIT_FAILURE);
+            if (!peek().has_value() || current().type != TokenType::OPENCURL) {
+                compileError("Expected '{'");
             }
             consume();
 
-            if (peek().has_value() && peek().value().type != TokenType::CLOSCURL) {
+            if (peek().has_value() && current().type != TokenType::CLOSCURL) {
                 falseBody = parseIfElseProgram();
             }else{
-                std::cerr << "Expected expression" << std::endl;
-                exit(EXIT_FAILURE);
+                compileError("Expected expression");
             };
 
         }
 
 
-        if (!peek().has_value() || peek().value().type != TokenType::SEMI_COL) {
-            std::cerr << "Expected ';'" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::SEMI_COL) {
+            compileError("Expected ';'");
         }
         consume();
 
-        return new IfStatementNode(condition, trueBody, falseBody);
+        return make<IfStatementNode>(condition, trueBody, falseBody);
     };
 
     AstNode *parseIfElseProgram() {
-        std::vector<AstNode *> statements;
-        while (peek().has_value() && peek().value().type != TokenType::CLOSCURL) {
+        size_t base = pending.size();
+        while (peek().has_value() && current().type != TokenType::CLOSCURL) {
             AstNode *statement = parseStatement();
             if (statement) {
-                statements.push_back(statement);
+                pending.push_back(statement);
             } else {
-                std::cerr << "Invalid statement in parse if program" << std::endl;
-                exit(EXIT_FAILURE);
+                compileError("Invalid statement in parse if program");
             }
         }
         consume();
-        return new ProgramNode(statements);
+        return make<ProgramNode>(takePending(base));
     };
 
     AstNode *parsePrintStatement(){
-        if (!peek().has_value() || peek().value().type != TokenType::OPENPAR) {
-            std::cerr << "Expected '('" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::OPENPAR) {
+            compileError("Expected '('");
         }
         consume();
 
-        if (!peek().has_value() || peek().value().type != TokenType::IDENT) {
-            std::cerr << "Expected an identifier" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::IDENT) {
+            compileError("Expected an identifier");
         }
 
-        IdentifierNode *identifierNode = new IdentifierNode(consume().value);
+        AstNode *identifierNode = make<IdentifierNode>(consume().symbol);
+        if (peek().has_value() && current().type == TokenType::OPENSQUAR) {
+            consume();
+            identifierNode = parseElement(static_cast<IdentifierNode*>(identifierNode)->name);
+        }
 
-        if (!peek().has_value() || peek().value().type != TokenType::CLOSPAR) {
-            std::cerr << "Expected ')'" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::CLOSPAR) {
+            compileError("Expected ')'");
         }
         consume();
 
-        if (!peek().has_value() || peek().value().type != TokenType::SEMI_COL) {
-            std::cerr << "Expected ';'" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::SEMI_COL) {
+            compileError("Expected ';'");
         }
         consume();
 
-        return new PrintNode(identifierNode);
+        return make<PrintNode>(identifierNode);
     };
 
     AstNode *parseLoopProgram() {
-        std::vector<AstNode *> statements;
-        while (peek().has_value() && peek().value().type != TokenType::CLOSCURL) {
+        size_t base = pending.size();
+        while (peek().has_value() && current().type != TokenType::CLOSCURL) {
             AstNode *statement = parseStatement();
             if (statement) {
-                statements.push_back(statement);
+                pending.push_back(statement);
             } else {
-                std::cerr << "Invalid statement in parse if program" << std::endl;
-                exit(EXIT_FAILURE);
+                compileError("Invalid statement in parse if program");
             }
         }
         consume();
-        return new ProgramNode(statements);
+        return make<ProgramNode>(takePending(base));
     };
 
     AstNode *parseIncrement(){
-        std::vector<std::string> increment = separateIdAndIncrementSymbols(consume().value);
-        if (!std::isalnum(increment.at(0)[0])){
-            std::cerr << "Expected an identifier" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() ||
+            (current().type != TokenType::INCVALUE && current().type != TokenType::DECVALUE)){
+            compileError("Expected an identifier");
         };
-        return new IncrementNode(new IdentifierNode(increment.at(0)),increment.at(1));
+        Token increment = consume();
+        return make<IncrementNode>(make<IdentifierNode>(increment.symbol), operatorFor(increment.type));
     };
 
     AstNode *parseForLoopStatement(){
-        if (!peek().has_value() || peek().value().type != TokenType::OPENPAR) {
-            std::cerr << "Expected '('" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::OPENPAR) {
+            compileError("Expected '('");
         }
         consume();
 
         AstNode* initialization = parseAssignment(consume());
         AstNode* condition = parseComparison();
 
-        if (!peek().has_value() || peek().value().type != TokenType::SEMI_COL) {
-            std::cerr << "Expected ';'" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::SEMI_COL) {
+            compileError("Expected ';'");
         }
         consume();
 
         AstNode* incrementNode = parseIncrement();
 
-        if (!peek().has_value() || peek().value().type != TokenType::CLOSPAR) {
-            std::cerr << "Expected ')'" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::CLOSPAR) {
+            compileError("Expected ')'");
         }
         consume();
 
-        if (!peek().has_value() || peek().value().type != TokenType::OPENCURL) {
-            std::cerr << "Expected '{'" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::OPENCURL) {
+            compileError("Expected '{'");
         }
         consume();
 
         AstNode* body = nullptr;
-        if (peek().has_value() && peek().value().type != TokenType::CLOSCURL) {
+        if (peek().has_value() && current().type != TokenType::CLOSCURL) {
             body = parseLoopProgram();
         };
 
-        if (!peek().has_value() || peek().value().type != TokenType::SEMI_COL) {
-            std::cerr << "Expected ';'" << std::endl;
-            exit(EXIT_FAILURE);
+        if (!peek().has_value() || current().type != TokenType::SEMI_COL) {
+            compileError("Expected ';'");
         }
         consume();
 
-        return new ForLoopNode(initialization,condition, incrementNode,body);
+        return make<ForLoopNode>(initialization,condition, incrementNode,body);
     };
 
 
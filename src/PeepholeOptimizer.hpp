@@ -0,0 +1,318 @@
+#ifndef PEEPHOLE_OPTIMIZER_HPP
+#define PEEPHOLE_OPTIMIZER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "Assembly.hpp"
+
+// Local clean-ups over one region of machine code, looking at a few
+// neighbouring instructions at a time.
+//
+// Before register allocation, a constant moved into a temporary only to be
+// compared is folded into the cmp itself (the comparison is mirrored so
+// the immediate ends up on the right).
+//
+// After allocation:
+// - a jump to a label whose first instruction is another jmp is threaded
+//   straight to the final target;
+// - jcc L1 / jmp L2 / L1: becomes a single inverted jcc L2;
+// - a jmp to a label bound right after it is removed, as is code after an
+//   unconditional jmp that no label leads to;
+// - a load of a value a register is already known to hold, from a store or
+//   load a few instructions up, is removed, and so is a store overwritten
+//   a few instructions later before anything reads it;
+// - labels nothing jumps to any more are dropped.
+//
+// Every region is self-contained: all jumps stay within it.
+class PeepholeOptimizer {
+private:
+    // How far back a reload looks for the store or load that makes it redundant.
+    static constexpr size_t reloadWindow = 8;
+
+    size_t removedCount = 0;
+    size_t examinedCount = 0;
+
+    std::unordered_map<LabelId, uint32_t> labelPosition {};
+    std::vector<uint32_t> references {};
+    LabelId firstLabel = 0;
+    std::vector<Instruction> kept {};
+
+    static bool isJump(Opcode op) { return op >= Opcode::Jmp; }
+
+    static bool isConditional(Opcode op) { return op > Opcode::Jmp; }
+
+    // Where the windows below stop looking: control may enter or leave, or
+    // the instruction touches registers and memory it does not name. Vector
+    // instructions read and write whole runs of an array.
+    static bool isBarrier(Opcode op) {
+        return op == Opcode::Label || op == Opcode::Call || op == Opcode::Int || op == Opcode::Syscall ||
+               op == Opcode::Ret || op == Opcode::RepMovsb || isVectorOpcode(op) || isJump(op);
+    }
+
+    static LabelId target(const Instruction& instruction) { return static_cast<LabelId>(instruction.dst.value); }
+
+    static Opcode inverse(Opcode jump) {
+        switch (jump) {
+            case Opcode::Je: return Opcode::Jne;
+            case Opcode::Jne: return Opcode::Je;
+            case Opcode::Jl: return Opcode::Jge;
+            case Opcode::Jge: return Opcode::Jl;
+            case Opcode::Jg: return Opcode::Jle;
+            case Opcode::Jle: return Opcode::Jg;
+            default: return jump;
+        }
+    }
+
+    // The jump that tests b op a, given the one that tests a op b.
+    static Opcode mirror(Opcode jump) {
+        switch (jump) {
+            case Opcode::Jl: return Opcode::Jg;
+            case Opcode::Jg: return Opcode::Jl;
+            case Opcode::Jle: return Opcode::Jge;
+            case Opcode::Jge: return Opcode::Jle;
+            default: return jump;
+        }
+    }
+
+    // Whether executing instruction may change what operand holds. A store
+    // to an element of an array may be to any element of it.
+    static bool writes(const Instruction& instruction, const Operand& operand) {
+        if (instruction.dst.kind == OperandKind::Element && operand.isMemory() &&
+            operand.symbol == instruction.dst.symbol) {
+            return true;
+        }
+        switch (instruction.op) {
+            case Opcode::Mov:
+            case Opcode::Add:
+            case Opcode::Sub:
+            case Opcode::Imul:
+            case Opcode::Pop:
+            case Opcode::Neg:
+            case Opcode::Shr:
+                return instruction.dst == operand;
+            case Opcode::Cdq:
+            case Opcode::Idiv:
+            case Opcode::Mul:
+                return operand.kind == OperandKind::Register &&
+                       (operand.reg == Reg::Eax || operand.reg == Reg::Edx);
+            default:
+                return false;
+        }
+    }
+
+    void indexLabels(const std::vector<Instruction>& code) {
+        labelPosition.clear();
+        for (uint32_t i = 0; i < code.size(); i++) {
+            if (code[i].op == Opcode::Label) {
+                labelPosition[target(code[i])] = i;
+            }
+        }
+    }
+
+    // The first real instruction at or after position, skipping labels.
+    static size_t skipLabels(const std::vector<Instruction>& code, size_t position) {
+        while (position < code.size() && code[position].op == Opcode::Label) {
+            position++;
+        }
+        return position;
+    }
+
+    bool labelFollows(const std::vector<Instruction>& code, size_t position, LabelId label) {
+        for (; position < code.size() && code[position].op == Opcode::Label; position++) {
+            if (target(code[position]) == label) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool threadJumps(std::vector<Instruction>& code) {
+        bool changed = false;
+        for (Instruction& instruction : code) {
+            if (!isJump(instruction.op)) {
+                continue;
+            }
+            // Follow a chain of jmps, at most as long as the region, so a
+            // cycle of jumps cannot loop forever.
+            LabelId label = target(instruction);
+            for (size_t hops = 0; hops < code.size(); hops++) {
+                auto it = labelPosition.find(label);
+                if (it == labelPosition.end()) {
+                    break;
+                }
+                size_t next = skipLabels(code, it->second);
+                if (next == code.size() || code[next].op != Opcode::Jmp || target(code[next]) == label) {
+                    break;
+                }
+                label = target(code[next]);
+            }
+            if (label != target(instruction)) {
+                instruction.dst = Operand::ofLabel(label);
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    bool isRedundantReload(const std::vector<Instruction>& code, size_t position) {
+        const Instruction& load = code[position];
+        if (load.op != Opcode::Mov || load.dst.kind != OperandKind::Register ||
+            load.src.kind != OperandKind::Memory) {
+            return false;
+        }
+        size_t limit = position > reloadWindow ? position - reloadWindow : 0;
+        for (size_t i = position; i-- > limit;) {
+            const Instruction& earlier = code[i];
+            if (isBarrier(earlier.op)) {
+                return false;
+            }
+            if (earlier.op == Opcode::Mov &&
+                ((earlier.dst == load.src && earlier.src == load.dst) ||
+                 (earlier.dst == load.dst && earlier.src == load.src))) {
+                return true;
+            }
+            if (writes(earlier, load.dst) || writes(earlier, load.src)) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    static bool mentions(const Operand& operand, Symbol symbol) {
+        return operand.isMemory() && operand.symbol == symbol;
+    }
+
+    // A store to memory that is overwritten a few instructions later, with
+    // nothing reading it in between.
+    bool isDeadStore(const std::vector<Instruction>& code, size_t position) {
+        const Instruction& store = code[position];
+        if (store.op != Opcode::Mov || store.dst.kind != OperandKind::Memory) {
+            return false;
+        }
+        size_t limit = std::min(code.size(), position + 1 + reloadWindow);
+        for (size_t i = position + 1; i < limit; i++) {
+            const Instruction& later = code[i];
+            if (isBarrier(later.op)) {
+                return false;
+            }
+            if (mentions(later.src, store.dst.symbol)) {
+                return false;
+            }
+            if (later.op == Opcode::Mov && later.dst == store.dst) {
+                return true;
+            }
+            if (mentions(later.dst, store.dst.symbol)) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // One sweep of the removal rules; returns whether anything changed.
+    bool sweep(std::vector<Instruction>& code) {
+        indexLabels(code);
+        bool changed = threadJumps(code);
+
+        // Label ids grow over the whole program; count references relative
+        // to the first one this region uses.
+        firstLabel = UINT32_MAX;
+        LabelId lastLabel = 0;
+        for (const Instruction& instruction : code) {
+            if (instruction.op == Opcode::Label || isJump(instruction.op)) {
+                firstLabel = std::min(firstLabel, target(instruction));
+                lastLabel = std::max(lastLabel, target(instruction));
+            }
+        }
+        references.assign(firstLabel == UINT32_MAX ? 0 : lastLabel - firstLabel + 1, 0);
+        for (const Instruction& instruction : code) {
+            if (isJump(instruction.op)) {
+                references[target(instruction) - firstLabel]++;
+            }
+        }
+        auto referenced = [this](LabelId label) { return references[label - firstLabel] > 0; };
+
+        kept.clear();
+        bool reachable = true;
+        for (size_t i = 0; i < code.size(); i++) {
+            const Instruction& instruction = code[i];
+            if (instruction.op == Opcode::Label) {
+                if (referenced(target(instruction))) {
+                    kept.push_back(instruction);
+                    reachable = true;
+                }
+                continue;
+            }
+            bool remove = !reachable;
+            if (!remove && instruction.op == Opcode::Jmp) {
+                remove = labelFollows(code, i + 1, target(instruction));
+            } else if (!remove && isConditional(instruction.op) && i + 1 < code.size() &&
+                       code[i + 1].op == Opcode::Jmp && labelFollows(code, i + 2, target(instruction))) {
+                // jcc L1 / jmp L2 / L1:  ->  j!cc L2 / L1:
+                references[target(instruction) - firstLabel]--;
+                kept.push_back({inverse(instruction.op), code[i + 1].dst});
+                removedCount++;
+                changed = true;
+                i++;
+                continue;
+            } else if (!remove) {
+                remove = isRedundantReload(code, i) || isDeadStore(code, i);
+            }
+            if (remove) {
+                if (isJump(instruction.op)) references[target(instruction) - firstLabel]--;
+                removedCount++;
+                changed = true;
+                continue;
+            }
+            kept.push_back(instruction);
+            if (instruction.op == Opcode::Jmp) {
+                reachable = false;
+            }
+        }
+        code.swap(kept);
+        return changed;
+    }
+
+public:
+    // Runs on virtual registers, which are each defined once by the
+    // selector: mov vN, imm / cmp vN, x / jcc  ->  cmp x, imm / mirrored jcc.
+    void foldCompares(std::vector<Instruction>& code, uint32_t virtualCount) {
+        std::vector<uint32_t> uses(virtualCount, 0);
+        for (const Instruction& instruction : code) {
+            examinedCount += instruction.op != Opcode::Label;
+            for (const Operand* operand : {&instruction.dst, &instruction.src}) {
+                if (operand->kind == OperandKind::Virtual) uses[operand->value]++;
+            }
+        }
+        kept.clear();
+        for (size_t i = 0; i < code.size(); i++) {
+            const Instruction& move = code[i];
+            if (i + 2 < code.size() && move.op == Opcode::Mov && move.dst.kind == OperandKind::Virtual &&
+                move.src.kind == OperandKind::Immediate && uses[move.dst.value] == 2 &&
+                code[i + 1].op == Opcode::Cmp && code[i + 1].dst == move.dst &&
+                code[i + 1].src.kind != OperandKind::Immediate && isConditional(code[i + 2].op)) {
+                kept.push_back({Opcode::Cmp, code[i + 1].src, move.src});
+                kept.push_back({mirror(code[i + 2].op), code[i + 2].dst});
+                removedCount++;
+                i += 2;
+                continue;
+            }
+            kept.push_back(move);
+        }
+        code.swap(kept);
+    }
+
+    // Runs on allocated code until no rule applies any more.
+    void optimize(std::vector<Instruction>& code) {
+        while (sweep(code)) {
+        }
+    }
+
+    // Instructions removed so far, out of the total handed to foldCompares.
+    size_t removed() const { return removedCount; }
+
+    size_t examined() const { return examinedCount; }
+};
+
+#endif
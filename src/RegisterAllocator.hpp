@@ -0,0 +1,405 @@
+#ifndef REGISTER_ALLOCATOR_HPP
+#define REGISTER_ALLOCATOR_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Assembly.hpp"
+#include "StringTable.hpp"
+
+// Linear-scan register allocation over one region of code: the
+// instructions of a single top-level statement, which never jumps outside
+// itself.
+//
+// InstructionSelector produces every SSA value that is not a constant or a
+// plain variable read as a Virtual operand, including the values variables
+// take inside loops. Liveness is computed over the region's basic blocks and
+// turned into one interval per virtual register.
+// The intervals are then assigned to registers in order of their start:
+// ecx, ebx, esi, edi and ebp on x86, and on x86-64 those plus r8 to r15.
+//
+// eax and edx are never allocated: idiv and cdq use them, and eax is the
+// scratch register for fixing up memory-to-memory forms. On x86 the
+// runtime's print routines clobber nothing else, so calls need no special
+// care. On x86-64 they follow the SysV convention, so an interval live
+// across a call only gets a callee-saved register. Anything that does not
+// fit is spilled to a spill_N slot in .data. An array index that ends up
+// spilled is reloaded into edx where it is used.
+class RegisterAllocator {
+private:
+    struct Interval {
+        uint32_t start = UINT32_MAX;
+        uint32_t end = 0;
+        uint32_t references = 0;
+        bool crossesCall = false;
+    };
+
+    struct Block {
+        uint32_t begin;
+        uint32_t end;
+        std::vector<uint32_t> successors;
+    };
+
+    using Bits = std::vector<uint64_t>;
+
+    // Caller-saved registers come first, for intervals no call interrupts.
+    static constexpr Reg callerSaved64[] = {Reg::Ecx, Reg::Esi, Reg::Edi, Reg::R8,
+                                            Reg::R9, Reg::R10, Reg::R11};
+    static constexpr Reg calleeSaved64[] = {Reg::Ebx, Reg::Ebp, Reg::R12, Reg::R13, Reg::R14, Reg::R15};
+    static constexpr Reg calleeSaved32[] = {Reg::Ecx, Reg::Ebx, Reg::Esi, Reg::Edi, Reg::Ebp};
+    static constexpr int registerCount = 16;
+
+    StringTable& strings;
+    std::vector<Reg> callerSaved {};
+    std::vector<Reg> calleeSaved {};
+    std::vector<Symbol> spillSlots {};
+    size_t spilledCount = 0;
+
+    // Scratch reused from region to region.
+    std::vector<Interval> intervals {};
+    std::vector<uint32_t> order {};
+    std::vector<uint32_t> active {};
+    std::vector<uint32_t> calls {};
+    std::vector<Operand> assignment {};
+    std::vector<Instruction> rewritten {};
+
+    static bool test(const Bits& bits, uint32_t index) { return bits[index / 64] >> (index % 64) & 1; }
+
+    static void set(Bits& bits, uint32_t index) { bits[index / 64] |= uint64_t(1) << (index % 64); }
+
+    static void reset(Bits& bits, uint32_t index) { bits[index / 64] &= ~(uint64_t(1) << (index % 64)); }
+
+    static bool isJump(Opcode op) { return op >= Opcode::Jmp; }
+
+    // Reports the virtual registers an instruction reads and writes.
+    template<typename Use, typename Def>
+    static void forEachAccess(const Instruction& instruction, Use&& use, Def&& def) {
+        auto read = [&use](const Operand& operand) {
+            if (operand.kind == OperandKind::Virtual) use(static_cast<uint32_t>(operand.value));
+        };
+        auto write = [&def](const Operand& operand) {
+            if (operand.kind == OperandKind::Virtual) def(static_cast<uint32_t>(operand.value));
+        };
+        // An element operand reads its index wherever it appears.
+        for (const Operand* operand : {&instruction.dst, &instruction.src}) {
+            if (operand->kind == OperandKind::VirtualElement) use(static_cast<uint32_t>(operand->value));
+        }
+        switch (instruction.op) {
+            case Opcode::Movd:
+            case Opcode::Vmovd:
+                read(instruction.src);
+                break;
+            case Opcode::Mov:
+                read(instruction.src);
+                write(instruction.dst);
+                break;
+            case Opcode::Add:
+            case Opcode::Sub:
+            case Opcode::Imul:
+                read(instruction.src);
+                read(instruction.dst);
+                write(instruction.dst);
+                break;
+            case Opcode::Cmp:
+                read(instruction.dst);
+                read(instruction.src);
+                break;
+            case Opcode::Push:
+            case Opcode::Idiv:
+                read(instruction.dst);
+                break;
+            case Opcode::Pop:
+                write(instruction.dst);
+                break;
+            default:
+                break;
+        }
+    }
+
+    Symbol spillSlot(size_t index) {
+        while (spillSlots.size() <= index) {
+            spillSlots.push_back(strings.internCopy("spill_" + std::to_string(spillSlots.size())));
+        }
+        return spillSlots[index];
+    }
+
+    static std::vector<Block> buildBlocks(const std::vector<Instruction>& code) {
+        std::vector<Block> blocks;
+        std::unordered_map<LabelId, uint32_t> labelBlock;
+        uint32_t begin = 0;
+        for (uint32_t i = 0; i <= code.size(); i++) {
+            bool boundary = i == code.size() || code[i].op == Opcode::Label || (i > 0 && isJump(code[i - 1].op));
+            if (boundary && i > begin) {
+                blocks.push_back({begin, i, {}});
+                begin = i;
+            }
+            if (i < code.size() && code[i].op == Opcode::Label) {
+                labelBlock[static_cast<LabelId>(code[i].dst.value)] = static_cast<uint32_t>(blocks.size());
+            }
+        }
+        for (uint32_t b = 0; b < blocks.size(); b++) {
+            const Instruction& last = code[blocks[b].end - 1];
+            if (isJump(last.op)) {
+                auto it = labelBlock.find(static_cast<LabelId>(last.dst.value));
+                if (it != labelBlock.end()) {
+                    blocks[b].successors.push_back(it->second);
+                }
+            }
+            if (last.op != Opcode::Jmp && b + 1 < blocks.size()) {
+                blocks[b].successors.push_back(b + 1);
+            }
+        }
+        return blocks;
+    }
+
+    // Straight-line code: an interval runs from the first to the last access.
+    void buildStraightIntervals(const std::vector<Instruction>& code, uint32_t virtualCount) {
+        intervals.assign(virtualCount, Interval {});
+        for (uint32_t i = 0; i < code.size(); i++) {
+            auto touch = [this, i](uint32_t v) {
+                intervals[v].start = std::min(intervals[v].start, i);
+                intervals[v].end = i;
+                intervals[v].references++;
+            };
+            forEachAccess(code[i], touch, touch);
+        }
+    }
+
+    // Backward data-flow liveness, then one conservative interval per
+    // virtual register covering every position where it is live.
+    void buildIntervals(const std::vector<Instruction>& code, uint32_t virtualCount) {
+        std::vector<Block> blocks = buildBlocks(code);
+        size_t words = (virtualCount + 63) / 64;
+        std::vector<Bits> uses(blocks.size(), Bits(words)), defs(blocks.size(), Bits(words));
+        std::vector<Bits> liveIn(blocks.size(), Bits(words)), liveOut(blocks.size(), Bits(words));
+
+        for (size_t b = 0; b < blocks.size(); b++) {
+            for (uint32_t i = blocks[b].begin; i < blocks[b].end; i++) {
+                forEachAccess(code[i],
+                              [&](uint32_t v) { if (!test(defs[b], v)) set(uses[b], v); },
+                              [&](uint32_t v) { set(defs[b], v); });
+            }
+        }
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t b = blocks.size(); b-- > 0;) {
+                Bits out(words);
+                for (uint32_t successor : blocks[b].successors) {
+                    for (size_t w = 0; w < words; w++) out[w] |= liveIn[successor][w];
+                }
+                Bits in(words);
+                for (size_t w = 0; w < words; w++) in[w] = uses[b][w] | (out[w] & ~defs[b][w]);
+                if (in != liveIn[b] || out != liveOut[b]) {
+                    liveIn[b] = std::move(in);
+                    liveOut[b] = std::move(out);
+                    changed = true;
+                }
+            }
+        }
+
+        intervals.assign(virtualCount, Interval {});
+        auto cover = [this](uint32_t v, uint32_t position) {
+            intervals[v].start = std::min(intervals[v].start, position);
+            intervals[v].end = std::max(intervals[v].end, position);
+        };
+        auto coverAll = [&](const Bits& live, uint32_t position) {
+            for (size_t w = 0; w < words; w++) {
+                for (uint64_t bits = live[w]; bits; bits &= bits - 1) {
+                    cover(static_cast<uint32_t>(w * 64 + __builtin_ctzll(bits)), position);
+                }
+            }
+        };
+
+        for (size_t b = 0; b < blocks.size(); b++) {
+            Bits live = liveOut[b];
+            coverAll(live, blocks[b].end - 1);
+            for (uint32_t i = blocks[b].end; i-- > blocks[b].begin;) {
+                forEachAccess(code[i], [](uint32_t) {}, [&](uint32_t v) { reset(live, v); cover(v, i); });
+                forEachAccess(code[i], [&](uint32_t v) { set(live, v); }, [](uint32_t) {});
+                forEachAccess(code[i], [&](uint32_t v) { intervals[v].references++; },
+                              [&](uint32_t v) { intervals[v].references++; });
+                coverAll(live, i);
+            }
+            coverAll(liveIn[b], blocks[b].begin);
+        }
+    }
+
+    // The index of a spilled element operand is loaded into edx first,
+    // which only cdq and idiv use otherwise.
+    static Operand rewrite(const Operand& operand, const std::vector<Operand>& assignment,
+                           std::vector<Instruction>& out) {
+        if (operand.kind == OperandKind::VirtualElement) {
+            Operand index = assignment[operand.value];
+            if (index.kind != OperandKind::Register) {
+                out.push_back({Opcode::Mov, Operand::ofRegister(Reg::Edx), index});
+                return Operand::ofElement(operand.symbol, Reg::Edx);
+            }
+            return Operand::ofElement(operand.symbol, index.reg);
+        }
+        if (operand.kind != OperandKind::Virtual) {
+            return operand;
+        }
+        return assignment[operand.value];
+    }
+
+    // Fixes forms x86 cannot encode once spilled operands have turned into
+    // memory: two memory operands, or imul into memory.
+    static void legalize(const Instruction& instruction, std::vector<Instruction>& out) {
+        Operand eax = Operand::ofRegister(Reg::Eax);
+        bool dstMemory = instruction.dst.isMemory();
+        bool srcMemory = instruction.src.isMemory();
+
+        if (instruction.op == Opcode::Mov && instruction.dst == instruction.src) {
+            return;
+        }
+        if (instruction.op == Opcode::Imul && dstMemory) {
+            out.push_back({Opcode::Mov, eax, instruction.dst});
+            out.push_back({Opcode::Imul, eax, instruction.src});
+            out.push_back({Opcode::Mov, instruction.dst, eax});
+            return;
+        }
+        if (dstMemory && srcMemory) {
+            out.push_back({Opcode::Mov, eax, instruction.src});
+            out.push_back({instruction.op, instruction.dst, eax});
+            return;
+        }
+        out.push_back(instruction);
+    }
+
+public:
+    explicit RegisterAllocator(StringTable& strings, Target target = Target::X86) : strings(strings) {
+        if (target == Target::X86_64) {
+            callerSaved.assign(std::begin(callerSaved64), std::end(callerSaved64));
+            calleeSaved.assign(std::begin(calleeSaved64), std::end(calleeSaved64));
+        } else {
+            calleeSaved.assign(std::begin(calleeSaved32), std::end(calleeSaved32));
+        }
+    }
+
+    // Rewrites code in place so that no Virtual operand is left.
+    void allocate(std::vector<Instruction>& code, uint32_t virtualCount) {
+        if (virtualCount == 0) {
+            return;
+        }
+
+        bool branches = std::any_of(code.begin(), code.end(), [](const Instruction& instruction) {
+            return instruction.op == Opcode::Label || isJump(instruction.op);
+        });
+        if (branches) {
+            buildIntervals(code, virtualCount);
+        } else {
+            buildStraightIntervals(code, virtualCount);
+        }
+
+        calls.clear();
+        if (!callerSaved.empty()) {
+            for (uint32_t i = 0; i < code.size(); i++) {
+                if (code[i].op == Opcode::Call) {
+                    calls.push_back(i);
+                }
+            }
+        }
+        order.clear();
+        for (uint32_t v = 0; v < virtualCount; v++) {
+            Interval& interval = intervals[v];
+            if (interval.start == UINT32_MAX) {
+                continue;
+            }
+            auto call = std::upper_bound(calls.begin(), calls.end(), interval.start);
+            interval.crossesCall = call != calls.end() && *call < interval.end;
+            order.push_back(v);
+        }
+        std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+            return intervals[a].start < intervals[b].start;
+        });
+
+        // Cheaper to spill: fewer references per instruction covered.
+        auto weight = [this](uint32_t v) {
+            const Interval& interval = intervals[v];
+            return static_cast<double>(interval.references) / (interval.end - interval.start + 1);
+        };
+
+        assignment.assign(virtualCount, Operand {});
+        int owner[registerCount];
+        std::fill(owner, owner + registerCount, -1);
+        active.clear();
+        size_t spilledTemporaries = 0;
+
+        auto spill = [&](uint32_t v) {
+            assignment[v] = Operand::ofMemory(spillSlot(spilledTemporaries++));
+            spilledCount++;
+        };
+
+        for (uint32_t v : order) {
+            const Interval& interval = intervals[v];
+            active.erase(std::remove_if(active.begin(), active.end(), [&](uint32_t other) {
+                if (intervals[other].end < interval.start) {
+                    owner[static_cast<int>(assignment[other].reg)] = -1;
+                    return true;
+                }
+                return false;
+            }), active.end());
+
+            int chosen = -1;
+            if (!interval.crossesCall) {
+                for (Reg reg : callerSaved) {
+                    if (chosen < 0 && owner[static_cast<int>(reg)] < 0) {
+                        chosen = static_cast<int>(reg);
+                    }
+                }
+            }
+            for (Reg reg : calleeSaved) {
+                if (chosen < 0 && owner[static_cast<int>(reg)] < 0) {
+                    chosen = static_cast<int>(reg);
+                }
+            }
+
+            if (chosen < 0) {
+                // Evict the cheapest active interval whose register this one
+                // may use, unless this one is cheaper still.
+                int victim = -1;
+                for (size_t a = 0; a < active.size(); a++) {
+                    Reg reg = assignment[active[a]].reg;
+                    bool usable = !interval.crossesCall ||
+                                  std::find(callerSaved.begin(), callerSaved.end(), reg) == callerSaved.end();
+                    if (usable && (victim < 0 || weight(active[a]) < weight(active[victim]))) {
+                        victim = static_cast<int>(a);
+                    }
+                }
+                if (victim < 0 || weight(active[victim]) >= weight(v)) {
+                    spill(v);
+                    continue;
+                }
+                uint32_t evicted = active[victim];
+                chosen = static_cast<int>(assignment[evicted].reg);
+                active.erase(active.begin() + victim);
+                spill(evicted);
+            }
+
+            owner[chosen] = static_cast<int>(v);
+            assignment[v] = Operand::ofRegister(static_cast<Reg>(chosen));
+            active.push_back(v);
+        }
+
+        // Operands are rewritten only now, so an interval evicted halfway
+        // through the scan lives in memory over its whole range.
+        rewritten.clear();
+        for (const Instruction& instruction : code) {
+            Operand dst = rewrite(instruction.dst, assignment, rewritten);
+            Operand src = rewrite(instruction.src, assignment, rewritten);
+            legalize({instruction.op, dst, src}, rewritten);
+        }
+        code.swap(rewritten);
+    }
+
+    const std::vector<Symbol>& spillSymbols() const { return spillSlots; }
+
+    size_t spilledIntervals() const { return spilledCount; }
+};
+
+#endif
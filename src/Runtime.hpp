@@ -0,0 +1,384 @@
+#ifndef RUNTIME_HPP
+#define RUNTIME_HPP
+
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+#include "Assembly.hpp"
+#include "StringTable.hpp"
+
+// The support code every program needs, emitted into the program itself so
+// the result links with ld alone: no libc, no startup files.
+//
+// Output goes to a buffer in .bss that is written to stdout with raw write
+// system calls when it fills up and once more at exit.
+//
+// - print_int takes its value in eax and converts it to decimal, dividing
+//   by 10 with a multiply by the reciprocal instead of div;
+// - print_string takes an address in eax and a length in edx, the string's
+//   _len minus its NUL, and copies the bytes with rep movsb (a string
+//   longer than the buffer is written directly);
+// - both clobber eax and edx only. RegisterAllocator never hands those out,
+//   so a print costs the caller no registers and leaves the stack as it was.
+//
+// On x86-64 the routines follow the SysV calling convention instead: the
+// value, or the address and length, come in edi and esi, output goes out
+// through syscall, and every caller-saved register may be clobbered.
+// RegisterAllocator keeps values that live across a print in callee-saved
+// registers there.
+//
+// Hosted, for --run, the program is called like a function of the
+// compiler's own process instead: it saves the registers its caller keeps
+// and returns at the end, and each routine jumps on to a function of the
+// host through an address the host stores in the routine's slot.
+//
+// Every routine and variable name starts with verse_; Verse identifiers are
+// letters only, so they cannot clash with a program's variables.
+class Runtime {
+private:
+    static constexpr int32_t bufferSize = 1 << 16;
+    // The longest int, "-2147483648", plus its newline.
+    static constexpr int32_t digitsSize = 12;
+
+    InstructionList& program;
+    Target target;
+    bool hosted;
+
+    LabelId printIntLabel;
+    LabelId printStringLabel;
+    LabelId flushLabel;
+    LabelId writeLabel;
+
+    Symbol bufferSymbol;
+    Symbol positionSymbol;
+    Symbol digitsSymbol;
+
+    // Hosted: where print_int, print_string and flush jump to.
+    std::array<Symbol, 3> hostSlots;
+
+    static Operand reg(Reg reg) { return Operand::ofRegister(reg); }
+
+    static Operand imm(int32_t value) { return Operand::ofImmediate(value); }
+
+    LabelId local(const char* name) { return program.newLabel(name, -1); }
+
+    void emit(Opcode op, Operand dst = {}, Operand src = {}) { program.emit(op, dst, src); }
+
+    void save() {
+        for (Reg saved : {Reg::Ecx, Reg::Ebx, Reg::Esi, Reg::Edi}) {
+            emit(Opcode::Push, reg(saved));
+        }
+    }
+
+    void restoreAndReturn() {
+        for (Reg saved : {Reg::Edi, Reg::Esi, Reg::Ebx, Reg::Ecx}) {
+            emit(Opcode::Pop, reg(saved));
+        }
+        emit(Opcode::Ret);
+    }
+
+    // Appends ecx bytes from esi to the buffer, which has room for them.
+    void append() {
+        emit(Opcode::Mov, reg(Reg::Edi), Operand::ofMemory(positionSymbol));
+        emit(Opcode::Add, Operand::ofMemory(positionSymbol), reg(Reg::Ecx));
+        emit(Opcode::Add, reg(Reg::Edi), Operand::ofAddress(bufferSymbol));
+        emit(Opcode::RepMovsb);
+    }
+
+    // Where write takes its buffer: ecx for int 0x80, esi for syscall.
+    Reg writeBuffer() const { return target == Target::X86_64 ? Reg::Esi : Reg::Ecx; }
+
+    // write(1, buffer, edx) until all of it is written or the call fails.
+    // Clobbers eax, ebx, ecx and edx on x86; eax, ecx, edx, esi, edi and r11
+    // on x86-64.
+    void emitWrite() {
+        LabelId loop = local("verse_write_loop");
+        LabelId done = local("verse_write_done");
+        program.bind(writeLabel);
+        program.bind(loop);
+        emit(Opcode::Cmp, reg(Reg::Edx), imm(0));
+        emit(Opcode::Jle, Operand::ofLabel(done));
+        if (target == Target::X86_64) {
+            emit(Opcode::Mov, reg(Reg::Edi), imm(1));
+            emit(Opcode::Mov, reg(Reg::Eax), imm(1));
+            emit(Opcode::Syscall);
+        } else {
+            emit(Opcode::Mov, reg(Reg::Ebx), imm(1));
+            emit(Opcode::Mov, reg(Reg::Eax), imm(4));
+            emit(Opcode::Int, imm(0x80));
+        }
+        emit(Opcode::Cmp, reg(Reg::Eax), imm(0));
+        emit(Opcode::Jle, Operand::ofLabel(done));
+        emit(Opcode::Add, reg(writeBuffer()), reg(Reg::Eax));
+        emit(Opcode::Sub, reg(Reg::Edx), reg(Reg::Eax));
+        emit(Opcode::Jmp, Operand::ofLabel(loop));
+        program.bind(done);
+        emit(Opcode::Ret);
+    }
+
+    // Writes out and empties the buffer, clobbering what write does.
+    void emitFlush() {
+        program.bind(flushLabel);
+        emit(Opcode::Mov, reg(writeBuffer()), Operand::ofAddress(bufferSymbol));
+        emit(Opcode::Mov, reg(Reg::Edx), Operand::ofMemory(positionSymbol));
+        emit(Opcode::Call, Operand::ofLabel(writeLabel));
+        emit(Opcode::Mov, Operand::ofMemory(positionSymbol), imm(0));
+        emit(Opcode::Ret);
+    }
+
+    // Digits are produced last first, right to left into verse_digits,
+    // whose final byte is the newline, and then copied out in one go.
+    void emitPrintInt() {
+        LabelId room = local("verse_int_room");
+        LabelId positive = local("verse_int_positive");
+        LabelId unsignedValue = local("verse_int_unsigned");
+
+        program.bind(printIntLabel);
+        save();
+        emit(Opcode::Cmp, Operand::ofMemory(positionSymbol), imm(bufferSize - digitsSize));
+        emit(Opcode::Jle, Operand::ofLabel(room));
+        emit(Opcode::Push, reg(Reg::Eax));
+        emit(Opcode::Call, Operand::ofLabel(flushLabel));
+        emit(Opcode::Pop, reg(Reg::Eax));
+        program.bind(room);
+
+        emit(Opcode::Mov, reg(Reg::Edi), Operand::ofAddress(digitsSymbol, digitsSize - 1));
+        emit(Opcode::Push, reg(Reg::Eax));
+        emit(Opcode::Cmp, reg(Reg::Eax), imm(0));
+        emit(Opcode::Jge, Operand::ofLabel(positive));
+        // -2147483648 stays as it is, which read unsigned is its magnitude.
+        emit(Opcode::Neg, reg(Reg::Eax));
+        program.bind(positive);
+
+        emitDigits(Reg::Ecx, Reg::Ebx);
+
+        emit(Opcode::Pop, reg(Reg::Eax));
+        emit(Opcode::Cmp, reg(Reg::Eax), imm(0));
+        emitSign(unsignedValue);
+        restoreAndReturn();
+    }
+
+    // The magnitude in eax, written backwards from edi as decimal digits;
+    // edi ends on the first one. digit needs a byte register.
+    void emitDigits(Reg multiplier, Reg digit) {
+        LabelId next = local("verse_int_digit");
+        // n / 10 == (n * 0xCCCCCCCD) >> 35 for every unsigned 32-bit n.
+        emit(Opcode::Mov, reg(multiplier), imm(static_cast<int32_t>(0xCCCCCCCDu)));
+        program.bind(next);
+        emit(Opcode::Mov, reg(digit), reg(Reg::Eax));
+        emit(Opcode::Mul, reg(multiplier));
+        emit(Opcode::Shr, reg(Reg::Edx), imm(3));
+        emit(Opcode::Mov, reg(Reg::Eax), reg(Reg::Edx));
+        emit(Opcode::Imul, reg(Reg::Edx), imm(10));
+        emit(Opcode::Sub, reg(digit), reg(Reg::Edx));
+        emit(Opcode::Add, reg(digit), imm('0'));
+        emit(Opcode::Sub, reg(Reg::Edi), imm(1));
+        emit(Opcode::MovByte, Operand::ofIndirect(Reg::Edi), reg(digit));
+        emit(Opcode::Cmp, reg(Reg::Eax), imm(0));
+        emit(Opcode::Jne, Operand::ofLabel(next));
+    }
+
+    // Given flags from comparing the value with 0: prepends a '-' when it
+    // is negative, then copies the digits out.
+    void emitSign(LabelId unsignedValue) {
+        emit(Opcode::Jge, Operand::ofLabel(unsignedValue));
+        emit(Opcode::Sub, reg(Reg::Edi), imm(1));
+        emit(Opcode::MovByte, Operand::ofIndirect(Reg::Edi), imm('-'));
+        program.bind(unsignedValue);
+
+        emit(Opcode::Mov, reg(Reg::Esi), reg(Reg::Edi));
+        emit(Opcode::Mov, reg(Reg::Ecx), Operand::ofAddress(digitsSymbol, digitsSize));
+        emit(Opcode::Sub, reg(Reg::Ecx), reg(Reg::Esi));
+        append();
+    }
+
+    // The x86-64 print_int: the value comes in edi and waits in r9d while
+    // the buffer is flushed, which leaves r8 to r10 alone.
+    void emitPrintInt64() {
+        LabelId room = local("verse_int_room");
+        LabelId positive = local("verse_int_positive");
+        LabelId unsignedValue = local("verse_int_unsigned");
+
+        program.bind(printIntLabel);
+        emit(Opcode::Mov, reg(Reg::R9), reg(Reg::Edi));
+        emit(Opcode::Cmp, Operand::ofMemory(positionSymbol), imm(bufferSize - digitsSize));
+        emit(Opcode::Jle, Operand::ofLabel(room));
+        emit(Opcode::Call, Operand::ofLabel(flushLabel));
+        program.bind(room);
+
+        emit(Opcode::Mov, reg(Reg::Edi), Operand::ofAddress(digitsSymbol, digitsSize - 1));
+        emit(Opcode::Mov, reg(Reg::Eax), reg(Reg::R9));
+        emit(Opcode::Cmp, reg(Reg::Eax), imm(0));
+        emit(Opcode::Jge, Operand::ofLabel(positive));
+        emit(Opcode::Neg, reg(Reg::Eax));
+        program.bind(positive);
+        emitDigits(Reg::R8, Reg::Ecx);
+
+        emit(Opcode::Cmp, reg(Reg::R9), imm(0));
+        emitSign(unsignedValue);
+        emit(Opcode::Ret);
+    }
+
+    // The x86-64 print_string: address in edi, length in esi, kept in r8d
+    // and r9d across a flush.
+    void emitPrintString64() {
+        LabelId room = local("verse_string_room");
+
+        program.bind(printStringLabel);
+        emit(Opcode::Mov, reg(Reg::R8), reg(Reg::Edi));
+        emit(Opcode::Mov, reg(Reg::R9), reg(Reg::Esi));
+        emit(Opcode::Mov, reg(Reg::Eax), Operand::ofMemory(positionSymbol));
+        emit(Opcode::Add, reg(Reg::Eax), reg(Reg::R9));
+        emit(Opcode::Cmp, reg(Reg::Eax), imm(bufferSize));
+        emit(Opcode::Jle, Operand::ofLabel(room));
+        emit(Opcode::Call, Operand::ofLabel(flushLabel));
+        emit(Opcode::Cmp, reg(Reg::R9), imm(bufferSize));
+        emit(Opcode::Jle, Operand::ofLabel(room));
+        emit(Opcode::Mov, reg(Reg::Esi), reg(Reg::R8));
+        emit(Opcode::Mov, reg(Reg::Edx), reg(Reg::R9));
+        emit(Opcode::Call, Operand::ofLabel(writeLabel));
+        emit(Opcode::Ret);
+        program.bind(room);
+        emit(Opcode::Mov, reg(Reg::Esi), reg(Reg::R8));
+        emit(Opcode::Mov, reg(Reg::Ecx), reg(Reg::R9));
+        append();
+        emit(Opcode::Ret);
+    }
+
+    void emitPrintString() {
+        LabelId room = local("verse_string_room");
+        LabelId done = local("verse_string_done");
+
+        program.bind(printStringLabel);
+        save();
+        emit(Opcode::Mov, reg(Reg::Esi), reg(Reg::Eax));
+        emit(Opcode::Mov, reg(Reg::Ecx), reg(Reg::Edx));
+        emit(Opcode::Mov, reg(Reg::Eax), Operand::ofMemory(positionSymbol));
+        emit(Opcode::Add, reg(Reg::Eax), reg(Reg::Ecx));
+        emit(Opcode::Cmp, reg(Reg::Eax), imm(bufferSize));
+        emit(Opcode::Jle, Operand::ofLabel(room));
+        emit(Opcode::Push, reg(Reg::Ecx));
+        emit(Opcode::Call, Operand::ofLabel(flushLabel));
+        emit(Opcode::Pop, reg(Reg::Ecx));
+        emit(Opcode::Cmp, reg(Reg::Ecx), imm(bufferSize));
+        emit(Opcode::Jle, Operand::ofLabel(room));
+        emit(Opcode::Mov, reg(Reg::Edx), reg(Reg::Ecx));
+        emit(Opcode::Mov, reg(Reg::Ecx), reg(Reg::Esi));
+        emit(Opcode::Call, Operand::ofLabel(writeLabel));
+        emit(Opcode::Jmp, Operand::ofLabel(done));
+        program.bind(room);
+        append();
+        program.bind(done);
+        restoreAndReturn();
+    }
+
+    // The registers a SysV caller expects kept, rbx and rbp through r12 to
+    // r15, with rbx twice to keep the stack 16-byte aligned for the host's
+    // functions.
+    static constexpr Reg calleeSaved[] = {Reg::Ebx, Reg::Ebp, Reg::R12, Reg::R13, Reg::R14, Reg::R15, Reg::Ebx};
+
+    // A tail jump to the address in slot: push it, then return to it.
+    void emitHostJump(LabelId label, Symbol slot) {
+        program.bind(label);
+        emit(Opcode::Push, Operand::ofMemory(slot));
+        emit(Opcode::Ret);
+    }
+
+public:
+    Runtime(StringTable& strings, InstructionList& program, Target target = Target::X86, bool hosted = false)
+            : program(program),
+              target(target),
+              hosted(hosted),
+              printIntLabel(program.newLabel("verse_print_int", -1)),
+              printStringLabel(program.newLabel("verse_print_string", -1)),
+              flushLabel(program.newLabel("verse_flush", -1)),
+              writeLabel(program.newLabel("verse_write", -1)),
+              bufferSymbol(strings.intern("verse_buffer")),
+              positionSymbol(strings.intern("verse_position")),
+              digitsSymbol(strings.intern("verse_digits")),
+              hostSlots {strings.intern("verse_print_int_address"), strings.intern("verse_print_string_address"),
+                         strings.intern("verse_flush_address")} {}
+
+    // Starts the program. Only a hosted one needs anything here.
+    void enter() {
+        if (hosted) {
+            for (Reg saved : calleeSaved) {
+                emit(Opcode::Push, reg(saved));
+            }
+        }
+    }
+
+    // Prints value followed by a newline.
+    void printInt(const Operand& value) {
+        emit(Opcode::Mov, reg(target == Target::X86_64 ? Reg::Edi : Reg::Eax), value);
+        emit(Opcode::Call, Operand::ofLabel(printIntLabel));
+    }
+
+    // Prints the string variable name; its text already ends in a newline.
+    void printString(Symbol name) {
+        bool wide = target == Target::X86_64;
+        emit(Opcode::Mov, reg(wide ? Reg::Edi : Reg::Eax), Operand::ofAddress(name));
+        emit(Opcode::Mov, reg(wide ? Reg::Esi : Reg::Edx), Operand::ofSize(name, -1));
+        emit(Opcode::Call, Operand::ofLabel(printStringLabel));
+    }
+
+    // Ends the program: flushes the buffer and exits with status 0, or
+    // returns to the host.
+    void exit() {
+        emit(Opcode::Call, Operand::ofLabel(flushLabel));
+        if (hosted) {
+            for (auto it = std::rbegin(calleeSaved); it != std::rend(calleeSaved); ++it) {
+                emit(Opcode::Pop, reg(*it));
+            }
+            emit(Opcode::Ret);
+        } else if (target == Target::X86_64) {
+            emit(Opcode::Mov, reg(Reg::Edi), imm(0));
+            emit(Opcode::Mov, reg(Reg::Eax), imm(60));
+            emit(Opcode::Syscall);
+        } else {
+            emit(Opcode::Mov, reg(Reg::Ebx), imm(0));
+            emit(Opcode::Mov, reg(Reg::Eax), imm(1));
+            emit(Opcode::Int, imm(0x80));
+        }
+    }
+
+    // The routines themselves, placed after the program's last instruction.
+    void emitRoutines() {
+        if (hosted) {
+            emitHostJump(printIntLabel, hostSlots[0]);
+            emitHostJump(printStringLabel, hostSlots[1]);
+            emitHostJump(flushLabel, hostSlots[2]);
+            return;
+        }
+        if (target == Target::X86_64) {
+            emitPrintInt64();
+            emitPrintString64();
+        } else {
+            emitPrintInt();
+            emitPrintString();
+        }
+        emitFlush();
+        emitWrite();
+    }
+
+    void addData(std::vector<DataDefinition>& data) const {
+        if (hosted) {
+            for (Symbol slot : hostSlots) {
+                data.push_back({slot, false, 0, {}, 8, 8});
+            }
+            return;
+        }
+        // Eleven placeholder bytes; the string's own newline comes last.
+        data.push_back({digitsSymbol, true, 0, "           "});
+        data.push_back({positionSymbol, false, 0, {}});
+        data.push_back({bufferSymbol, false, 0, {}, static_cast<uint32_t>(bufferSize)});
+    }
+
+    // The slots of a hosted program, for print_int, print_string and flush
+    // in that order: each holds the address of a function taking the same
+    // arguments, in edi and esi.
+    const std::array<Symbol, 3>& hostFunctionSlots() const { return hostSlots; }
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef SOURCE_FILE_HPP
+#define SOURCE_FILE_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include "CompileError.hpp"
+
+// Read-only view of a .vs file. Regular files are mapped straight into memory
+// so the tokenizer can hand out views into the mapping instead of copies; pipes
+// and other non-mappable inputs fall back to a single read into an owned buffer.
+class SourceFile {
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    size_t released = 0;
+    static constexpr size_t releaseChunk = 1 << 20;
+    std::string fallback {};
+
+public:
+    explicit SourceFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            compileError("Could not open file ", path);
+        }
+
+        struct stat info {};
+        if (::fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            void* addr = ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                ::madvise(addr, info.st_size, MADV_SEQUENTIAL);
+                data = static_cast<const char*>(addr);
+                size = info.st_size;
+                mapped = true;
+            }
+        }
+
+        if (!mapped) {
+            char chunk[1 << 16];
+            ssize_t n;
+            while ((n = ::read(fd, chunk, sizeof(chunk))) > 0) {
+                fallback.append(chunk, n);
+            }
+            data = fallback.data();
+            size = fallback.size();
+        }
+
+        ::close(fd);
+    }
+
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    ~SourceFile() {
+        if (mapped) {
+            ::munmap(const_cast<char*>(data), size);
+        }
+    }
+
+    std::string_view view() const { return {data, size}; }
+
+    // Drops the resident pages of the mapping below offset. Views into that
+    // range stay valid: touching them again simply faults the page back in
+    // from the file. Used by streaming compiles to keep RSS flat.
+    void release(size_t offset) {
+        static const size_t pageSize = ::sysconf(_SC_PAGESIZE);
+        size_t end = offset / pageSize * pageSize;
+        if (!mapped || end < released + releaseChunk) {
+            return;
+        }
+        ::madvise(const_cast<char*>(data) + released, end - released, MADV_DONTNEED);
+        released = end;
+    }
+};
+
+#endif
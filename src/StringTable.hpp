@@ -0,0 +1,50 @@
+#ifndef STRING_TABLE_HPP
+#define STRING_TABLE_HPP
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using Symbol = uint32_t;
+
+constexpr Symbol NoSymbol = UINT32_MAX;
+
+// Interns identifiers and literals once per compilation. Entries added with
+// intern() are views into the caller's buffer (normally the mapped source), so
+// that buffer must outlive the table; internCopy() keeps its own copy for text
+// synthesized by the compiler.
+class StringTable {
+private:
+    std::vector<std::string_view> strings {};
+    std::unordered_map<std::string_view, Symbol> index {};
+    std::deque<std::string> owned {};
+
+public:
+    Symbol intern(std::string_view text) {
+        auto it = index.find(text);
+        if (it != index.end()) {
+            return it->second;
+        }
+        Symbol symbol = static_cast<Symbol>(strings.size());
+        strings.push_back(text);
+        index.emplace(text, symbol);
+        return symbol;
+    }
+
+    Symbol internCopy(std::string_view text) {
+        auto it = index.find(text);
+        if (it != index.end()) {
+            return it->second;
+        }
+        return intern(owned.emplace_back(text));
+    }
+
+    std::string_view str(Symbol symbol) const { return strings[symbol]; }
+
+    size_t size() const { return strings.size(); }
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs a fixed set of independent tasks on threads that steal work from
+// each other. The tasks are dealt out round-robin up front; each worker
+// takes from the back of its own queue and, once that is empty, from the
+// front of the others', so one slow task holds up only the worker running
+// it. Tasks never add tasks, so a worker that finds every queue empty is
+// done.
+class WorkStealingPool {
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+
+    unsigned workers;
+
+    static bool take(Queue& queue, bool own, size_t& task) {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        if (own) {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        } else {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+        return true;
+    }
+
+public:
+    explicit WorkStealingPool(unsigned workers) : workers(std::max(workers, 1u)) {}
+
+    // Calls task(i) once for every i below count and returns when all the
+    // calls have. The calling thread is one of the workers. task must not
+    // throw.
+    void run(size_t count, const std::function<void(size_t)>& task) {
+        if (count == 0) {
+            return;
+        }
+        unsigned used = static_cast<unsigned>(std::min<size_t>(workers, count));
+        std::vector<Queue> queues(used);
+        for (size_t i = 0; i < count; i++) {
+            queues[i % used].tasks.push_back(i);
+        }
+
+        auto work = [&](unsigned self) {
+            size_t next;
+            for (;;) {
+                bool found = take(queues[self], true, next);
+                for (unsigned other = 1; !found && other < used; other++) {
+                    found = take(queues[(self + other) % used], false, next);
+                }
+                if (!found) {
+                    return;
+                }
+                task(next);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        threads.reserve(used - 1);
+        for (unsigned worker = 1; worker < used; worker++) {
+            threads.emplace_back(work, worker);
+        }
+        work(0);
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef TOKEN_STREAM_HPP
+#define TOKEN_STREAM_HPP
+
+#include <optional>
+#include <vector>
+#include "CompileError.hpp"
+#include "Tokenizer.hpp"
+
+// Token source for the parser. It either walks a fully tokenized vector or
+// pulls tokens from a Tokenizer on demand into a small ring buffer, in which
+// case only the current lookahead window is ever held in memory.
+class TokenStream {
+private:
+    static constexpr size_t lookahead = 4;
+
+    std::vector<Token> tokens {};
+    size_t idx = 0;
+
+    Tokenizer* tokenizer = nullptr;
+    Token ring[lookahead] {};
+    size_t head = 0;
+    size_t count = 0;
+
+    bool fill(size_t offset) {
+        while (count <= offset) {
+            Token token;
+            if (!tokenizer->next(token)) {
+                return false;
+            }
+            ring[(head + count) % lookahead] = token;
+            count++;
+        }
+        return true;
+    }
+
+public:
+    explicit TokenStream(std::vector<Token> tokens) : tokens(std::move(tokens)) {}
+
+    explicit TokenStream(Tokenizer& tokenizer) : tokenizer(&tokenizer) {}
+
+    std::optional<Token> peek(size_t offset = 0) {
+        if (!tokenizer) {
+            if (idx + offset >= tokens.size()) {
+                return std::nullopt;
+            }
+            return tokens[idx + offset];
+        }
+        if (offset >= lookahead || !fill(offset)) {
+            return std::nullopt;
+        }
+        return ring[(head + offset) % lookahead];
+    }
+
+    Token consume() {
+        if (!tokenizer) {
+            if (idx >= tokens.size()) {
+                compileError("Unexpected end of input");
+            }
+            return tokens[idx++];
+        }
+        if (!fill(0)) {
+            compileError("Unexpected end of input");
+        }
+        Token token = ring[head];
+        head = (head + 1) % lookahead;
+        count--;
+        return token;
+    }
+};
+
+#endif
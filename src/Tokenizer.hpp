@@ -1,11 +1,16 @@
 #ifndef TOKENIZER_HPP
 #define TOKENIZER_HPP
 
+#include <cstdint>
 #include <iostream>
-#include <optional>
+#include <string_view>
+#include <type_traits>
 #include <vector>
+#include "CompileError.hpp"
+#include "CharScanner.hpp"
+#include "StringTable.hpp"
 
-enum class TokenType {
+enum class TokenType : uint8_t {
     IDENT = 0,
     NUMBER = 1,
     STRING = 2,
@@ -38,165 +43,285 @@ enum class TokenType {
     DECVALUE = 31
 };
 
+// Identifiers and string literals carry the symbol of their interned text and
+// numbers carry their value, so distinct literals never grow the string table;
+// operators and punctuation are fully described by their type and carry
+// NoSymbol. Offsets are byte positions in the tokenizer's source.
 struct Token {
-    std::string value{};
     TokenType type;
+    uint32_t offset;
+    union {
+        Symbol symbol;
+        int32_t number;
+    };
+};
+
+static_assert(std::is_trivially_copyable_v<Token>);
+static_assert(sizeof(Token) <= 12);
+
+struct Keyword {
+    std::string_view text;
+    TokenType type;
+};
+
+// Reserved words. Adding a keyword only needs a new entry here: the slot table
+// below is rebuilt at compile time and the static_assert fails if no collision
+// free seed exists for the hash.
+constexpr Keyword keywords[] = {
+    {"let", TokenType::LET},
+    {"if", TokenType::IF},
+    {"else", TokenType::ELSE},
+    {"for", TokenType::FOR},
+    {"while", TokenType::WHILE},
+    {"print", TokenType::PRINT},
+};
+
+constexpr size_t keywordCount = sizeof(keywords) / sizeof(keywords[0]);
+constexpr size_t keywordSlotBits = 4;
+constexpr size_t keywordSlotCount = size_t(1) << keywordSlotBits;
+constexpr uint8_t noKeyword = 0xFF;
+
+static_assert(keywordCount < keywordSlotCount);
+
+constexpr size_t keywordMinLength() {
+    size_t length = SIZE_MAX;
+    for (const Keyword& keyword : keywords) {
+        length = keyword.text.size() < length ? keyword.text.size() : length;
+    }
+    return length;
+}
+
+constexpr size_t keywordMaxLength() {
+    size_t length = 0;
+    for (const Keyword& keyword : keywords) {
+        length = keyword.text.size() > length ? keyword.text.size() : length;
+    }
+    return length;
+}
+
+constexpr uint32_t keywordHash(std::string_view text, uint32_t seed) {
+    uint32_t key = static_cast<uint8_t>(text[0]) * seed + static_cast<uint8_t>(text[text.size() - 1]) +
+                   static_cast<uint32_t>(text.size()) * 0x10001u;
+    return (key * 0x9E3779B1u) >> (32 - keywordSlotBits);
+}
+
+constexpr uint32_t findKeywordSeed() {
+    for (uint32_t seed = 1; seed < 4096; seed++) {
+        bool used[keywordSlotCount] = {};
+        bool collision = false;
+        for (const Keyword& keyword : keywords) {
+            uint32_t slot = keywordHash(keyword.text, seed);
+            collision = collision || used[slot];
+            used[slot] = true;
+        }
+        if (!collision) {
+            return seed;
+        }
+    }
+    return 0;
+}
+
+constexpr uint32_t keywordSeed = findKeywordSeed();
+
+static_assert(keywordSeed != 0, "no perfect hash seed for the keyword table");
+
+struct KeywordSlots {
+    uint8_t index[keywordSlotCount];
 };
 
+constexpr KeywordSlots buildKeywordSlots() {
+    KeywordSlots slots {};
+    for (size_t i = 0; i < keywordSlotCount; i++) {
+        slots.index[i] = noKeyword;
+    }
+    for (size_t i = 0; i < keywordCount; i++) {
+        slots.index[keywordHash(keywords[i].text, keywordSeed)] = static_cast<uint8_t>(i);
+    }
+    return slots;
+}
+
+constexpr KeywordSlots keywordSlots = buildKeywordSlots();
+
+// Maps an identifier-shaped lexeme to its keyword type, or IDENT, with one
+// hash, one table load and at most one comparison.
+constexpr TokenType keywordType(std::string_view text) {
+    if (text.size() < keywordMinLength() || text.size() > keywordMaxLength()) {
+        return TokenType::IDENT;
+    }
+    uint8_t index = keywordSlots.index[keywordHash(text, keywordSeed)];
+    if (index == noKeyword || keywords[index].text != text) {
+        return TokenType::IDENT;
+    }
+    return keywords[index].type;
+}
+
+static_assert(keywordType("let") == TokenType::LET);
+static_assert(keywordType("print") == TokenType::PRINT);
+static_assert(keywordType("lets") == TokenType::IDENT);
+
 class Tokenizer {
 private:
-    std::string source;
-    int idx = 0;
+    std::string_view source;
+    StringTable& strings;
+    ScanKernel kernel = activeScanKernel();
+    size_t idx = 0;
+    size_t produced = 0;
 
 public:
-    explicit Tokenizer(std::string source) : source(std::move(source)){};
+    explicit Tokenizer(std::string_view source, StringTable& strings) : source(source), strings(strings) {
+        if (source.size() > UINT32_MAX) {
+            compileError("Source file too large");
+        }
+    };
 
-    std::optional<char> peek(int offset = 0) {
+    // Returns '\0' past the end so lookahead never needs a bounds branch at the call site.
+    char peek(size_t offset = 0) {
         if (idx + offset >= source.size()) {
-            return {};
+            return '\0';
         };
         return source[idx + offset];
     };
 
+    size_t scan(uint8_t mask) {
+        return scanRun(kernel, source.data() + idx, source.data() + source.size(), mask);
+    };
+
     char consume() { return source[idx++]; };
 
-    std::vector<Token> tokenize() {
-        std::vector<Token> tokens;
-        std::string buffer;
+    std::string_view lexeme(size_t start) { return source.substr(start, idx - start); };
 
-        while (peek().has_value()) {
-            if (peek().value() == '\"') {
-                consume();
-                while (peek().has_value() && std::isalnum(peek().value()) || isspace(peek().value()) || peek().value() == '\\') {
-                    buffer.push_back(consume());
-                };
-                if (peek().value() != '\"') {
-                    std::cout << "Expected \" " << std::endl;
-                    exit(EXIT_FAILURE);
-                };
-                consume();
-                tokens.push_back({.value = buffer, .type = TokenType::STRING});
-                buffer.clear();
-            } else if (std::isalpha(peek().value())) {
-                buffer.push_back(consume());
-                if (peek().has_value() && peek().value() == '+' && peek(1).value() =='+'){
-                    buffer.push_back(consume());
-                    buffer.push_back(consume());
-                    tokens.push_back({.value = buffer, .type = TokenType::INCVALUE});
-                } else if(peek().has_value() && peek().value() == '-' && peek(1).value() =='-'){
-                    buffer.push_back(consume());
-                    buffer.push_back(consume());
-                    tokens.push_back({.value = buffer, .type = TokenType::DECVALUE});
-                } else{
-                    while (peek().has_value() && std::isalnum(peek().value())) {
-                        buffer.push_back(consume());
-                    };
-                    if (buffer == ",") {
-                        tokens.push_back({.value = buffer, .type = TokenType::COMMA});
-                    } else if (buffer == "let") {
-                        tokens.push_back({.value = buffer, .type = TokenType::LET});
-                    } else if (buffer == "if") {
-                        tokens.push_back({.value = buffer, .type = TokenType::IF});
-                    } else if (buffer == "else") {
-                        tokens.push_back({.value = buffer, .type = TokenType::ELSE});
-                    } else if (buffer == "for") {
-                        tokens.push_back({.value = buffer, .type = TokenType::FOR});
-                    } else if (buffer == "while") {
-                        tokens.push_back({.value = buffer, .type = TokenType::WHILE});
-                    } else if (buffer == "print") {
-                        tokens.push_back({.value = buffer, .type = TokenType::PRINT});
-                    } else {
-                        tokens.push_back({.value = buffer, .type = TokenType::IDENT});
-                    };
-                };
-                buffer.clear();
-            } else if (std::isdigit(peek().value())) {
-                buffer.push_back(consume());
-                while (peek().has_value() && std::isdigit(peek().value())) {
-                    buffer.push_back(consume());
-                };
+    int32_t parseNumber(std::string_view digits) {
+        int64_t value = 0;
+        for (char digit : digits) {
+            value = value * 10 + (digit - '0');
+            if (value > INT32_MAX) {
+                compileError("Invalid number: ", digits);
+            };
+        };
+        return static_cast<int32_t>(value);
+    };
 
-                tokens.push_back({.value = buffer, .type = TokenType::NUMBER});
-                buffer.clear();
-            } else if (std::isspace(peek().value())) {
-                consume();
-            } else if (peek().value() == '(') {
-                consume();
-                tokens.push_back({.type = TokenType::OPENPAR});
-            } else if (peek().value() == ')') {
-                consume();
-                tokens.push_back({.type = TokenType::CLOSPAR});
-            } else if (peek().value() == '{') {
-                consume();
-                tokens.push_back({.type = TokenType::OPENCURL});
-            } else if (peek().value() == '}') {
-                consume();
-                tokens.push_back({.type = TokenType::CLOSCURL});
-            } else if (peek().value() == '[') {
-                consume();
-                tokens.push_back({.type = TokenType::OPENSQUAR});
-            } else if (peek().value() == ']') {
-                consume();
-                tokens.push_back({.type = TokenType::CLOSSQUAR});
-            } else if (peek().value() == '+') {
-                consume();
-                tokens.push_back({.value = "+" , .type = TokenType::PLUS});  
-            } else if (peek().value() == '-') {
-                consume();
-                tokens.push_back({.value = "-" , .type = TokenType::MINUS});
-            } else if (peek().value() == '*') {
-                consume();
-                tokens.push_back({.value = "*", .type = TokenType::STAR});
-            } else if (peek().value() == '/') {
-                consume();
-                tokens.push_back({.value = "/", .type = TokenType::DIVIDE});
-            } else if (peek().value() == ';') {
-                consume();
-                tokens.push_back({.type = TokenType::SEMI_COL});
-            } else if (peek().value() == '=') {
-                consume();
-                if (peek().value() == '=') {
-                    consume();
-                    tokens.push_back({.value = "==", .type = TokenType::EQEQ});
-                } else {
-                    tokens.push_back({.value = "=", .type = TokenType::EQ});
-                };
-            } else if (peek().value() == '>') {
+    Token token(TokenType type, size_t start) {
+        return {.type = type, .offset = static_cast<uint32_t>(start), .symbol = NoSymbol};
+    };
+
+    Token token(TokenType type, size_t start, std::string_view text) {
+        return {.type = type, .offset = static_cast<uint32_t>(start), .symbol = strings.intern(text)};
+    };
+
+    // Produces the next token, or returns false once the source is exhausted.
+    bool next(Token& out) {
+        while (idx < source.size()) {
+            char c = source[idx];
+            uint8_t cls = charClass(c);
+            if (cls & CharSpace) {
+                idx += scan(CharSpace);
+                continue;
+            } else if (c == '\"') {
                 consume();
-                if (peek().value() == '=') {
-                    consume();
-                    tokens.push_back({.value = ">=" , .type = TokenType::GTEQ});
-                } else {
-                    tokens.push_back({.value = ">" , .type = TokenType::GT});
+                size_t start = idx;
+                idx += scan(CharStringBody);
+                if (peek() != '\"') {
+                    compileError("Expected \" ");
                 };
-            } else if (peek().value() == '<') {
+                std::string_view buffer = lexeme(start);
                 consume();
-                if (peek().value() == '=') {
-                    consume();
-                    tokens.push_back({.value = "<=" , .type = TokenType::LTEQ});
+                out = token(TokenType::STRING, start - 1, buffer);
+            } else if (cls & CharAlpha) {
+                size_t start = idx;
+                idx += scan(CharAlnum);
+                std::string_view buffer = lexeme(start);
+                if (peek() == '+' && peek(1) == '+') {
+                    idx += 2;
+                    out = token(TokenType::INCVALUE, start, buffer);
+                } else if (peek() == '-' && peek(1) == '-') {
+                    idx += 2;
+                    out = token(TokenType::DECVALUE, start, buffer);
                 } else {
-                    tokens.push_back({.value = "<" , .type = TokenType::LT});
+                    TokenType type = keywordType(buffer);
+                    if (type == TokenType::IDENT) {
+                        out = token(TokenType::IDENT, start, buffer);
+                    } else {
+                        out = token(type, start);
+                    };
                 };
-            } else if (peek().value() == '!') {
+            } else if (cls & CharDigit) {
+                size_t start = idx;
+                idx += scan(CharDigit);
+                out = token(TokenType::NUMBER, start);
+                out.number = parseNumber(lexeme(start));
+            } else {
                 consume();
-                if (peek().value() == '=') {
-                    consume();
-                    tokens.push_back({.value = "!=" , .type = TokenType::NOTEQ});
-                } else {
-                    std::cout << "Invalid syntax (" << idx << ") -> " << peek().value()
-                              << std::endl;
-                    exit(EXIT_FAILURE);
+                switch (c) {
+                    case '(': out = token(TokenType::OPENPAR, idx - 1); break;
+                    case ')': out = token(TokenType::CLOSPAR, idx - 1); break;
+                    case '{': out = token(TokenType::OPENCURL, idx - 1); break;
+                    case '}': out = token(TokenType::CLOSCURL, idx - 1); break;
+                    case '[': out = token(TokenType::OPENSQUAR, idx - 1); break;
+                    case ']': out = token(TokenType::CLOSSQUAR, idx - 1); break;
+                    case '+': out = token(TokenType::PLUS, idx - 1); break;
+                    case '-': out = token(TokenType::MINUS, idx - 1); break;
+                    case '*': out = token(TokenType::STAR, idx - 1); break;
+                    case '/': out = token(TokenType::DIVIDE, idx - 1); break;
+                    case ';': out = token(TokenType::SEMI_COL, idx - 1); break;
+                    case '=':
+                        if (peek() == '=') {
+                            consume();
+                            out = token(TokenType::EQEQ, idx - 2);
+                        } else {
+                            out = token(TokenType::EQ, idx - 1);
+                        };
+                        break;
+                    case '>':
+                        if (peek() == '=') {
+                            consume();
+                            out = token(TokenType::GTEQ, idx - 2);
+                        } else {
+                            out = token(TokenType::GT, idx - 1);
+                        };
+                        break;
+                    case '<':
+                        if (peek() == '=') {
+                            consume();
+                            out = token(TokenType::LTEQ, idx - 2);
+                        } else {
+                            out = token(TokenType::LT, idx - 1);
+                        };
+                        break;
+                    case '!':
+                        if (peek() == '=') {
+                            consume();
+                            out = token(TokenType::NOTEQ, idx - 2);
+                        } else {
+                            compileError("Invalid syntax (", idx, ") -> ", peek());
+                        };
+                        break;
+                    default:
+                        compileError("Invalid syntax (", idx - 1, ") -> ", c);
                 };
-            } else {
-                std::cout << "Invalid syntax (" << idx << ") -> " << peek().value()
-                          << std::endl;
-                exit(EXIT_FAILURE);
             };
+            produced++;
+            return true;
+        };
+        return false;
+    };
+
+    std::vector<Token> tokenize() {
+        std::vector<Token> tokens;
+        Token token;
+
+        while (next(token)) {
+            tokens.push_back(token);
         };
 
         idx = 0;
         return tokens;
     };
+
+    size_t position() const { return idx; };
+
+    // Tokens handed out by next() so far, counting those tokenize() collected.
+    size_t tokenCount() const { return produced; }
 };
 
 #endif
\ No newline at end of file
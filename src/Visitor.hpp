@@ -13,6 +13,9 @@ struct IfStatementNode;
 struct ForLoopNode;
 struct PrintNode;
 struct IncrementNode;
+struct ArrayDeclarationNode;
+struct ElementNode;
+struct ElementAssignmentNode;
 
 class Visitor {
 public:
@@ -28,6 +31,9 @@ public:
     virtual void visit(ForLoopNode* node) = 0;
     virtual void visit(PrintNode* node) = 0;
     virtual void visit(IncrementNode* node) = 0;
+    virtual void visit(ArrayDeclarationNode* node) = 0;
+    virtual void visit(ElementNode* node) = 0;
+    virtual void visit(ElementAssignmentNode* node) = 0;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,19 @@
+let a[37];
+let b[37];
+let i;
+for (i=0;i<37;i++){
+a[i] = i * 3;
+b[i] = a[i] * a[i] - i;
+};
+let s = 0;
+for (i=0;i<37;i++){
+s = s + b[i];
+};
+print(s);
+print(b[36]);
+let n = 2;
+for (i=n;i<37;i++){
+a[i] = a[i] + b[i];
+};
+print(a[36]);
+print(a[1]);
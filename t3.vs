@@ -0,0 +1,16 @@
+let i;
+for (i=0;i<3;i++){
+print("hi there");
+print(i);
+};
+let q = 5;
+q++;
+print(q);
+q--;
+q--;
+print(q);
+if (q == 4){ print("four"); };
+if (q != 4){ print("notfour"); } else { print("else"); };
+if (q <= 4){ print(1); };
+if (q >= 5){ print(2); };
+if (q < 4){ print(3); };
@@ -0,0 +1,76 @@
+#!/bin/bash
+
+# A compile that fails must leave nothing at its output path: no empty or
+# half-written file for a later link to pick up, and no stale output from
+# an earlier run. Run from the repository root after make:
+#   ./tests/failed_output.sh
+
+workdir=$(mktemp -d)
+
+cleanup() {
+  rm -rf "$workdir"
+}
+trap cleanup EXIT
+
+failures=0
+
+fail() {
+  echo "FAIL: $1"
+  failures=$((failures + 1))
+}
+
+cat > "$workdir/good.vs" <<'VERSE'
+let a = 2;
+print(a);
+VERSE
+
+cat > "$workdir/bad.vs" <<'VERSE'
+let a = 2;
+print(b);
+VERSE
+
+printf 'let x = ' > "$workdir/truncated.vs"
+
+# Each mode starts from a stale file at the output path.
+for mode in "" "-S" "--emit-ir" "--stream" "--flat" "--stream -S"; do
+  for source in bad truncated; do
+    output="$workdir/out"
+    echo stale > "$output"
+    if ./versec $mode "$workdir/$source.vs" -o "$output" 2> /dev/null; then
+      fail "versec $mode $source.vs succeeded"
+    fi
+    if [ -e "$output" ]; then
+      fail "versec $mode $source.vs left $output behind"
+    fi
+  done
+done
+
+# --link removes both the executable and the object it links from.
+echo stale > "$workdir/exe"
+echo stale > "$workdir/exe.o"
+./versec --link "$workdir/bad.vs" -o "$workdir/exe" 2> /dev/null
+if [ -e "$workdir/exe" ] || [ -e "$workdir/exe.o" ]; then
+  fail "versec --link left output behind"
+fi
+
+# In a batch only the failed file's output is missing.
+mkdir "$workdir/batch"
+./versec "$workdir/good.vs" "$workdir/bad.vs" -o "$workdir/batch" 2> /dev/null
+if [ ! -s "$workdir/batch/good.o" ]; then
+  fail "batch compile did not write good.o"
+fi
+if [ -e "$workdir/batch/bad.o" ]; then
+  fail "batch compile left bad.o behind"
+fi
+
+# --run writes no file, so a file named like its default output survives.
+echo keep > "$workdir/out.o"
+(cd "$workdir" && "$OLDPWD/versec" --run bad.vs 2> /dev/null)
+if [ "$(cat "$workdir/out.o")" != keep ]; then
+  fail "versec --run touched out.o"
+fi
+
+if [ "$failures" -ne 0 ]; then
+  exit 1
+fi
+echo "failed compiles leave no output"